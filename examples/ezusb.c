@@ -48,6 +48,7 @@ extern void logerror(const char *format, ...)
  */
 
 int verbose = 1;
+int pipeline_depth = 8;
 
 /*
  * return true if [addr,addr+len] includes external RAM
@@ -120,26 +121,50 @@ static bool fx2lp_is_external(uint32_t addr, size_t len)
 #define RW_MEMORY       0xA3
 
 /*
- * Issues the specified vendor-specific write request.
+ * Sets up a vendor-specific request for ezusb_batch().
  */
-static int ezusb_write(libusb_device_handle *device, const char *label,
-	uint8_t opcode, uint32_t addr, const unsigned char *data, size_t len)
+static void ezusb_fill_request(struct libusb_control_request *request,
+	uint8_t direction, uint8_t opcode, uint32_t addr, unsigned char *data,
+	size_t len)
 {
-	int status;
+	request->bmRequestType = direction | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+	request->bRequest = opcode;
+	request->wValue = addr & 0xFFFF;
+	request->wIndex = addr >> 16;
+	request->wLength = (uint16_t)len;
+	request->data = data;
+}
 
-	if (verbose > 1)
-		logerror("%s, addr 0x%08x len %4u (0x%04x)\n", label, addr, (unsigned)len, (unsigned)len);
-	status = libusb_control_transfer(device,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-		opcode, addr & 0xFFFF, addr >> 16,
-		(unsigned char*)data, (uint16_t)len, 1000);
-	if (status != len) {
-		if (status < 0)
-			logerror("%s: %s\n", label, libusb_error_name(status));
-		else
-			logerror("%s ==> %d\n", label, status);
+/*
+ * Issues the specified vendor-specific requests in order, with up to
+ * pipeline_depth of them in flight. Returns the index of the first
+ * request which failed, or count if all of them succeeded.
+ */
+static int ezusb_batch(libusb_device_handle *device, const char *label,
+	struct libusb_control_request *requests, int count)
+{
+	int i, status;
+
+	if (verbose > 1) {
+		for (i = 0; i < count; i++)
+			logerror("%s, addr 0x%08x len %4u (0x%04x)\n", label,
+				(uint32_t)requests[i].wIndex << 16 | requests[i].wValue,
+				requests[i].wLength, requests[i].wLength);
 	}
-	return (status < 0) ? -EIO : 0;
+	status = libusb_control_transfer_batch(device, requests, count,
+		pipeline_depth, 1000);
+	for (i = 0; i < count; i++) {
+		if (requests[i].result == requests[i].wLength)
+			continue;
+		if (requests[i].result >= 0)
+			logerror("%s ==> %d\n", label, requests[i].result);
+		else if (requests[i].result != LIBUSB_ERROR_INTERRUPTED)
+			logerror("%s: %s\n", label, libusb_error_name(requests[i].result));
+	}
+	if (status == 0)
+		return count;
+	for (i = 0; i < count && requests[i].result >= 0; i++);
+	return i;
 }
 
 /*
@@ -494,20 +519,57 @@ typedef enum {
 	skip_external		/* second phase, second-stage loader */
 } ram_mode;
 
+/*
+ * Writes are queued and issued in batches of up to RAM_BATCH requests, so
+ * that several of them are in flight at any time.
+ */
+#define RAM_BATCH 64
+
 struct ram_poke_context {
 	libusb_device_handle *device;
 	ram_mode mode;
 	size_t total, count;
+	struct libusb_control_request requests[RAM_BATCH];
+	int queued;
 };
 
 #define RETRY_LIMIT 5
 
+/*
+ * Issues the queued writes. Returns 0, or -EIO if a write failed.
+ */
+static int ram_flush(struct ram_poke_context *ctx)
+{
+	int done = 0, i, rc = 0;
+	unsigned retry = 0;
+
+	/* Retry from the failed write till we get a real error. Control
+	 * messages are not NAKed (just dropped) so time out means is a real
+	 * problem.
+	 */
+	while (done < ctx->queued) {
+		done += ezusb_batch(ctx->device, "write firmware",
+			ctx->requests + done, ctx->queued - done);
+		if (done == ctx->queued)
+			break;
+		if (ctx->requests[done].result != LIBUSB_ERROR_TIMEOUT
+				|| retry++ >= RETRY_LIMIT) {
+			rc = -EIO;
+			break;
+		}
+	}
+
+	for (i = 0; i < ctx->queued; i++)
+		free(ctx->requests[i].data);
+	ctx->queued = 0;
+	return rc;
+}
+
 static int ram_poke(void *context, uint32_t addr, bool external,
 	const unsigned char *data, size_t len)
 {
 	struct ram_poke_context *ctx = (struct ram_poke_context*)context;
-	int rc;
-	unsigned retry = 0;
+	unsigned char *buf;
 
 	switch (ctx->mode) {
 	case internal_only:		/* CPU should be stopped */
@@ -544,19 +606,20 @@ static int ram_poke(void *context, uint32_t addr, bool external,
 	ctx->total += len;
 	ctx->count++;
 
-	/* Retry this till we get a real error. Control messages are not
-	 * NAKed (just dropped) so time out means is a real problem.
-	 */
-	while ((rc = ezusb_write(ctx->device,
-		external ? "write external" : "write on-chip",
-		external ? RW_MEMORY : RW_INTERNAL,
-		addr, data, len)) < 0
-		&& retry < RETRY_LIMIT) {
-		if (rc != LIBUSB_ERROR_TIMEOUT)
-			break;
-		retry += 1;
+	/* the image parsers reuse their buffer for the next segment */
+	buf = malloc(len);
+	if (buf == NULL) {
+		logerror("could not allocate buffer for %u bytes at 0x%08x\n",
+			(unsigned)len, addr);
+		return -ENOMEM;
 	}
-	return rc;
+	memcpy(buf, data, len);
+	ezusb_fill_request(&ctx->requests[ctx->queued++], LIBUSB_ENDPOINT_OUT,
+		external ? RW_MEMORY : RW_INTERNAL, addr, buf, len);
+
+	if (ctx->queued == RAM_BATCH)
+		return ram_flush(ctx);
+	return 0;
 }
 
 /*
@@ -565,11 +628,12 @@ static int ram_poke(void *context, uint32_t addr, bool external,
  */
 static int fx3_load_ram(libusb_device_handle *device, const char *path)
 {
-	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLen, dLength;
+	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLen, dLength, nChunks;
 	uint32_t* dImageBuf;
-	unsigned char *bBuf, hBuf[4], blBuf[4], rBuf[4096];
+	unsigned char *bBuf, *rBuf, hBuf[4], blBuf[4];
+	struct libusb_control_request *requests;
 	FILE *image;
-	int ret = 0;
+	int status, ret = 0;
 
 	image = fopen(path, "rb");
 	if (image == NULL) {
@@ -655,31 +719,55 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
 		dLength <<= 2; // convert to Byte length
 		bBuf = (unsigned char*) dImageBuf;
 
-		while (dLength > 0) {
+		// write the section in 4K chunks, then read it back, with several
+		// requests in flight
+		nChunks = (dLength + 4095) / 4096;
+		rBuf = (unsigned char*) malloc(dLength);
+		requests = (struct libusb_control_request*) calloc(nChunks, sizeof(*requests));
+		if ((rBuf == NULL) || (requests == NULL)) {
+			logerror("could not allocate buffer for image chunk\n");
+			free(requests);
+			free(rBuf);
+			free(dImageBuf);
+			ret = -4;
+			goto exit;
+		}
+		for (i = 0; i < nChunks; i++) {
 			dLen = 4096; // 4K max
-			if (dLen > dLength)
-				dLen = dLength;
-			if ((ezusb_write(device, "write firmware", RW_INTERNAL, dAddress, bBuf, dLen) < 0) ||
-				(ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0)) {
-				logerror("R/W error\n");
+			if (dLen > dLength - i * 4096)
+				dLen = dLength - i * 4096;
+			ezusb_fill_request(&requests[i], LIBUSB_ENDPOINT_OUT, RW_INTERNAL,
+				dAddress + i * 4096, bBuf + i * 4096, dLen);
+		}
+		if (ezusb_batch(device, "write firmware", requests, nChunks) == (int)nChunks) {
+			for (i = 0; i < nChunks; i++)
+				ezusb_fill_request(&requests[i], LIBUSB_ENDPOINT_IN, RW_INTERNAL,
+					(uint32_t)requests[i].wIndex << 16 | requests[i].wValue,
+					rBuf + i * 4096, requests[i].wLength);
+			status = ezusb_batch(device, "read firmware", requests, nChunks);
+		} else {
+			status = -1;
+		}
+		free(requests);
+		if (status != (int)nChunks) {
+			logerror("R/W error\n");
+			free(rBuf);
+			free(dImageBuf);
+			ret = -5;
+			goto exit;
+		}
+		// Verify data: rBuf with bBuf
+		for (i = 0; i < dLength; i++) {
+			if (rBuf[i] != bBuf[i]) {
+				logerror("verify error");
+				free(rBuf);
 				free(dImageBuf);
-				ret = -5;
+				ret = -6;
 				goto exit;
 			}
-			// Verify data: rBuf with bBuf
-			for (i = 0; i < dLen; i++) {
-				if (rBuf[i] != bBuf[i]) {
-					logerror("verify error");
-					free(dImageBuf);
-					ret = -6;
-					goto exit;
-				}
-			}
-
-			dLength -= dLen;
-			bBuf += dLen;
-			dAddress += dLen;
 		}
+		free(rBuf);
+		dAddress += dLength;
 		free(dImageBuf);
 	}
 
@@ -785,7 +873,10 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 	/* scan the image, first (maybe only) time */
 	ctx.device = device;
 	ctx.total = ctx.count = 0;
+	ctx.queued = 0;
 	status = parse[img_type](image, &ctx, is_external, ram_poke);
+	if (ram_flush(&ctx) < 0 && status >= 0)
+		status = -EIO;
 	if (status < 0) {
 		logerror("unable to upload %s\n", path);
 		ret = status;
@@ -809,6 +900,8 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 		if (verbose)
 			logerror("2nd stage: write on-chip memory\n");
 		status = parse_ihex(image, &ctx, is_external, ram_poke);
+		if (ram_flush(&ctx) < 0 && status >= 0)
+			status = -EIO;
 		if (status < 0) {
 			logerror("unable to completely upload %s\n", path);
 			ret = status;
@@ -113,6 +113,9 @@ extern int ezusb_load_eeprom(libusb_device_handle *device,
 /* Verbosity level (default 1). Can be increased or decreased with options v/q  */
 extern int verbose;
 
+/* Number of vendor requests kept in flight while uploading to RAM (default 8) */
+extern int pipeline_depth;
+
 #ifdef __cplusplus
 }
 #endif
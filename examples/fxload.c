@@ -65,11 +65,12 @@ void logerror(const char *format, ...)
 }
 
 static int print_usage(int error_code) {
-	fprintf(stderr, "\nUsage: fxload [-v] [-V] [-t type] [-d vid:pid] [-p bus,addr] -i firmware\n");
+	fprintf(stderr, "\nUsage: fxload [-v] [-V] [-t type] [-d vid:pid] [-p bus,addr] [-w depth] -i firmware\n");
 	fprintf(stderr, "  -i <path>       -- Firmware to upload\n");
 	fprintf(stderr, "  -t <type>       -- Target type: an21, fx, fx2, fx2lp, fx3\n");
 	fprintf(stderr, "  -d <vid:pid>    -- Target device, as an USB VID:PID\n");
 	fprintf(stderr, "  -p <bus,addr>   -- Target device, as a libusb bus number and device address path\n");
+	fprintf(stderr, "  -w <depth>      -- Number of writes in flight during upload (default 8)\n");
 	fprintf(stderr, "  -v              -- Increase verbosity\n");
 	fprintf(stderr, "  -q              -- Decrease verbosity (silent mode)\n");
 	fprintf(stderr, "  -V              -- Print program version\n");
@@ -95,7 +96,7 @@ int main(int argc, char*argv[])
 	libusb_device_handle *device = NULL;
 	struct libusb_device_descriptor desc;
 
-	while ((opt = getopt(argc, argv, "qvV?hd:p:i:I:t:")) != EOF)
+	while ((opt = getopt(argc, argv, "qvV?hd:p:i:I:t:w:")) != EOF)
 		switch (opt) {
 
 		case 'd':
@@ -127,6 +128,14 @@ int main(int argc, char*argv[])
 			type = optarg;
 			break;
 
+		case 'w':
+			pipeline_depth = atoi(optarg);
+			if (pipeline_depth <= 0) {
+				fputs ("please specify a positive number of writes in flight\n", stderr);
+				return -1;
+			}
+			break;
+
 		case 'v':
 			verbose++;
 			break;
@@ -1,11 +1,12 @@
 /*
- * libusb example program to measure Atmel SAM3U isochronous performance
+ * libusb example program to measure the throughput of an endpoint
  * Copyright (C) 2012 Harald Welte <laforge@gnumonks.org>
  *
  * Copied with the author's permission under LGPL-2.1 from
  * http://git.gnumonks.org/cgi-bin/gitweb.cgi?p=sam3u-tests.git;a=blob;f=usb-benchmark-project/host/benchmark.c;h=74959f7ee88f1597286cd435f312a8ff52c56b7e
  *
  * An Atmel SAM3U test firmware is also available in the above repository.
+ * Without options, this program streams from its isochronous endpoint.
  *
  * This library is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Lesser General Public
@@ -25,85 +26,314 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <libusb.h>
 
+#define DEFAULT_VID	0x16c0
+#define DEFAULT_PID	0x0763
+#define DEFAULT_EP	0x86
+
+#define MAX_THREADS	64
+
+enum mode {
+	MODE_ASYNC,		/* malloc()ed buffers, resubmitted from the callback */
+	MODE_ZEROCOPY,		/* same, with libusb_dev_mem_alloc() buffers */
+	MODE_RING,		/* libusb_alloc_ring() */
+	MODE_STREAMS,		/* libusb_alloc_stream_scheduler() */
+};
+
+enum format {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+static const char *mode_names[] = { "async", "zerocopy", "ring", "streams" };
+
+static struct {
+	uint16_t vid, pid;
+	int interface;
+	unsigned char ep;
+	int type;
+	int size;
+	int iso_packets;
+	int depth;
+	int threads;
+	int duration;
+	int num_streams;
+	enum mode mode;
+	enum format format;
+	int autotune;
+} opt = {
+	DEFAULT_VID, DEFAULT_PID, -1, DEFAULT_EP, -1, 2048, 16, 4, 1, 0, 4,
+	MODE_ASYNC, FORMAT_TEXT, 0,
+};
+
+static volatile int do_exit = 0;	/* set by SIGINT or the end of the run */
+static volatile int stopping = 0;	/* no more resubmissions */
+static volatile int threads_exit = 0;	/* event threads should return */
+static volatile int in_flight = 0;
+
+static libusb_context *ctx = NULL;
+static struct libusb_device_handle *devh = NULL;
+static libusb_stream_scheduler *sched = NULL;
+static libusb_ring *ring = NULL;
 
-#define EP_DATA_IN	0x82
-#define EP_ISO_IN	0x86
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
 
-static int do_exit = 0;
-static struct libusb_device_handle *devh = NULL;
+static double now(void)
+{
+	struct timeval tv;
 
-static unsigned long num_bytes = 0, num_xfer = 0;
-static struct timeval tv_start;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+static int submit(struct libusb_transfer *xfr)
+{
+	int r;
+
+	__sync_add_and_fetch(&in_flight, 1);
+	if (opt.mode == MODE_STREAMS)
+		r = libusb_stream_submit(sched, xfr);
+	else
+		r = libusb_submit_transfer(xfr);
+	if (r < 0)
+		__sync_sub_and_fetch(&in_flight, 1);
+	return r;
+}
 
 static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
 {
-	unsigned int i;
+	int r;
 
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED && !stopping) {
+		fprintf(stderr, "transfer status %s\n", libusb_error_name(xfr->status));
+		do_exit = 1;
 	}
 
-	if (xfr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-		for (i = 0; i < xfr->num_iso_packets; i++) {
-			struct libusb_iso_packet_descriptor *pack = &xfr->iso_packet_desc[i];
+	if (!stopping && !do_exit) {
+		/* resubmit before dropping our count, so that it never reads
+		 * zero while the endpoint is still in use */
+		r = submit(xfr);
+		if (r < 0) {
+			fprintf(stderr, "error re-submitting transfer: %s\n",
+				libusb_error_name(r));
+			do_exit = 1;
+		}
+	}
+	__sync_sub_and_fetch(&in_flight, 1);
+}
 
-			if (pack->status != LIBUSB_TRANSFER_COMPLETED) {
-				fprintf(stderr, "Error: pack %u status %d\n", i, pack->status);
-				exit(5);
-			}
+static void LIBUSB_CALL cb_ring(libusb_ring *r, void *user_data)
+{
+	pthread_mutex_lock(&ring_lock);
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+}
 
-			printf("pack%u length:%u, actual_length:%u\n", i, pack->length, pack->actual_length);
-		}
+static void *event_thread(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
+
+	while (!threads_exit)
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	return NULL;
+}
+
+/* the upper bound of the bucket holding the given fraction of the
+ * completions of a latency histogram, or 0 if it is empty */
+static unsigned long long percentile(const uint64_t *hist, double fraction)
+{
+	uint64_t total = 0, count = 0;
+	int i;
+
+	for (i = 0; i < LIBUSB_LATENCY_BUCKETS; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < LIBUSB_LATENCY_BUCKETS - 1; i++) {
+		count += hist[i];
+		if (count >= total * fraction)
+			break;
 	}
+	return 2ULL << i;
+}
 
-	printf("length:%u, actual_length:%u\n", xfr->length, xfr->actual_length);
-	for (i = 0; i < xfr->actual_length; i++) {
-		printf("%02x", xfr->buffer[i]);
-		if (i % 16)
-			printf("\n");
-		else if (i % 8)
-			printf("  ");
-		else
-			printf(" ");
+static void print_header(void)
+{
+	switch (opt.format) {
+	case FORMAT_TEXT:
+		printf("%8s %12s %14s %8s %8s %10s %10s %10s\n", "time(s)",
+			"transfers/s", "bytes/s", "cpu(%)", "errors", "p50(us)",
+			"p90(us)", "p99(us)");
+		break;
+	case FORMAT_CSV:
+		printf("record,mode,endpoint,size,depth,threads,time_s,"
+			"transfers,bytes,transfers_per_sec,bytes_per_sec,"
+			"cpu_percent,errors,p50_us,p90_us,p99_us\n");
+		break;
+	case FORMAT_JSON:
+		break;
 	}
-	num_bytes += xfr->actual_length;
-	num_xfer++;
+}
 
-	if (libusb_submit_transfer(xfr) < 0) {
-		fprintf(stderr, "error re-submitting URB\n");
-		exit(1);
+/* print the activity between two snapshots of the endpoint counters */
+static void print_record(const char *record, double t,
+	const struct libusb_endpoint_stats *prev,
+	const struct libusb_endpoint_stats *cur, double wall, double cpu)
+{
+	uint64_t hist[LIBUSB_LATENCY_BUCKETS];
+	uint64_t transfers = cur->completed - prev->completed;
+	uint64_t bytes = cur->bytes - prev->bytes;
+	uint64_t errors = (cur->errors + cur->timeouts + cur->stalls)
+		- (prev->errors + prev->timeouts + prev->stalls);
+	double cpu_percent = wall > 0 ? cpu * 100.0 / wall : 0;
+	int i;
+
+	for (i = 0; i < LIBUSB_LATENCY_BUCKETS; i++)
+		hist[i] = cur->latency_us[i] - prev->latency_us[i];
+	if (wall <= 0)
+		wall = 1;
+
+	switch (opt.format) {
+	case FORMAT_TEXT:
+		printf("%8.1f %12.0f %14.0f %8.1f %8llu %10llu %10llu %10llu%s\n", t,
+			transfers / wall, bytes / wall, cpu_percent,
+			(unsigned long long)errors, percentile(hist, 0.5),
+			percentile(hist, 0.9), percentile(hist, 0.99),
+			strcmp(record, "total") ? "" : "  (total)");
+		break;
+	case FORMAT_CSV:
+		printf("%s,%s,0x%02x,%d,%d,%d,%.3f,%llu,%llu,%.1f,%.1f,%.1f,%llu,"
+			"%llu,%llu,%llu\n", record, mode_names[opt.mode], opt.ep,
+			opt.size, opt.depth, opt.threads, t,
+			(unsigned long long)transfers, (unsigned long long)bytes,
+			transfers / wall, bytes / wall, cpu_percent,
+			(unsigned long long)errors, percentile(hist, 0.5),
+			percentile(hist, 0.9), percentile(hist, 0.99));
+		break;
+	case FORMAT_JSON:
+		printf("{\"record\":\"%s\",\"mode\":\"%s\",\"endpoint\":%u,"
+			"\"size\":%d,\"depth\":%d,\"threads\":%d,\"time_s\":%.3f,"
+			"\"transfers\":%llu,\"bytes\":%llu,"
+			"\"transfers_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+			"\"cpu_percent\":%.1f,\"errors\":%llu,\"latency_us\":{",
+			record, mode_names[opt.mode], opt.ep, opt.size,
+			opt.depth, opt.threads, t, (unsigned long long)transfers,
+			(unsigned long long)bytes, transfers / wall, bytes / wall,
+			cpu_percent, (unsigned long long)errors);
+		for (i = 0; i < LIBUSB_LATENCY_BUCKETS; i++)
+			printf("%s\"%llu\":%llu", i ? "," : "", 2ULL << i,
+				(unsigned long long)hist[i]);
+		printf("}}\n");
+		break;
 	}
+	fflush(stdout);
 }
 
-static int benchmark_in(uint8_t ep)
+static int find_endpoint(void)
 {
-	static uint8_t buf[2048];
-	static struct libusb_transfer *xfr;
-	int num_iso_pack = 0;
+	struct libusb_config_descriptor *config;
+	int i, j, k, r;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(devh), &config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (i = 0; i < config->bNumInterfaces && r; i++) {
+		for (j = 0; j < config->interface[i].num_altsetting && r; j++) {
+			const struct libusb_interface_descriptor *alt =
+				&config->interface[i].altsetting[j];
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				if (alt->endpoint[k].bEndpointAddress != opt.ep)
+					continue;
+				if (opt.interface < 0)
+					opt.interface = alt->bInterfaceNumber;
+				if (opt.type < 0)
+					opt.type = alt->endpoint[k].bmAttributes
+						& LIBUSB_TRANSFER_TYPE_MASK;
+				r = 0;
+				break;
+			}
+		}
+	}
 
-	if (ep == EP_ISO_IN)
-		num_iso_pack = 16;
+	libusb_free_config_descriptor(config);
+	return r;
+}
 
-	xfr = libusb_alloc_transfer(num_iso_pack);
-	if (!xfr)
-		return -ENOMEM;
+/* whether the transfer buffers come from libusb_dev_mem_alloc() */
+static int bufs_dev_mem = 0;
 
-	if (ep == EP_ISO_IN) {
-		libusb_fill_iso_transfer(xfr, devh, ep, buf,
-				sizeof(buf), num_iso_pack, cb_xfr, NULL, 0);
-		libusb_set_iso_packet_lengths(xfr, sizeof(buf)/num_iso_pack);
-	} else
-		libusb_fill_bulk_transfer(xfr, devh, ep, buf,
-				sizeof(buf), cb_xfr, NULL, 0);
+static int start_transfers(struct libusb_transfer ***xfrs_out,
+	unsigned char **bufs_out, int *num_out)
+{
+	struct libusb_transfer **xfrs;
+	unsigned char *bufs = NULL;
+	int num = opt.depth, i, r;
+
+	if (opt.mode == MODE_STREAMS) {
+		r = libusb_alloc_stream_scheduler(devh, opt.ep, opt.num_streams,
+			opt.depth, &sched);
+		if (r < 0)
+			return r;
+		num = r * opt.depth;
+	}
 
-	gettimeofday(&tv_start, NULL);
+	if (opt.mode == MODE_ZEROCOPY) {
+		bufs = libusb_dev_mem_alloc(devh, (size_t)num * opt.size);
+		if (bufs)
+			bufs_dev_mem = 1;
+		else
+			fprintf(stderr, "zero-copy buffers not available, "
+				"using malloc()\n");
+	}
+	if (!bufs)
+		bufs = malloc((size_t)num * opt.size);
+	xfrs = calloc(num, sizeof(*xfrs));
+	*xfrs_out = xfrs;
+	*bufs_out = bufs;
+	if (!bufs || !xfrs)
+		return LIBUSB_ERROR_NO_MEM;
+	*num_out = num;
+
+	for (i = 0; i < num; i++) {
+		int iso = opt.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+
+		xfrs[i] = libusb_alloc_transfer(iso ? opt.iso_packets : 0);
+		if (!xfrs[i])
+			return LIBUSB_ERROR_NO_MEM;
+		if (iso) {
+			libusb_fill_iso_transfer(xfrs[i], devh, opt.ep,
+				bufs + i * opt.size, opt.size, opt.iso_packets,
+				cb_xfr, NULL, 0);
+			libusb_set_iso_packet_lengths(xfrs[i],
+				opt.size / opt.iso_packets);
+		} else {
+			libusb_fill_bulk_transfer(xfrs[i], devh, opt.ep,
+				bufs + i * opt.size, opt.size, cb_xfr, NULL, 0);
+			xfrs[i]->type = (unsigned char)opt.type;
+		}
+	}
 
 	/* NOTE: To reach maximum possible performance the program must
 	 * submit *multiple* transfers here, not just one.
@@ -118,76 +348,309 @@ static int benchmark_in(uint8_t ep)
 	 * more transfers on the bus while the callback is running for
 	 * transfers which have completed on the bus.
 	 */
-
-	return libusb_submit_transfer(xfr);
+	for (i = 0; i < num; i++) {
+		r = submit(xfrs[i]);
+		if (r < 0)
+			return r;
+	}
+	return 0;
 }
 
-static void measure(void)
+/* consume ring data, or just wait, until the given time */
+static void run_until(double end)
 {
-	struct timeval tv_stop;
-	unsigned int diff_msec;
-
-	gettimeofday(&tv_stop, NULL);
-
-	diff_msec = (tv_stop.tv_sec - tv_start.tv_sec)*1000;
-	diff_msec += (tv_stop.tv_usec - tv_start.tv_usec)/1000;
+	unsigned char *data;
+	struct timespec ts;
+	double t;
+	int length, r;
+
+	while (!do_exit && (t = now()) < end) {
+		if (!ring) {
+			usleep((useconds_t)((end - t) * 1000000.0) > 100000 ?
+				100000 : (useconds_t)((end - t) * 1000000.0));
+			continue;
+		}
 
-	printf("%lu transfers (total %lu bytes) in %u miliseconds => %lu bytes/sec\n",
-		num_xfer, num_bytes, diff_msec, (num_bytes*1000)/diff_msec);
+		r = libusb_ring_read(ring, &data, &length);
+		if (r == 1) {
+			libusb_ring_release(ring);
+		} else if (r == 0) {
+			t += 0.01;
+			ts.tv_sec = (time_t)t;
+			ts.tv_nsec = (long)((t - ts.tv_sec) * 1000000000.0);
+			pthread_mutex_lock(&ring_lock);
+			pthread_cond_timedwait(&ring_cond, &ring_lock, &ts);
+			pthread_mutex_unlock(&ring_lock);
+		} else {
+			fprintf(stderr, "ring stopped: %s\n", libusb_error_name(r));
+			do_exit = 1;
+		}
+	}
 }
 
 static void sig_hdlr(int signum)
 {
 	switch (signum) {
 	case SIGINT:
-		measure();
 		do_exit = 1;
 		break;
 	}
 }
 
+static int usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d vid:pid    device (default %04x:%04x)\n"
+		"  -e endpoint   endpoint address (default 0x%02x)\n"
+		"  -i interface  interface to claim (default: the endpoint's)\n"
+		"  -t type       bulk, interrupt or iso (default: the endpoint's)\n"
+		"  -s size       transfer size in bytes (default 2048)\n"
+		"  -p packets    packets per isochronous transfer (default 16)\n"
+		"  -q depth      transfers in flight, per stream in streams mode\n"
+		"                (default 4)\n"
+		"  -j threads    event handling threads (default 1)\n"
+		"  -D seconds    run time, 0 to run until interrupted (default)\n"
+		"  -m mode       async, zerocopy, ring or streams (default async)\n"
+		"  -S streams    bulk streams to allocate in streams mode\n"
+		"                (default 4)\n"
+		"  -o format     text, csv or json (default text)\n"
+		"  -A            in ring mode, let the ring tune its depth and\n"
+		"                transfer size, up to the -q and -s values\n",
+		argv0, DEFAULT_VID, DEFAULT_PID, DEFAULT_EP);
+	return 1;
+}
+
+static int lookup(const char *name, const char **names, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (!strcmp(name, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static int parse_options(int argc, char **argv)
+{
+	static const char *types[] = { "control", "iso", "bulk", "interrupt" };
+	static const char *formats[] = { "text", "csv", "json" };
+	unsigned int vid, pid;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:e:i:t:s:p:q:j:D:m:S:o:Ah")) != -1) {
+		switch (c) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2)
+				return -1;
+			opt.vid = (uint16_t)vid;
+			opt.pid = (uint16_t)pid;
+			break;
+		case 'e':
+			opt.ep = (unsigned char)strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			opt.interface = atoi(optarg);
+			break;
+		case 't':
+			opt.type = lookup(optarg, types, 4);
+			if (opt.type <= 0)
+				return -1;
+			break;
+		case 's':
+			opt.size = atoi(optarg);
+			break;
+		case 'p':
+			opt.iso_packets = atoi(optarg);
+			break;
+		case 'q':
+			opt.depth = atoi(optarg);
+			break;
+		case 'j':
+			opt.threads = atoi(optarg);
+			break;
+		case 'D':
+			opt.duration = atoi(optarg);
+			break;
+		case 'm':
+			c = lookup(optarg, mode_names, 4);
+			if (c < 0)
+				return -1;
+			opt.mode = (enum mode)c;
+			break;
+		case 'S':
+			opt.num_streams = atoi(optarg);
+			break;
+		case 'o':
+			c = lookup(optarg, formats, 3);
+			if (c < 0)
+				return -1;
+			opt.format = (enum format)c;
+			break;
+		case 'A':
+			opt.autotune = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (opt.size <= 0 || opt.iso_packets <= 0 || opt.depth <= 0
+			|| opt.threads <= 0 || opt.threads > MAX_THREADS
+			|| opt.duration < 0 || opt.num_streams <= 0)
+		return -1;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int rc;
+	struct libusb_endpoint_stats first, prev, cur;
+	struct libusb_transfer **xfrs = NULL;
+	unsigned char *bufs = NULL;
+	pthread_t threads[MAX_THREADS];
 	struct sigaction sigact;
+	double start, t, last, cpu_start, cpu_last, cpu;
+	int num_xfrs = 0, num_threads = 0, claimed = 0;
+	int i, rc;
+
+	if (parse_options(argc, argv) < 0)
+		return usage(argv[0]);
 
 	sigact.sa_handler = sig_hdlr;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigaction(SIGINT, &sigact, NULL);
 
-	rc = libusb_init(NULL);
+	rc = libusb_init(&ctx);
 	if (rc < 0) {
 		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
 		exit(1);
 	}
 
-	devh = libusb_open_device_with_vid_pid(NULL, 0x16c0, 0x0763);
+	devh = libusb_open_device_with_vid_pid(ctx, opt.vid, opt.pid);
 	if (!devh) {
 		fprintf(stderr, "Error finding USB device\n");
+		rc = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	rc = find_endpoint();
+	if (rc < 0 && (opt.interface < 0 || opt.type < 0)) {
+		fprintf(stderr, "Error finding endpoint 0x%02x\n", opt.ep);
 		goto out;
 	}
 
-	rc = libusb_claim_interface(devh, 2);
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	rc = libusb_claim_interface(devh, opt.interface);
 	if (rc < 0) {
 		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
 		goto out;
 	}
+	claimed = 1;
 
-	benchmark_in(EP_ISO_IN);
-
-	while (!do_exit) {
-		rc = libusb_handle_events(NULL);
-		if (rc != LIBUSB_SUCCESS)
-			break;
+	for (i = 0; i < opt.threads; i++) {
+		if (pthread_create(&threads[i], NULL, event_thread, NULL) != 0) {
+			fprintf(stderr, "Error creating event thread\n");
+			rc = LIBUSB_ERROR_OTHER;
+			goto out_stop;
+		}
+		num_threads++;
 	}
 
-	/* Measurement has already been done by the signal handler. */
+	libusb_get_endpoint_stats(devh, opt.ep, &first);
+	if (opt.mode == MODE_RING) {
+		rc = libusb_alloc_ring(devh, opt.ep, opt.depth * 2, opt.depth,
+			opt.size, opt.iso_packets, cb_ring, NULL, &ring);
+		if (rc == 0 && opt.autotune)
+			rc = libusb_set_ring_autotune(ring, 1);
+		if (rc == 0)
+			rc = libusb_start_ring(ring);
+	} else {
+		rc = start_transfers(&xfrs, &bufs, &num_xfrs);
+	}
+	if (rc < 0) {
+		fprintf(stderr, "Error starting %s transfers: %s\n",
+			mode_names[opt.mode], libusb_error_name(rc));
+		goto out_stop;
+	}
 
-	libusb_release_interface(devh, 0);
+	print_header();
+	start = last = now();
+	cpu_start = cpu_last = cpu_time();
+	prev = first;
+	while (!do_exit) {
+		double end = last + 1.0;
+
+		if (opt.duration && end > start + opt.duration)
+			end = start + opt.duration;
+		run_until(end);
+
+		t = now();
+		cpu = cpu_time();
+		libusb_get_endpoint_stats(devh, opt.ep, &cur);
+		print_record("interval", t - start, &prev, &cur, t - last,
+			cpu - cpu_last);
+		prev = cur;
+		last = t;
+		cpu_last = cpu;
+		if (opt.duration && t >= start + opt.duration)
+			do_exit = 1;
+	}
+	t = now();
+	libusb_get_endpoint_stats(devh, opt.ep, &cur);
+	print_record("total", t - start, &first, &cur, t - start,
+		cpu_time() - cpu_start);
+	if (ring && opt.autotune) {
+		struct libusb_ring_tuning tuning;
+
+		libusb_get_ring_tuning(ring, &tuning);
+		fprintf(stderr, "ring %s at depth %d, %d bytes per transfer\n",
+			tuning.warming_up ? "still tuning" : "tuned",
+			tuning.queue_depth, tuning.transfer_length);
+	}
+	rc = 0;
+
+out_stop:
+	/* stop resubmitting, then wait for the event threads to hand back
+	 * the transfers still in flight */
+	stopping = 1;
+	if (ring) {
+		struct libusb_ring_stats rs;
+
+		libusb_stop_ring(ring);
+		while (num_threads && libusb_get_ring_stats(ring, &rs) == 0
+				&& rs.in_flight > 0)
+			usleep(1000);
+	} else if (num_xfrs) {
+		/* cancel again as long as needed, as a stream scheduler
+		 * submits queued transfers when others complete */
+		while (num_threads && in_flight > 0) {
+			libusb_cancel_endpoint_transfers(devh, opt.ep);
+			usleep(1000);
+		}
+	}
+	threads_exit = 1;
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (ring)
+		libusb_free_ring(ring);
+	if (sched)
+		libusb_free_stream_scheduler(sched);
+	for (i = 0; xfrs && i < num_xfrs; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(xfrs);
+	if (bufs_dev_mem)
+		libusb_dev_mem_free(devh, bufs, (size_t)num_xfrs * opt.size);
+	else
+		free(bufs);
+
+	if (claimed)
+		libusb_release_interface(devh, opt.interface);
 out:
 	if (devh)
 		libusb_close(devh);
-	libusb_exit(NULL);
-	return rc;
+	libusb_exit(ctx);
+	return rc < 0 ? 1 : 0;
 }
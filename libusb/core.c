@@ -44,7 +44,9 @@
 #include "libusbi.h"
 #include "hotplug.h"
 
-#if defined(OS_LINUX)
+#if defined(OS_NULL)
+const struct usbi_os_backend * const usbi_backend = &null_backend;
+#elif defined(OS_LINUX)
 const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
 #elif defined(OS_DARWIN)
 const struct usbi_os_backend * const usbi_backend = &darwin_backend;
@@ -71,6 +73,23 @@ static struct timeval timestamp_origin = { 0, 0 };
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
 
+/* until the first context has been set up, let every message through to
+ * usbi_log_v(), which checks LIBUSB_DEBUG itself */
+volatile int usbi_log_threshold = LIBUSB_LOG_LEVEL_DEBUG;
+
+/* level from the LIBUSB_DEBUG environment variable, read at the first
+ * libusb_init(), or -1 until then */
+static int env_log_level = -1;
+
+/* messages queued for the log thread beyond this are dropped */
+#define MAX_QUEUED_LOG_MESSAGES	1024
+
+struct usbi_log_message {
+	struct list_head list;
+	enum libusb_log_level level;
+	char str[1];
+};
+
 /**
  * \mainpage libusb-1.0 API Reference
  *
@@ -531,58 +550,60 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
-void usbi_connect_device(struct libusb_device *dev)
+static unsigned int session_bucket(unsigned long session_id)
 {
-	libusb_hotplug_message message;
-	ssize_t ret;
+	unsigned long h = session_id;
+
+	/* fold all of the bytes in, backends put the bus number, port path
+	 * or location ID in different parts of the ID */
+	h ^= (h >> 16) >> 16;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return (unsigned int) (h % USBI_SESSION_BUCKETS);
+}
 
-	memset(&message, 0, sizeof(message));
-	message.event = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
-	message.device = dev;
+void usbi_connect_device(struct libusb_device *dev)
+{
 	dev->attached = 1;
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 	list_add(&dev->list, &dev->ctx->usb_devs);
+	list_add(&dev->session_list,
+		&dev->ctx->usb_devs_by_session[session_bucket(dev->session_data)]);
+	dev->ctx->usb_devs_generation++;
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug pipe is ready. This prevents an event from getting raised during
 	 * initial enumeration. */
-	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_pipe[1] > 0) {
-		ret = usbi_write(dev->ctx->hotplug_pipe[1], &message, sizeof(message));
-		if (sizeof (message) != ret) {
-			usbi_err(DEVICE_CTX(dev), "error writing hotplug message");
-		}
-	}
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_pipe[1] > 0)
+		usbi_hotplug_notification(dev->ctx, dev,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
 }
 
 void usbi_disconnect_device(struct libusb_device *dev)
 {
-	libusb_hotplug_message message;
 	struct libusb_context *ctx = dev->ctx;
-	ssize_t ret;
 
-	memset(&message, 0, sizeof(message));
-	message.event = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
-	message.device = dev;
 	usbi_mutex_lock(&dev->lock);
 	dev->attached = 0;
 	usbi_mutex_unlock(&dev->lock);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->session_list);
+	ctx->usb_devs_generation++;
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
+	usbi_clear_string_cache(dev);
+
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug pipe is ready. This prevents an event from getting raised during
 	 * initial enumeration. libusb_handle_events will take care of dereferencing the
 	 * device. */
-	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_pipe[1] > 0) {
-		ret = usbi_write(dev->ctx->hotplug_pipe[1], &message, sizeof(message));
-		if (sizeof(message) != ret) {
-			usbi_err(DEVICE_CTX(dev), "error writing hotplug message");
-		}
-	}
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_pipe[1] > 0)
+		usbi_hotplug_notification(dev->ctx, dev,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
 }
 
 /* Perform some final sanity checks on a newly discovered device. If this
@@ -618,7 +639,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, &ctx->usb_devs_by_session[session_bucket(session_id)],
+			session_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -649,6 +671,36 @@ DEFAULT_VISIBILITY void * LIBUSB_CALL libusb_get_device_user_data(libusb_device
 	return device->user_data;
 }
 
+/* bring the cached list of the devices of usb_devs up to date. must be
+ * called with the usb_devs_lock held */
+static int update_device_list(struct libusb_context *ctx)
+{
+	struct libusb_device **devs;
+	struct libusb_device *dev;
+	ssize_t len = 0;
+
+	if (ctx->device_list && ctx->device_list_generation == ctx->usb_devs_generation)
+		return 0;
+
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+		len++;
+
+	devs = realloc(ctx->device_list, (len + 1) * sizeof(*devs));
+	if (!devs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	len = 0;
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+		devs[len++] = dev;
+	devs[len] = NULL;
+
+	ctx->device_list = devs;
+	ctx->device_list_len = len;
+	ctx->device_list_generation = ctx->usb_devs_generation;
+	usbi_dbg("device list now has %d devices", (int)len);
+	return 0;
+}
+
 /** @ingroup dev
  * Returns a list of USB devices currently attached to the system. This is
  * your entry point into finding a USB device to operate.
@@ -668,42 +720,54 @@ DEFAULT_VISIBILITY void * LIBUSB_CALL libusb_get_device_user_data(libusb_device
  * libusb_free_device_list().
  * \returns the number of devices in the outputted list, or any
  * \ref libusb_error according to errors encountered by the backend.
+ * \see libusb_get_device_list_generation()
  */
 ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list)
 {
-	struct discovered_devs *discdevs = discovered_devs_alloc();
+	struct discovered_devs *discdevs;
 	struct libusb_device **ret;
 	int r = 0;
 	ssize_t i, len;
 	USBI_GET_CONTEXT(ctx);
 	usbi_dbg("");
 
-	if (!discdevs)
-		return LIBUSB_ERROR_NO_MEM;
-
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
-		/* backend provides hotplug support */
-		struct libusb_device *dev;
-
+		/* backend provides hotplug support, so usb_devs is kept up to
+		 * date and the list is only rebuilt after it changed */
 		if (usbi_backend->hotplug_poll)
 			usbi_backend->hotplug_poll();
+		if (usbi_backend->sync_devices)
+			usbi_backend->sync_devices(ctx);
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
-		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
-			discdevs = discovered_devs_append(discdevs, dev);
+		r = update_device_list(ctx);
+		if (r < 0) {
+			usbi_mutex_unlock(&ctx->usb_devs_lock);
+			return r;
+		}
 
-			if (!discdevs) {
-				r = LIBUSB_ERROR_NO_MEM;
-				break;
-			}
+		len = ctx->device_list_len;
+		ret = malloc((len + 1) * sizeof(struct libusb_device *));
+		if (!ret) {
+			usbi_mutex_unlock(&ctx->usb_devs_lock);
+			return LIBUSB_ERROR_NO_MEM;
 		}
+		for (i = 0; i <= len; i++)
+			ret[i] = ctx->device_list[i] ?
+				libusb_ref_device(ctx->device_list[i]) : NULL;
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
-	} else {
-		/* backend does not provide hotplug support */
-		r = usbi_backend->get_device_list(ctx, &discdevs);
+
+		*list = ret;
+		return len;
 	}
 
+	/* backend does not provide hotplug support */
+	discdevs = discovered_devs_alloc();
+	if (!discdevs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = usbi_backend->get_device_list(ctx, &discdevs);
 	if (r < 0) {
 		len = r;
 		goto out;
@@ -729,6 +793,90 @@ out:
 	return len;
 }
 
+/** \ingroup dev
+ * Get a number which changes whenever a device is connected to or
+ * disconnected from the system, so that applications which watch the
+ * attached devices by polling can skip calling libusb_get_device_list()
+ * while nothing changed.
+ *
+ * This only reads a counter maintained by the hotplug machinery, after
+ * applying the hotplug events already received to the device list of the
+ * context. It does not involve the operating system, so it may lag behind by
+ * the time the hotplug monitor of the backend takes to notice a new device.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param generation output location for the number
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform has no hotplug support
+ * \see libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+ */
+int API_EXPORTED libusb_get_device_list_generation(libusb_context *ctx,
+	unsigned int *generation)
+{
+	USBI_GET_CONTEXT(ctx);
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (usbi_backend->sync_devices)
+		usbi_backend->sync_devices(ctx);
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	*generation = ctx->usb_devs_generation;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	return 0;
+}
+
+/** \ingroup dev
+ * Report how much memory a context holds for the devices it knows of.
+ *
+ * Descriptors and other immutable per-device data are stored once for all
+ * devices which have the same contents, in any context, and are shared with
+ * every clone of a device. The descriptors of a device are only read when
+ * first needed if the LIBUSB_LAZY_DESCRIPTORS environment variable is set to
+ * a non-zero value (Linux only), which keeps memory low on systems with many
+ * devices that are never opened.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_memory_stats(libusb_context *ctx,
+	struct libusb_memory_stats *stats)
+{
+	struct libusb_device *dev;
+	size_t dev_size = sizeof(struct libusb_device)
+		+ usbi_backend->device_priv_size;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset(stats, 0, sizeof(*stats));
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+		stats->devices++;
+		stats->device_bytes += dev_size;
+		if (usbi_backend->device_memory)
+			stats->descriptor_bytes +=
+				usbi_backend->device_memory(dev);
+		stats->cache_bytes += usbi_device_cache_size(dev);
+	}
+	if (ctx->device_list)
+		stats->device_list_bytes = (ctx->device_list_len + 1)
+			* sizeof(*ctx->device_list);
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	stats->shared_bytes = usbi_shared_blob_bytes();
+	return 0;
+}
+
 /** \ingroup dev
  * Frees a list of devices previously discovered using
  * libusb_get_device_list(). If the unref_devices parameter is set, the
@@ -864,31 +1012,6 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
-{
-	int iface_idx;
-	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
-		const struct libusb_interface *iface = &config->interface[iface_idx];
-		int altsetting_idx;
-
-		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
-				altsetting_idx++) {
-			const struct libusb_interface_descriptor *altsetting
-				= &iface->altsetting[altsetting_idx];
-			int ep_idx;
-
-			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-				const struct libusb_endpoint_descriptor *ep =
-					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
-			}
-		}
-	}
-	return NULL;
-}
-
 /** \ingroup dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -919,7 +1042,7 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
+	ep = usbi_find_endpoint(config, endpoint);
 	if (!ep) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
@@ -932,6 +1055,34 @@ out:
 	return r;
 }
 
+/* return the LIBUSB_TRANSFER_TYPE of an endpoint in the active
+ * configuration */
+int usbi_get_endpoint_type(struct libusb_device *dev, unsigned char endpoint)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_endpoint_descriptor *ep;
+	int r;
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0) {
+		usbi_err(DEVICE_CTX(dev),
+			"could not retrieve active config descriptor");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	ep = usbi_find_endpoint(config, endpoint);
+	if (!ep) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	r = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+
+out:
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
 /** \ingroup dev
  * Calculate the maximum packet size which a specific endpoint is capable is
  * sending or receiving in the duration of 1 microframe
@@ -974,7 +1125,7 @@ int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
+	ep = usbi_find_endpoint(config, endpoint);
 	if (!ep) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
@@ -1027,6 +1178,8 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 		usbi_dbg("destroy device %d.%d", dev->bus_number, dev->device_address);
 
 		libusb_unref_device(dev->parent_dev);
+		usbi_clear_config_cache(dev);
+		usbi_clear_string_cache(dev);
 
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
@@ -1110,7 +1263,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_device_handle *_handle;
 	size_t priv_size = usbi_backend->device_handle_priv_size;
-	int r;
+	int r, i;
 	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
 
 	if (!dev->attached) {
@@ -1126,16 +1279,38 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		free(_handle);
 		return LIBUSB_ERROR_OTHER;
 	}
+	r = usbi_mutex_init(&_handle->stats_lock, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->auto_detach_kernel_driver = 0;
 	_handle->claimed_interfaces = 0;
+	_handle->event_domain = NULL;
+	_handle->sync_transfer = NULL;
+	_handle->sync_buffer = NULL;
+	_handle->sync_buffer_size = 0;
+	_handle->busy_poll_budget = 0;
+	_handle->dedicated_reaper = USBI_REAPER_OFF;
+	_handle->reaper_tid = 0;
+	_handle->priority = LIBUSB_PRIORITY_NORMAL;
+	memset(_handle->ep_stats, 0, sizeof(_handle->ep_stats));
+	for (i = 0; i < (int)(sizeof(_handle->callback_queues)
+			/ sizeof(_handle->callback_queues[0])); i++) {
+		list_init(&_handle->callback_queues[i].transfers);
+		_handle->callback_queues[i].busy = 0;
+	}
+	_handle->deferred_callbacks = 0;
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
 	if (r < 0) {
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
+		usbi_mutex_destroy(&_handle->stats_lock);
 		usbi_mutex_destroy(&_handle->lock);
 		free(_handle);
 		return r;
@@ -1214,6 +1389,7 @@ static void do_close(struct libusb_context *ctx,
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
+	int i;
 
 	libusb_lock_events(ctx);
 
@@ -1242,7 +1418,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		usbi_mutex_lock(&itransfer->lock);
-		list_del(&itransfer->list);
+		usbi_remove_from_flying_list(itransfer);
 		transfer->dev_handle = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 
@@ -1259,10 +1435,18 @@ static void do_close(struct libusb_context *ctx,
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
+	if (dev_handle->busy_poll_budget)
+		ctx->busy_poll_handles--;
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	libusb_free_transfer(dev_handle->sync_transfer);
+	free(dev_handle->sync_buffer);
+	for (i = 0; i < (int)(sizeof(dev_handle->ep_stats)
+			/ sizeof(dev_handle->ep_stats[0])); i++)
+		free(dev_handle->ep_stats[i]);
+	usbi_mutex_destroy(&dev_handle->stats_lock);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
@@ -1290,6 +1474,18 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
+	/* hand the handle back to the context first, so that only the context's
+	 * event handlers need to be kept away from it below */
+	if (dev_handle->event_domain)
+		libusb_event_domain_remove_handle(dev_handle);
+
+	/* completions must not be reaped behind do_close()'s back */
+	if (dev_handle->dedicated_reaper)
+		libusb_set_dedicated_reaper(dev_handle, 0);
+
+	/* nor may callback workers still be using the handle */
+	usbi_wait_deferred_callbacks(dev_handle);
+
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
 	 * the device while holding the event handling lock (preventing any other
@@ -1445,8 +1641,13 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+	if (r == 0)
+		usbi_clear_config_cache(dev->dev);
+	return r;
 }
 
 /** \ingroup dev
@@ -1641,6 +1842,9 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
+	/* the device may come back with different strings, or as a different
+	 * device altogether */
+	usbi_clear_string_cache(dev->dev);
 	return usbi_backend->reset_device(dev);
 }
 
@@ -1707,6 +1911,186 @@ int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/** \ingroup asyncio
+ * Allocate memory for transfer buffers which the kernel can transfer data
+ * to and from directly. On Linux this maps memory of the usbfs device node
+ * into the process, so that the kernel does not need to copy the data of
+ * transfers using it between the user buffer and a kernel bounce buffer,
+ * which gives a significant speedup for high bandwidth transfers. On macOS
+ * the memory is created with LowLatencyCreateBuffer() on a claimed interface
+ * (preferably one with an isochronous IN endpoint), and isochronous IN
+ * transfers using it go through the low latency isochronous path, which
+ * saves mapping the buffer on every submission.
+ *
+ * The memory is only valid for transfers to and from the device the handle
+ * belongs to, and must be released with libusb_dev_mem_free() before the
+ * handle is closed.
+ *
+ * This function is not available on all platforms, nor on Linux kernels which
+ * do not support it (before 4.6). In that case NULL is returned and the
+ * application should fall back to allocating its buffers with malloc().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param length size of the buffer to allocate
+ * \returns a pointer to the newly allocated memory, or NULL on failure or if
+ * the functionality is not available
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length)
+{
+	usbi_dbg("len %u", (unsigned) length);
+
+	if (!dev->dev->attached)
+		return NULL;
+
+	if (usbi_backend->dev_mem_alloc)
+		return usbi_backend->dev_mem_alloc(dev, length);
+	else
+		return NULL;
+}
+
+/** \ingroup asyncio
+ * Free memory allocated with libusb_dev_mem_alloc(). No transfer using the
+ * memory may be in flight when calling this function.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param buffer pointer to the previously allocated memory
+ * \param length size of the previously allocated memory
+ * \returns LIBUSB_SUCCESS, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length)
+{
+	usbi_dbg("len %u", (unsigned) length);
+
+	if (usbi_backend->dev_mem_free)
+		return usbi_backend->dev_mem_free(dev, buffer, length);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Set the size of the units that bulk and interrupt transfers on an
+ * endpoint are split into when they are handed to the operating system.
+ *
+ * Some platforms must split large transfers into several requests to the
+ * kernel, each of which is submitted, reaped and completed on its own. On
+ * Linux, for instance, kernels without scatter-gather support for the host
+ * controller split transfers into 16kB units by default, so a 4MB read
+ * takes 256 of them. Larger units mean less overhead per transfer, while
+ * smaller ones need less contiguous kernel memory.
+ *
+ * The size is rounded down to a multiple of 1024 bytes, so that only the
+ * last unit of a transfer can end in a short packet, and it may be limited
+ * further by what the running kernel can do. Use
+ * libusb_get_bulk_urb_size() to see the size that is actually used. The
+ * new size applies to transfers submitted afterwards.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param endpoint the address of the endpoint, or 0 to set the size used
+ * for all endpoints of the handle which have no size of their own
+ * \param size the size in bytes, 0 to restore the default policy, or
+ * \ref LIBUSB_BULK_URB_SIZE_UNLIMITED to use as few units as the kernel
+ * allows, ideally a single one per transfer
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint address or the size
+ * is not valid
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not split
+ * transfers or does not let the size be chosen
+ */
+int API_EXPORTED libusb_set_bulk_urb_size(libusb_device_handle *dev,
+	unsigned char endpoint, int size)
+{
+	usbi_dbg("endpoint %02x size %d", endpoint, size);
+
+	if ((endpoint & ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK))
+			|| (size < 0 && size != LIBUSB_BULK_URB_SIZE_UNLIMITED))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->set_bulk_urb_size)
+		return usbi_backend->set_bulk_urb_size(dev, endpoint, size);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Get the size of the units that bulk and interrupt transfers on an
+ * endpoint are currently split into, as chosen from the size set with
+ * libusb_set_bulk_urb_size() and the capabilities of the running kernel.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param endpoint the address of the endpoint
+ * \returns the size in bytes of each unit
+ * \returns 0 if each transfer is submitted as a single unit, whatever its
+ * length
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint address is not valid
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not report it
+ */
+int API_EXPORTED libusb_get_bulk_urb_size(libusb_device_handle *dev,
+	unsigned char endpoint)
+{
+	if (endpoint & ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->get_bulk_urb_size)
+		return usbi_backend->get_bulk_urb_size(dev, endpoint);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Enable or disable raw I/O on a bulk or interrupt IN endpoint.
+ *
+ * Some platform drivers queue and buffer reads on their own, which keeps
+ * the host controller from working on more than one of them at a time. In
+ * raw I/O mode, every transfer goes straight to the host controller, so
+ * that keeping several transfers submitted on the endpoint keeps it busy.
+ * In exchange, the length of each transfer on the endpoint must be a
+ * multiple of its maximum packet size, and no larger than the size this
+ * function returns. Other transfers fail to submit with
+ * LIBUSB_ERROR_INVALID_PARAM.
+ *
+ * This is currently only implemented for WinUSB (the RAW_IO pipe policy)
+ * and libusbK. The interface of the endpoint must be claimed, and the mode
+ * is lost when it is released.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param endpoint the address of an IN endpoint
+ * \param enable non-zero to enable raw I/O, 0 to disable it
+ * \returns the largest transfer length accepted on the endpoint while raw
+ * I/O is enabled, or 0 if it was disabled
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint address is not valid
+ * \returns LIBUSB_ERROR_NOT_FOUND if no claimed interface has the endpoint
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform or driver has no raw
+ * I/O mode
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_raw_io(libusb_device_handle *dev,
+	unsigned char endpoint, int enable)
+{
+	usbi_dbg("endpoint %02x enable %d", endpoint, enable);
+
+	if ((endpoint & ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK))
+			|| !(endpoint & LIBUSB_ENDPOINT_IN))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->set_raw_io)
+		return usbi_backend->set_raw_io(dev, endpoint, enable != 0);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /** \ingroup dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -1839,6 +2223,27 @@ int API_EXPORTED libusb_set_auto_detach_kernel_driver(
 	return LIBUSB_SUCCESS;
 }
 
+/* recompute usbi_log_threshold from the levels of all contexts */
+static void update_log_threshold(void)
+{
+	int threshold = env_log_level > 0 ? env_log_level : 0;
+
+#ifdef ENABLE_DEBUG_LOGGING
+	threshold = LIBUSB_LOG_LEVEL_DEBUG;
+#else
+	struct libusb_context *ctx;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		if (ctx->debug > threshold)
+			threshold = ctx->debug;
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+#endif
+
+	usbi_log_threshold = threshold;
+}
+
 /** \ingroup lib
  * Set log message verbosity.
  *
@@ -1869,6 +2274,122 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	USBI_GET_CONTEXT(ctx);
 	if (!ctx->debug_fixed)
 		ctx->debug = level;
+	update_log_threshold();
+}
+
+static void *log_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_log_message *msg;
+	libusb_log_cb cb;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	while (1) {
+		while (list_empty(&ctx->log_queue) && !ctx->log_thread_stop)
+			usbi_cond_wait(&ctx->log_cond, &ctx->log_lock);
+		/* drain the queue before honouring a stop request */
+		if (list_empty(&ctx->log_queue))
+			break;
+
+		msg = list_entry(ctx->log_queue.next, struct usbi_log_message, list);
+		list_del(&msg->list);
+		ctx->log_queued--;
+		cb = ctx->log_cb;
+		usbi_mutex_unlock(&ctx->log_lock);
+
+		if (cb)
+			cb(ctx, msg->level, msg->str);
+		free(msg);
+
+		usbi_mutex_lock(&ctx->log_lock);
+	}
+	usbi_mutex_unlock(&ctx->log_lock);
+	return NULL;
+}
+
+/* stop the log thread of a context once it has passed on the messages
+ * queued so far. must be called with log_lock held, which is dropped while
+ * waiting for the thread */
+static void stop_log_thread(struct libusb_context *ctx)
+{
+	unsigned int dropped;
+
+	if (!ctx->log_thread_running)
+		return;
+
+	ctx->log_thread_stop = 1;
+	usbi_cond_signal(&ctx->log_cond);
+	usbi_mutex_unlock(&ctx->log_lock);
+	usbi_thread_join(ctx->log_thread);
+	usbi_mutex_lock(&ctx->log_lock);
+	ctx->log_thread_running = 0;
+	ctx->log_thread_stop = 0;
+	dropped = ctx->log_dropped;
+	ctx->log_dropped = 0;
+
+	if (dropped) {
+		usbi_mutex_unlock(&ctx->log_lock);
+		usbi_warn(ctx, "log thread dropped %u messages", dropped);
+		usbi_mutex_lock(&ctx->log_lock);
+	}
+}
+
+/** \ingroup lib
+ * Pass the messages logged by a context to a callback instead of writing
+ * them to stderr or the system log. Which messages are logged is still
+ * controlled by libusb_set_debug() and the LIBUSB_DEBUG environment
+ * variable.
+ *
+ * By default the callback is called by the thread logging the message,
+ * which may be holding internal libusb locks at the time. The callback must
+ * therefore not call back into libusb, or it may deadlock. With
+ * \ref LIBUSB_LOG_CB_ASYNC, that thread only formats the message and queues
+ * it, and the callback is called by a background thread with no libusb lock
+ * held, which keeps slow log output off the threads handling events. That
+ * callback may call libusb functions other than libusb_set_log_cb() and
+ * libusb_exit(), which wait for the background thread. If more than 1024 messages are waiting for that thread, new ones
+ * are dropped, and a warning saying how many is logged when the thread
+ * stops.
+ *
+ * Queued messages are passed to the callback before this function returns
+ * after replacing an asynchronous callback, and before libusb_exit()
+ * returns.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb the callback, or NULL to restore the default output
+ * \param flags bitwise OR of \ref libusb_log_cb_flag values
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if flags is invalid
+ * \returns LIBUSB_ERROR_OTHER if the log thread could not be started
+ */
+int API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	int flags)
+{
+	int r = 0;
+
+	if (flags & ~LIBUSB_LOG_CB_ASYNC)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->log_lock);
+	stop_log_thread(ctx);
+	ctx->log_cb = cb;
+
+	if (cb && (flags & LIBUSB_LOG_CB_ASYNC)) {
+		if (usbi_thread_create(&ctx->log_thread, log_thread_main, ctx) != 0) {
+			ctx->log_cb = NULL;
+			r = LIBUSB_ERROR_OTHER;
+		} else {
+			ctx->log_thread_running = 1;
+		}
+	}
+	usbi_mutex_unlock(&ctx->log_lock);
+
+	if (r < 0)
+		usbi_err(ctx, "failed to start log thread");
+	return r;
 }
 
 /** \ingroup lib
@@ -1890,7 +2411,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	char *dbg = getenv("LIBUSB_DEBUG");
 	struct libusb_context *ctx;
 	static int first_init = 1;
-	int r = 0;
+	int r = 0, i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -1911,6 +2432,10 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		goto err_unlock;
 	}
 
+	usbi_mutex_init(&ctx->log_lock, NULL);
+	usbi_cond_init(&ctx->log_cond, NULL);
+	list_init(&ctx->log_queue);
+
 #ifdef ENABLE_DEBUG_LOGGING
 	ctx->debug = LIBUSB_LOG_LEVEL_DEBUG;
 #endif
@@ -1920,6 +2445,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		if (ctx->debug)
 			ctx->debug_fixed = 1;
 	}
+	if (env_log_level < 0)
+		env_log_level = dbg ? atoi(dbg) : 0;
 
 	/* default context should be initialized before calling usbi_dbg */
 	if (!usbi_default_context) {
@@ -1935,8 +2462,12 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	usbi_mutex_init(&ctx->open_devs_lock, NULL);
 	usbi_mutex_init(&ctx->hotplug_drivers_lock, NULL);
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_SESSION_BUCKETS; i++)
+		list_init(&ctx->usb_devs_by_session[i]);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_drivers);
+	list_init(&ctx->hotplug_subscriber);
+	usbi_hotplug_init(ctx);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	if (first_init) {
@@ -1945,6 +2476,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	}
 	list_add (&ctx->list, &active_contexts_list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	update_log_threshold();
 
 	if (usbi_backend->init) {
 		r = usbi_backend->init(ctx);
@@ -1973,17 +2505,21 @@ err_free_ctx:
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	update_log_threshold();
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 		list_del(&dev->list);
 		libusb_unref_device(dev);
 	}
+	free(ctx->device_list);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_drivers_lock);
+	usbi_mutex_destroy(&ctx->log_lock);
+	usbi_cond_destroy(&ctx->log_cond);
 
 	free(ctx);
 err_unlock:
@@ -1991,6 +2527,48 @@ err_unlock:
 	return r;
 }
 
+#ifdef ENABLE_LOCK_PROFILING
+static int compare_lock_wait(const void *a, const void *b)
+{
+	const struct libusb_lock_stats *sa = a, *sb = b;
+
+	if (sa->wait_ns != sb->wait_ns)
+		return sa->wait_ns < sb->wait_ns ? 1 : -1;
+	return sa->contended < sb->contended ? 1 : sa->contended > sb->contended
+		? -1 : 0;
+}
+
+/* print the lock statistics to stderr if LIBUSB_LOCK_STATS is set, the
+ * locks waited for longest first */
+static void dump_lock_stats(void)
+{
+	const char *env = getenv("LIBUSB_LOCK_STATS");
+	struct libusb_lock_stats *stats;
+	int i, n;
+
+	if (!env || !atoi(env))
+		return;
+
+	n = usbi_get_lock_stats(NULL, 0);
+	stats = malloc(n * sizeof(*stats));
+	if (!stats)
+		return;
+	n = usbi_get_lock_stats(stats, n);
+	qsort(stats, n, sizeof(*stats), compare_lock_wait);
+
+	fprintf(stderr, "libusb: %-36s %12s %10s %12s %12s %10s\n", "lock",
+		"acquired", "contended", "wait_us", "hold_us", "max_hold_us");
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "libusb: %-36s %12llu %10llu %12llu %12llu %10llu\n",
+			stats[i].name, (unsigned long long)stats[i].acquisitions,
+			(unsigned long long)stats[i].contended,
+			(unsigned long long)stats[i].wait_ns / 1000,
+			(unsigned long long)stats[i].hold_ns / 1000,
+			(unsigned long long)stats[i].max_hold_ns / 1000);
+	free(stats);
+}
+#endif
+
 /** \ingroup lib
  * Deinitialize libusb. Should be called after closing all open devices and
  * before your application terminates.
@@ -2018,9 +2596,13 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	}
 	usbi_mutex_static_unlock(&default_context_lock);
 
+	libusb_stop_event_thread(ctx);
+	libusb_stop_callback_workers(ctx);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
+	update_log_threshold();
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_hotplug_deregister_all(ctx);
@@ -2056,10 +2638,66 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	if (usbi_backend->exit)
 		usbi_backend->exit();
 
+	free(ctx->device_list);
+
+	usbi_mutex_lock(&ctx->log_lock);
+	stop_log_thread(ctx);
+	ctx->log_cb = NULL;
+	usbi_mutex_unlock(&ctx->log_lock);
+
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_drivers_lock);
+	usbi_mutex_destroy(&ctx->log_lock);
+	usbi_cond_destroy(&ctx->log_cond);
 	free(ctx);
+
+#ifdef ENABLE_LOCK_PROFILING
+	dump_lock_stats();
+#endif
+}
+
+/** \ingroup misc
+ * Retrieve the contention statistics of the internal locks of libusb, to
+ * find out which of them limits the scaling of an application. The
+ * statistics are only collected by builds configured with
+ * --enable-lock-profiling, which makes every lock and unlock noticeably more
+ * expensive.
+ *
+ * Locks are named after the expression they are initialized with in the
+ * source of libusb, or locked with for static locks. The locks of all
+ * contexts, devices or transfers with the same name are counted together,
+ * e.g. "ctx->flying_transfers_lock" or "itransfer->lock", since the process
+ * started. Waiting on a condition variable does not count as holding its
+ * lock.
+ *
+ * If the LIBUSB_LOCK_STATS environment variable is set to a non-zero value,
+ * the statistics are also printed to stderr by libusb_exit(), the locks
+ * waited for longest first.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stats output array of max_stats elements, which may be NULL if
+ * max_stats is 0
+ * \param max_stats size of the array
+ * \returns the number of named locks, which may be larger than max_stats,
+ * in which case only the first max_stats are filled in
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the array is invalid
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if lock profiling was not enabled at
+ * build time
+ */
+int API_EXPORTED libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int max_stats)
+{
+#ifdef ENABLE_LOCK_PROFILING
+	if (max_stats < 0 || (max_stats && !stats))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	return usbi_get_lock_stats(stats, max_stats);
+#else
+	UNUSED(stats);
+	UNUSED(max_stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
 }
 
 /** \ingroup misc
@@ -2175,6 +2813,47 @@ static void usbi_log_str(struct libusb_context *ctx,
 	UNUSED(level);
 }
 
+/* pass a formatted message to the log callback of a context, or queue it
+ * for the log thread. returns nonzero if the message was taken care of */
+static int log_to_callback(struct libusb_context *ctx,
+	enum libusb_log_level level, const char *str)
+{
+	struct usbi_log_message *msg;
+	libusb_log_cb cb;
+	size_t len;
+
+	usbi_mutex_lock(&ctx->log_lock);
+	cb = ctx->log_cb;
+	if (!cb) {
+		usbi_mutex_unlock(&ctx->log_lock);
+		return 0;
+	}
+
+	if (ctx->log_thread_running && !ctx->log_thread_stop) {
+		if (ctx->log_queued >= MAX_QUEUED_LOG_MESSAGES) {
+			ctx->log_dropped++;
+			usbi_mutex_unlock(&ctx->log_lock);
+			return 1;
+		}
+		len = strlen(str);
+		msg = malloc(sizeof(*msg) + len);
+		if (msg) {
+			msg->level = level;
+			memcpy(msg->str, str, len + 1);
+			list_add_tail(&msg->list, &ctx->log_queue);
+			ctx->log_queued++;
+			usbi_cond_signal(&ctx->log_cond);
+			usbi_mutex_unlock(&ctx->log_lock);
+			return 1;
+		}
+		/* out of memory: fall back to calling the callback directly */
+	}
+	usbi_mutex_unlock(&ctx->log_lock);
+
+	cb(ctx, level, str);
+	return 1;
+}
+
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args)
 {
@@ -2193,6 +2872,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	USBI_GET_CONTEXT(ctx);
 	if (ctx) {
 		ctx_level = ctx->debug;
+	} else if (env_log_level >= 0) {
+		ctx_level = env_log_level;
 	} else {
 		char *dbg = getenv("LIBUSB_DEBUG");
 		if (dbg)
@@ -2271,6 +2952,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	}
 	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
 
+	if (ctx && log_to_callback(ctx, level, buf))
+		return;
 	usbi_log_str(ctx, level, buf);
 }
 
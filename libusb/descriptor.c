@@ -20,6 +20,7 @@
  */
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,66 @@
 #define ENDPOINT_DESC_LENGTH		7
 #define ENDPOINT_AUDIO_DESC_LENGTH	9
 
+/* Parsed configuration descriptors are cached per device, keyed by the index
+ * they were requested by (-1 if that isn't known) and their
+ * bConfigurationValue. Each one lives in a single allocation which holds the
+ * descriptor, its interface, altsetting and endpoint arrays and all of the
+ * extra descriptor blobs. The cache owns one reference, and every config
+ * descriptor handed out to the user owns another. */
+struct usbi_cached_config {
+	struct usbi_cached_config *next;
+	int refcnt;
+	int index;
+	/* the first endpoint descriptor found for each endpoint address,
+	 * indexed by ENDPOINT_INDEX() */
+	const struct libusb_endpoint_descriptor *endpoints[32];
+	/* the raw descriptor bytes the config was parsed from */
+	const unsigned char *raw;
+	int raw_length;
+	int host_endian;
+	/* size of the allocation, for libusb_get_memory_stats() */
+	size_t size;
+	struct libusb_config_descriptor config;
+};
+
+#define ENDPOINT_INDEX(address) \
+	(((address) & LIBUSB_ENDPOINT_ADDRESS_MASK) \
+	| (((address) & LIBUSB_ENDPOINT_DIR_MASK) ? 16 : 0))
+
+#define CACHED_CONFIG(config) \
+	((struct usbi_cached_config *) ((unsigned char *) (config) \
+	- offsetof(struct usbi_cached_config, config)))
+
+/* protects the config_cache list of every device and the refcnt of every
+ * cached config */
+static usbi_mutex_static_t config_cache_lock = USBI_MUTEX_INITIALIZER;
+
+/* String descriptors (and the language ID list, index 0) read from a device
+ * while its string cache is enabled, keyed by index and language ID. The raw
+ * descriptor follows the structure in the same allocation. */
+struct usbi_cached_string {
+	struct usbi_cached_string *next;
+	uint8_t desc_index;
+	uint16_t langid;
+	int length;
+};
+
+#define CACHED_STRING_DATA(cached) ((unsigned char *) ((cached) + 1))
+
+/* protects the string_cache list and flag of every device */
+static usbi_mutex_static_t string_cache_lock = USBI_MUTEX_INITIALIZER;
+
+/* Immutable data which backends keep for their devices (raw descriptors,
+ * sysfs paths) is interned in a process-wide hash table, so identical
+ * devices, and the same device seen by several contexts, share one copy. */
+#define SHARED_BLOB_BUCKETS	256
+
+static struct usbi_shared_blob *shared_blobs[SHARED_BLOB_BUCKETS];
+static size_t shared_blob_bytes;
+
+/* protects the shared_blobs table and the refcnt of every shared blob */
+static usbi_mutex_static_t shared_blob_lock = USBI_MUTEX_INITIALIZER;
+
 /** @defgroup desc USB descriptors
  * This page details how to examine the various standard USB descriptors
  * for detected devices
@@ -494,29 +555,239 @@ err:
 	return r;
 }
 
+static const unsigned char *copy_extra(unsigned char **dest,
+	const unsigned char *extra, int length)
+{
+	unsigned char *copy = *dest;
+
+	if (!length)
+		return NULL;
+
+	memcpy(copy, extra, length);
+	*dest += length;
+	return copy;
+}
+
+/* copy a parsed configuration, and the raw descriptor it was parsed from,
+ * into a single allocation */
+static struct usbi_cached_config *compact_config(
+	const struct libusb_config_descriptor *src, const unsigned char *raw,
+	int raw_length, int host_endian)
+{
+	struct usbi_cached_config *cached;
+	struct libusb_interface *ifaces;
+	unsigned char *next, *extra;
+	size_t structs, extras = src->extra_length + raw_length;
+	int i, j, k;
+
+	structs = src->bNumInterfaces * sizeof(struct libusb_interface);
+	for (i = 0; i < src->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &src->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt =
+				&iface->altsetting[j];
+
+			structs += sizeof(struct libusb_interface_descriptor)
+				+ alt->bNumEndpoints
+				* sizeof(struct libusb_endpoint_descriptor);
+			extras += alt->extra_length;
+			for (k = 0; k < alt->bNumEndpoints; k++)
+				extras += alt->endpoint[k].extra_length;
+		}
+	}
+
+	cached = malloc(sizeof(*cached) + structs + extras);
+	if (!cached)
+		return NULL;
+
+	cached->size = sizeof(*cached) + structs + extras;
+	memset(cached->endpoints, 0, sizeof(cached->endpoints));
+	cached->config = *src;
+
+	/* all of the structures are pointer-aligned, so they go first, and the
+	 * extra blobs after them */
+	next = (unsigned char *) (cached + 1);
+	extra = next + structs;
+
+	ifaces = (struct libusb_interface *) next;
+	next += src->bNumInterfaces * sizeof(struct libusb_interface);
+	cached->config.interface = ifaces;
+	cached->config.extra = copy_extra(&extra, src->extra,
+		src->extra_length);
+	cached->raw = copy_extra(&extra, raw, raw_length);
+	cached->raw_length = raw_length;
+	cached->host_endian = host_endian;
+
+	for (i = 0; i < src->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &src->interface[i];
+		struct libusb_interface_descriptor *alts =
+			(struct libusb_interface_descriptor *) next;
+
+		next += iface->num_altsetting
+			* sizeof(struct libusb_interface_descriptor);
+		ifaces[i].altsetting = alts;
+		ifaces[i].num_altsetting = iface->num_altsetting;
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt =
+				&iface->altsetting[j];
+			struct libusb_endpoint_descriptor *eps =
+				(struct libusb_endpoint_descriptor *) next;
+
+			next += alt->bNumEndpoints
+				* sizeof(struct libusb_endpoint_descriptor);
+			alts[j] = *alt;
+			alts[j].endpoint = alt->bNumEndpoints ? eps : NULL;
+			alts[j].extra = copy_extra(&extra, alt->extra,
+				alt->extra_length);
+
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				int idx;
+
+				eps[k] = alt->endpoint[k];
+				eps[k].extra = copy_extra(&extra,
+					alt->endpoint[k].extra,
+					alt->endpoint[k].extra_length);
+
+				idx = ENDPOINT_INDEX(eps[k].bEndpointAddress);
+				if (!cached->endpoints[idx])
+					cached->endpoints[idx] = &eps[k];
+			}
+		}
+	}
+
+	return cached;
+}
+
 static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
-	struct libusb_config_descriptor **config)
+	struct usbi_cached_config **cached)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	struct libusb_config_descriptor _config;
 	int r;
-	
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	r = parse_configuration(ctx, &_config, buf, size, host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
-	
-	*config = _config;
+
+	*cached = compact_config(&_config, buf, size, host_endian);
+	clear_configuration(&_config);
+	if (!*cached)
+		return LIBUSB_ERROR_NO_MEM;
+
+	return LIBUSB_SUCCESS;
+}
+
+/* look up a cached config by index or, if index is -1, by
+ * bConfigurationValue. the caller owns a reference to the result. */
+static struct libusb_config_descriptor *get_cached_config(
+	struct libusb_device *dev, int index, uint8_t value)
+{
+	struct usbi_cached_config *cached;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	for (cached = dev->config_cache; cached; cached = cached->next) {
+		if (index >= 0 ? cached->index == index
+				: cached->config.bConfigurationValue == value) {
+			cached->refcnt++;
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	return cached ? &cached->config : NULL;
+}
+
+/* parse a raw config descriptor and add it to the device's cache */
+static int cache_config(struct libusb_device *dev, int index,
+	unsigned char *buf, int size, int host_endian,
+	struct libusb_config_descriptor **config)
+{
+	struct usbi_cached_config *cached, *it;
+	int r;
+
+	r = raw_desc_to_config(dev->ctx, buf, size, host_endian, &cached);
+	if (r < 0)
+		return r;
+
+	cached->refcnt = 2;
+	cached->index = index;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	/* another thread may have cached the same config meanwhile */
+	for (it = dev->config_cache; it; it = it->next) {
+		if (it->index == index && it->config.bConfigurationValue ==
+				cached->config.bConfigurationValue)
+			break;
+	}
+	if (it) {
+		it->refcnt++;
+		free(cached);
+		cached = it;
+	} else {
+		cached->next = dev->config_cache;
+		dev->config_cache = cached;
+	}
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	*config = &cached->config;
 	return LIBUSB_SUCCESS;
 }
 
+/* drop the cache's references to the parsed configs of a device. configs
+ * still held by the user are freed when they are released. */
+void usbi_clear_config_cache(struct libusb_device *dev)
+{
+	struct usbi_cached_config *cached;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	while ((cached = dev->config_cache)) {
+		dev->config_cache = cached->next;
+		if (--cached->refcnt == 0)
+			free(cached);
+	}
+	usbi_mutex_static_unlock(&config_cache_lock);
+}
+
+/* find an endpoint in a config obtained from one of the
+ * libusb_get_*config_descriptor() functions */
+const struct libusb_endpoint_descriptor *usbi_find_endpoint(
+	struct libusb_config_descriptor *config, unsigned char endpoint)
+{
+	const struct libusb_endpoint_descriptor *ep;
+	int iface_idx;
+
+	ep = CACHED_CONFIG(config)->endpoints[ENDPOINT_INDEX(endpoint)];
+	if (!ep || ep->bEndpointAddress == endpoint)
+		return ep;
+
+	/* the address has reserved bits set, and the table holds a different
+	 * endpoint with the same number and direction */
+	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
+		const struct libusb_interface *iface = &config->interface[iface_idx];
+		int altsetting_idx;
+
+		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
+				altsetting_idx++) {
+			const struct libusb_interface_descriptor *altsetting
+				= &iface->altsetting[altsetting_idx];
+			int ep_idx;
+
+			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
+				ep = &altsetting->endpoint[ep_idx];
+				if (ep->bEndpointAddress == endpoint)
+					return ep;
+			}
+		}
+	}
+	return NULL;
+}
+
 int usbi_device_cache_descriptor(libusb_device *dev)
 {
 	int r, host_endian = 0;
@@ -590,6 +861,10 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
+	*config = get_cached_config(dev, -1, tmp[5]);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
@@ -598,7 +873,7 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	r = usbi_backend->get_active_config_descriptor(dev, buf,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
-		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		r = cache_config(dev, -1, buf, r, host_endian, config);
 
 	free(buf);
 	return r;
@@ -633,6 +908,10 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	*config = get_cached_config(dev, config_index, 0);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
 		LIBUSB_DT_CONFIG_SIZE, &host_endian);
 	if (r < 0)
@@ -651,7 +930,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	r = usbi_backend->get_config_descriptor(dev, config_index, buf,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
-		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		r = cache_config(dev, config_index, buf, r, host_endian, config);
 
 	free(buf);
 	return r;
@@ -710,12 +989,16 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	int r, idx, host_endian;
 	unsigned char *buf = NULL;
 
+	*config = get_cached_config(dev, -1, bConfigurationValue);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	if (usbi_backend->get_config_descriptor_by_value) {
 		r = usbi_backend->get_config_descriptor_by_value(dev,
 			bConfigurationValue, &buf, &host_endian);
 		if (r < 0)
 			return r;
-		return raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		return cache_config(dev, -1, buf, r, host_endian, config);
 	}
 
 	r = usbi_get_config_index_by_value(dev, bConfigurationValue, &idx);
@@ -733,16 +1016,160 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104, parsed
+ * configuration descriptors are cached per device and shared between
+ * callers, so they must not be modified. The cache is dropped when
+ * libusb_set_configuration() succeeds.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config)
 {
+	struct usbi_cached_config *cached;
+	int refcnt;
+
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	cached = CACHED_CONFIG(config);
+	usbi_mutex_static_lock(&config_cache_lock);
+	refcnt = --cached->refcnt;
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	if (refcnt == 0)
+		free(cached);
+}
+
+static uint16_t iterator_get16(struct libusb_descriptor_iterator *iter,
+	const unsigned char *p)
+{
+	uint16_t w;
+
+	if (iter->host_endian)
+		memcpy(&w, p, 2);
+	else
+		w = (uint16_t)((p[1] << 8) | p[0]);
+	return w;
+}
+
+/** \ingroup desc
+ * Set up an iterator over the descriptors of a configuration, in the order
+ * the device reported them. The configuration descriptor itself comes first,
+ * followed by every interface, endpoint, class-specific and vendor-specific
+ * descriptor.
+ *
+ * The iterator walks the bytes kept with config in place, so config must
+ * not be freed while the iterator is in use.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param config a configuration descriptor obtained from
+ * libusb_get_active_config_descriptor(), libusb_get_config_descriptor() or
+ * libusb_get_config_descriptor_by_value()
+ * \param iter the iterator to initialize
+ * \see libusb_next_descriptor()
+ */
+void API_EXPORTED libusb_init_descriptor_iterator(
+	const struct libusb_config_descriptor *config,
+	struct libusb_descriptor_iterator *iter)
+{
+	const struct usbi_cached_config *cached = CACHED_CONFIG(config);
+
+	memset(iter, 0, sizeof(*iter));
+	iter->interface_number = -1;
+	iter->altsetting = -1;
+	iter->next = cached->raw;
+	iter->remaining = cached->raw_length;
+	iter->host_endian = cached->host_endian;
+}
+
+/** \ingroup desc
+ * Advance a descriptor iterator to the next descriptor. On success the
+ * raw, bLength and bDescriptorType members describe it and, for the standard
+ * descriptor types listed with struct libusb_descriptor_iterator, desc holds
+ * a host-endian copy of it.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param iter an iterator set up with libusb_init_descriptor_iterator()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if there are no more descriptors
+ * \returns LIBUSB_ERROR_IO if the next descriptor is malformed
+ */
+int API_EXPORTED libusb_next_descriptor(struct libusb_descriptor_iterator *iter)
+{
+	const unsigned char *p = iter->next;
+	uint8_t length;
+
+	if (iter->remaining < DESC_HEADER_LENGTH)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	length = p[0];
+	if (length < DESC_HEADER_LENGTH || length > iter->remaining)
+		return LIBUSB_ERROR_IO;
+
+	memset(&iter->desc, 0, sizeof(iter->desc));
+	switch (p[1]) {
+	case LIBUSB_DT_CONFIG:
+		if (length < LIBUSB_DT_CONFIG_SIZE)
+			return LIBUSB_ERROR_IO;
+		iter->desc.config.bLength = p[0];
+		iter->desc.config.bDescriptorType = p[1];
+		iter->desc.config.wTotalLength = iterator_get16(iter, p + 2);
+		iter->desc.config.bNumInterfaces = p[4];
+		iter->desc.config.bConfigurationValue = p[5];
+		iter->desc.config.iConfiguration = p[6];
+		iter->desc.config.bmAttributes = p[7];
+		iter->desc.config.MaxPower = p[8];
+		break;
+	case LIBUSB_DT_INTERFACE:
+		if (length < LIBUSB_DT_INTERFACE_SIZE)
+			return LIBUSB_ERROR_IO;
+		iter->desc.interface.bLength = p[0];
+		iter->desc.interface.bDescriptorType = p[1];
+		iter->desc.interface.bInterfaceNumber = p[2];
+		iter->desc.interface.bAlternateSetting = p[3];
+		iter->desc.interface.bNumEndpoints = p[4];
+		iter->desc.interface.bInterfaceClass = p[5];
+		iter->desc.interface.bInterfaceSubClass = p[6];
+		iter->desc.interface.bInterfaceProtocol = p[7];
+		iter->desc.interface.iInterface = p[8];
+		iter->interface_number = p[2];
+		iter->altsetting = p[3];
+		break;
+	case LIBUSB_DT_ENDPOINT:
+		if (length < LIBUSB_DT_ENDPOINT_SIZE)
+			return LIBUSB_ERROR_IO;
+		iter->desc.endpoint.bLength = p[0];
+		iter->desc.endpoint.bDescriptorType = p[1];
+		iter->desc.endpoint.bEndpointAddress = p[2];
+		iter->desc.endpoint.bmAttributes = p[3];
+		iter->desc.endpoint.wMaxPacketSize = iterator_get16(iter, p + 4);
+		iter->desc.endpoint.bInterval = p[6];
+		if (length >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE) {
+			iter->desc.endpoint.bRefresh = p[7];
+			iter->desc.endpoint.bSynchAddress = p[8];
+		}
+		break;
+	case LIBUSB_DT_SS_ENDPOINT_COMPANION:
+		if (length < LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE)
+			return LIBUSB_ERROR_IO;
+		iter->desc.ss_ep_comp.bLength = p[0];
+		iter->desc.ss_ep_comp.bDescriptorType = p[1];
+		iter->desc.ss_ep_comp.bMaxBurst = p[2];
+		iter->desc.ss_ep_comp.bmAttributes = p[3];
+		iter->desc.ss_ep_comp.wBytesPerInterval =
+			iterator_get16(iter, p + 4);
+		break;
+	}
+
+	iter->raw = p;
+	iter->bLength = length;
+	iter->bDescriptorType = p[1];
+	iter->next += length;
+	iter->remaining -= length;
+	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup desc
@@ -1133,52 +1560,271 @@ void API_EXPORTED libusb_free_container_id_descriptor(
 	free(container_id);
 }
 
+/* copy a cached string descriptor to data, which holds 255 bytes. returns
+ * its length, or LIBUSB_ERROR_NOT_FOUND if it isn't in the cache */
+static int get_cached_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *data)
+{
+	struct usbi_cached_string *cached;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_static_lock(&string_cache_lock);
+	for (cached = dev->string_cache; cached; cached = cached->next) {
+		if (cached->desc_index == desc_index && cached->langid == langid) {
+			memcpy(data, CACHED_STRING_DATA(cached), cached->length);
+			r = cached->length;
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&string_cache_lock);
+
+	return r;
+}
+
+/* remember a string descriptor read from the device if its cache is on */
+static void cache_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *data, int length)
+{
+	struct usbi_cached_string *cached, *it;
+
+	if (!dev->string_cache_enabled)
+		return;
+
+	cached = malloc(sizeof(*cached) + length);
+	if (!cached)
+		return; /* only a missed optimization */
+	cached->desc_index = desc_index;
+	cached->langid = langid;
+	cached->length = length;
+	memcpy(CACHED_STRING_DATA(cached), data, length);
+
+	usbi_mutex_static_lock(&string_cache_lock);
+	/* the cache may have been disabled, or the same string been cached by
+	 * another thread, meanwhile */
+	for (it = dev->string_cache; it; it = it->next) {
+		if (it->desc_index == desc_index && it->langid == langid)
+			break;
+	}
+	if (dev->string_cache_enabled && !it) {
+		cached->next = dev->string_cache;
+		dev->string_cache = cached;
+		cached = NULL;
+	}
+	usbi_mutex_static_unlock(&string_cache_lock);
+
+	free(cached);
+}
+
+/* forget the string descriptors cached for a device, which is done when it
+ * is reset or disconnected as well as when it is destroyed */
+void usbi_clear_string_cache(struct libusb_device *dev)
+{
+	struct usbi_cached_string *cached;
+
+	usbi_mutex_static_lock(&string_cache_lock);
+	while ((cached = dev->string_cache)) {
+		dev->string_cache = cached->next;
+		free(cached);
+	}
+	usbi_mutex_static_unlock(&string_cache_lock);
+}
+
+/* bytes of parsed configs and strings cached for a device */
+size_t usbi_device_cache_size(struct libusb_device *dev)
+{
+	struct usbi_cached_config *config;
+	struct usbi_cached_string *string;
+	size_t size = 0;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	for (config = dev->config_cache; config; config = config->next)
+		size += config->size;
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	usbi_mutex_static_lock(&string_cache_lock);
+	for (string = dev->string_cache; string; string = string->next)
+		size += sizeof(*string) + string->length;
+	usbi_mutex_static_unlock(&string_cache_lock);
+
+	return size;
+}
+
+/* FNV-1a */
+static unsigned int hash_blob(const unsigned char *data, int len)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+/* find or add a shared copy of len bytes of data. the caller owns a
+ * reference to the result, and must never write to it. returns NULL if out
+ * of memory. */
+struct usbi_shared_blob *usbi_share_blob(const void *data, int len)
+{
+	unsigned int hash = hash_blob(data, len);
+	struct usbi_shared_blob **bucket =
+		&shared_blobs[hash % SHARED_BLOB_BUCKETS];
+	struct usbi_shared_blob *blob;
+
+	usbi_mutex_static_lock(&shared_blob_lock);
+	for (blob = *bucket; blob; blob = blob->next) {
+		if (blob->hash == hash && blob->len == len
+				&& !memcmp(SHARED_BLOB_DATA(blob), data, len)) {
+			blob->refcnt++;
+			goto out;
+		}
+	}
+
+	blob = malloc(sizeof(*blob) + len);
+	if (!blob)
+		goto out;
+	blob->hash = hash;
+	blob->refcnt = 1;
+	blob->len = len;
+	memcpy(SHARED_BLOB_DATA(blob), data, len);
+	blob->next = *bucket;
+	*bucket = blob;
+	shared_blob_bytes += sizeof(*blob) + len;
+
+out:
+	usbi_mutex_static_unlock(&shared_blob_lock);
+	return blob;
+}
+
+struct usbi_shared_blob *usbi_ref_blob(struct usbi_shared_blob *blob)
+{
+	usbi_mutex_static_lock(&shared_blob_lock);
+	blob->refcnt++;
+	usbi_mutex_static_unlock(&shared_blob_lock);
+	return blob;
+}
+
+/* drop a reference to a shared blob, which may be NULL */
+void usbi_unref_blob(struct usbi_shared_blob *blob)
+{
+	struct usbi_shared_blob **it;
+
+	if (!blob)
+		return;
+
+	usbi_mutex_static_lock(&shared_blob_lock);
+	if (--blob->refcnt == 0) {
+		for (it = &shared_blobs[blob->hash % SHARED_BLOB_BUCKETS];
+				*it != blob; it = &(*it)->next)
+			;
+		*it = blob->next;
+		shared_blob_bytes -= sizeof(*blob) + blob->len;
+		free(blob);
+	}
+	usbi_mutex_static_unlock(&shared_blob_lock);
+}
+
+/* the share of a blob's memory that falls to each of its holders, for
+ * the device_memory backend op. 0 for NULL. */
+size_t usbi_blob_share(struct usbi_shared_blob *blob)
+{
+	size_t share;
+
+	if (!blob)
+		return 0;
+
+	usbi_mutex_static_lock(&shared_blob_lock);
+	share = (sizeof(*blob) + blob->len) / blob->refcnt;
+	usbi_mutex_static_unlock(&shared_blob_lock);
+	return share;
+}
+
+/* bytes held by all shared blobs, whichever devices and contexts use them */
+size_t usbi_shared_blob_bytes(void)
+{
+	size_t bytes;
+
+	usbi_mutex_static_lock(&shared_blob_lock);
+	bytes = shared_blob_bytes;
+	usbi_mutex_static_unlock(&shared_blob_lock);
+	return bytes;
+}
+
 /** \ingroup desc
- * Retrieve a string descriptor in C style ASCII.
+ * Enable or disable the string descriptor cache of a device.
  *
- * Wrapper around libusb_get_string_descriptor(). Uses the first language
- * supported by the device.
+ * While the cache is enabled, the string descriptors read by
+ * libusb_get_string_descriptor_ascii() and libusb_get_device_strings_ascii(),
+ * including the list of languages supported by the device, are kept in
+ * memory and later calls for the same strings are answered without talking
+ * to the device. The cache is shared by all handles of the device, and is
+ * emptied when the device is reset or disconnected, or when the cache is
+ * disabled. It is disabled by default.
  *
- * \param dev a device handle
- * \param desc_index the index of the descriptor to retrieve
- * \param data output buffer for ASCII string descriptor
- * \param length size of data buffer
- * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ * libusb_get_string_descriptor() always reads from the device.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device
+ * \param enable non-zero to enable the cache, 0 to disable it
  */
-int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
-	uint8_t desc_index, unsigned char *data, int length)
+void API_EXPORTED libusb_set_string_cache(libusb_device *dev, int enable)
 {
-	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
-	int r, si, di;
-	uint16_t langid;
+	usbi_mutex_static_lock(&string_cache_lock);
+	dev->string_cache_enabled = enable != 0;
+	usbi_mutex_static_unlock(&string_cache_lock);
+
+	if (!enable)
+		usbi_clear_string_cache(dev);
+}
+
+/* read a string descriptor into data, which holds 255 bytes (some devices
+ * choke on larger requests), from the cache if it's there */
+static int get_string(libusb_device_handle *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *data)
+{
+	int r;
+
+	r = get_cached_string(dev->dev, desc_index, langid, data);
+	if (r != LIBUSB_ERROR_NOT_FOUND)
+		return r;
+
+	r = libusb_get_string_descriptor(dev, desc_index, langid, data, 255);
+	if (r >= 0)
+		cache_string(dev->dev, desc_index, langid, data, r);
+	return r;
+}
+
+/* find the first language supported by the device */
+static int get_langid(libusb_device_handle *dev, uint16_t *langid)
+{
+	unsigned char tbuf[255];
+	int r;
 
 	/* Asking for the zero'th index is special - it returns a string
 	 * descriptor that contains all the language IDs supported by the
 	 * device. Typically there aren't many - often only one. Language
 	 * IDs are 16 bit numbers, and they start at the third byte in the
-	 * descriptor. There's also no point in trying to read descriptor 0
-	 * with this function. See USB 2.0 specification section 9.6.7 for
-	 * more information.
+	 * descriptor. See USB 2.0 specification section 9.6.7 for more
+	 * information.
 	 */
-
-	if (desc_index == 0)
-		return LIBUSB_ERROR_INVALID_PARAM;
-
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+	r = get_string(dev, 0, 0, tbuf);
 	if (r < 0)
 		return r;
 
 	if (r < 4)
 		return LIBUSB_ERROR_IO;
 
-	langid = tbuf[2] | (tbuf[3] << 8);
+	*langid = tbuf[2] | (tbuf[3] << 8);
+	return LIBUSB_SUCCESS;
+}
 
-	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
-		sizeof(tbuf));
-	if (r < 0)
-		return r;
+/* convert the length bytes of string descriptor in tbuf to C style ASCII */
+static int string_to_ascii(const unsigned char *tbuf, int r,
+	unsigned char *data, int length)
+{
+	int si, di;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
+	if (r < DESC_HEADER_LENGTH || tbuf[1] != LIBUSB_DT_STRING)
 		return LIBUSB_ERROR_IO;
 
 	if (tbuf[0] > r)
@@ -1197,3 +1843,237 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	data[di] = 0;
 	return di;
 }
+
+/** \ingroup desc
+ * Retrieve a string descriptor in C style ASCII.
+ *
+ * Wrapper around libusb_get_string_descriptor(). Uses the first language
+ * supported by the device.
+ *
+ * \param dev a device handle
+ * \param desc_index the index of the descriptor to retrieve
+ * \param data output buffer for ASCII string descriptor
+ * \param length size of data buffer
+ * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ * \see libusb_set_string_cache()
+ */
+int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
+	int r;
+	uint16_t langid;
+
+	/* There's no point in trying to read descriptor 0 with this
+	 * function, see get_langid(). */
+	if (desc_index == 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = get_langid(dev, &langid);
+	if (r < 0)
+		return r;
+
+	r = get_string(dev, desc_index, langid, tbuf);
+	if (r < 0)
+		return r;
+
+	return string_to_ascii(tbuf, r, data, length);
+}
+
+/* the transfers of libusb_get_device_strings_ascii() still in flight, plus
+ * one held while they are being submitted. their callbacks may run in
+ * another thread handling events */
+struct string_batch {
+	usbi_mutex_t lock;
+	int remaining;
+	int completed;
+};
+
+static void string_batch_done(struct string_batch *batch)
+{
+	usbi_mutex_lock(&batch->lock);
+	if (--batch->remaining == 0)
+		batch->completed = 1;
+	usbi_mutex_unlock(&batch->lock);
+}
+
+static void LIBUSB_CALL string_batch_cb(struct libusb_transfer *transfer)
+{
+	string_batch_done(transfer->user_data);
+}
+
+/** \ingroup desc
+ * Retrieve the manufacturer, product and serial number strings of a device
+ * in C style ASCII.
+ *
+ * This is equivalent to calling libusb_get_string_descriptor_ascii() for
+ * the iManufacturer, iProduct and iSerialNumber indexes of the device
+ * descriptor, but the three strings are requested from the device at once
+ * rather than one after another, which saves round trips. Strings which are
+ * in the string cache (see libusb_set_string_cache()) are not requested.
+ *
+ * Any of the buffers may be NULL if that string isn't needed. A string the
+ * device doesn't have, or which could not be read, is returned as an empty
+ * string.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param manufacturer output buffer for the manufacturer string, or NULL
+ * \param product output buffer for the product string, or NULL
+ * \param serial_number output buffer for the serial number string, or NULL
+ * \param length size of each of the buffers
+ * \returns 0 on success, or the LIBUSB_ERROR code of the first string that
+ * could not be read
+ */
+int API_EXPORTED libusb_get_device_strings_ascii(libusb_device_handle *dev,
+	unsigned char *manufacturer, unsigned char *product,
+	unsigned char *serial_number, int length)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev);
+	struct libusb_device_descriptor *desc = &dev->dev->device_descriptor;
+	struct libusb_transfer *transfers[3] = { NULL, NULL, NULL };
+	unsigned char *outputs[3];
+	uint8_t indexes[3];
+	int results[3];
+	struct string_batch batch;
+	struct timeval tv = { 60, 0 };
+	unsigned char tbuf[255];
+	uint16_t langid;
+	int i, r;
+
+	if (length <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	outputs[0] = manufacturer;
+	outputs[1] = product;
+	outputs[2] = serial_number;
+	indexes[0] = desc->iManufacturer;
+	indexes[1] = desc->iProduct;
+	indexes[2] = desc->iSerialNumber;
+
+	r = LIBUSB_SUCCESS;
+	for (i = 0; i < 3; i++) {
+		results[i] = LIBUSB_SUCCESS;
+		if (outputs[i])
+			outputs[i][0] = 0;
+		if (outputs[i] && indexes[i])
+			r = 1;
+	}
+	if (r == LIBUSB_SUCCESS)
+		return LIBUSB_SUCCESS;
+
+	r = get_langid(dev, &langid);
+	if (r < 0)
+		return r;
+
+	if (usbi_mutex_init(&batch.lock, NULL))
+		return LIBUSB_ERROR_OTHER;
+	batch.remaining = 1;
+	batch.completed = 0;
+
+	for (i = 0; i < 3; i++) {
+		unsigned char *buffer;
+
+		if (!outputs[i] || !indexes[i])
+			continue;
+
+		r = get_cached_string(dev->dev, indexes[i], langid, tbuf);
+		if (r != LIBUSB_ERROR_NOT_FOUND) {
+			results[i] = string_to_ascii(tbuf, r, outputs[i], length);
+			continue;
+		}
+
+		transfers[i] = libusb_alloc_transfer(0);
+		buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + sizeof(tbuf));
+		if (!transfers[i] || !buffer) {
+			free(buffer);
+			libusb_free_transfer(transfers[i]);
+			transfers[i] = NULL;
+			results[i] = LIBUSB_ERROR_NO_MEM;
+			continue;
+		}
+
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(uint16_t) ((LIBUSB_DT_STRING << 8) | indexes[i]),
+			langid, sizeof(tbuf));
+		libusb_fill_control_transfer(transfers[i], dev, buffer,
+			string_batch_cb, &batch, 1000);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+		usbi_mutex_lock(&batch.lock);
+		batch.remaining++;
+		usbi_mutex_unlock(&batch.lock);
+		results[i] = libusb_submit_transfer(transfers[i]);
+		if (results[i] < 0) {
+			string_batch_done(&batch);
+			libusb_free_transfer(transfers[i]);
+			transfers[i] = NULL;
+		}
+	}
+	string_batch_done(&batch);
+
+	while (!batch.completed) {
+		if (dev->event_domain)
+			r = libusb_handle_domain_events_timeout_completed(
+				dev->event_domain, &tv, &batch.completed);
+		else
+			r = libusb_handle_events_timeout_completed(ctx, &tv,
+				&batch.completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfers and retrying",
+				 libusb_error_name(r));
+			for (i = 0; i < 3; i++) {
+				if (transfers[i])
+					libusb_cancel_transfer(transfers[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+
+		if (!transfer)
+			continue;
+
+		switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			cache_string(dev->dev, indexes[i], langid,
+				libusb_control_transfer_get_data(transfer),
+				transfer->actual_length);
+			results[i] = string_to_ascii(
+				libusb_control_transfer_get_data(transfer),
+				transfer->actual_length, outputs[i], length);
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			results[i] = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			results[i] = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			results[i] = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			results[i] = LIBUSB_ERROR_OVERFLOW;
+			break;
+		default:
+			results[i] = LIBUSB_ERROR_IO;
+			break;
+		}
+		libusb_free_transfer(transfer);
+	}
+	usbi_mutex_destroy(&batch.lock);
+
+	r = LIBUSB_SUCCESS;
+	for (i = 0; i < 3; i++) {
+		if (results[i] < 0) {
+			if (outputs[i])
+				outputs[i][0] = 0;
+			if (r == LIBUSB_SUCCESS)
+				r = results[i];
+		}
+	}
+	return r;
+}
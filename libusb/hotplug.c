@@ -37,94 +37,335 @@ struct hotplug_list {
 	struct list_head list;
 	const struct libusb_hotplug *driver; /* Devices associated with this driver.  */
 	struct list_head dev_list;
+
+	/* link in the index list this driver is kept in, see hotplug_index() */
+	struct list_head index_list;
+	/* registration order. index lists are kept newest first, which is also
+	 * the order drivers are offered devices in */
+	unsigned long seq;
+	/* the context's driver list holds one reference, and so does every
+	 * event being dispatched to the driver without the lock held */
+	int refcnt;
+	int removed;
 };
 
-/* This tests the drivers filter against the device. 
- * If it matches, we fire off the callback corresponding to the event. 
- */
-static int usbi_hotplug_match_driver(struct libusb_context *ctx,
-	struct libusb_device* dev,
-	struct hotplug_list *driver_it)
+/* pick the index list a driver belongs in: drivers matching a vid and pid go
+ * in by_id, those matching only a vid go in by_vid, and everything else is a
+ * wildcard that has to be tried against every device */
+static struct list_head *hotplug_index(struct libusb_context *ctx,
+	int vid, int pid)
+{
+	if (vid == LIBUSB_HOTPLUG_MATCH_ANY)
+		return &ctx->hotplug_wildcard;
+	if (pid == LIBUSB_HOTPLUG_MATCH_ANY)
+		return &ctx->hotplug_by_vid[vid % USBI_HOTPLUG_BUCKETS];
+	return &ctx->hotplug_by_id[(vid ^ (pid * 31)) % USBI_HOTPLUG_BUCKETS];
+}
+
+void usbi_hotplug_init(struct libusb_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < USBI_HOTPLUG_BUCKETS; i++) {
+		list_init(&ctx->hotplug_by_id[i]);
+		list_init(&ctx->hotplug_by_vid[i]);
+	}
+	list_init(&ctx->hotplug_wildcard);
+}
+
+/* This tests the drivers filter against the device. */
+static int usbi_hotplug_match_driver(struct libusb_device* dev,
+	const struct libusb_hotplug *driver)
 {
-	const struct libusb_hotplug *driver = driver_it->driver;
-	
 	if (driver->vid != LIBUSB_HOTPLUG_MATCH_ANY &&
 	    driver->vid != dev->device_descriptor.idVendor) {
-		return 1;
+		return 0;
 	}
 
 	if (driver->pid != LIBUSB_HOTPLUG_MATCH_ANY &&
 	    driver->pid != dev->device_descriptor.idProduct) {
-		return 1;
+		return 0;
 	}
 
 	if (driver->dev_class != LIBUSB_HOTPLUG_MATCH_ANY  &&
 	    driver->dev_class != dev->device_descriptor.bDeviceClass) {
-		return 1;
+		return 0;
 	}
 
-
-	return driver->connect(ctx, dev);
+	return 1;
 }
 
-static void usbi_hotplug_connect_device(struct libusb_context *ctx,
-	struct libusb_device *device,
-	struct hotplug_list *it)
+/* drop a reference to a driver node. called with hotplug_drivers_lock held */
+static void hotplug_unref_driver(struct hotplug_list *it)
 {
-	list_add(&device->driver_dev_list, &it->dev_list);
+	if (--it->refcnt == 0)
+		free(it);
 }
 
+/* detach all devices from a driver that is going away and call its
+ * disconnect function for them. called with hotplug_drivers_lock held, which
+ * is dropped while the callbacks run. */
 static void usbi_hotplug_disconnect_all(struct libusb_context *ctx,
 	struct hotplug_list *it)
 {
-	struct libusb_device *dev_node, *next;
-	
-	list_for_each_entry_safe(dev_node, next, &it->dev_list, driver_dev_list, struct libusb_device) {
-		it->driver->disconnect(ctx, dev_node);
+	struct libusb_device *dev_node;
+
+	while (!list_empty(&it->dev_list)) {
+		dev_node = list_entry(it->dev_list.next, struct libusb_device,
+			driver_dev_list);
 		list_del(&dev_node->driver_dev_list);
+		dev_node->hotplug_driver = NULL;
+		libusb_ref_device(dev_node);
+
+		usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+		it->driver->disconnect(ctx, dev_node);
+		libusb_unref_device(dev_node);
+		usbi_mutex_lock(&ctx->hotplug_drivers_lock);
 	}
 }
 
-static void usbi_hotplug_disconnect_device(struct libusb_context *ctx,
-	struct libusb_device *device,
-	struct hotplug_list *it)
+/* collect the drivers that match a device into matches, newest first, taking
+ * a reference to each. the three index lists that can hold matching drivers
+ * are each sorted newest first, so they are merged by registration order.
+ * called with hotplug_drivers_lock held. returns the number of matches. */
+static int hotplug_collect_matches(struct libusb_context *ctx,
+	struct libusb_device *dev, struct hotplug_list **matches, int max)
 {
-	struct libusb_device *dev_node, *next;
-	
-	list_for_each_entry_safe(dev_node, next, &it->dev_list, driver_dev_list, struct libusb_device) {
-		if (dev_node != device) continue;
-				
-		it->driver->disconnect(ctx, device);
-		list_del(&dev_node->driver_dev_list);
+	struct list_head *lists[3];
+	struct list_head *pos[3];
+	int i, n = 0;
+
+	lists[0] = hotplug_index(ctx, dev->device_descriptor.idVendor,
+		dev->device_descriptor.idProduct);
+	lists[1] = hotplug_index(ctx, dev->device_descriptor.idVendor,
+		LIBUSB_HOTPLUG_MATCH_ANY);
+	lists[2] = &ctx->hotplug_wildcard;
+	for (i = 0; i < 3; i++)
+		pos[i] = lists[i]->next;
+
+	while (n < max) {
+		struct hotplug_list *best = NULL;
+		int best_list = 0;
+
+		for (i = 0; i < 3; i++) {
+			struct hotplug_list *it;
+
+			/* skip drivers in the same bucket that don't match */
+			while (pos[i] != lists[i]) {
+				it = list_entry(pos[i], struct hotplug_list, index_list);
+				if (usbi_hotplug_match_driver(dev, it->driver))
+					break;
+				pos[i] = pos[i]->next;
+			}
+			if (pos[i] == lists[i])
+				continue;
+
+			it = list_entry(pos[i], struct hotplug_list, index_list);
+			if (!best || it->seq > best->seq) {
+				best = it;
+				best_list = i;
+			}
+		}
+		if (!best)
+			break;
+
+		pos[best_list] = pos[best_list]->next;
+		best->refcnt++;
+		matches[n++] = best;
 	}
+
+	return n;
 }
 
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event)
+/* offer a new device to the matching drivers, newest first, until one of them
+ * claims it by returning 0 from its connect function. the callbacks are run
+ * without hotplug_drivers_lock held. */
+static void usbi_hotplug_connect_device(struct libusb_context *ctx,
+	struct libusb_device *dev)
 {
-	struct hotplug_list *it;
+	struct hotplug_list *static_matches[16];
+	struct hotplug_list **matches = static_matches;
+	int max = 16, num_matches, i;
 
 	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	if (dev->hotplug_driver) {
+		/* already claimed, e.g. by a LIBUSB_HOTPLUG_ENUMERATE pass */
+		usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+		return;
+	}
 
-	list_for_each_entry(it, &ctx->hotplug_drivers, list, struct hotplug_list) {
-		if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-			int error = usbi_hotplug_match_driver(ctx, dev, it);
-			
-			if (!error) {
-				usbi_hotplug_connect_device(ctx, dev, it);
-			}
-		}
-		else if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-			usbi_hotplug_disconnect_device(ctx, dev, it);
+	if (ctx->num_hotplug_drivers > max) {
+		matches = malloc(ctx->num_hotplug_drivers * sizeof(*matches));
+		if (matches)
+			max = ctx->num_hotplug_drivers;
+		else
+			matches = static_matches;
+	}
+	num_matches = hotplug_collect_matches(ctx, dev, matches, max);
+	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+
+	for (i = 0; i < num_matches; i++) {
+		struct hotplug_list *it = matches[i];
+		int claimed = 0;
+
+		if (it->removed)
+			continue;
+		if (it->driver->connect(ctx, dev))
+			continue;
+
+		usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+		if (!it->removed && !dev->hotplug_driver) {
+			list_add(&dev->driver_dev_list, &it->dev_list);
+			dev->hotplug_driver = it;
+			claimed = 1;
 		}
-		
+		usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+		if (claimed)
+			break;
 	}
 
+	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	for (i = 0; i < num_matches; i++)
+		hotplug_unref_driver(matches[i]);
 	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
 
+	if (matches != static_matches)
+		free(matches);
+}
+
+/* run the disconnect function of the driver that claimed a device */
+static void usbi_hotplug_disconnect_device(struct libusb_context *ctx,
+	struct libusb_device *dev)
+{
+	struct hotplug_list *it;
+
+	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	it = dev->hotplug_driver;
+	if (!it) {
+		usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+		return;
+	}
+	list_del(&dev->driver_dev_list);
+	dev->hotplug_driver = NULL;
+	it->refcnt++;
+	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+
+	it->driver->disconnect(ctx, dev);
+
+	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	hotplug_unref_driver(it);
+	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+}
+
+void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
+	libusb_hotplug_event event)
+{
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		usbi_hotplug_connect_device(ctx, dev);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		usbi_hotplug_disconnect_device(ctx, dev);
+
 	/* the backend is expected to call the callback for each active transfer */
 }
 
+/* queue a hotplug message for libusb_handle_events(). the hotplug pipe is
+ * only written to when the queue goes from empty to non-empty, so a burst of
+ * events costs a single wakeup. */
+void usbi_hotplug_notification(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event)
+{
+	libusb_hotplug_message *message;
+	unsigned char dummy = 1;
+	int was_empty;
+	ssize_t ret;
+
+	message = calloc(1, sizeof(*message));
+	if (!message) {
+		usbi_err(ctx, "error allocating hotplug message");
+		return;
+	}
+	message->event = event;
+	message->device = dev;
+
+	usbi_mutex_lock(&ctx->hotplug_msgs_lock);
+	was_empty = list_empty(&ctx->hotplug_msgs);
+	list_add_tail(&message->list, &ctx->hotplug_msgs);
+	usbi_mutex_unlock(&ctx->hotplug_msgs_lock);
+
+	if (was_empty) {
+		ret = usbi_write(ctx->hotplug_pipe[1], &dummy, sizeof(dummy));
+		if (ret != sizeof(dummy))
+			usbi_err(ctx, "error writing hotplug message");
+	}
+}
+
+/* move every queued hotplug message to messages */
+static void hotplug_take_messages(struct libusb_context *ctx,
+	struct list_head *messages)
+{
+	usbi_mutex_lock(&ctx->hotplug_msgs_lock);
+	list_init(messages);
+	if (!list_empty(&ctx->hotplug_msgs)) {
+		/* take over the whole queue */
+		messages->next = ctx->hotplug_msgs.next;
+		messages->prev = ctx->hotplug_msgs.prev;
+		messages->next->prev = messages;
+		messages->prev->next = messages;
+		list_init(&ctx->hotplug_msgs);
+	}
+	usbi_mutex_unlock(&ctx->hotplug_msgs_lock);
+}
+
+/* dispatch every queued hotplug message */
+void usbi_hotplug_process(struct libusb_context *ctx)
+{
+	libusb_hotplug_message *message, *next;
+	struct list_head messages;
+
+	hotplug_take_messages(ctx, &messages);
+
+	list_for_each_entry_safe(message, next, &messages, list, libusb_hotplug_message) {
+		usbi_hotplug_match(ctx, message->device, message->event);
+
+		/* the device left. dereference the device */
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+			libusb_unref_device(message->device);
+
+		free(message);
+	}
+}
+
+/* free every queued hotplug message without dispatching it. used at exit,
+ * when arrival messages may refer to devices that are already gone. only
+ * departures hold a device reference. */
+void usbi_hotplug_discard(struct libusb_context *ctx)
+{
+	libusb_hotplug_message *message, *next;
+	struct list_head messages;
+
+	hotplug_take_messages(ctx, &messages);
+
+	list_for_each_entry_safe(message, next, &messages, list, libusb_hotplug_message) {
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+			libusb_unref_device(message->device);
+		free(message);
+	}
+}
+
+/* unlink a driver from the context and disconnect its devices. called with
+ * hotplug_drivers_lock held. */
+static void hotplug_remove_driver(struct libusb_context *ctx,
+	struct hotplug_list *it)
+{
+	list_del(&it->list);
+	list_del(&it->index_list);
+	ctx->num_hotplug_drivers--;
+	it->removed = 1;
+
+	usbi_hotplug_disconnect_all(ctx, it);
+	hotplug_unref_driver(it);
+}
+
 int API_EXPORTED libusb_hotplug_register(
 	libusb_context *ctx,
 	const libusb_hotplug *driver)
@@ -151,13 +392,23 @@ int API_EXPORTED libusb_hotplug_register(
 
 	list_init(&node->dev_list);
 	node->driver = driver;
+	node->refcnt = 1;
+	node->removed = 0;
 
 	USBI_GET_CONTEXT(ctx);
 
 	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	node->seq = ++ctx->hotplug_seq;
 	list_add((struct list_head*)node, &ctx->hotplug_drivers);
+	list_add(&node->index_list, hotplug_index(ctx, driver->vid, driver->pid));
+	ctx->num_hotplug_drivers++;
 	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
 
+	/* from now on the backend has to deliver events as they arrive, and
+	 * usb_devs is brought up to date for the enumeration below */
+	if (usbi_backend->update_hotplug_subscription)
+		usbi_backend->update_hotplug_subscription(ctx);
+
 	if (driver->flags & LIBUSB_HOTPLUG_ENUMERATE) {
 		struct libusb_device *device;
 		
@@ -183,29 +434,32 @@ void API_EXPORTED libusb_hotplug_deregister (
 	USBI_GET_CONTEXT(ctx);
 
 	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+restart:
 	list_for_each_entry_safe(it, next, &ctx->hotplug_drivers, list, struct hotplug_list) {
 		if (it->driver != driver) continue;
-		
-		usbi_hotplug_disconnect_all(ctx, it);
-			
-		list_del((struct list_head*)it);
-		free(it);
-		
+
+		/* the lock is dropped while disconnect callbacks run */
+		hotplug_remove_driver(ctx, it);
+		goto restart;
 	}
 	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+
+	if (usbi_backend->update_hotplug_subscription)
+		usbi_backend->update_hotplug_subscription(ctx);
 }
 
 void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
-	struct hotplug_list *it, *next;
+	struct hotplug_list *it;
 
 	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
 	
-	list_for_each_entry_safe(it, next, &ctx->hotplug_drivers, list, struct hotplug_list) {
-		usbi_hotplug_disconnect_all(ctx, it);
-		
-		list_del((struct list_head*)it);
-		free(it);
+	while (!list_empty(&ctx->hotplug_drivers)) {
+		it = list_entry(ctx->hotplug_drivers.next, struct hotplug_list, list);
+		hotplug_remove_driver(ctx, it);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+
+	if (usbi_backend->update_hotplug_subscription)
+		usbi_backend->update_hotplug_subscription(ctx);
 }
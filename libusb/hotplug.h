@@ -27,14 +27,20 @@
 #endif
 
 struct libusb_hotplug_message {
+	struct list_head list;
 	libusb_hotplug_event event;
 	struct libusb_device *device;
 };
 
 typedef struct libusb_hotplug_message libusb_hotplug_message;
 
+void usbi_hotplug_init(struct libusb_context *ctx);
 void usbi_hotplug_deregister_all(struct libusb_context *ctx);
 void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 			libusb_hotplug_event event);
+void usbi_hotplug_notification(struct libusb_context *ctx,
+			       struct libusb_device *dev, libusb_hotplug_event event);
+void usbi_hotplug_process(struct libusb_context *ctx);
+void usbi_hotplug_discard(struct libusb_context *ctx);
 
 #endif
@@ -21,7 +21,9 @@
 
 #include "config.h"
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -34,6 +36,9 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef USBI_EPOLL_AVAILABLE
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
@@ -577,6 +582,12 @@ void my_libusb_exit(void)
     libusb_exit(ctx);
 }
 \endcode
+ *
+ * Alternatively, libusb_start_event_thread() lets libusb start and own
+ * such a thread, which libusb_stop_event_thread() or libusb_exit() stop
+ * without any of the above. It can also pin the thread to a set of CPUs,
+ * give it a real-time priority, or add threads handling event domains of
+ * their own, see libusb_get_event_thread_domain().
  */
 
 /**
@@ -741,6 +752,34 @@ while (user has not requested application exit) {
  * call libusb_get_pollfds(), you can set up notification functions for when
  * the file descriptor set changes using libusb_set_pollfd_notifiers().
  *
+ * \subsection eventfd A single event file descriptor
+ *
+ * Where the platform allows it, libusb can also aggregate all of its event
+ * sources behind one file descriptor, obtained with libusb_get_event_fd().
+ * That descriptor never changes for the life of the context, becomes readable
+ * whenever any event source (including the expiry of a transfer timeout) has
+ * something pending, and may be monitored with edge- as well as
+ * level-triggered mechanisms. When it becomes readable, call
+ * libusb_process_ready(), which handles everything pending without waiting
+ * for new events:
+\code
+// initialise libusb
+
+fd = libusb_get_event_fd(ctx)
+add fd to your reactor, e.g. with EPOLLIN | EPOLLET
+while (user has not requested application exit) {
+	wait for activity on any event sources of interest
+	if (fd is readable)
+		libusb_process_ready(ctx);
+	// handle events from other sources here
+}
+\endcode
+ *
+ * libusb_get_pollfds(), libusb_set_pollfd_notifiers() and
+ * libusb_get_next_timeout() are then not needed at all. On platforms where
+ * this is not possible, libusb_get_event_fd() returns
+ * LIBUSB_ERROR_NOT_SUPPORTED and the scheme described above must be used.
+ *
  * \subsection mtissues Multi-threaded considerations
  *
  * Unfortunately, the situation is complicated further when multiple threads
@@ -1111,11 +1150,33 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
 	usbi_mutex_init(&ctx->pollfd_modify_lock, NULL);
+	usbi_mutex_init(&ctx->event_stats_lock, NULL);
+	usbi_mutex_init(&ctx->event_threads_lock, NULL);
+	usbi_mutex_init(&ctx->callback_workers_lock, NULL);
+	usbi_cond_init(&ctx->callback_workers_cond, NULL);
+	usbi_cond_init(&ctx->callback_idle_cond, NULL);
+	usbi_mutex_init(&ctx->completion_queue_lock, NULL);
+	usbi_mutex_init(&ctx->hotplug_msgs_lock, NULL);
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
 	list_init(&ctx->flying_transfers);
 	list_init(&ctx->pollfds);
+	list_init(&ctx->completion_queue);
+	list_init(&ctx->ready_callback_queues);
+	list_init(&ctx->targeted_waiters);
+	list_init(&ctx->hotplug_msgs);
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the epoll instance must exist before any fd is added below */
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd >= 0) {
+		usbi_dbg("using epoll for event handling");
+	} else {
+		usbi_dbg("epoll not available (code %d error %d)", ctx->epoll_fd, errno);
+		ctx->epoll_fd = -1;
+	}
+#endif
 
 	/* FIXME should use an eventfd on kernels that support it */
 	r = usbi_pipe(ctx->ctrl_pipe);
@@ -1144,6 +1205,7 @@ int usbi_io_init(struct libusb_context *ctx)
 		TFD_NONBLOCK);
 	if (ctx->timerfd >= 0) {
 		usbi_dbg("using timerfd for timeouts");
+		ctx->timerfd_armed = 0;
 		r = usbi_add_pollfd(ctx, ctx->timerfd, POLLIN);
 		if (r < 0) {
 			usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
@@ -1165,9 +1227,20 @@ err_close_pipe:
 	usbi_close(ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[1]);
 err:
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+#endif
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
+	usbi_mutex_destroy(&ctx->event_stats_lock);
+	usbi_mutex_destroy(&ctx->event_threads_lock);
+	usbi_mutex_destroy(&ctx->callback_workers_lock);
+	usbi_cond_destroy(&ctx->callback_workers_cond);
+	usbi_cond_destroy(&ctx->callback_idle_cond);
+	usbi_mutex_destroy(&ctx->completion_queue_lock);
+	usbi_mutex_destroy(&ctx->hotplug_msgs_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
@@ -1182,26 +1255,52 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_remove_pollfd(ctx, ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[1]);
+	/* drops the references held by undelivered departures */
+	usbi_hotplug_discard(ctx);
 #ifdef USBI_TIMERFD_AVAILABLE
 	if (usbi_using_timerfd(ctx)) {
 		usbi_remove_pollfd(ctx, ctx->timerfd);
 		close(ctx->timerfd);
 	}
+#endif
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+	free(ctx->epoll_events);
+	ctx->epoll_events = NULL;
+	ctx->epoll_events_size = 0;
 #endif
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
+	usbi_mutex_destroy(&ctx->event_stats_lock);
+	usbi_mutex_destroy(&ctx->event_threads_lock);
+	usbi_mutex_destroy(&ctx->callback_workers_lock);
+	usbi_cond_destroy(&ctx->callback_workers_cond);
+	usbi_cond_destroy(&ctx->callback_idle_cond);
+	usbi_mutex_destroy(&ctx->completion_queue_lock);
+	usbi_mutex_destroy(&ctx->hotplug_msgs_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	ctx->trace_enabled = 0;
+	free(ctx->trace_slots);
+	ctx->trace_slots = NULL;
+	free(ctx->poll_fds);
+	ctx->poll_fds = NULL;
+	ctx->poll_fds_cnt = ctx->poll_fds_size = 0;
+	free(ctx->timeout_heap);
+	ctx->timeout_heap = NULL;
+	ctx->timeout_heap_len = ctx->timeout_heap_size = 0;
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
 {
 	int r;
 	struct timespec current_time;
-	unsigned int timeout =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
+	struct libusb_transfer *ltransfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer);
+	unsigned int timeout = ltransfer->timeout;
 
 	if (!timeout)
 		return 0;
@@ -1213,8 +1312,13 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 		return r;
 	}
 
-	current_time.tv_sec += timeout / 1000;
-	current_time.tv_nsec += (timeout % 1000) * 1000000;
+	if (ltransfer->flags & LIBUSB_TRANSFER_TIMEOUT_USEC) {
+		current_time.tv_sec += timeout / 1000000;
+		current_time.tv_nsec += (timeout % 1000000) * 1000;
+	} else {
+		current_time.tv_sec += timeout / 1000;
+		current_time.tv_nsec += (timeout % 1000) * 1000000;
+	}
 
 	while (current_time.tv_nsec >= 1000000000) {
 		current_time.tv_nsec -= 1000000000;
@@ -1225,69 +1329,137 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * Callers of this function must hold the flying_transfers_lock.
- * This function *always* adds the transfer to the flying_transfers list,
- * it will return non 0 if it fails to update the timer, but even then the
- * transfer is added to the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/* The timeout heap is a binary min-heap of the in-flight transfers which have
+ * a pending timeout, keyed on the absolute expiry time. Insertion and removal
+ * are O(log n) and the next timeout to expire is always at index 0. Each
+ * transfer records its own position in timeout_idx so that it can be removed
+ * from the middle of the heap when it completes. All of these functions must
+ * be called with the flying_transfers_lock held. */
+
+static int timeout_heap_before(struct usbi_transfer *a, struct usbi_transfer *b)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
+	return timercmp(&a->timeout, &b->timeout, <);
+}
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+static void timeout_heap_set(struct libusb_context *ctx, unsigned int idx,
+	struct usbi_transfer *transfer)
+{
+	ctx->timeout_heap[idx] = transfer;
+	transfer->timeout_idx = (int)idx;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, unsigned int idx)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[idx];
+
+	while (idx > 0) {
+		unsigned int parent = (idx - 1) / 2;
+		if (!timeout_heap_before(transfer, ctx->timeout_heap[parent]))
+			break;
+		timeout_heap_set(ctx, idx, ctx->timeout_heap[parent]);
+		idx = parent;
 	}
+	timeout_heap_set(ctx, idx, transfer);
+}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int idx)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[idx];
+	unsigned int len = ctx->timeout_heap_len;
+
+	while (2 * idx + 1 < len) {
+		unsigned int child = 2 * idx + 1;
+		if (child + 1 < len && timeout_heap_before(ctx->timeout_heap[child + 1],
+				ctx->timeout_heap[child]))
+			child++;
+		if (!timeout_heap_before(ctx->timeout_heap[child], transfer))
+			break;
+		timeout_heap_set(ctx, idx, ctx->timeout_heap[child]);
+		idx = child;
+	}
+	timeout_heap_set(ctx, idx, transfer);
+}
+
+static int timeout_heap_insert(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int new_size = ctx->timeout_heap_size ?
+			2 * ctx->timeout_heap_size : 16;
+		struct usbi_transfer **new_heap = realloc(ctx->timeout_heap,
+			new_size * sizeof(*new_heap));
+		if (!new_heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = new_heap;
+		ctx->timeout_heap_size = new_size;
 	}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+	ctx->timeout_heap[ctx->timeout_heap_len] = transfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len++);
+	return 0;
+}
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+/* returns 1 if the transfer was at the top of the heap (i.e. the timeout
+ * which the timerfd is armed for), 0 otherwise */
+static int timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	int idx = transfer->timeout_idx;
+	struct usbi_transfer *last;
+
+	if (idx < 0)
+		return 0;
+
+	transfer->timeout_idx = -1;
+	last = ctx->timeout_heap[--ctx->timeout_heap_len];
+	if (last != transfer) {
+		timeout_heap_set(ctx, idx, last);
+		if (idx > 0 && timeout_heap_before(last,
+				ctx->timeout_heap[(idx - 1) / 2]))
+			timeout_heap_sift_up(ctx, idx);
+		else
+			timeout_heap_sift_down(ctx, idx);
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
+	return idx == 0;
+}
+
+/* add a transfer to the active transfers list, and to the timeout heap if it
+ * has a finite timeout.
+ * Callers of this function must hold the flying_transfers_lock.
+ * This function *always* adds the transfer to the flying_transfers list,
+ * it will return non 0 if it fails to add the timeout to the heap, but even
+ * then the transfer is added to the flying_transfers list. The timerfd is
+ * left alone; callers rearm it once they are done if the transfer at the top
+ * of the timeout heap changed. */
+static int add_to_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+
 	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
-#ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
-		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
-			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
-		}
-	}
-#else
-	UNUSED(first);
-#endif
+	if (transfer->active_priority != LIBUSB_PRIORITY_NORMAL)
+		ctx->priority_transfers++;
 
-	return r;
+	/* transfers with infinite timeout never need to be looked at by the
+	 * timeout handling code, so there is nothing more to do */
+	if (!timerisset(&transfer->timeout))
+		return 0;
+
+	return timeout_heap_insert(ctx, transfer);
+}
+
+/* remove a transfer from the active transfers list and the timeout heap.
+ * Callers of this function must hold the flying_transfers_lock.
+ * Returns 1 if the transfer had the earliest pending timeout, in which case
+ * the caller should rearm the timerfd, 0 otherwise. */
+int usbi_remove_from_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+
+	list_del(&itransfer->list);
+	if (itransfer->active_priority != LIBUSB_PRIORITY_NORMAL)
+		ctx->priority_transfers--;
+	return timeout_heap_remove(ctx, itransfer);
 }
 
 /** \ingroup asyncio
@@ -1313,25 +1485,73 @@ out:
  * \param iso_packets number of isochronous packet descriptors to allocate
  * \returns a newly allocated transfer, or NULL on error
  */
-DEFAULT_VISIBILITY
-struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
-	int iso_packets)
+static size_t transfer_alloc_size(int iso_packets)
 {
 	size_t os_alloc_size = usbi_backend->transfer_priv_size
 		+ (usbi_backend->add_iso_packet_size * iso_packets);
-	size_t alloc_size = sizeof(struct usbi_transfer)
+	return sizeof(struct usbi_transfer)
 		+ sizeof(struct libusb_transfer)
 		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
 		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+}
+
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
+	int iso_packets)
+{
+	struct usbi_transfer *itransfer = calloc(1,
+		transfer_alloc_size(iso_packets));
 	if (!itransfer)
 		return NULL;
 
 	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout_idx = -1;
 	usbi_mutex_init(&itransfer->lock, NULL);
 	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
+static void free_pool_memory(struct libusb_transfer_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->num_transfers; i++) {
+		struct usbi_transfer *itransfer = (struct usbi_transfer *)
+			(pool->mem + (i * pool->transfer_size));
+		if (usbi_backend->destroy_transfer)
+			usbi_backend->destroy_transfer(itransfer);
+		usbi_mutex_destroy(&itransfer->lock);
+	}
+	usbi_mutex_destroy(&pool->lock);
+	free(pool->mem);
+	free(pool);
+}
+
+/* give a pooled transfer back to its pool, destroying the pool if this was
+ * the last busy transfer of a pool which has already been freed */
+static void pool_put_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer_pool *pool = itransfer->pool;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int destroy;
+
+	/* the next user expects a transfer as fresh as one from
+	 * libusb_alloc_transfer(). the backend private data is left alone, it
+	 * is cleaned up at completion and holds the preallocated resources */
+	memset(transfer, 0, sizeof(*transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor)
+			* itransfer->num_iso_packets));
+
+	usbi_mutex_lock(&pool->lock);
+	list_add_tail(&itransfer->list, &pool->free_list);
+	pool->num_busy--;
+	destroy = pool->destroyed && pool->num_busy == 0;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (destroy)
+		free_pool_memory(pool);
+}
+
 /** \ingroup asyncio
  * Free a transfer structure. This should be called for all transfers
  * allocated with libusb_alloc_transfer().
@@ -1355,848 +1575,4770 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	if (!transfer)
 		return;
 
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer
+			&& !usbi_transfer_uses_iov(itransfer))
 		free(transfer->buffer);
 
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	/* left behind if the handle was closed while the transfer was in
+	 * flight */
+	free(itransfer->iov_bounce);
+	itransfer->iov_bounce = NULL;
+	itransfer->iov = NULL;
+	itransfer->num_iov = 0;
+	if (itransfer->pool) {
+		pool_put_transfer(itransfer);
+		return;
+	}
+
+	if (usbi_backend->destroy_transfer)
+		usbi_backend->destroy_transfer(itransfer);
 	usbi_mutex_destroy(&itransfer->lock);
 	free(itransfer);
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int disarm_timerfd(struct libusb_context *ctx)
+/** \ingroup asyncio
+ * Allocate a pool of transfers, all with the same number of isochronous
+ * packet descriptors, in a single allocation. Where the backend supports it,
+ * the resources it needs to submit a transfer with a buffer of up to
+ * max_length bytes are set up at this point too, so that getting a transfer
+ * from the pool, submitting it and freeing it again does not involve any
+ * heap allocation.
+ *
+ * Transfers are taken from the pool with libusb_pool_get_transfer(). They
+ * are pre-initialized in the same way as those returned by
+ * libusb_alloc_transfer() and behave like them in every respect; in
+ * particular, passing one to libusb_free_transfer(), either directly or via
+ * the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" flag, gives it back to the pool it came
+ * from.
+ *
+ * Submitting a transfer with a longer buffer or more isochronous packets
+ * than the pool was created for is allowed, the backend then falls back to
+ * allocating its resources at submission time.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_transfers number of transfers in the pool
+ * \param iso_packets number of isochronous packet descriptors to allocate
+ * for each transfer
+ * \param max_length largest transfer buffer length to preallocate backend
+ * resources for, or 0 to not preallocate any
+ * \param pool output location for the newly allocated pool. Only populated
+ * on success.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if one of the numbers is out of range
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_transfer_pool(libusb_context *ctx,
+	int num_transfers, int iso_packets, int max_length,
+	libusb_transfer_pool **pool)
 {
-	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
-	int r;
+	struct libusb_transfer_pool *_pool;
+	size_t transfer_size;
+	int i, r;
 
-	usbi_dbg("");
-	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
-	if (r < 0)
-		return LIBUSB_ERROR_OTHER;
-	else
-		return 0;
-}
+	USBI_GET_CONTEXT(ctx);
+	if (num_transfers <= 0 || iso_packets < 0 || max_length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
- * or a LIBUSB_ERROR code on failure.
- */
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
-{
-	struct usbi_transfer *transfer;
+	/* keep every transfer suitably aligned for the backend private data */
+	transfer_size = (transfer_alloc_size(iso_packets) + sizeof(void *) - 1)
+		& ~(sizeof(void *) - 1);
+	if ((size_t)num_transfers > SIZE_MAX / transfer_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
-
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
+	_pool = calloc(1, sizeof(*_pool));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->mem = calloc(num_transfers, transfer_size);
+	if (!_pool->mem) {
+		free(_pool);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_pool->ctx = ctx;
+	_pool->num_transfers = num_transfers;
+	_pool->transfer_size = transfer_size;
+	usbi_mutex_init(&_pool->lock, NULL);
+	list_init(&_pool->free_list);
+
+	for (i = 0; i < num_transfers; i++) {
+		struct usbi_transfer *itransfer = (struct usbi_transfer *)
+			(_pool->mem + (i * transfer_size));
+		itransfer->num_iso_packets = iso_packets;
+		itransfer->timeout_idx = -1;
+		itransfer->pool = _pool;
+		usbi_mutex_init(&itransfer->lock, NULL);
+		list_add_tail(&itransfer->list, &_pool->free_list);
+	}
+
+	if (max_length && usbi_backend->prealloc_transfer) {
+		for (i = 0; i < num_transfers; i++) {
+			r = usbi_backend->prealloc_transfer((struct usbi_transfer *)
+				(_pool->mem + (i * transfer_size)), max_length);
+			if (r < 0) {
+				usbi_err(ctx, "failed to preallocate transfer %d, %d",
+					i, r);
+				free_pool_memory(_pool);
+				return r;
+			}
 		}
 	}
 
-disarm:
-	return disarm_timerfd(ctx);
-}
-#else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
-{
-	(void)ctx;
+	usbi_dbg("allocated pool of %d transfers of %d bytes", num_transfers,
+		max_length);
+	*pool = _pool;
 	return 0;
 }
-#endif
 
 /** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
+ * Take a transfer from a pool allocated with libusb_alloc_transfer_pool().
+ * When the transfer is no longer needed, it should be given back to the pool
+ * with libusb_free_transfer().
  *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
+ * This function does not block and may be called from any thread, including
+ * from within a transfer callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param pool the pool to take a transfer from
+ * \returns a transfer, or NULL if all transfers of the pool are in use
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_pool_get_transfer(
+	libusb_transfer_pool *pool)
 {
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-	int updated_fds;
+	struct usbi_transfer *itransfer = NULL;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->transferred = 0;
-	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto out;
-	}
+	if (!pool)
+		return NULL;
 
-	r = add_to_flying_list(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		r = usbi_backend->submit_transfer(itransfer);
-	}
-	if (r != LIBUSB_SUCCESS) {
+	usbi_mutex_lock(&pool->lock);
+	if (!pool->destroyed && !list_empty(&pool->free_list)) {
+		itransfer = list_entry(pool->free_list.next,
+			struct usbi_transfer, list);
 		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
-	} else {
-		/* keep a reference to this device */
-		libusb_ref_device(transfer->dev_handle->dev);
+		pool->num_busy++;
 	}
-out:
-	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
-	usbi_mutex_unlock(&itransfer->lock);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (updated_fds)
-		usbi_fd_notification(ctx);
-	return r;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (!itransfer)
+		return NULL;
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
 /** \ingroup asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
+ * Free a pool allocated with libusb_alloc_transfer_pool().
  *
- * \param transfer the transfer to cancel
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
- * cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * Transfers from the pool which are still in use remain valid. The memory of
+ * the pool is released once the last of them has been freed with
+ * libusb_free_transfer(). No more transfers can be taken from the pool after
+ * this function has been called.
+ *
+ * It is legal to call this function with a NULL pool. In this case,
+ * the function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param pool the pool to free
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+void API_EXPORTED libusb_free_transfer_pool(libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-
-	usbi_dbg("");
-	usbi_mutex_lock(&itransfer->lock);
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	int destroy;
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
-	}
+	if (!pool)
+		return;
 
-	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	usbi_mutex_lock(&pool->lock);
+	pool->destroyed = 1;
+	destroy = pool->num_busy == 0;
+	usbi_mutex_unlock(&pool->lock);
 
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+	if (destroy)
+		free_pool_memory(pool);
 }
 
-/** \ingroup asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
- */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+static uint64_t elapsed_us(const struct timespec *start)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct timespec now;
 
-	itransfer->stream_id = stream_id;
+	if (!start->tv_sec && !start->tv_nsec)
+		return 0;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		return 0;
+
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000
+		+ (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
-/** \ingroup asyncio
- * Get a transfers bulk stream id.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
- */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+/* microseconds since the transfer was last submitted, or 0 if unknown */
+static uint64_t elapsed_since_submit_us(struct usbi_transfer *itransfer)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-
-	return itransfer->stream_id;
+	return elapsed_us(&itransfer->submitted);
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+/* index into dev_handle->ep_stats: the endpoint number, plus 16 for IN.
+ * both directions of endpoint 0 share index 0, as control transfers always
+ * carry endpoint 0 whatever their direction */
+static int usbi_ep_stats_index(unsigned char endpoint)
+{
+	int number = endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK;
+
+	if (!number)
+		return 0;
+	return number | ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) ? 16 : 0);
+}
+
+/* the counters of an endpoint, allocated on first use when alloc is set. if
+ * the allocation fails, the endpoint simply goes uncounted until a later
+ * submission succeeds in allocating them. must be called with the
+ * stats_lock held */
+static struct libusb_endpoint_stats *get_ep_stats_locked(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int alloc)
+{
+	struct libusb_endpoint_stats **stats =
+		&dev_handle->ep_stats[usbi_ep_stats_index(endpoint)];
+
+	if (!*stats && alloc)
+		*stats = calloc(1, sizeof(**stats));
+	return *stats;
+}
+
+/* must be called with the stats_lock held */
+static void count_completion_locked(struct libusb_endpoint_stats *stats,
+	enum libusb_transfer_status status, int length, int transferred,
+	uint64_t latency_us)
+{
+	int bucket = 0;
+
+	while (latency_us >= 2 && bucket < LIBUSB_LATENCY_BUCKETS - 1) {
+		latency_us >>= 1;
+		bucket++;
+	}
+
+	stats->bytes += transferred;
+	stats->latency_us[bucket]++;
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stats->completed++;
+		if (transferred < length)
+			stats->short_transfers++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timeouts++;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		stats->stalls++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancelled++;
+		break;
+	default:
+		stats->errors++;
+		break;
+	}
+}
+
+/* account for a successful submission */
+static void count_submission(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+
+	usbi_mutex_lock(&dev_handle->stats_lock);
+	stats = get_ep_stats_locked(dev_handle, transfer->endpoint, 1);
+	if (stats) {
+		stats->submitted++;
+		if (++stats->in_flight > stats->max_in_flight)
+			stats->max_in_flight = stats->in_flight;
+	}
+	usbi_mutex_unlock(&dev_handle->stats_lock);
+}
+
+/* account for a transfer about to be handed back to the application with
+ * the given final status */
+static void count_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct libusb_device_handle *handle = transfer->dev_handle;
-	uint8_t flags;
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+	uint64_t latency_us = elapsed_since_submit_us(itransfer);
+	int length = transfer->length;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+
+	usbi_mutex_lock(&dev_handle->stats_lock);
+	stats = get_ep_stats_locked(dev_handle, transfer->endpoint, 0);
+	if (stats) {
+		if (stats->in_flight > 0)
+			stats->in_flight--;
+		count_completion_locked(stats, status, length,
+			itransfer->transferred, latency_us);
+	}
+	usbi_mutex_unlock(&dev_handle->stats_lock);
+}
+
+/* account for a synchronous transfer which the backend carried out by
+ * itself, without a libusb_transfer, in the endpoint statistics and the
+ * trace ring. r is its result, start when it began */
+void usbi_count_sync_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, int transferred, int r,
+	const struct timespec *start)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_endpoint_stats *stats;
+	enum libusb_transfer_status status;
+	uint64_t latency_us = elapsed_us(start);
+
+	switch (r) {
+	case LIBUSB_SUCCESS:
+		status = LIBUSB_TRANSFER_COMPLETED;
+		break;
+	case LIBUSB_ERROR_TIMEOUT:
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+		break;
+	case LIBUSB_ERROR_PIPE:
+		status = LIBUSB_TRANSFER_STALL;
+		break;
+	case LIBUSB_ERROR_INTERRUPTED:
+		status = LIBUSB_TRANSFER_CANCELLED;
+		break;
+	default:
+		status = r > 0 ? LIBUSB_TRANSFER_COMPLETED : LIBUSB_TRANSFER_ERROR;
+		break;
+	}
+
+	usbi_mutex_lock(&dev_handle->stats_lock);
+	stats = get_ep_stats_locked(dev_handle, endpoint, 1);
+	if (stats) {
+		stats->submitted++;
+		if (stats->in_flight + 1 > stats->max_in_flight)
+			stats->max_in_flight = stats->in_flight + 1;
+		count_completion_locked(stats, status, length, transferred,
+			latency_us);
+	}
+	usbi_mutex_unlock(&dev_handle->stats_lock);
+
+	if (ctx->trace_enabled)
+		usbi_trace_sync_transfer(ctx, endpoint, length, transferred,
+			status, start);
+}
+
+/** \ingroup asyncio
+ * Get the counters libusb keeps for the transfers of an endpoint. They are
+ * always maintained, for the transfers submitted with
+ * libusb_submit_transfer() and the functions built on top of it, as well as
+ * for the transfers of the synchronous API. The counters only ever
+ * grow, except for the number of transfers in flight, so that they can be
+ * sampled periodically and exported as rates.
+ *
+ * Control transfers are counted on endpoint 0, whatever their direction.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param stats output location for the counters, which are all zero if no
+ * transfer was ever submitted to the endpoint through this handle
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint address is not valid
+ * or stats is NULL
+ */
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats)
+{
+	struct libusb_endpoint_stats *ep_stats;
+
+	if (!stats || (endpoint
+			& ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&dev_handle->stats_lock);
+	ep_stats = dev_handle->ep_stats[usbi_ep_stats_index(endpoint)];
+	if (ep_stats)
+		*stats = *ep_stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+	usbi_mutex_unlock(&dev_handle->stats_lock);
+	return 0;
+}
+
+/* submit empty slots in ring order until queue_depth transfers are in
+ * flight. must be called with the ring lock held */
+static void ring_refill_locked(struct libusb_ring *ring)
+{
+	while (ring->running && ring->in_flight < ring->queue_depth) {
+		struct usbi_ring_slot *slot = &ring->slots[ring->next_submit];
+		int r;
+
+		if (slot->state != USBI_RING_SLOT_EMPTY)
+			break;
+
+		if (!ring->num_iso_packets)
+			slot->transfer->length = ring->transfer_length;
+		r = libusb_submit_transfer(slot->transfer);
+		if (r < 0) {
+			usbi_err(HANDLE_CTX(ring->dev_handle),
+				"ring submission failed, stopping (%d)", r);
+			ring->stats.errors++;
+			ring->running = 0;
+			ring->error = r;
+			break;
+		}
+
+		slot->state = USBI_RING_SLOT_IN_FLIGHT;
+		ring->in_flight++;
+		ring->next_submit = (ring->next_submit + 1) % ring->num_slots;
+	}
+}
+
+/* a measurement window of an autotuned ring spans at least this many
+ * transfers and this much time */
+#define RING_TUNE_WINDOW_TRANSFERS	16
+#define RING_TUNE_WINDOW_US		20000
+
+/* start a new measurement window. after a change of the settings, the
+ * transfers in flight were submitted with the previous ones, so they are
+ * left out of it with skip_in_flight set. must be called with the ring lock
+ * held */
+static void ring_tune_reset_window_locked(struct libusb_ring *ring,
+	int skip_in_flight)
+{
+	ring->win_transfers = 0;
+	ring->win_bytes = 0;
+	ring->win_latency_us = 0;
+	ring->win_skip = skip_in_flight ? ring->in_flight : 0;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+			&ring->win_start) < 0) {
+		ring->win_start.tv_sec = 0;
+		ring->win_start.tv_nsec = 0;
+	}
+}
+
+static void ring_tune_restart_locked(struct libusb_ring *ring)
+{
+	ring->tune_phase = USBI_RING_TUNE_LENGTH;
+	ring->tune_best = 0;
+	ring->tune_degraded = 0;
+	ring->queue_depth = ring->max_queue_depth;
+	ring->transfer_length = ring->tune_unit;
+	ring->tune_prev = ring->tune_unit;
+	ring_tune_reset_window_locked(ring, 1);
+}
+
+/* move on to the next settings to try, judging the current ones by the
+ * throughput of the window which just completed. lengths are tried from
+ * the smallest up at the full queue depth, for as long as each step gains
+ * at least 5%, then the depth is halved for as long as this costs less than
+ * 5%. must be called with the ring lock held */
+static void ring_tune_step_locked(struct libusb_ring *ring)
+{
+	uint64_t t = ring->throughput;
+	int next;
+
+	switch (ring->tune_phase) {
+	case USBI_RING_TUNE_LENGTH:
+		if (t > ring->tune_best + ring->tune_best / 20) {
+			ring->tune_best = t;
+			next = ring->transfer_length * 2;
+			if (next > ring->buffer_length || next < 0)
+				next = ring->buffer_length;
+			if (next > ring->transfer_length) {
+				ring->tune_prev = ring->transfer_length;
+				ring->transfer_length = next;
+				break;
+			}
+		} else {
+			ring->transfer_length = ring->tune_prev;
+		}
+
+		ring->tune_phase = USBI_RING_TUNE_DEPTH;
+		if (ring->queue_depth > 1) {
+			ring->tune_prev = ring->queue_depth;
+			ring->queue_depth /= 2;
+			break;
+		}
+		goto settle;
+	case USBI_RING_TUNE_DEPTH:
+		if (t >= ring->tune_best - ring->tune_best / 20) {
+			if (ring->queue_depth > 1) {
+				ring->tune_prev = ring->queue_depth;
+				ring->queue_depth /= 2;
+				break;
+			}
+		} else {
+			ring->queue_depth = ring->tune_prev;
+		}
+		goto settle;
+	case USBI_RING_TUNE_SETTLED:
+		/* retune once the throughput stayed a quarter below what was
+		 * measured during warm-up for a few windows in a row */
+		if (t >= ring->tune_best - ring->tune_best / 4) {
+			ring->tune_degraded = 0;
+		} else if (++ring->tune_degraded >= 3) {
+			usbi_dbg("ring throughput dropped to %llu bytes/s, retuning",
+				(unsigned long long)t);
+			ring_tune_restart_locked(ring);
+			return;
+		}
+
+		ring_tune_reset_window_locked(ring, 0);
+		return;
+	default:
+		return;
+	}
+
+	ring_tune_reset_window_locked(ring, 1);
+	return;
+
+settle:
+	ring->tune_phase = USBI_RING_TUNE_SETTLED;
+	ring->tune_degraded = 0;
+	usbi_info(HANDLE_CTX(ring->dev_handle),
+		"ring on endpoint %02x tuned to %d transfers of %d bytes, "
+		"%llu bytes/s", ring->slots[0].transfer->endpoint,
+		ring->queue_depth, ring->transfer_length,
+		(unsigned long long)ring->tune_best);
+	ring_tune_reset_window_locked(ring, 1);
+}
+
+/* account for a completed transfer of an autotuned ring. must be called with
+ * the ring lock held */
+static void ring_tune_account_locked(struct libusb_ring *ring,
+	struct libusb_transfer *transfer, int length)
+{
+	uint64_t elapsed;
+
+	if (ring->win_skip > 0) {
+		if (--ring->win_skip == 0)
+			ring_tune_reset_window_locked(ring, 0);
+		return;
+	}
+
+	ring->win_transfers++;
+	ring->win_bytes += length;
+	ring->win_latency_us += elapsed_since_submit_us(
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer));
+
+	if (ring->win_transfers < RING_TUNE_WINDOW_TRANSFERS)
+		return;
+	elapsed = elapsed_us(&ring->win_start);
+	if (elapsed < RING_TUNE_WINDOW_US)
+		return;
+
+	ring->throughput = ring->win_bytes * 1000000 / elapsed;
+	ring->latency_us = ring->win_latency_us / ring->win_transfers;
+	usbi_dbg("ring window: %d transfers of %d bytes, depth %d: %llu bytes/s, "
+		"%llu us latency", ring->win_transfers, ring->transfer_length,
+		ring->queue_depth, (unsigned long long)ring->throughput,
+		(unsigned long long)ring->latency_us);
+	ring_tune_step_locked(ring);
+}
+
+static void LIBUSB_CALL ring_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_ring_slot *slot = transfer->user_data;
+	struct libusb_ring *ring = slot->ring;
+	int length = 0;
+	int offset = 0;
+	int notify;
+	int i;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			length = transfer->actual_length;
+			break;
+		}
+
+		/* close the gaps left by short packets so that the consumer gets
+		 * one contiguous region */
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pack =
+				&transfer->iso_packet_desc[i];
+			if (pack->status == LIBUSB_TRANSFER_COMPLETED) {
+				if (offset != length)
+					memmove(transfer->buffer + length,
+						transfer->buffer + offset,
+						pack->actual_length);
+				length += pack->actual_length;
+			}
+			offset += pack->length;
+		}
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_STALL:
+		usbi_dbg("ring stopped by transfer status %d", transfer->status);
+		usbi_mutex_lock(&ring->lock);
+		ring->error = transfer->status == LIBUSB_TRANSFER_STALL ?
+			LIBUSB_ERROR_PIPE : LIBUSB_ERROR_NO_DEVICE;
+		ring->running = 0;
+		ring->stats.errors++;
+		usbi_mutex_unlock(&ring->lock);
+		break;
+	default:
+		usbi_mutex_lock(&ring->lock);
+		ring->stats.errors++;
+		usbi_mutex_unlock(&ring->lock);
+		break;
+	}
+
+	usbi_mutex_lock(&ring->lock);
+	slot->state = USBI_RING_SLOT_FILLED;
+	slot->length = length;
+	ring->in_flight--;
+	ring->filled++;
+	if (length) {
+		ring->stats.transfers++;
+		ring->stats.bytes += length;
+	}
+	if (ring->tune_phase != USBI_RING_TUNE_OFF
+			&& transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		ring_tune_account_locked(ring, transfer, length);
+
+	ring_refill_locked(ring);
+	if (ring->running && ring->in_flight < ring->queue_depth)
+		ring->stats.overruns++;
+	notify = length && ring->callback;
+	usbi_mutex_unlock(&ring->lock);
+
+	if (notify)
+		ring->callback(ring, ring->user_data);
+}
+
+static void free_ring_memory(struct libusb_ring *ring)
+{
+	int i;
+
+	if (ring->slots) {
+		for (i = 0; i < ring->num_slots; i++)
+			libusb_free_transfer(ring->slots[i].transfer);
+		free(ring->slots);
+	}
+	libusb_free_transfer_pool(ring->pool);
+
+	if (ring->dev_mem)
+		libusb_dev_mem_free(ring->dev_handle, ring->buffers,
+			(size_t)ring->num_slots * ring->buffer_length);
+	else
+		free(ring->buffers);
+
+	usbi_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+/** \ingroup asyncio
+ * Allocate a streaming ring for an IN endpoint. A ring owns num_buffers
+ * buffers of buffer_length bytes each, and keeps up to queue_depth of them
+ * submitted to the endpoint. Whenever a transfer completes, the next free
+ * buffer is resubmitted right away from the event handler, so that the
+ * endpoint never runs out of transfers as long as the application consumes
+ * the received data quickly enough. The data is then read in order with
+ * libusb_ring_read() and libusb_ring_release(), without the application
+ * having to deal with transfers or their callbacks.
+ *
+ * The transfers of the ring are taken from a transfer pool, so submitting
+ * them does not allocate memory, and the buffers are allocated with
+ * libusb_dev_mem_alloc() where available, so that the kernel does not need
+ * to copy the data.
+ *
+ * Bulk, interrupt and isochronous endpoints are supported. For isochronous
+ * endpoints, each transfer carries num_iso_packets packets of
+ * buffer_length / num_iso_packets bytes, and the data of the packets which
+ * completed is made contiguous before it is handed to the application.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device to stream from, with the
+ * interface of the endpoint claimed
+ * \param endpoint address of a valid IN endpoint
+ * \param num_buffers number of buffers in the ring
+ * \param queue_depth maximum number of buffers submitted at any time. Must
+ * not be larger than num_buffers; the difference is how far the application
+ * may fall behind before transfers stop being resubmitted immediately
+ * \param buffer_length size of each buffer
+ * \param num_iso_packets number of packets per transfer for isochronous
+ * endpoints, ignored for other endpoints
+ * \param callback function called from the event handler each time a buffer
+ * has been filled, or NULL
+ * \param user_data user data to pass to the callback
+ * \param ring output location for the newly allocated ring. Only populated
+ * on success.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range or the
+ * endpoint is not an IN endpoint
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_alloc_ring(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_buffers, int queue_depth,
+	int buffer_length, int num_iso_packets, libusb_ring_cb_fn callback,
+	void *user_data, libusb_ring **ring)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_ring *_ring;
+	size_t total_length;
+	int type, i, r;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) || num_buffers <= 0
+			|| queue_depth <= 0 || queue_depth > num_buffers
+			|| buffer_length <= 0 || num_iso_packets < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	type = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (type < 0)
+		return type;
+	if (type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		num_iso_packets = 0;
+	else if (num_iso_packets == 0 || buffer_length < num_iso_packets)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	total_length = (size_t)num_buffers * buffer_length;
+	if (total_length / num_buffers != (size_t)buffer_length)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_ring = calloc(1, sizeof(*_ring));
+	if (!_ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_mutex_init(&_ring->lock, NULL);
+	_ring->dev_handle = dev_handle;
+	_ring->callback = callback;
+	_ring->user_data = user_data;
+	_ring->num_slots = num_buffers;
+	_ring->queue_depth = queue_depth;
+	_ring->buffer_length = buffer_length;
+	_ring->num_iso_packets = num_iso_packets;
+	_ring->max_queue_depth = queue_depth;
+	_ring->transfer_length = buffer_length;
+
+	_ring->buffers = libusb_dev_mem_alloc(dev_handle, total_length);
+	if (_ring->buffers) {
+		_ring->dev_mem = 1;
+	} else {
+		_ring->buffers = malloc(total_length);
+		if (!_ring->buffers) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err;
+		}
+	}
+
+	_ring->slots = calloc(num_buffers, sizeof(*_ring->slots));
+	if (!_ring->slots) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err;
+	}
+
+	r = libusb_alloc_transfer_pool(ctx, num_buffers, num_iso_packets,
+		buffer_length, &_ring->pool);
+	if (r < 0)
+		goto err;
+
+	for (i = 0; i < num_buffers; i++) {
+		struct usbi_ring_slot *slot = &_ring->slots[i];
+		struct libusb_transfer *transfer =
+			libusb_pool_get_transfer(_ring->pool);
+		unsigned char *buffer = _ring->buffers
+			+ ((size_t)i * buffer_length);
+
+		slot->ring = _ring;
+		slot->transfer = transfer;
+		transfer->dev_handle = dev_handle;
+		transfer->endpoint = endpoint;
+		transfer->type = (unsigned char)type;
+		transfer->buffer = buffer;
+		transfer->length = buffer_length;
+		transfer->callback = ring_transfer_cb;
+		transfer->user_data = slot;
+		if (num_iso_packets) {
+			transfer->num_iso_packets = num_iso_packets;
+			libusb_set_iso_packet_lengths(transfer,
+				(unsigned int)(buffer_length / num_iso_packets));
+		}
+	}
+
+	usbi_dbg("ring of %d buffers of %d bytes, depth %d, dev mem %d",
+		num_buffers, buffer_length, queue_depth, _ring->dev_mem);
+	*ring = _ring;
+	return 0;
+
+err:
+	free_ring_memory(_ring);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Start streaming: submit the free buffers of the ring, up to its queue
+ * depth. Events must be handled as usual for the transfers to complete.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to start
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the ring is already running
+ * \returns the error of the failed submission if no transfer could be
+ * submitted
+ */
+int API_EXPORTED libusb_start_ring(libusb_ring *ring)
+{
 	int r = 0;
 
-	/* FIXME: could be more intelligent with the timerfd here. we don't need
-	 * to disarm the timerfd if there was no timer running, and we only need
-	 * to rearm the timerfd if the transfer that expired was the one with
-	 * the shortest timeout. */
+	usbi_mutex_lock(&ring->lock);
+	if (ring->running) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	if (usbi_using_timerfd(ctx))
-		r = arm_timerfd_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (usbi_using_timerfd(ctx) && (r < 0))
-		return r;
+	ring->running = 1;
+	ring->error = 0;
+	ring_refill_locked(ring);
+	if (!ring->running)
+		r = ring->error;
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
+out:
+	usbi_mutex_unlock(&ring->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Stop streaming: cancel the transfers in flight and do not submit any new
+ * ones. This function returns immediately; the cancelled transfers are
+ * retired while events are handled. Data which was already received can
+ * still be read.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to stop
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the ring was not running
+ */
+int API_EXPORTED libusb_stop_ring(libusb_ring *ring)
+{
+	int i, r = 0;
+
+	usbi_mutex_lock(&ring->lock);
+	if (!ring->running && !ring->in_flight) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	ring->running = 0;
+	for (i = 0; i < ring->num_slots; i++)
+		if (ring->slots[i].state == USBI_RING_SLOT_IN_FLIGHT)
+			libusb_cancel_transfer(ring->slots[i].transfer);
+
+out:
+	usbi_mutex_unlock(&ring->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Free a ring allocated with libusb_alloc_ring(). A running ring is stopped
+ * first, and this function then handles events until all of its transfers
+ * have been retired.
+ *
+ * It is legal to call this function with a NULL ring. In this case,
+ * the function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to free
+ */
+void API_EXPORTED libusb_free_ring(libusb_ring *ring)
+{
+	struct libusb_context *ctx;
+	int in_flight;
+	int r;
+
+	if (!ring)
+		return;
+
+	ctx = HANDLE_CTX(ring->dev_handle);
+	libusb_stop_ring(ring);
+	for (;;) {
+		struct timeval tv = { 1, 0 };
+
+		usbi_mutex_lock(&ring->lock);
+		in_flight = ring->in_flight;
+		usbi_mutex_unlock(&ring->lock);
+		if (!in_flight)
+			break;
+
+		if (ring->dev_handle->event_domain)
+			r = libusb_handle_domain_events_timeout_completed(
+				ring->dev_handle->event_domain, &tv, NULL);
+		else
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "failed to retire ring transfers (%d), leaking",
+				r);
+			return;
 		}
 	}
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
-	libusb_unref_device(handle->dev);
+	free_ring_memory(ring);
+}
+
+/** \ingroup asyncio
+ * Get the oldest filled buffer of a ring. The data stays valid, and its
+ * buffer out of the ring, until it is given back with libusb_ring_release(),
+ * which must be done before the next call to this function.
+ *
+ * This function does not block and does not handle events. It may be
+ * called from any thread.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to read from
+ * \param data output location for the start of the data
+ * \param length output location for the number of bytes of data
+ * \returns 1 if data was returned
+ * \returns 0 if no data is available yet
+ * \returns LIBUSB_ERROR_BUSY if the previous data has not been released
+ * \returns the reason the ring stopped, if it stopped on its own and all
+ * data has been consumed, e.g. LIBUSB_ERROR_NO_DEVICE
+ */
+int API_EXPORTED libusb_ring_read(libusb_ring *ring, unsigned char **data,
+	int *length)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&ring->lock);
+	for (;;) {
+		struct usbi_ring_slot *slot = &ring->slots[ring->next_read];
+
+		if (slot->state == USBI_RING_SLOT_CONSUMING) {
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+
+		if (slot->state != USBI_RING_SLOT_FILLED) {
+			if (!ring->running && !ring->in_flight)
+				r = ring->error;
+			break;
+		}
+
+		/* transfers which completed without data keep their place in
+		 * the ring, but are not worth handing out */
+		if (!slot->length) {
+			slot->state = USBI_RING_SLOT_EMPTY;
+			ring->filled--;
+			ring->next_read = (ring->next_read + 1) % ring->num_slots;
+			ring_refill_locked(ring);
+			continue;
+		}
+
+		slot->state = USBI_RING_SLOT_CONSUMING;
+		*data = slot->transfer->buffer;
+		*length = slot->length;
+		r = 1;
+		break;
+	}
+	usbi_mutex_unlock(&ring->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Give the buffer returned by the last call to libusb_ring_read() back to
+ * the ring, which resubmits it if the ring is running and fewer transfers
+ * than its queue depth are in flight.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to release the buffer to
+ */
+void API_EXPORTED libusb_ring_release(libusb_ring *ring)
+{
+	struct usbi_ring_slot *slot;
+
+	usbi_mutex_lock(&ring->lock);
+	slot = &ring->slots[ring->next_read];
+	if (slot->state == USBI_RING_SLOT_CONSUMING) {
+		slot->state = USBI_RING_SLOT_EMPTY;
+		ring->filled--;
+		ring->next_read = (ring->next_read + 1) % ring->num_slots;
+		ring_refill_locked(ring);
+	}
+	usbi_mutex_unlock(&ring->lock);
+}
+
+/** \ingroup asyncio
+ * Get the counters of a ring.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to get the counters of
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_ring_stats(libusb_ring *ring,
+	struct libusb_ring_stats *stats)
+{
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ring->lock);
+	*stats = ring->stats;
+	stats->in_flight = ring->in_flight;
+	stats->filled = ring->filled;
+	usbi_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+/* smallest transfer length worth trying when autotuning a ring: one packet
+ * of the maximum size, or one burst of them on a SuperSpeed endpoint.
+ * isochronous transfers keep their length, their layout is set by the
+ * packets */
+static int ring_tune_unit(struct libusb_ring *ring)
+{
+	struct libusb_transfer *transfer = ring->slots[0].transfer;
+	struct libusb_config_descriptor *config;
+	const struct libusb_endpoint_descriptor *ep;
+	struct libusb_ss_endpoint_companion_descriptor *comp;
+	int unit = 0;
+
+	if (ring->num_iso_packets)
+		return ring->buffer_length;
+
+	if (libusb_get_active_config_descriptor(ring->dev_handle->dev,
+			&config) < 0)
+		return ring->buffer_length;
+	ep = usbi_find_endpoint(config, transfer->endpoint);
+	if (ep) {
+		unit = ep->wMaxPacketSize & 0x7ff;
+		if (libusb_get_ss_endpoint_companion_descriptor(
+				HANDLE_CTX(ring->dev_handle), ep, &comp) == 0) {
+			unit *= comp->bMaxBurst + 1;
+			libusb_free_ss_endpoint_companion_descriptor(comp);
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	if (unit <= 0 || unit > ring->buffer_length)
+		return ring->buffer_length;
+	return unit;
+}
+
+/** \ingroup asyncio
+ * Let a ring pick its queue depth and transfer length by itself. During a
+ * warm-up, the ring measures its throughput over windows of a few dozen
+ * milliseconds while trying out transfer lengths, from one maximum size
+ * packet (one burst of them on SuperSpeed endpoints) up to the buffer
+ * length, and then smaller queue depths. It settles on the smallest
+ * settings which do not cost throughput, as these also give the lowest
+ * latency, and reports them at the LIBUSB_LOG_LEVEL_INFO log level and
+ * through libusb_get_ring_tuning().
+ *
+ * Once settled, the ring keeps measuring, and warms up again if the
+ * throughput stays well below what it measured with the chosen settings.
+ *
+ * The queue depth given to libusb_alloc_ring() and the buffer length are
+ * the upper limits of the settings tried. The transfer length of an
+ * isochronous ring is not changed. Disabling autotuning keeps the settings
+ * it had chosen so far.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to tune
+ * \param enable 1 to enable autotuning, 0 to disable it
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_set_ring_autotune(libusb_ring *ring, int enable)
+{
+	int unit = enable ? ring_tune_unit(ring) : 0;
+
+	usbi_mutex_lock(&ring->lock);
+	if (!enable) {
+		ring->tune_phase = USBI_RING_TUNE_OFF;
+	} else if (ring->tune_phase == USBI_RING_TUNE_OFF) {
+		ring->tune_unit = unit;
+		ring_tune_restart_locked(ring);
+		ring_refill_locked(ring);
+	}
+	usbi_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Get the settings a ring runs with, and the measurements autotuning based
+ * them on, see libusb_set_ring_autotune().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ring the ring to get the settings of
+ * \param tuning output location for the settings
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if tuning is NULL
+ */
+int API_EXPORTED libusb_get_ring_tuning(libusb_ring *ring,
+	struct libusb_ring_tuning *tuning)
+{
+	if (!tuning)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ring->lock);
+	tuning->throughput = ring->throughput;
+	tuning->latency_us = ring->latency_us;
+	tuning->queue_depth = ring->queue_depth;
+	tuning->transfer_length = ring->transfer_length;
+	tuning->warming_up = ring->tune_phase == USBI_RING_TUNE_LENGTH
+		|| ring->tune_phase == USBI_RING_TUNE_DEPTH;
+	usbi_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+/* pick the stream the next transfer should go to: the one with the fewest
+ * transfers in flight, starting from next_stream to break ties, or -1 if
+ * all of them are full. must be called with the scheduler lock held */
+static int stream_pick_locked(struct libusb_stream_scheduler *sched)
+{
+	int i, best = -1;
+
+	for (i = 0; i < sched->num_streams; i++) {
+		int n = (sched->next_stream + i) % sched->num_streams;
+
+		if (sched->streams[n].in_flight >= sched->queue_depth)
+			continue;
+		if (best < 0 || sched->streams[n].in_flight
+				< sched->streams[best].in_flight)
+			best = n;
+	}
+
+	if (best >= 0)
+		sched->next_stream = (best + 1) % sched->num_streams;
+	return best;
+}
+
+/* give a transfer back to the application, restoring its callback. the
+ * callback itself is left for the caller to invoke */
+static void stream_release_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	transfer->callback = itransfer->stream_callback;
+	itransfer->stream_sched = NULL;
+	itransfer->stream_callback = NULL;
+}
+
+/* must be called with the scheduler lock held */
+static int stream_start_locked(struct libusb_stream_scheduler *sched,
+	int n, struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	libusb_transfer_set_stream_id(transfer, (uint32_t)n + 1);
+	r = libusb_submit_transfer(transfer);
+	if (r < 0)
+		return r;
+
+	sched->streams[n].in_flight++;
+	sched->in_flight++;
+	return 0;
+}
+
+/* start queued transfers for as long as a stream has room. transfers which
+ * fail to start are moved to the failed list, with their status set, for
+ * the caller to complete once the lock is dropped. must be called with the
+ * scheduler lock held */
+static void stream_dispatch_locked(struct libusb_stream_scheduler *sched,
+	struct list_head *failed)
+{
+	struct usbi_transfer *itransfer;
+	int n, r;
+
+	while (!list_empty(&sched->queue)) {
+		n = stream_pick_locked(sched);
+		if (n < 0)
+			break;
+
+		itransfer = list_entry(sched->queue.next, struct usbi_transfer,
+			list);
+		list_del(&itransfer->list);
+		sched->queued--;
+
+		r = stream_start_locked(sched, n, itransfer);
+		if (r < 0) {
+			struct libusb_transfer *transfer =
+				USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+			usbi_dbg("queued stream transfer failed to start (%d)", r);
+			transfer->status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			transfer->actual_length = 0;
+			list_add_tail(&itransfer->list, failed);
+		}
+	}
+}
+
+/* complete the transfers collected by stream_dispatch_locked() */
+static void stream_complete_failed(struct list_head *failed)
+{
+	struct usbi_transfer *itransfer, *tmp;
+
+	list_for_each_entry_safe(itransfer, tmp, failed, list, struct usbi_transfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		list_del(&itransfer->list);
+		stream_release_transfer(itransfer);
+		if (transfer->callback)
+			transfer->callback(transfer);
+	}
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_stream_scheduler *sched = itransfer->stream_sched;
+	struct usbi_stream *stream =
+		&sched->streams[itransfer->stream_id - 1];
+	struct list_head failed;
+	uint64_t latency_us = elapsed_since_submit_us(itransfer);
+
+	list_init(&failed);
+
+	usbi_mutex_lock(&sched->lock);
+	stream->in_flight--;
+	sched->in_flight--;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		stream->transfers++;
+		stream->bytes += transfer->actual_length;
+	} else {
+		stream->errors++;
+	}
+	stream->total_latency_us += latency_us;
+	if (latency_us > stream->max_latency_us)
+		stream->max_latency_us = latency_us;
+
+	/* the stream has room again */
+	stream_dispatch_locked(sched, &failed);
+	usbi_mutex_unlock(&sched->lock);
+
+	stream_release_transfer(itransfer);
+	if (transfer->callback)
+		transfer->callback(transfer);
+
+	stream_complete_failed(&failed);
+}
+
+/** \ingroup asyncio
+ * Allocate a stream scheduler for a USB 3 bulk endpoint. The scheduler
+ * allocates bulk streams on the endpoint with libusb_alloc_streams(), and
+ * then takes care of assigning the transfers given to
+ * libusb_stream_submit() to those streams: each transfer goes to the stream
+ * with the fewest transfers in flight, so that all streams are kept busy,
+ * and transfers are queued inside the scheduler while every stream already
+ * has queue_depth of them in flight.
+ *
+ * The streams of an endpoint complete independently of each other, so the
+ * transfers of different streams complete, and have their callbacks
+ * called, in any order. The number of transfers, bytes, errors and the
+ * completion latency of each stream are counted, see
+ * libusb_get_stream_stats().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device, with the interface of the
+ * endpoint claimed
+ * \param endpoint address of a bulk endpoint
+ * \param num_streams number of streams to try to allocate
+ * \param queue_depth maximum number of transfers in flight on each stream
+ * \param sched output location for the newly allocated scheduler. Only
+ * populated on success.
+ * \returns the number of streams allocated, which may be less than
+ * num_streams, on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range or the
+ * endpoint is not a bulk endpoint
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support bulk
+ * streams
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_alloc_stream_scheduler(libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t num_streams, int queue_depth,
+	libusb_stream_scheduler **sched)
+{
+	struct libusb_stream_scheduler *_sched;
+	int type, r;
+
+	if (num_streams == 0 || queue_depth <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	type = usbi_get_endpoint_type(dev_handle->dev, endpoint);
+	if (type < 0)
+		return type;
+	if (type != LIBUSB_TRANSFER_TYPE_BULK)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_sched = calloc(1, sizeof(*_sched));
+	if (!_sched)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = libusb_alloc_streams(dev_handle, num_streams, &endpoint, 1);
+	if (r < 0)
+		goto err_free;
+	if (r == 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_free;
+	}
+
+	_sched->streams = calloc(r, sizeof(*_sched->streams));
+	if (!_sched->streams) {
+		libusb_free_streams(dev_handle, &endpoint, 1);
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free;
+	}
+
+	usbi_mutex_init(&_sched->lock, NULL);
+	list_init(&_sched->queue);
+	_sched->dev_handle = dev_handle;
+	_sched->endpoint = endpoint;
+	_sched->num_streams = r;
+	_sched->queue_depth = queue_depth;
+
+	usbi_dbg("scheduler for ep %02x with %d streams, depth %d", endpoint,
+		r, queue_depth);
+	*sched = _sched;
+	return r;
+
+err_free:
+	free(_sched);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Submit a bulk transfer through a stream scheduler. The transfer is
+ * started right away on the least busy stream if one has room, and queued
+ * behind the transfers already waiting otherwise. Its stream ID is set by
+ * the scheduler, and can be read with libusb_transfer_get_stream_id() from
+ * the callback.
+ *
+ * The transfer must be filled as for libusb_submit_transfer(), for the
+ * device and endpoint of the scheduler. Its callback is called as usual
+ * once it completes; a queued transfer which could not be started
+ * completes with status \ref LIBUSB_TRANSFER_ERROR, or
+ * \ref LIBUSB_TRANSFER_NO_DEVICE.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler to submit to
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not a bulk transfer
+ * for the device and endpoint of the scheduler
+ * \returns LIBUSB_ERROR_BUSY if the transfer is already owned by a
+ * scheduler, or the scheduler is being freed
+ * \returns the error of libusb_submit_transfer() if the transfer was
+ * started right away and its submission failed
+ */
+int API_EXPORTED libusb_stream_submit(libusb_stream_scheduler *sched,
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct list_head failed;
+	int n, r = 0;
+
+	if (transfer->dev_handle != sched->dev_handle
+			|| transfer->endpoint != sched->endpoint
+			|| transfer->type != LIBUSB_TRANSFER_TYPE_BULK)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	list_init(&failed);
+	usbi_mutex_lock(&sched->lock);
+	if (sched->closing || itransfer->stream_sched) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	itransfer->stream_sched = sched;
+	itransfer->stream_callback = transfer->callback;
+	transfer->callback = stream_transfer_cb;
+
+	/* keep submission order: only bypass the queue while it is empty */
+	if (list_empty(&sched->queue)) {
+		n = stream_pick_locked(sched);
+		if (n >= 0) {
+			r = stream_start_locked(sched, n, itransfer);
+			if (r < 0)
+				stream_release_transfer(itransfer);
+			goto out;
+		}
+	}
+
+	list_add_tail(&itransfer->list, &sched->queue);
+	sched->queued++;
+	stream_dispatch_locked(sched, &failed);
+
+out:
+	usbi_mutex_unlock(&sched->lock);
+	stream_complete_failed(&failed);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Get the counters of one stream of a scheduler, or of all of its streams
+ * together.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler to get the counters of
+ * \param stream_id the stream to get the counters of, from 1 to the number
+ * of streams returned by libusb_alloc_stream_scheduler(), or 0 for the sum
+ * of all streams
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ * \returns LIBUSB_ERROR_NOT_FOUND if there is no such stream
+ */
+int API_EXPORTED libusb_get_stream_stats(libusb_stream_scheduler *sched,
+	uint32_t stream_id, struct libusb_stream_stats *stats)
+{
+	uint64_t completed, total_latency_us = 0;
+	int first, last, i;
+
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (stream_id > (uint32_t)sched->num_streams)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (stream_id) {
+		first = (int)stream_id - 1;
+		last = first + 1;
+	} else {
+		first = 0;
+		last = sched->num_streams;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	usbi_mutex_lock(&sched->lock);
+	for (i = first; i < last; i++) {
+		struct usbi_stream *stream = &sched->streams[i];
+
+		stats->transfers += stream->transfers;
+		stats->bytes += stream->bytes;
+		stats->errors += stream->errors;
+		stats->in_flight += stream->in_flight;
+		total_latency_us += stream->total_latency_us;
+		if (stream->max_latency_us > stats->max_latency_us)
+			stats->max_latency_us = stream->max_latency_us;
+	}
+	if (!stream_id)
+		stats->queued = sched->queued;
+	usbi_mutex_unlock(&sched->lock);
+
+	completed = stats->transfers + stats->errors;
+	if (completed)
+		stats->avg_latency_us = total_latency_us / completed;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Free a stream scheduler allocated with libusb_alloc_stream_scheduler().
+ * The transfers still queued complete with status
+ * \ref LIBUSB_TRANSFER_CANCELLED, the transfers in flight on the endpoint
+ * are cancelled, and this function then handles events until they have
+ * been retired, before freeing the streams of the endpoint.
+ *
+ * It is legal to call this function with a NULL scheduler. In this case,
+ * the function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler to free
+ */
+void API_EXPORTED libusb_free_stream_scheduler(libusb_stream_scheduler *sched)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *itransfer, *tmp;
+	struct list_head cancelled;
+	int in_flight;
+	int r;
+
+	if (!sched)
+		return;
+
+	ctx = HANDLE_CTX(sched->dev_handle);
+	list_init(&cancelled);
+	usbi_mutex_lock(&sched->lock);
+	sched->closing = 1;
+	list_for_each_entry_safe(itransfer, tmp, &sched->queue, list,
+			struct usbi_transfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		list_del(&itransfer->list);
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+		list_add_tail(&itransfer->list, &cancelled);
+	}
+	sched->queued = 0;
+	in_flight = sched->in_flight;
+	usbi_mutex_unlock(&sched->lock);
+
+	stream_complete_failed(&cancelled);
+
+	if (in_flight)
+		libusb_cancel_endpoint_transfers(sched->dev_handle,
+			sched->endpoint);
+	for (;;) {
+		struct timeval tv = { 1, 0 };
+
+		usbi_mutex_lock(&sched->lock);
+		in_flight = sched->in_flight;
+		usbi_mutex_unlock(&sched->lock);
+		if (!in_flight)
+			break;
+
+		if (sched->dev_handle->event_domain)
+			r = libusb_handle_domain_events_timeout_completed(
+				sched->dev_handle->event_domain, &tv, NULL);
+		else
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "failed to retire stream transfers (%d), "
+				"leaking", r);
+			return;
+		}
+	}
+
+	libusb_free_streams(sched->dev_handle, &sched->endpoint, 1);
+	usbi_mutex_destroy(&sched->lock);
+	free(sched->streams);
+	free(sched);
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static void count_timerfd_reprogram(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	ctx->event_stats.timerfd_reprograms++;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+}
+
+static int disarm_timerfd(struct libusb_context *ctx)
+{
+	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
+	int r;
+
+	if (ctx->timerfd_armed == 0)
+		return 0;
+
+	usbi_dbg("");
+	count_timerfd_reprogram(ctx);
+	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
+	if (r < 0) {
+		ctx->timerfd_armed = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+	ctx->timerfd_armed = 0;
+	return 0;
+}
+
+/* rearms the timerfd based on the next upcoming timeout, which is always at
+ * the top of the timeout heap. the timerfd is left alone if it is already
+ * armed for that deadline.
+ * must be called with flying_list locked.
+ * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
+ * or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	struct usbi_transfer *transfer;
+	struct libusb_transfer *ltransfer;
+	struct itimerspec it = { {0, 0}, {0, 0} };
+	int r;
+
+	if (!ctx->timeout_heap_len)
+		return disarm_timerfd(ctx);
+
+	transfer = ctx->timeout_heap[0];
+	if (ctx->timerfd_armed == 1
+			&& timercmp(&ctx->timerfd_deadline, &transfer->timeout, ==))
+		return 1;
+
+	it.it_value.tv_sec = transfer->timeout.tv_sec;
+	it.it_value.tv_nsec = transfer->timeout.tv_usec * 1000;
+	ltransfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer);
+	usbi_dbg("next timeout originally %u%s", ltransfer->timeout,
+		ltransfer->flags & LIBUSB_TRANSFER_TIMEOUT_USEC ? "us" : "ms");
+	count_timerfd_reprogram(ctx);
+	r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+	if (r < 0) {
+		ctx->timerfd_armed = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+	ctx->timerfd_deadline = transfer->timeout;
+	ctx->timerfd_armed = 1;
+	return 1;
+}
+#else
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+#endif
+
+/* get a scatter/gather transfer ready for the backend. the segments are
+ * passed on if the backend takes them and they end on packet boundaries,
+ * otherwise the transfer is given a contiguous copy of them as its buffer.
+ * must be called with the itransfer lock held */
+static int setup_iov_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	const struct libusb_iovec *iov = itransfer->iov;
+	unsigned char *bounce;
+	int i, native, offset = 0;
+
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK
+			&& transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	native = itransfer->iov_max_packet > 0;
+	for (i = 0; native && i < itransfer->num_iov - 1; i++)
+		if (iov[i].len % itransfer->iov_max_packet)
+			native = 0;
+	if (native)
+		return 0;
+
+	bounce = malloc(transfer->length ? transfer->length : 1);
+	if (!bounce)
+		return LIBUSB_ERROR_NO_MEM;
+	if ((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+		for (i = 0; i < itransfer->num_iov; i++) {
+			memcpy(bounce + offset, iov[i].base, iov[i].len);
+			offset += iov[i].len;
+		}
+	}
+	itransfer->iov_bounce = bounce;
+	transfer->buffer = bounce;
+	return 0;
+}
+
+/* undo setup_iov_transfer(), copying the data received into the copy of
+ * the segments back to them if received is non-zero */
+static void complete_iov_transfer(struct usbi_transfer *itransfer,
+	int received)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	const struct libusb_iovec *iov = itransfer->iov;
+	int i, n, offset = 0;
+
+	if (!itransfer->iov_bounce)
+		return;
+
+	if ((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+		for (i = 0; i < itransfer->num_iov && offset < received; i++) {
+			n = MIN(iov[i].len, received - offset);
+			memcpy(iov[i].base, itransfer->iov_bounce + offset, n);
+			offset += n;
+		}
+	}
+	free(itransfer->iov_bounce);
+	itransfer->iov_bounce = NULL;
+	transfer->buffer = (unsigned char *)iov;
+}
+
+/* the class a transfer is submitted with, see libusb_transfer_set_priority() */
+static int transfer_priority(struct usbi_transfer *itransfer)
+{
+	return itransfer->priority_set ? itransfer->priority
+		: USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle->priority;
+}
+
+/* interrupt the poll of a domain's event handler, which then polls again
+ * until the earlier timeout. the handler reads the byte written here itself,
+ * see handle_domain_events(). must be called with the flying_transfers_lock
+ * held */
+static void wake_domain_for_timeout(struct libusb_event_domain *domain,
+	const struct timeval *timeout)
+{
+	unsigned char dummy = 1;
+
+	domain->timeout_armed = *timeout;
+	if (usbi_write(domain->ctrl_pipe[1], &dummy, sizeof(dummy)) <= 0) {
+		usbi_warn(domain->ctx, "internal signalling write failed");
+		return;
+	}
+	domain->timeout_wakes++;
+}
+
+/* submit a transfer with the flying_transfers_lock held. *updated_fds is set
+ * if the backend changed the set of poll fds. */
+static int submit_transfer_locked(struct usbi_transfer *itransfer,
+	int *updated_fds)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_event_domain *domain;
+	int r;
+
+	if ((transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) && (transfer->flags
+			& (LIBUSB_TRANSFER_FREE_TRANSFER | LIBUSB_TRANSFER_QUEUE_COMPLETION)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* libusb_reap_completions() only handles the events of the context, so
+	 * nothing would wait for the completions of a domain's handle */
+	if ((transfer->flags & LIBUSB_TRANSFER_QUEUE_COMPLETION)
+			&& transfer->dev_handle->event_domain)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_trace(ctx, LIBUSB_TRACE_SUBMIT, transfer, transfer->endpoint,
+		transfer->length, 0);
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->transferred = 0;
+	itransfer->flags = 0;
+	itransfer->timeout_idx = -1;
+	itransfer->active_priority = (int8_t)transfer_priority(itransfer);
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+			&itransfer->submitted) < 0) {
+		itransfer->submitted.tv_sec = 0;
+		itransfer->submitted.tv_nsec = 0;
+	}
+	r = calculate_timeout(itransfer);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	if (usbi_transfer_uses_iov(itransfer)) {
+		r = setup_iov_transfer(itransfer);
+		if (r < 0)
+			goto out;
+	}
+
+	r = add_to_flying_list(itransfer);
+	if (r == LIBUSB_SUCCESS) {
+		r = usbi_backend->submit_transfer(itransfer);
+		usbi_trace(ctx, LIBUSB_TRACE_BACKEND_SUBMIT, transfer,
+			transfer->endpoint, transfer->length, r);
+	}
+	if (r != LIBUSB_SUCCESS) {
+		usbi_remove_from_flying_list(itransfer);
+		complete_iov_transfer(itransfer, 0);
+	} else {
+		/* the backend takes care of the timeout itself, so it must not be
+		 * seen by the timeout handling code */
+		if (itransfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT)
+			timeout_heap_remove(ctx, itransfer);
+
+		/* keep a reference to this device */
+		libusb_ref_device(transfer->dev_handle->dev);
+		count_submission(itransfer);
+
+		/* the event handler of a domain does not watch the timerfd, so
+		 * interrupt its poll if it would sleep past the new timeout */
+		domain = transfer->dev_handle->event_domain;
+		if (domain && timerisset(&domain->timeout_armed)
+				&& !(itransfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT)
+				&& timerisset(&itransfer->timeout)
+				&& timercmp(&itransfer->timeout,
+					&domain->timeout_armed, <))
+			wake_domain_for_timeout(domain, &itransfer->timeout);
+	}
+out:
+	if (itransfer->flags & USBI_TRANSFER_UPDATED_FDS)
+		*updated_fds = 1;
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/* the transfer with the earliest pending timeout. must be called with the
+ * flying_transfers_lock held */
+static struct usbi_transfer *first_timeout(struct libusb_context *ctx)
+{
+	return ctx->timeout_heap_len ? ctx->timeout_heap[0] : NULL;
+}
+
+/* rearm the timerfd if the earliest pending timeout is no longer that of
+ * first. must be called with the flying_transfers_lock held */
+static void rearm_timerfd_if_changed(struct libusb_context *ctx,
+	struct usbi_transfer *first)
+{
+	if (usbi_using_timerfd(ctx) && first_timeout(ctx) != first &&
+			arm_timerfd_for_next_timeout(ctx) < 0)
+		usbi_warn(ctx, "failed to arm timerfd (errno %d)", errno);
+}
+
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct usbi_transfer *first;
+	int r;
+	int updated_fds = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	first = first_timeout(ctx);
+	r = submit_transfer_locked(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer),
+		&updated_fds);
+	rearm_timerfd_if_changed(ctx, first);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Submit several transfers at once. The transfers are submitted in array
+ * order, as if by libusb_submit_transfer(), but the internal lock protecting
+ * the set of active transfers is only taken once and timeout tracking is
+ * only updated once for the whole batch, which makes refilling a deep queue
+ * of transfers noticeably cheaper.
+ *
+ * If the transfers are of different priority classes, those of the higher
+ * classes are submitted first, see libusb_transfer_set_priority().
+ *
+ * A failure to submit one transfer does not prevent the following ones from
+ * being submitted. All transfers must belong to devices of the same context.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfers array of transfers to submit
+ * \param num_transfers number of transfers in the array
+ * \param results array of num_transfers integers which receives the result
+ * libusb_submit_transfer() would have returned for each transfer, or NULL
+ * \returns the number of transfers successfully submitted
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the arguments are invalid, in which
+ * case no transfer was submitted
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *first;
+	int i, r, num_submitted = 0;
+	int min_priority = LIBUSB_PRIORITY_HIGH, max_priority = LIBUSB_PRIORITY_LOW;
+	int pass, updated_fds = 0;
+
+	if (!transfers || num_transfers < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (num_transfers == 0)
+		return 0;
+
+	ctx = TRANSFER_CTX(transfers[0]);
+	for (i = 1; i < num_transfers; i++)
+		if (TRANSFER_CTX(transfers[i]) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* with priority classes, the transfers of each class are submitted in
+	 * one pass, from the highest class down, keeping their order within
+	 * the class */
+	for (i = 0; i < num_transfers; i++) {
+		int priority = transfer_priority(
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+
+		if (priority > max_priority)
+			max_priority = priority;
+		if (priority < min_priority)
+			min_priority = priority;
+	}
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	first = first_timeout(ctx);
+	for (pass = max_priority; pass >= min_priority; pass--) {
+		for (i = 0; i < num_transfers; i++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+			if (min_priority != max_priority
+					&& transfer_priority(itransfer) != pass)
+				continue;
+
+			r = submit_transfer_locked(itransfer, &updated_fds);
+			if (r == LIBUSB_SUCCESS)
+				num_submitted++;
+			if (results)
+				results[i] = r;
+		}
+	}
+	rearm_timerfd_if_changed(ctx, first);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	usbi_dbg("submitted %d of %d transfers", num_submitted, num_transfers);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	return num_submitted;
+}
+
+/* move up to max_transfers queued completions to transfers */
+static int pop_completions(struct libusb_context *ctx,
+	struct libusb_transfer **transfers, int max_transfers)
+{
+	int n = 0;
+
+	usbi_mutex_lock(&ctx->completion_queue_lock);
+	while (n < max_transfers && !list_empty(&ctx->completion_queue)) {
+		struct usbi_transfer *itransfer = list_entry(
+			ctx->completion_queue.next, struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		transfers[n++] = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	}
+	ctx->num_queued_completions -= n;
+	usbi_mutex_unlock(&ctx->completion_queue_lock);
+	return n;
+}
+
+/** \ingroup asyncio
+ * Retrieve transfers flagged with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+ * "LIBUSB_TRANSFER_QUEUE_COMPLETION" from the completion queue of a context,
+ * in the order they completed. Their status and actual_length fields are
+ * filled in as they would be when the callback of a transfer is invoked.
+ *
+ * If the queue is empty, this function handles events, or waits for the
+ * thread currently handling them, following the rules of
+ * libusb_handle_events_timeout_completed(), until at least one completion is
+ * queued or the timeout expires. It may be called from any thread; a
+ * single consumer can retrieve many completions per call.
+ *
+ * Only the events of the context are handled, not those of its event
+ * domains, see libusb_alloc_event_domain(). Transfers on handles that belong
+ * to an event domain can therefore not be flagged with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+ * "LIBUSB_TRANSFER_QUEUE_COMPLETION"; libusb_submit_transfer() returns
+ * LIBUSB_ERROR_NOT_SUPPORTED for them.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param transfers array which receives the completed transfers
+ * \param max_transfers size of the array
+ * \param tv the maximum time to wait for a completion, an all zero timeval
+ * struct to only retrieve the completions already queued, or NULL to wait
+ * indefinitely
+ * \returns the number of transfers stored in the array, 0 if the timeout
+ * expired
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the array is invalid
+ * \returns another LIBUSB_ERROR code if event handling failed
+ */
+int API_EXPORTED libusb_reap_completions(libusb_context *ctx,
+	struct libusb_transfer **transfers, int max_transfers, struct timeval *tv)
+{
+	struct timespec now_ts;
+	struct timeval now, deadline, remaining;
+	int n, r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!transfers || max_transfers <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	n = pop_completions(ctx, transfers, max_transfers);
+	if (n || (tv && !timerisset(tv)))
+		return n;
+
+	if (tv) {
+		r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts);
+		if (r < 0)
+			return LIBUSB_ERROR_OTHER;
+		TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+		deadline.tv_sec = now.tv_sec + tv->tv_sec;
+		deadline.tv_usec = now.tv_usec + tv->tv_usec;
+		if (deadline.tv_usec >= 1000000) {
+			deadline.tv_usec -= 1000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	for (;;) {
+		if (tv) {
+			r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts);
+			if (r < 0)
+				return LIBUSB_ERROR_OTHER;
+			TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+			if (!timercmp(&now, &deadline, <))
+				return 0;
+			timersub(&deadline, &now, &remaining);
+		} else {
+			remaining.tv_sec = 60;
+			remaining.tv_usec = 0;
+		}
+
+		r = libusb_handle_events_timeout_completed(ctx, &remaining,
+			&ctx->num_queued_completions);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			return r;
+
+		n = pop_completions(ctx, transfers, max_transfers);
+		if (n)
+			return n;
+	}
+}
+
+/* cancel a transfer through the backend. must be called with the transfer's
+ * lock held */
+static int cancel_transfer_locked(struct usbi_transfer *itransfer)
+{
+	int r;
+
+	r = usbi_backend->cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ITRANSFER_CTX(itransfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	return r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
+ * cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg("");
+	usbi_mutex_lock(&itransfer->lock);
+	r = cancel_transfer_locked(itransfer);
+	usbi_mutex_unlock(&itransfer->lock);
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_CANCEL, transfer,
+		transfer->endpoint, 0, r);
+	return r;
+}
+
+/* bit of an endpoint address in a 32-bit endpoint mask */
+#define ENDPOINT_BIT(ep) \
+	(1UL << (((ep) & LIBUSB_ENDPOINT_ADDRESS_MASK) \
+		| (((ep) & LIBUSB_ENDPOINT_DIR_MASK) ? 16 : 0)))
+
+/* whether the backend may cancel the transfer by aborting its endpoint */
+static int can_abort_endpoint(struct libusb_transfer *transfer)
+{
+	return usbi_backend->abort_endpoint
+		&& (transfer->type == LIBUSB_TRANSFER_TYPE_BULK
+			|| transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT
+			|| transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS);
+}
+
+/* cancel the transfers in flight for the handle, either all of them or only
+ * those on one endpoint. returns the number of transfers being cancelled */
+static int cancel_handle_transfers(struct libusb_device_handle *dev_handle,
+	int all_endpoints, unsigned char endpoint)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer *transfer;
+	unsigned long abort_eps = 0, aborted_eps = 0;
+	int count = 0;
+	int i;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+
+	/* mark the transfers which can go with their whole endpoint first, so
+	 * that their completions are reported as cancellations */
+	list_for_each_entry(itransfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (transfer->dev_handle != dev_handle
+				|| (!all_endpoints && transfer->endpoint != endpoint)
+				|| !can_abort_endpoint(transfer))
+			continue;
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (!(itransfer->flags & (USBI_TRANSFER_CANCELLING
+				| USBI_TRANSFER_DEVICE_DISAPPEARED))) {
+			itransfer->flags |= USBI_TRANSFER_CANCELLING
+				| USBI_TRANSFER_ENDPOINT_ABORT;
+			abort_eps |= ENDPOINT_BIT(transfer->endpoint);
+		}
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+
+	for (i = 0; i < 32 && abort_eps; i++) {
+		unsigned char ep = (unsigned char)((i & 0x0f)
+			| (i & 0x10 ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT));
+		int r;
+
+		if (!(abort_eps & ENDPOINT_BIT(ep)))
+			continue;
+		r = usbi_backend->abort_endpoint(dev_handle, ep);
+		if (r == 0)
+			aborted_eps |= ENDPOINT_BIT(ep);
+		else
+			usbi_dbg("aborting endpoint %02x failed error %d, cancelling its transfers one by one",
+				ep, r);
+	}
+
+	list_for_each_entry(itransfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (transfer->dev_handle != dev_handle
+				|| (!all_endpoints && transfer->endpoint != endpoint))
+			continue;
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->flags & USBI_TRANSFER_ENDPOINT_ABORT) {
+			itransfer->flags &= ~USBI_TRANSFER_ENDPOINT_ABORT;
+			if (aborted_eps & ENDPOINT_BIT(transfer->endpoint)) {
+				count++;
+			} else {
+				/* usual cancellation path below */
+				itransfer->flags &= ~USBI_TRANSFER_CANCELLING;
+			}
+		}
+		if (!(itransfer->flags & (USBI_TRANSFER_CANCELLING
+				| USBI_TRANSFER_DEVICE_DISAPPEARED))) {
+			if (cancel_transfer_locked(itransfer) == 0)
+				count++;
+		}
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return count;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all the transfers in flight on an endpoint of a
+ * device handle. This is equivalent to calling libusb_cancel_transfer() for
+ * each of them, but is cheaper for deep queues: where the operating system
+ * can abort all the I/O on a pipe at once, as WinUSB and Darwin can for
+ * bulk, interrupt and isochronous endpoints, this is done with one request.
+ *
+ * As with libusb_cancel_transfer(), this function returns immediately and
+ * the callback of each cancelled transfer is invoked later with a status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED".
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle the device handle the transfers were submitted on
+ * \param endpoint the address of the endpoint
+ * \returns the number of transfers being cancelled, which does not include
+ * transfers which had already completed or were already being cancelled
+ * \see libusb_cancel_handle_transfers()
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	usbi_dbg("endpoint %02x", endpoint);
+	return cancel_handle_transfers(dev_handle, 0, endpoint);
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all the transfers in flight on a device handle,
+ * on any endpoint. See libusb_cancel_endpoint_transfers() for details.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle the device handle the transfers were submitted on
+ * \returns the number of transfers being cancelled, which does not include
+ * transfers which had already completed or were already being cancelled
+ */
+int API_EXPORTED libusb_cancel_handle_transfers(
+	libusb_device_handle *dev_handle)
+{
+	usbi_dbg("");
+	return cancel_handle_transfers(dev_handle, 1, 0);
+}
+
+/** \ingroup asyncio
+ * Get the time at which an isochronous packet was received or sent during
+ * the last submission of a transfer, for synchronizing audio or video
+ * streams against another clock. The time is taken from the same monotonic
+ * clock that libusb uses for transfer timeouts, and has the granularity of
+ * the unit in which the operating system completes isochronous I/O, which
+ * may span several packets.
+ *
+ * This must be called after the transfer has completed and before it is
+ * submitted again.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer a completed isochronous transfer
+ * \param packet the index of the packet in the transfer
+ * \param tv output location for the time
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous or
+ * the packet index is out of range
+ * \returns LIBUSB_ERROR_NOT_FOUND if no time was recorded for the packet,
+ * e.g. because the transfer was never submitted or is in flight
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not record
+ * packet times
+ */
+int API_EXPORTED libusb_get_iso_packet_time(struct libusb_transfer *transfer,
+	unsigned int packet, struct timeval *tv)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| packet >= (unsigned int) transfer->num_iso_packets)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend->get_iso_packet_time)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->get_iso_packet_time(itransfer, (int) packet, tv);
+}
+
+/** \ingroup asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/** \ingroup asyncio
+ * Set the priority class of the transfers of a device handle, for the
+ * transfers which have no class of their own, see
+ * libusb_transfer_set_priority(). The class is applied when a transfer is
+ * submitted, so transfers already in flight keep their class.
+ *
+ * When the event handler finds several completions at once, it reaps the
+ * handles of higher classes first and invokes the callbacks of transfers of
+ * higher classes first, which also puts their resubmissions ahead of those
+ * done by the callbacks of lower classes. Before each callback of a
+ * \ref LIBUSB_PRIORITY_LOW transfer, the high-priority handles that had
+ * events in the same round are checked again, and their new completions
+ * are handled first. As long as all transfers in flight are of class
+ * \ref LIBUSB_PRIORITY_NORMAL, completions are handled in the order they
+ * are found.
+ *
+ * Completions are ordered by class by the Linux backend only, which does so
+ * by reaping them in batches, as with libusb_set_event_batch_size(). The
+ * settings are accepted on other platforms, but have no effect there
+ * besides the submission order of libusb_submit_transfers().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param priority a \ref libusb_priority class
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the class is invalid
+ */
+int API_EXPORTED libusb_set_handle_priority(libusb_device_handle *dev_handle,
+	int priority)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+
+	if (priority < LIBUSB_PRIORITY_LOW || priority > LIBUSB_PRIORITY_HIGH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("priority %d", priority);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	dev_handle->priority = priority;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Set the priority class of a transfer, overriding the class of its device
+ * handle set with libusb_set_handle_priority(). The class is applied the
+ * next time the transfer is submitted, and kept until it is changed again.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer
+ * \param priority a \ref libusb_priority class
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the class is invalid
+ */
+int API_EXPORTED libusb_transfer_set_priority(struct libusb_transfer *transfer,
+	int priority)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (priority < LIBUSB_PRIORITY_LOW || priority > LIBUSB_PRIORITY_HIGH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	itransfer->priority = (int8_t)priority;
+	itransfer->priority_set = 1;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Get the priority class a transfer is submitted with: its own class if one
+ * was set with libusb_transfer_set_priority(), otherwise the class of its
+ * device handle, or \ref LIBUSB_PRIORITY_NORMAL if it has no handle yet.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer
+ * \returns a \ref libusb_priority class
+ */
+int API_EXPORTED libusb_transfer_get_priority(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (!itransfer->priority_set && !transfer->dev_handle)
+		return LIBUSB_PRIORITY_NORMAL;
+	return transfer_priority(itransfer);
+}
+
+/** \ingroup asyncio
+ * Populate the required \ref libusb_transfer fields for a bulk transfer
+ * whose data is scattered across several buffers, e.g. a protocol header,
+ * a payload and a trailer, so that they need not be copied into a single
+ * buffer first. The segments are sent, or filled, in array order as one
+ * transfer. Set the type field afterwards to use the segments for an
+ * interrupt transfer.
+ *
+ * The array of segments and the buffers must remain valid until the
+ * transfer completed. The transfer's buffer field points at the array, and
+ * its length field is set to the total length of the segments. The
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag cannot be used with such a transfer.
+ * Filling the transfer with another helper function turns it back into an
+ * ordinary transfer.
+ *
+ * On Linux, each segment is handed to the kernel as it is, as long as the
+ * length of every segment but the last one is a multiple of the maximum
+ * packet size of the endpoint; segment boundaries then fall on packet
+ * boundaries, as they would with a single buffer. Otherwise, and on other
+ * platforms, the segments are copied to and from a temporary contiguous
+ * buffer.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param iov array of segments
+ * \param num_iov number of segments
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if there are no segments or a segment
+ * length is negative
+ * \returns LIBUSB_ERROR_OVERFLOW if the total length does not fit a transfer
+ */
+int API_EXPORTED libusb_fill_bulk_transfer_iov(struct libusb_transfer *transfer,
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	const struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int i, length = 0;
+
+	if (!iov || num_iov <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < num_iov; i++) {
+		if (iov[i].len < 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (iov[i].len > INT_MAX - length)
+			return LIBUSB_ERROR_OVERFLOW;
+		length += iov[i].len;
+	}
+
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	transfer->timeout = timeout;
+	transfer->buffer = (unsigned char *)iov;
+	transfer->length = length;
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+
+	itransfer->iov = iov;
+	itransfer->num_iov = num_iov;
+	itransfer->iov_max_packet = 0;
+	if (usbi_backend->caps & USBI_CAP_BULK_IOV) {
+		int r = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+		if (r > 0)
+			itransfer->iov_max_packet = r;
+	}
+	return 0;
+}
+
+/* resubmit a LIBUSB_TRANSFER_AUTO_RESUBMIT transfer after its callback. the
+ * timerfd is only touched if the earliest deadline changed, which is not
+ * the case when the transfer has no timeout or is not the next to expire */
+static int resubmit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int updated_fds = 0;
+	int r;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = submit_transfer_locked(itransfer, &updated_fds);
+	if (usbi_using_timerfd(ctx) && arm_timerfd_for_next_timeout(ctx) < 0)
+		usbi_warn(ctx, "failed to arm timerfd (errno %d)", errno);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	return r;
+}
+
+/* call the callback of a completed transfer, which may free it */
+static void invoke_callback(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	unsigned char endpoint = transfer->endpoint;
+
+	usbi_trace(ctx, LIBUSB_TRACE_CALLBACK_ENTER, transfer, endpoint,
+		transfer->actual_length, transfer->status);
+	transfer->callback(transfer);
+	usbi_trace(ctx, LIBUSB_TRACE_CALLBACK_EXIT, transfer, endpoint, 0, 0);
+}
+
+/* invoke the callback of a completed transfer, then resubmit or free the
+ * transfer as its flags ask and wake up event waiters. the transfer must
+ * not be used afterwards */
+static void finish_completion(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, int resubmit)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	uint8_t flags = transfer->flags;
+	int r;
+
+	if (resubmit) {
+		/* the transfer may not be freed by its callback */
+		if (transfer->callback)
+			invoke_callback(ctx, transfer);
+		if ((transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+				&& transfer->dev_handle) {
+			r = resubmit_transfer(itransfer);
+			if (r < 0) {
+				usbi_dbg("resubmitting transfer %p failed with error %d",
+					transfer, r);
+				transfer->status = r == LIBUSB_ERROR_NO_DEVICE ?
+					LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+				transfer->actual_length = 0;
+				if (transfer->callback)
+					invoke_callback(ctx, transfer);
+			}
+		} else if (usbi_using_timerfd(ctx)) {
+			/* the callback stopped resubmission, so do the rearming
+			 * which usbi_handle_transfer_completion() left to
+			 * resubmit_transfer() */
+			usbi_mutex_lock(&ctx->flying_transfers_lock);
+			if (arm_timerfd_for_next_timeout(ctx) < 0)
+				usbi_warn(ctx, "failed to arm timerfd (errno %d)",
+					errno);
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		}
+	} else {
+		usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+		if (transfer->callback)
+			invoke_callback(ctx, transfer);
+		/* transfer might have been freed by the above call, do not use
+		 * from this point. */
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+	}
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	libusb_unref_device(handle->dev);
+}
+
+/* hand a completed transfer flagged with LIBUSB_TRANSFER_DEFER_CALLBACK to
+ * the callback workers, through the queue of its endpoint. returns 1 if it
+ * was queued, 0 if no workers are running or the handle is being closed */
+static int defer_callback(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, int resubmit)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct usbi_callback_queue *queue;
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	if (!ctx->callback_workers || handle->callbacks_closing) {
+		usbi_mutex_unlock(&ctx->callback_workers_lock);
+		return 0;
+	}
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (resubmit)
+		itransfer->flags |= USBI_TRANSFER_DEFERRED_RESUBMIT;
+	else
+		itransfer->flags &= ~USBI_TRANSFER_DEFERRED_RESUBMIT;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	/* the transfer left the flying list, so its list entry is free */
+	queue = &handle->callback_queues[usbi_ep_stats_index(transfer->endpoint)];
+	list_add_tail(&itransfer->list, &queue->transfers);
+	handle->deferred_callbacks++;
+	if (!queue->busy) {
+		queue->busy = 1;
+		list_add_tail(&queue->list, &ctx->ready_callback_queues);
+		usbi_cond_signal(&ctx->callback_workers_cond);
+	}
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+	return 1;
+}
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
+ * after calling this function, and you should free all backend-specific
+ * data before calling it.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	int resubmit;
+	int r = 0;
+
+	/* a transfer which is about to be resubmitted leaves the rearming of
+	 * the timerfd to resubmit_transfer(), which often finds nothing to do.
+	 * otherwise the timerfd only needs rearming if this transfer owned the
+	 * earliest pending timeout */
+	resubmit = status == LIBUSB_TRANSFER_COMPLETED
+		&& (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT);
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (usbi_remove_from_flying_list(itransfer) && usbi_using_timerfd(ctx)
+			&& !resubmit)
+		r = arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	complete_iov_transfer(itransfer, itransfer->transferred);
+	if (usbi_using_timerfd(ctx) && (r < 0))
+		return r;
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	if (handle)
+		count_completion(itransfer, status);
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	if (transfer->flags & LIBUSB_TRANSFER_QUEUE_COMPLETION) {
+		/* the transfer left the flying list above, so its list entry is
+		 * free to link it into the completion queue */
+		usbi_dbg("queueing completion of transfer %p", transfer);
+		usbi_mutex_lock(&ctx->completion_queue_lock);
+		list_add_tail(&itransfer->list, &ctx->completion_queue);
+		ctx->num_queued_completions++;
+		usbi_mutex_unlock(&ctx->completion_queue_lock);
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		libusb_unref_device(handle->dev);
+		return 0;
+	}
+
+	if ((transfer->flags & LIBUSB_TRANSFER_DEFER_CALLBACK) && transfer->callback
+			&& defer_callback(ctx, itransfer, resubmit)) {
+		usbi_dbg("deferred callback of transfer %p", transfer);
+		return 0;
+	}
+
+	finish_completion(ctx, itransfer, resubmit);
+	return 0;
+}
+
+/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
+ * that were asynchronously cancelled. The same concerns w.r.t. freeing of
+ * transfers exist here.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+{
+	/* if the URB was cancelled due to timeout, report timeout to the user */
+	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		usbi_dbg("detected timeout cancellation");
+		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
+	}
+
+	/* otherwise its a normal async cancel */
+	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
+}
+
+/** \ingroup poll
+ * Attempt to acquire the event handling lock. This lock is used to ensure that
+ * only one thread is monitoring libusb event sources at any one time.
+ *
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
+ *
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 if the lock was obtained successfully
+ * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
+{
+	int r;
+	unsigned int ru;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to modify poll fds? if so, don't let this thread
+	 * start event handling */
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ru = ctx->pollfd_modify;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	if (ru) {
+		usbi_dbg("someone else is modifying poll fds");
+		return 1;
+	}
+
+	r = usbi_mutex_trylock(&ctx->events_lock);
+	if (r)
+		return 1;
+
+	ctx->event_handler_active = 1;
+	return 0;
+}
+
+/** \ingroup poll
+ * Acquire the event handling lock, blocking until successful acquisition if
+ * it is contended. This lock is used to ensure that only one thread is
+ * monitoring libusb event sources at any one time.
+ *
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
+ *
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_lock_events(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->events_lock);
+	ctx->event_handler_active = 1;
+}
+
+/* hand the events lock over to one targeted waiter which still has something
+ * to wait for. the others stay asleep: if the woken waiter loses the race
+ * for the lock, whoever won it wakes up the next one when releasing it.
+ * must be called with the event waiters lock held */
+static void wake_next_event_handler(struct libusb_context *ctx)
+{
+	struct usbi_event_waiter *waiter;
+
+	list_for_each_entry(waiter, &ctx->targeted_waiters, list, struct usbi_event_waiter) {
+		if (!waiter->completed) {
+			usbi_cond_signal(&waiter->cond);
+			break;
+		}
+	}
+}
+
+/** \ingroup poll
+ * Release the lock previously acquired with libusb_try_lock_events() or
+ * libusb_lock_events(). Releasing this lock will wake up any threads blocked
+ * on libusb_wait_for_event().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->event_handler_active = 0;
+	usbi_mutex_unlock(&ctx->events_lock);
+
+	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
+	 * the availability of the events lock when we are modifying pollfds
+	 * (check ctx->pollfd_modify)? */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	wake_next_event_handler(ctx);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/** \ingroup poll
+ * Determine if it is still OK for this thread to be doing event handling.
+ *
+ * Sometimes, libusb needs to temporarily pause all event handlers, and this
+ * is the function you should use before polling file descriptors to see if
+ * this is the case.
+ *
+ * If this function instructs your thread to give up the events lock, you
+ * should just continue the usual logic that is documented in \ref mtasync.
+ * On the next iteration, your thread will fail to obtain the events lock,
+ * and will hence become an event waiter.
+ *
+ * This function should be called while the events lock is held: you don't
+ * need to worry about the results of this function if your thread is not
+ * the current event handler.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 1 if event handling can start or continue
+ * \returns 0 if this thread must give up the events lock
+ * \ref fullstory "Multi-threaded I/O: the full story"
+ */
+int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
+{
+	unsigned int r;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to modify poll fds? if so, don't let this thread
+	 * continue event handling */
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	r = ctx->pollfd_modify;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	if (r) {
+		usbi_dbg("someone else is modifying poll fds");
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/** \ingroup poll
+ * Determine if an active thread is handling events (i.e. if anyone is holding
+ * the event handling lock).
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 1 if a thread is handling events
+ * \returns 0 if there are no threads currently handling events
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
+{
+	unsigned int r;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to modify poll fds? if so, don't let this thread
+	 * start event handling -- indicate that event handling is happening */
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	r = ctx->pollfd_modify;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	if (r) {
+		usbi_dbg("someone else is modifying poll fds");
+		return 1;
+	}
+
+	return ctx->event_handler_active;
+}
+
+/** \ingroup poll
+ * Acquire the event waiters lock. This lock is designed to be obtained under
+ * the situation where you want to be aware when events are completed, but
+ * some other thread is event handling so calling libusb_handle_events() is not
+ * allowed.
+ *
+ * You then obtain this lock, re-check that another thread is still handling
+ * events, then call libusb_wait_for_event().
+ *
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly,
+ * <b>and</b> may potentially be handling events from 2 threads simultaenously.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_lock_event_waiters(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+}
+
+/** \ingroup poll
+ * Release the event waiters lock.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/* wait on cond for at most tv, or indefinitely if tv is NULL. returns 1 if
+ * the timeout was reached */
+static int wait_for_cond(struct libusb_context *ctx, usbi_cond_t *cond,
+	usbi_mutex_t *mutex, struct timeval *tv)
+{
+	struct timespec timeout;
+	int r;
+
+	if (tv == NULL) {
+		usbi_cond_wait(cond, mutex);
+		return 0;
+	}
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_REALTIME, &timeout);
+	if (r < 0) {
+		usbi_err(ctx, "failed to read realtime clock, error %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	timeout.tv_sec += tv->tv_sec;
+	timeout.tv_nsec += tv->tv_usec * 1000;
+	while (timeout.tv_nsec >= 1000000000) {
+		timeout.tv_nsec -= 1000000000;
+		timeout.tv_sec++;
+	}
+
+	r = usbi_cond_timedwait(cond, mutex, &timeout);
+	return (r == ETIMEDOUT);
+}
+
+/** \ingroup poll
+ * Wait for another thread to signal completion of an event. Must be called
+ * with the event waiters lock held, see libusb_lock_event_waiters().
+ *
+ * This function will block until any of the following conditions are met:
+ * -# The timeout expires
+ * -# A transfer completes
+ * -# A thread releases the event handling lock through libusb_unlock_events()
+ *
+ * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
+ * the callback for the transfer has completed. Condition 3 is important
+ * because it means that the thread that was previously handling events is no
+ * longer doing so, so if any events are to complete, another thread needs to
+ * step up and start event handling.
+ *
+ * This function releases the event waiters lock before putting your thread
+ * to sleep, and reacquires the lock as it is being woken up.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv maximum timeout for this blocking function. A NULL value
+ * indicates unlimited timeout.
+ * \returns 0 after a transfer completes or another thread stops event handling
+ * \returns 1 if the timeout expired
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+{
+	USBI_GET_CONTEXT(ctx);
+	return wait_for_cond(ctx, &ctx->event_waiters_cond,
+		&ctx->event_waiters_lock, tv);
+}
+
+void usbi_init_event_waiter(struct usbi_event_waiter *waiter)
+{
+	usbi_cond_init(&waiter->cond, NULL);
+	waiter->completed = 0;
+}
+
+void usbi_destroy_event_waiter(struct usbi_event_waiter *waiter)
+{
+	usbi_cond_destroy(&waiter->cond);
+}
+
+/* mark the waiter's event as having happened and wake up that waiter only.
+ * the waiter may return as soon as the event waiters lock is released, so
+ * the caller must not touch it afterwards */
+void usbi_signal_event_waiter(struct libusb_context *ctx,
+	struct usbi_event_waiter *waiter)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	waiter->completed = 1;
+	usbi_cond_signal(&waiter->cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+static void handle_timeout(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_TIMEOUT, transfer,
+		transfer->endpoint, 0, 0);
+	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+	r = libusb_cancel_transfer(transfer);
+	if (r < 0)
+		usbi_warn(TRANSFER_CTX(transfer),
+			"async cancel failed %d errno=%d", r, errno);
+}
+
+static int handle_timeouts_locked(struct libusb_context *ctx)
+{
+	int r;
+	struct timespec systime_ts;
+	struct timeval systime;
+	struct usbi_transfer *transfer;
+
+	if (!ctx->timeout_heap_len)
+		return 0;
+
+	/* get current time */
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	if (r < 0)
+		return r;
+
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	/* pop expired timeouts off the top of the heap. once handled, a timeout
+	 * leaves the heap, so every entry still in it is pending */
+	while (ctx->timeout_heap_len) {
+		transfer = ctx->timeout_heap[0];
+
+		/* if transfer has non-expired timeout, nothing more to do */
+		if (timercmp(&transfer->timeout, &systime, >))
+			return 0;
+
+		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(ctx, transfer);
+		handle_timeout(transfer);
+	}
+	return 0;
+}
+
+static int handle_timeouts(struct libusb_context *ctx)
+{
+	int r;
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = handle_timeouts_locked(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int handle_timerfd_trigger(struct libusb_context *ctx)
+{
+	int r;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+
+	/* the timerfd stays readable until it is reprogrammed, even if the
+	 * next deadline happens to be the one that just expired */
+	ctx->timerfd_armed = -1;
+
+	/* process the timeout that just happened */
+	r = handle_timeouts_locked(ctx);
+	if (r < 0)
+		goto out;
+
+	/* arm for next timeout*/
+	r = arm_timerfd_for_next_timeout(ctx);
+
+out:
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+#endif
+
+/* refresh ctx->poll_fds if the set of poll fds has changed since the last
+ * time. must be called with the events lock held. */
+static int update_poll_fds(struct libusb_context *ctx)
+{
+	struct usbi_pollfd *ipollfd;
+	unsigned int size;
+	unsigned int i = 0;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (!ctx->pollfds_modified)
+		goto out;
+
+	/* with epoll, poll_fds only holds the fds with pending events, but the
+	 * ctrl pipe, hotplug pipe and timerfd keep their usual slots at the
+	 * front even when idle, so leave room for them */
+	size = ctx->pollfds_cnt;
+	if (usbi_using_epoll(ctx))
+		size += 3;
+
+	if (size > ctx->poll_fds_size) {
+		struct pollfd *fds = realloc(ctx->poll_fds, size * sizeof(*fds));
+		if (!fds) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		ctx->poll_fds = fds;
+		ctx->poll_fds_size = size;
+	}
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		if (ctx->pollfds_cnt > ctx->epoll_events_size) {
+			struct epoll_event *events = realloc(ctx->epoll_events,
+				ctx->pollfds_cnt * sizeof(*events));
+			if (!events) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto out;
+			}
+			ctx->epoll_events = events;
+			ctx->epoll_events_size = ctx->pollfds_cnt;
+		}
+		ctx->pollfds_modified = 0;
+		goto out;
+	}
+#endif
+
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
+		struct libusb_pollfd *pollfd = &ipollfd->pollfd;
+		if (ipollfd->domain)
+			continue;
+		ctx->poll_fds[i].fd = pollfd->fd;
+		ctx->poll_fds[i].events = pollfd->events;
+		i++;
+	}
+	ctx->poll_fds_cnt = i;
+	ctx->pollfds_modified = 0;
+
+out:
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	return r;
+}
+
+#if !defined(HAVE_PPOLL) || defined(USBI_EPOLL_AVAILABLE)
+/* the poll timeout in milliseconds, rounded up so that the deadline is not
+ * missed */
+static int timeval_to_poll_ms(const struct timeval *tv)
+{
+	int timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+
+	if (tv->tv_usec % 1000)
+		timeout_ms++;
+	return timeout_ms;
+}
+#endif
+
+/* poll() for at most tv, with the full resolution of tv where ppoll() is
+ * available so that sub-millisecond timeouts are honoured */
+static int poll_fds_timeout(struct pollfd *fds, POLL_NFDS_TYPE nfds,
+	const struct timeval *tv)
+{
+#ifdef HAVE_PPOLL
+	struct timespec ts;
+
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+	return ppoll(fds, nfds, &ts, NULL);
+#else
+	return usbi_poll(fds, nfds, timeval_to_poll_ms(tv));
+#endif
+}
+
+#ifdef USBI_EPOLL_AVAILABLE
+#ifdef HAVE_EPOLL_PWAIT2
+/* set once epoll_pwait2() turns out not to be implemented by the kernel */
+static int epoll_pwait2_unsupported = 0;
+#endif
+
+/* epoll_wait() for at most tv, using epoll_pwait2() where available for the
+ * same reason as poll_fds_timeout() */
+static int epoll_wait_timeout(struct libusb_context *ctx,
+	const struct timeval *tv)
+{
+#ifdef HAVE_EPOLL_PWAIT2
+	if (!epoll_pwait2_unsupported) {
+		struct timespec ts;
+		int r;
+
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		r = epoll_pwait2(ctx->epoll_fd, ctx->epoll_events,
+			(int)ctx->epoll_events_size, &ts, NULL);
+		if (r >= 0 || errno != ENOSYS)
+			return r;
+		usbi_dbg("epoll_pwait2 not supported, using epoll_wait");
+		epoll_pwait2_unsupported = 1;
+	}
+#endif
+	return epoll_wait(ctx->epoll_fd, ctx->epoll_events,
+		(int)ctx->epoll_events_size, timeval_to_poll_ms(tv));
+}
+
+/* epoll flavour of wait_for_fds(). the fds reported by epoll_wait() are laid
+ * out in poll_fds the same way poll() would report them: ctrl pipe first,
+ * hotplug pipe second, timerfd third, followed by any other fds with
+ * events. epoll event bits have the same values as their poll counterparts,
+ * so they are passed on unchanged. */
+static int epoll_wait_for_fds(struct libusb_context *ctx,
+	const struct timeval *tv, POLL_NFDS_TYPE *nfds)
+{
+	struct pollfd *fds = ctx->poll_fds;
+	unsigned int num_fds = 2;
+	int r, i;
+
+	fds[0].fd = ctx->ctrl_pipe[0];
+	fds[1].fd = ctx->hotplug_pipe[0];
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (usbi_using_timerfd(ctx))
+		fds[num_fds++].fd = ctx->timerfd;
+#endif
+	for (i = 0; i < (int)num_fds; i++) {
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+
+	r = epoll_wait_timeout(ctx, tv);
+	for (i = 0; i < r; i++) {
+		struct usbi_pollfd *ipollfd = ctx->epoll_events[i].data.ptr;
+		int fd = ipollfd->pollfd.fd;
+		short revents = (short)ctx->epoll_events[i].events;
+
+		if (fd == ctx->ctrl_pipe[0]) {
+			fds[0].revents = revents;
+		} else if (fd == ctx->hotplug_pipe[0]) {
+			fds[1].revents = revents;
+#ifdef USBI_TIMERFD_AVAILABLE
+		} else if (usbi_using_timerfd(ctx) && fd == ctx->timerfd) {
+			fds[2].revents = revents;
+#endif
+		} else {
+			fds[num_fds].fd = fd;
+			fds[num_fds].events = ipollfd->pollfd.events;
+			fds[num_fds].revents = revents;
+			num_fds++;
+		}
+	}
+
+	*nfds = (POLL_NFDS_TYPE)num_fds;
+	return r;
+}
+#endif
+
+/* wait up to tv for events on the poll fds. returns the same as poll():
+ * the number of fds with events, 0 on timeout or -1 with errno set.
+ * on return, the first *nfds entries of ctx->poll_fds describe the fds to
+ * be processed. */
+static int wait_for_fds(struct libusb_context *ctx, const struct timeval *tv,
+	POLL_NFDS_TYPE *nfds)
+{
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		return epoll_wait_for_fds(ctx, tv, nfds);
+#endif
+
+	*nfds = (POLL_NFDS_TYPE)ctx->poll_fds_cnt;
+	return poll_fds_timeout(ctx->poll_fds, *nfds, tv);
+}
+
+/* the most handles which are busy-polled at once */
+#define MAX_BUSY_POLL_HANDLES	8
+
+static void busy_poll_now(struct timeval *tv)
+{
+	struct timespec ts;
+
+	usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts);
+	TIMESPEC_TO_TIMEVAL(tv, &ts);
+}
+
+/* spin on the handles with a busy-poll budget which have transfers in
+ * flight, until one of them completes a transfer or the largest of their
+ * budgets runs out. the time spent is taken off the poll timeout tv.
+ * returns 1 if a completion was handled, 0 if not, or an error code */
+static int busy_poll(struct libusb_context *ctx, struct timeval *tv)
+{
+	struct libusb_device_handle *handles[MAX_BUSY_POLL_HANDLES];
+	struct usbi_transfer *itransfer;
+	struct timeval start, now, limit, deadline, spent;
+	unsigned int budget = 0;
+	int num_handles = 0;
+	int i, r;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	list_for_each_entry(itransfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		struct libusb_device_handle *handle =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+
+		/* handles in an event domain are reaped by its own thread */
+		if (!handle || !handle->busy_poll_budget || handle->event_domain)
+			continue;
+		for (i = 0; i < num_handles; i++)
+			if (handles[i] == handle)
+				break;
+		if (i < num_handles)
+			continue;
+
+		handles[num_handles++] = handle;
+		if (handle->busy_poll_budget > budget)
+			budget = handle->busy_poll_budget;
+		if (num_handles == MAX_BUSY_POLL_HANDLES)
+			break;
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	if (!num_handles)
+		return 0;
+
+	/* spin for the budget or until the poll timeout, which is already
+	 * capped at the next transfer timeout, whichever is shorter */
+	limit.tv_sec = budget / 1000000;
+	limit.tv_usec = budget % 1000000;
+	if (timercmp(tv, &limit, <))
+		limit = *tv;
+	busy_poll_now(&start);
+	timeradd(&start, &limit, &deadline);
+
+	do {
+		for (i = 0; i < num_handles; i++) {
+			r = usbi_backend->busy_poll(handles[i]);
+			if (r == 1) {
+				usbi_mutex_lock(&ctx->event_stats_lock);
+				ctx->event_stats.busy_poll_hits++;
+				usbi_mutex_unlock(&ctx->event_stats_lock);
+				return 1;
+			} else if (r == LIBUSB_ERROR_NO_DEVICE) {
+				/* leave the disconnect to poll() */
+				return 0;
+			} else if (r < 0) {
+				return r;
+			}
+		}
+		busy_poll_now(&now);
+	} while (timercmp(&now, &deadline, <));
+
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	ctx->event_stats.busy_poll_sleeps++;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+
+	timersub(&now, &start, &spent);
+	if (timercmp(&spent, tv, <))
+		timersub(tv, &spent, tv);
+	else
+		timerclear(tv);
+	return 0;
+}
+
+/* interrupt the poll of an event handler by writing a byte to its ctrl pipe
+ * fd, unless one is already pending. the handler reads the byte itself, see
+ * consume_handler_wake(). must be called with ctx->pollfds_lock held */
+static void wake_handler(struct libusb_context *ctx, int *wake, int fd)
+{
+	unsigned char dummy = 1;
+
+	if (*wake)
+		return;
+	if (usbi_write(fd, &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "internal signalling write failed");
+	else
+		*wake = 1;
+}
+
+/* wake the event handler of a handle after one of its deferred callbacks
+ * returned, so that libusb_handle_events_completed() and its domain
+ * counterpart see a flag set by the callback */
+static void wake_for_callback(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	/* a domain detaches its handles under pollfds_lock before it is freed */
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (handle->event_domain)
+		wake_handler(ctx, &handle->event_domain->handler_wake,
+			handle->event_domain->ctrl_pipe[1]);
+	else
+		wake_handler(ctx, &ctx->handler_wake, ctx->ctrl_pipe[1]);
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+}
+
+/* read the byte written by wake_handler(), if there is one */
+static void consume_handler_wake(struct libusb_context *ctx, int *wake,
+	int fd)
+{
+	unsigned char dummy;
+	int pending;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	pending = *wake;
+	*wake = 0;
+	if (pending && usbi_read(fd, &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "internal signalling read failed");
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+}
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+	POLL_NFDS_TYPE nfds = 0;
+	struct pollfd *fds;
+	struct timeval poll_timeout = *tv;
+	int special_event;
+
+	r = update_poll_fds(ctx);
+	if (r < 0)
+		return r;
+	fds = ctx->poll_fds;
+
+	/* the busy-polled handles go first. if one of them had something to
+	 * do, the others just get a chance without waiting */
+	if (ctx->busy_poll_handles && timerisset(&poll_timeout)
+			&& usbi_backend->busy_poll) {
+		r = busy_poll(ctx, &poll_timeout);
+		if (r < 0)
+			return r;
+		else if (r == 1)
+			timerclear(&poll_timeout);
+	}
+
+redo_poll:
+	usbi_dbg("poll() with timeout %ld.%06lds", (long)poll_timeout.tv_sec,
+		(long)poll_timeout.tv_usec);
+	r = wait_for_fds(ctx, &poll_timeout, &nfds);
+	usbi_dbg("poll() returned %d", r);
+	if (r == 0) {
+		return handle_timeouts(ctx);
+	} else if (r == -1 && errno == EINTR) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	} else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	special_event = 0;
+
+	/* fd[0] is always the ctrl pipe */
+	if (fds[0].revents) {
+		/* another thread wanted to interrupt event handling, and it succeeded!
+		 * handle any other events that cropped up at the same time, and
+		 * simply return */
+		usbi_dbg("caught a fish on the control pipe");
+		consume_handler_wake(ctx, &ctx->handler_wake,
+			ctx->ctrl_pipe[0]);
+
+		if (r == 1) {
+			r = 0;
+			goto handled;
+		} else {
+			/* prevent OS backend from trying to handle events on ctrl pipe */
+			fds[0].revents = 0;
+			r--;
+		}
+	}
+
+	/* fd[1] is always the hotplug pipe */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && fds[1].revents) {
+		unsigned char dummy;
+		ssize_t ret;
+
+		usbi_dbg("caught a fish on the hotplug pipe");
+		special_event = 1;
+
+		/* the pipe only signals that the queue became non-empty */
+		ret = usbi_read(ctx->hotplug_pipe[0], &dummy, sizeof(dummy));
+		if (ret != sizeof(dummy)) {
+			usbi_err(ctx, "hotplug pipe read error %d != %u",
+				 ret, sizeof(dummy));
+			r = LIBUSB_ERROR_OTHER;
+			goto handled;
+		}
+
+		/* handle every message queued since, not just one */
+		usbi_hotplug_process(ctx);
+
+		fds[1].revents = 0;
+		if (1 == r--)
+			goto handled;
+	} /* else there shouldn't be anything on this pipe */
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	/* on timerfd configurations, fds[2] is the timerfd */
+	if (usbi_using_timerfd(ctx) && fds[2].revents) {
+		/* timerfd indicates that a timeout has expired */
+		int ret;
+		usbi_dbg("timerfd triggered");
+		special_event = 1;
+
+		ret = handle_timerfd_trigger(ctx);
+		if (ret < 0) {
+			/* return error code */
+			r = ret;
+			goto handled;
+		} else if (r == 1) {
+			/* no more active file descriptors, nothing more to do */
+			r = 0;
+			goto handled;
+		} else {
+			/* more events pending...
+			 * prevent OS backend from trying to handle events on timerfd */
+			fds[2].revents = 0;
+			r--;
+		}
+	}
+#endif
+
+	r = usbi_backend->handle_events(ctx, fds, nfds, r);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+
+handled:
+        if (r == 0 && special_event) {
+                timerclear(&poll_timeout);
+                goto redo_poll;
+        }
+
+	return r;
+}
+
+/* returns the smallest of:
+ *  1. timeout of next URB
+ *  2. user-supplied timeout
+ * returns 1 if there is an already-expired timeout, otherwise returns 0
+ * and populates out
+ */
+static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
+	struct timeval *out)
+{
+	struct timeval timeout;
+	int r = libusb_get_next_timeout(ctx, &timeout);
+	if (r) {
+		/* timeout already expired? */
+		if (!timerisset(&timeout))
+			return 1;
+
+		/* choose the smallest of next URB timeout or user specified timeout */
+		if (timercmp(&timeout, tv, <))
+			*out = timeout;
+		else
+			*out = *tv;
+	} else {
+		*out = *tv;
+	}
+	return 0;
+}
+
+static int handle_events_timeout_completed(struct libusb_context *ctx,
+	struct timeval *tv, int *completed, struct usbi_event_waiter *waiter)
+{
+	int r;
+	struct timeval poll_timeout;
+
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+retry:
+	if (libusb_try_lock_events(ctx) == 0) {
+		if (completed == NULL || !*completed) {
+			/* we obtained the event lock: do our own event handling */
+			usbi_dbg("doing our own event handling");
+			r = handle_events(ctx, &poll_timeout);
+		}
+		libusb_unlock_events(ctx);
+		return r;
+	}
+
+	/* another thread is doing event handling. wait for thread events that
+	 * notify event completion. */
+	libusb_lock_event_waiters(ctx);
+
+	if (completed && *completed)
+		goto already_done;
+
+	if (!libusb_event_handler_active(ctx)) {
+		/* we hit a race: whoever was event handling earlier finished in the
+		 * time it took us to reach this point. try the cycle again. */
+		libusb_unlock_event_waiters(ctx);
+		usbi_dbg("event handler was active but went away, retrying");
+		goto retry;
+	}
+
+	usbi_dbg("another thread is doing event handling");
+	if (waiter) {
+		list_add_tail(&waiter->list, &ctx->targeted_waiters);
+		r = wait_for_cond(ctx, &waiter->cond, &ctx->event_waiters_lock,
+			&poll_timeout);
+		list_del(&waiter->list);
+	} else {
+		r = libusb_wait_for_event(ctx, &poll_timeout);
+	}
+
+already_done:
+	libusb_unlock_event_waiters(ctx);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
+}
+
+/** \ingroup poll
+ * Handle any pending events.
+ *
+ * libusb determines "pending events" by checking if any timeouts have expired
+ * and by checking the set of file descriptors for activity.
+ *
+ * If a zero timeval is passed, this function will handle any already-pending
+ * events and then immediately return in non-blocking style.
+ *
+ * If a non-zero timeval is passed and no events are currently pending, this
+ * function will block waiting for events to handle up until the specified
+ * timeout. If an event arrives or a signal is raised, this function will
+ * return early.
+ *
+ * If the parameter completed is not NULL then <em>after obtaining the event
+ * handling lock</em> this function will return immediately if the integer
+ * pointed to is not 0. This allows for race free waiting for the completion
+ * of a specific transfer.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
+	struct timeval *tv, int *completed)
+{
+	USBI_GET_CONTEXT(ctx);
+	return handle_events_timeout_completed(ctx, tv, completed, NULL);
+}
+
+/* like libusb_handle_events_timeout_completed() with the waiter's completed
+ * flag, but while another thread is handling events, sleep until this
+ * waiter is signalled instead of waking up on every event */
+int usbi_handle_events_for_waiter(struct libusb_context *ctx,
+	struct timeval *tv, struct usbi_event_waiter *waiter)
+{
+	return handle_events_timeout_completed(ctx, tv, &waiter->completed,
+		waiter);
+}
+
+/** \ingroup poll
+ * Handle any pending events
+ *
+ * Like libusb_handle_events_timeout_completed(), but without the completed
+ * parameter, calling this function is equivalent to calling
+ * libusb_handle_events_timeout_completed() with a NULL completed parameter.
+ *
+ * This function is kept primarily for backwards compatibility.
+ * All new code should call libusb_handle_events_completed() or
+ * libusb_handle_events_timeout_completed() to avoid race conditions.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_handle_events_timeout(libusb_context *ctx,
+	struct timeval *tv)
+{
+	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+/** \ingroup poll
+ * Handle any pending events in blocking mode. There is currently a timeout
+ * hardcoded at 60 seconds but we plan to make it unlimited in future. For
+ * finer control over whether this function is blocking or non-blocking, or
+ * for control over the timeout, use libusb_handle_events_timeout_completed()
+ * instead.
+ *
+ * This function is kept primarily for backwards compatibility.
+ * All new code should call libusb_handle_events_completed() or
+ * libusb_handle_events_timeout_completed() to avoid race conditions.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_handle_events(libusb_context *ctx)
+{
+	struct timeval tv;
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+/** \ingroup poll
+ * Handle any pending events in blocking mode.
+ *
+ * Like libusb_handle_events(), with the addition of a completed parameter
+ * to allow for race free waiting for the completion of a specific transfer.
+ *
+ * See libusb_handle_events_timeout_completed() for details on the completed
+ * parameter.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
+	int *completed)
+{
+	struct timeval tv;
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+/** \ingroup poll
+ * Handle any pending events by polling file descriptors, without checking if
+ * any other threads are already doing so. Must be called with the event lock
+ * held, see libusb_lock_events().
+ *
+ * This function is designed to be called under the situation where you have
+ * taken the event lock and are calling poll()/select() directly on libusb's
+ * file descriptors (as opposed to using libusb_handle_events() or similar).
+ * You detect events on libusb's descriptors, so you then call this function
+ * with a zero timeout value (while still holding the event lock).
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or zero for
+ * non-blocking mode
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
+	struct timeval *tv)
+{
+	int r;
+	struct timeval poll_timeout;
+
+	USBI_GET_CONTEXT(ctx);
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+	return handle_events(ctx, &poll_timeout);
+}
+
+/** \ingroup poll
+ * Determines whether your application must apply special timing considerations
+ * when monitoring libusb's file descriptors.
+ *
+ * This function is only useful for applications which retrieve and poll
+ * libusb's file descriptors in their own main loop (\ref pollmain).
+ *
+ * Ordinarily, libusb's event handler needs to be called into at specific
+ * moments in time (in addition to times when there is activity on the file
+ * descriptor set). The usual approach is to use libusb_get_next_timeout()
+ * to learn about when the next timeout occurs, and to adjust your
+ * poll()/select() timeout accordingly so that you can make a call into the
+ * library at that time.
+ *
+ * Some platforms supported by libusb do not come with this baggage - any
+ * events relevant to timing will be represented by activity on the file
+ * descriptor set, and libusb_get_next_timeout() will always return 0.
+ * This function allows you to detect whether you are running on such a
+ * platform.
+ *
+ * Since v1.0.5.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 if you must call into libusb at times determined by
+ * libusb_get_next_timeout(), or 1 if all timeout events are handled internally
+ * or through regular activity on the file descriptors.
+ * \ref pollmain "Polling libusb file descriptors for event handling"
+ */
+int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
+{
+#if defined(USBI_TIMERFD_AVAILABLE)
+	USBI_GET_CONTEXT(ctx);
+	return usbi_using_timerfd(ctx);
+#else
+	(void)ctx;
+	return 0;
+#endif
+}
+
+/* like libusb_get_next_timeout(), but regardless of whether timeouts are
+ * otherwise signalled by the timerfd */
+static int get_pending_timeout(struct libusb_context *ctx, struct timeval *tv)
+{
+	struct timespec cur_ts;
+	struct timeval cur_tv;
+	struct timeval next_timeout;
+	int r;
+
+	/* the next transfer which hasn't already been processed as timed out is
+	 * at the top of the timeout heap */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (!ctx->timeout_heap_len) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
+		return 0;
+	}
+	next_timeout = ctx->timeout_heap[0]->timeout;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
+	if (r < 0) {
+		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+		return 0;
+	}
+	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
+
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
+		usbi_dbg("first timeout already expired");
+		timerclear(tv);
+	} else {
+		timersub(&next_timeout, &cur_tv, tv);
+		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
+	}
+
+	return 1;
+}
+
+/** \ingroup poll
+ * Determine the next internal timeout that libusb needs to handle. You only
+ * need to use this function if you are calling poll() or select() or similar
+ * on libusb's file descriptors yourself - you do not need to use it if you
+ * are calling libusb_handle_events() or a variant directly.
+ *
+ * You should call this function in your main loop in order to determine how
+ * long to wait for select() or poll() to return results. libusb needs to be
+ * called into at this timeout, so you should use it as an upper bound on
+ * your select() or poll() call.
+ *
+ * When the timeout has expired, call into libusb_handle_events_timeout()
+ * (perhaps in non-blocking mode) so that libusb can handle the timeout.
+ *
+ * This function may return 1 (success) and an all-zero timeval. If this is
+ * the case, it indicates that libusb has a timeout that has already expired
+ * so you should call libusb_handle_events_timeout() or similar immediately.
+ * A return code of 0 indicates that there are no pending timeouts.
+ *
+ * On some platforms, this function will always returns 0 (no pending
+ * timeouts). See \ref polltime.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv output location for a relative time against the current
+ * clock in which libusb must be called into in order to process timeout events
+ * \returns 0 if there are no pending timeouts, 1 if a timeout was returned,
+ * or LIBUSB_ERROR_OTHER on failure
+ */
+int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
+	struct timeval *tv)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (usbi_using_timerfd(ctx))
+		return 0;
+
+	return get_pending_timeout(ctx, tv);
+}
+
+/** \ingroup poll
+ * Register notification functions for file descriptor additions/removals.
+ * These functions will be invoked for every new or removed file descriptor
+ * that libusb uses as an event source.
+ *
+ * To remove notifiers, pass NULL values for the function pointers.
+ *
+ * Note that file descriptors may have been added even before you register
+ * these notifiers (e.g. at libusb_init() time).
+ *
+ * Additionally, note that the removal notifier may be called during
+ * libusb_exit() (e.g. when it is closing file descriptors that were opened
+ * and added to the poll set at libusb_init() time). If you don't want this,
+ * remove the notifiers immediately before calling libusb_exit().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param added_cb pointer to function for addition notifications
+ * \param removed_cb pointer to function for removal notifications
+ * \param user_data User data to be passed back to callbacks (useful for
+ * passing context information)
+ */
+void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
+	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+	void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->fd_added_cb = added_cb;
+	ctx->fd_removed_cb = removed_cb;
+	ctx->fd_cb_user_data = user_data;
+}
+
+/** \ingroup poll
+ * Retrieve a single file descriptor that aggregates every event source of the
+ * context, see \ref eventfd. The descriptor stays the same until
+ * libusb_exit() and must not be read from, written to or closed.
+ *
+ * Event sources of event domains, see libusb_alloc_event_domain(), are not
+ * covered by this descriptor.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor, which becomes readable whenever
+ * libusb_process_ready() has work to do
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot provide one
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+#ifdef USBI_EPOLL_AVAILABLE
+	/* without the timerfd, timeouts could not wake the fd up */
+	if (usbi_using_epoll(ctx) && usbi_using_timerfd(ctx))
+		return ctx->epoll_fd;
+#endif
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup poll
+ * Handle all events pending on the context without blocking, typically
+ * after libusb_get_event_fd() has been reported readable. Events keep being
+ * handled until the event file descriptor is no longer readable, so an
+ * edge-triggered reactor does not miss events that arrive meanwhile.
+ *
+ * This function never waits for the event handling lock. If another thread
+ * is handling events of the context at the time, it returns
+ * LIBUSB_ERROR_BUSY and leaves the pending events to that thread. An
+ * edge-triggered reactor which shares the context with other event handling
+ * threads should then call it again once they are done, as the event file
+ * descriptor may not become readable again until they are.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if another thread is handling events
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if libusb_get_event_fd() is not
+ * supported
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_process_ready(libusb_context *ctx)
+{
+#ifdef USBI_EPOLL_AVAILABLE
+	struct timeval zero_tv = { 0, 0 };
+	struct pollfd pfd;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!usbi_using_epoll(ctx) || !usbi_using_timerfd(ctx))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (libusb_try_lock_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	pfd.fd = ctx->epoll_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		r = handle_events(ctx, &zero_tv);
+		libusb_unlock_events(ctx);
+		if (r < 0)
+			return r;
+
+		pfd.revents = 0;
+		r = poll(&pfd, 1, 0);
+		if (r <= 0)
+			break;
+
+		/* the lock is dropped after each pass so that a thread waiting to
+		 * modify the poll fds gets its turn. if another thread takes over
+		 * meanwhile, what is left is its to handle */
+		if (libusb_try_lock_events(ctx))
+			return 0;
+	}
+
+	if (r < 0 && errno != EINTR) {
+		usbi_err(ctx, "poll failed errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+	return 0;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* Add a file descriptor to the list of file descriptors to be monitored.
+ * events should be specified as a bitmask of events passed to poll(), e.g.
+ * POLLIN and/or POLLOUT. */
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+{
+	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
+	if (!ipollfd)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_dbg("add fd %d events %d", fd, events);
+	ipollfd->pollfd.fd = fd;
+	ipollfd->pollfd.events = events;
+	ipollfd->domain = NULL;
+	usbi_mutex_lock(&ctx->pollfds_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = (uint32_t)events;
+		event.data.ptr = ipollfd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll (errno %d)",
+				fd, errno);
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			free(ipollfd);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+#endif
+	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	ctx->pollfds_cnt++;
+	ctx->pollfds_modified = 1;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	if (ctx->fd_added_cb)
+		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
 	return 0;
 }
 
-/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
- * that were asynchronously cancelled. The same concerns w.r.t. freeing of
- * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+/* Remove a file descriptor from the list of file descriptors to be polled. */
+void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
-	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
-		usbi_dbg("detected timeout cancellation");
-		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
+	struct usbi_pollfd *ipollfd;
+	int found = 0;
+
+	usbi_dbg("remove fd %d", fd);
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+		if (ipollfd->pollfd.fd == fd) {
+			found = 1;
+			break;
+		}
+
+	if (!found) {
+		usbi_dbg("couldn't find fd %d to remove", fd);
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		return;
 	}
 
-	/* otherwise its a normal async cancel */
-	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
+#ifdef USBI_EPOLL_AVAILABLE
+	/* fds of event domains are not in the context's epoll set */
+	if (usbi_using_epoll(ctx) && !ipollfd->domain &&
+			epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		usbi_dbg("failed to remove fd %d from epoll (errno %d)", fd, errno);
+#endif
+	list_del(&ipollfd->list);
+	ctx->pollfds_cnt--;
+	ctx->pollfds_modified = 1;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	free(ipollfd);
+	if (ctx->fd_removed_cb)
+		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
 /** \ingroup poll
- * Attempt to acquire the event handling lock. This lock is used to ensure that
- * only one thread is monitoring libusb event sources at any one time.
+ * Retrieve a list of file descriptors that should be polled by your main loop
+ * as libusb event sources.
  *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+ * The returned list is NULL-terminated and should be freed with free() when
+ * done. The actual list contents must not be touched.
  *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
+ * As file descriptors are a Unix-specific concept, this function is not
+ * available on Windows and will always return NULL.
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 if the lock was obtained successfully
- * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
- * \ref mtasync
+ * \returns a NULL-terminated list of libusb_pollfd structures
+ * \returns NULL on error
+ * \returns NULL on platforms where the functionality is not available
  */
-int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
+DEFAULT_VISIBILITY
+const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
+	libusb_context *ctx)
 {
-	int r;
-	unsigned int ru;
+#ifndef OS_WINDOWS
+	struct libusb_pollfd **ret = NULL;
+	struct usbi_pollfd *ipollfd;
+	size_t i = 0;
+	size_t cnt = 0;
 	USBI_GET_CONTEXT(ctx);
 
-	/* is someone else waiting to modify poll fds? if so, don't let this thread
-	 * start event handling */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ru = ctx->pollfd_modify;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
-	if (ru) {
-		usbi_dbg("someone else is modifying poll fds");
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+		if (!ipollfd->domain)
+			cnt++;
+
+	ret = calloc(cnt + 1, sizeof(struct libusb_pollfd *));
+	if (!ret)
+		goto out;
+
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+		if (!ipollfd->domain)
+			ret[i++] = (struct libusb_pollfd *) ipollfd;
+	ret[cnt] = NULL;
+
+out:
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	return (const struct libusb_pollfd **) ret;
+#else
+	usbi_err(ctx, "external polling of libusb's internal descriptors "\
+		"is not yet supported on Windows platforms");
+	return NULL;
+#endif
+}
+
+/* find the pollfd of the given fd. must be called with the pollfds_lock
+ * held */
+static struct usbi_pollfd *find_pollfd(struct libusb_context *ctx, int fd)
+{
+	struct usbi_pollfd *ipollfd;
+
+	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+		if (ipollfd->pollfd.fd == fd)
+			return ipollfd;
+	return NULL;
+}
+
+static int domain_try_lock_events(struct libusb_event_domain *domain)
+{
+	int r;
+
+	/* is someone else waiting to modify the domain's fds? if so, don't let
+	 * this thread start event handling */
+	usbi_mutex_lock(&domain->ctx->pollfds_lock);
+	r = domain->fds_modifying;
+	usbi_mutex_unlock(&domain->ctx->pollfds_lock);
+	if (r) {
+		usbi_dbg("someone else is modifying domain fds");
 		return 1;
 	}
 
-	r = usbi_mutex_trylock(&ctx->events_lock);
+	r = usbi_mutex_trylock(&domain->events_lock);
 	if (r)
 		return 1;
 
-	ctx->event_handler_active = 1;
+	domain->event_handler_active = 1;
+	domain->event_handler_tid = usbi_get_tid();
 	return 0;
 }
 
-/** \ingroup poll
- * Acquire the event handling lock, blocking until successful acquisition if
- * it is contended. This lock is used to ensure that only one thread is
- * monitoring libusb event sources at any one time.
- *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
- *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
- */
-void API_EXPORTED libusb_lock_events(libusb_context *ctx)
-{
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->events_lock);
-	ctx->event_handler_active = 1;
-}
-
-/** \ingroup poll
- * Release the lock previously acquired with libusb_try_lock_events() or
- * libusb_lock_events(). Releasing this lock will wake up any threads blocked
- * on libusb_wait_for_event().
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
- */
-void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
+static void domain_unlock_events(struct libusb_event_domain *domain)
 {
-	USBI_GET_CONTEXT(ctx);
-	ctx->event_handler_active = 0;
-	usbi_mutex_unlock(&ctx->events_lock);
+	domain->event_handler_active = 0;
+	usbi_mutex_unlock(&domain->events_lock);
 
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->pollfd_modify)? */
-	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	usbi_mutex_lock(&domain->event_waiters_lock);
+	usbi_cond_broadcast(&domain->event_waiters_cond);
+	usbi_mutex_unlock(&domain->event_waiters_lock);
 }
 
-/** \ingroup poll
- * Determine if it is still OK for this thread to be doing event handling.
- *
- * Sometimes, libusb needs to temporarily pause all event handlers, and this
- * is the function you should use before polling file descriptors to see if
- * this is the case.
- *
- * If this function instructs your thread to give up the events lock, you
- * should just continue the usual logic that is documented in \ref mtasync.
- * On the next iteration, your thread will fail to obtain the events lock,
- * and will hence become an event waiter.
- *
- * This function should be called while the events lock is held: you don't
- * need to worry about the results of this function if your thread is not
- * the current event handler.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 1 if event handling can start or continue
- * \returns 0 if this thread must give up the events lock
- * \ref fullstory "Multi-threaded I/O: the full story"
- */
-int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
+/* interrupt the event handler of the domain, if there is one, and keep event
+ * handlers away until domain_end_modify() is called. does nothing when
+ * called by the domain's event handler itself, e.g. from a transfer
+ * callback. returns whether the domain's events lock was taken. */
+static int domain_begin_modify(struct libusb_event_domain *domain)
 {
-	unsigned int r;
-	USBI_GET_CONTEXT(ctx);
+	struct libusb_context *ctx = domain->ctx;
+	unsigned char dummy = 1;
+	ssize_t r;
 
-	/* is someone else waiting to modify poll fds? if so, don't let this thread
-	 * continue event handling */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	r = ctx->pollfd_modify;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
-	if (r) {
-		usbi_dbg("someone else is modifying poll fds");
+	if (domain->event_handler_active &&
+			domain->event_handler_tid == usbi_get_tid())
 		return 0;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	domain->fds_modifying++;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	r = usbi_write(domain->ctrl_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(ctx, "internal signalling write failed");
+
+	usbi_mutex_lock(&domain->events_lock);
+	domain->event_handler_active = 1;
+	domain->event_handler_tid = usbi_get_tid();
+
+	if (r > 0) {
+		r = usbi_read(domain->ctrl_pipe[0], &dummy, sizeof(dummy));
+		if (r <= 0)
+			usbi_warn(ctx, "internal signalling read failed");
 	}
 
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	domain->fds_modifying--;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
 	return 1;
 }
 
+static void domain_end_modify(struct libusb_event_domain *domain, int locked)
+{
+	if (locked)
+		domain_unlock_events(domain);
+}
 
-/** \ingroup poll
- * Determine if an active thread is handling events (i.e. if anyone is holding
- * the event handling lock).
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 1 if a thread is handling events
- * \returns 0 if there are no threads currently handling events
- * \ref mtasync
- */
-int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
+/* the same dance as in libusb_close(), for the context's event handlers */
+static void ctx_begin_modify(struct libusb_context *ctx)
 {
-	unsigned int r;
-	USBI_GET_CONTEXT(ctx);
+	unsigned char dummy = 1;
+	ssize_t r;
 
-	/* is someone else waiting to modify poll fds? if so, don't let this thread
-	 * start event handling -- indicate that event handling is happening */
 	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	r = ctx->pollfd_modify;
+	ctx->pollfd_modify++;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
-	if (r) {
-		usbi_dbg("someone else is modifying poll fds");
-		return 1;
-	}
 
-	return ctx->event_handler_active;
+	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(ctx, "internal signalling write failed");
+
+	libusb_lock_events(ctx);
+
+	if (r > 0) {
+		r = usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
+		if (r <= 0)
+			usbi_warn(ctx, "internal signalling read failed");
+	}
 }
 
-/** \ingroup poll
- * Acquire the event waiters lock. This lock is designed to be obtained under
- * the situation where you want to be aware when events are completed, but
- * some other thread is event handling so calling libusb_handle_events() is not
- * allowed.
- *
- * You then obtain this lock, re-check that another thread is still handling
- * events, then call libusb_wait_for_event().
- *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly,
- * <b>and</b> may potentially be handling events from 2 threads simultaenously.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
- */
-void API_EXPORTED libusb_lock_event_waiters(libusb_context *ctx)
+static void ctx_end_modify(struct libusb_context *ctx)
 {
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify--;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+
+	libusb_unlock_events(ctx);
 }
 
-/** \ingroup poll
- * Release the event waiters lock.
- * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
- */
-void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
+/* hand a member handle back to the context. must be called with the
+ * pollfds_lock held. returns the pollfd of the handle, if it has one. */
+static struct usbi_pollfd *domain_detach_handle(
+	struct libusb_event_domain *domain, libusb_device_handle *dev_handle)
 {
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	struct libusb_context *ctx = domain->ctx;
+	struct usbi_pollfd *ipollfd;
+	int fd;
+
+	list_del(&dev_handle->event_domain_list);
+	dev_handle->event_domain = NULL;
+	domain->fds_modified = 1;
+
+	fd = usbi_backend->handle_event_fd(dev_handle);
+	ipollfd = fd < 0 ? NULL : find_pollfd(ctx, fd);
+	if (!ipollfd || ipollfd->domain != domain)
+		return NULL;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = (uint32_t)ipollfd->pollfd.events;
+		event.data.ptr = ipollfd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+			usbi_err(ctx, "failed to add fd %d to epoll (errno %d)",
+				fd, errno);
+	}
+#endif
+	ipollfd->domain = NULL;
+	ctx->pollfds_modified = 1;
+	return ipollfd;
 }
 
 /** \ingroup poll
- * Wait for another thread to signal completion of an event. Must be called
- * with the event waiters lock held, see libusb_lock_event_waiters().
+ * Allocate an event domain. The events of the device handles in an event
+ * domain are handled with libusb_handle_domain_events_timeout_completed()
+ * instead of libusb_handle_events() and friends. Each domain has its own
+ * event handling lock and set of waiters, so that different threads can
+ * handle the events of different domains, and of the rest of the context,
+ * in parallel, while all of them share the context's device list and
+ * hotplug machinery.
  *
- * This function will block until any of the following conditions are met:
- * -# The timeout expires
- * -# A transfer completes
- * -# A thread releases the event handling lock through libusb_unlock_events()
+ * Handles are added to the domain with libusb_event_domain_add_handle().
+ * Their file descriptors are no longer part of the context's poll set, nor
+ * returned by libusb_get_pollfds(), and synchronous I/O on them handles the
+ * events of the domain instead of those of the context.
  *
- * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
- * the callback for the transfer has completed. Condition 3 is important
- * because it means that the thread that was previously handling events is no
- * longer doing so, so if any events are to complete, another thread needs to
- * step up and start event handling.
+ * Timeouts are still tracked by the context; an expired timeout is handled
+ * by whichever event handler notices it first.
  *
- * This function releases the event waiters lock before putting your thread
- * to sleep, and reacquires the lock as it is being woken up.
+ * This function is only supported by backends with a file descriptor per
+ * device handle, currently only Linux.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param tv maximum timeout for this blocking function. A NULL value
- * indicates unlimited timeout.
- * \returns 0 after a transfer completes or another thread stops event handling
- * \returns 1 if the timeout expired
- * \ref mtasync
+ * \param domain output location for the newly allocated domain. Only
+ * populated on success.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the backend does not support event
+ * domains
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
  */
-int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+int API_EXPORTED libusb_alloc_event_domain(libusb_context *ctx,
+	libusb_event_domain **domain)
 {
-	struct timespec timeout;
-	int r;
+	struct libusb_event_domain *_domain;
 
 	USBI_GET_CONTEXT(ctx);
-	if (tv == NULL) {
-		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
-		return 0;
-	}
+	if (!usbi_backend->handle_event_fd)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_REALTIME, &timeout);
-	if (r < 0) {
-		usbi_err(ctx, "failed to read realtime clock, error %d", errno);
+	_domain = calloc(1, sizeof(*_domain));
+	if (!_domain)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (usbi_pipe(_domain->ctrl_pipe) < 0) {
+		free(_domain);
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	timeout.tv_sec += tv->tv_sec;
-	timeout.tv_nsec += tv->tv_usec * 1000;
-	while (timeout.tv_nsec >= 1000000000) {
-		timeout.tv_nsec -= 1000000000;
-		timeout.tv_sec++;
-	}
+	_domain->ctx = ctx;
+	list_init(&_domain->handles);
+	_domain->fds_modified = 1;
+	usbi_mutex_init(&_domain->events_lock, NULL);
+	usbi_mutex_init(&_domain->event_waiters_lock, NULL);
+	usbi_cond_init(&_domain->event_waiters_cond, NULL);
 
-	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
-		&ctx->event_waiters_lock, &timeout);
-	return (r == ETIMEDOUT);
+	*domain = _domain;
+	return 0;
 }
 
-static void handle_timeout(struct usbi_transfer *itransfer)
+/** \ingroup poll
+ * Free an event domain allocated with libusb_alloc_event_domain(). Any
+ * handles still in the domain are handed back to the context first. No
+ * thread may be handling the events of the domain when calling this
+ * function.
+ *
+ * It is legal to call this function with a NULL domain. In this case,
+ * the function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param domain the domain to free
+ */
+void API_EXPORTED libusb_free_event_domain(libusb_event_domain *domain)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	int r;
+	struct libusb_context *ctx;
 
-	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
-	r = libusb_cancel_transfer(transfer);
-	if (r < 0)
-		usbi_warn(TRANSFER_CTX(transfer),
-			"async cancel failed %d errno=%d", r, errno);
+	if (!domain)
+		return;
+
+	ctx = domain->ctx;
+	if (!list_empty(&domain->handles)) {
+		ctx_begin_modify(ctx);
+		for (;;) {
+			struct usbi_pollfd *ipollfd;
+			struct libusb_pollfd pollfd = { -1, 0 };
+
+			usbi_mutex_lock(&ctx->pollfds_lock);
+			if (list_empty(&domain->handles)) {
+				usbi_mutex_unlock(&ctx->pollfds_lock);
+				break;
+			}
+			ipollfd = domain_detach_handle(domain,
+				list_entry(domain->handles.next,
+					struct libusb_device_handle, event_domain_list));
+			if (ipollfd)
+				pollfd = ipollfd->pollfd;
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+
+			if (ipollfd && ctx->fd_added_cb)
+				ctx->fd_added_cb(pollfd.fd, pollfd.events,
+					ctx->fd_cb_user_data);
+		}
+		ctx_end_modify(ctx);
+	}
+
+	usbi_close(domain->ctrl_pipe[0]);
+	usbi_close(domain->ctrl_pipe[1]);
+	usbi_mutex_destroy(&domain->events_lock);
+	usbi_mutex_destroy(&domain->event_waiters_lock);
+	usbi_cond_destroy(&domain->event_waiters_cond);
+	free(domain->poll_fds);
+	free(domain);
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+/** \ingroup poll
+ * Move a device handle to an event domain. From then on, the events of the
+ * handle are only handled by libusb_handle_domain_events_timeout_completed()
+ * on that domain. Transfers may be in flight on the handle, except for
+ * transfers flagged with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+ * "LIBUSB_TRANSFER_QUEUE_COMPLETION", which cannot be used on the handle
+ * while it belongs to the domain, see libusb_reap_completions().
+ *
+ * When the device is disconnected, the domain's event handler hands the
+ * handle back to the context, whose event handler then handles the
+ * disconnect as for any other handle.
+ *
+ * This function interrupts the event handling of both the context and the
+ * domain and must not be called from a transfer callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param domain the domain to add the handle to
+ * \param dev_handle a device handle of the context the domain belongs to
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the handle belongs to another
+ * context
+ * \returns LIBUSB_ERROR_BUSY if the handle already belongs to an event domain
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_event_domain_add_handle(libusb_event_domain *domain,
+	libusb_device_handle *dev_handle)
 {
-	int r;
-	struct timespec systime_ts;
-	struct timeval systime;
-	struct usbi_transfer *transfer;
+	struct libusb_context *ctx = domain->ctx;
+	struct usbi_pollfd *ipollfd;
+	int fd, locked, r = 0;
 
-	if (list_empty(&ctx->flying_transfers))
-		return 0;
+	if (HANDLE_CTX(dev_handle) != ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	/* get current time */
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
-	if (r < 0)
-		return r;
+	fd = usbi_backend->handle_event_fd(dev_handle);
+	if (fd < 0)
+		return fd;
 
-	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+	locked = domain_begin_modify(domain);
+	ctx_begin_modify(ctx);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (dev_handle->event_domain) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
 
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
+	ipollfd = find_pollfd(ctx, fd);
+	if (!ipollfd) {
+		usbi_err(ctx, "fd %d of handle is not polled", fd);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
 
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx) &&
+			epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		usbi_dbg("failed to remove fd %d from epoll (errno %d)", fd, errno);
+#endif
+	ipollfd->domain = domain;
+	ctx->pollfds_modified = 1;
 
-		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
-			return 0;
+	dev_handle->event_domain = domain;
+	list_add_tail(&dev_handle->event_domain_list, &domain->handles);
+	domain->fds_modified = 1;
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(transfer);
-	}
-	return 0;
-}
+out:
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	ctx_end_modify(ctx);
+	domain_end_modify(domain, locked);
 
-static int handle_timeouts(struct libusb_context *ctx)
-{
-	int r;
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (r == 0 && ctx->fd_removed_cb)
+		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 	return r;
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int handle_timerfd_trigger(struct libusb_context *ctx)
+/** \ingroup poll
+ * Hand a device handle back from its event domain to the context, undoing
+ * libusb_event_domain_add_handle(). libusb_close() does this automatically.
+ *
+ * This function interrupts the event handling of both the context and the
+ * domain. It may be called from a transfer callback run by the domain's
+ * event handler, but not from one run by the context's.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the handle does not belong to an event
+ * domain
+ */
+int API_EXPORTED libusb_event_domain_remove_handle(
+	libusb_device_handle *dev_handle)
 {
-	int r;
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_event_domain *domain = dev_handle->event_domain;
+	struct usbi_pollfd *ipollfd = NULL;
+	struct libusb_pollfd pollfd = { -1, 0 };
+	int locked, r = 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (!domain)
+		return LIBUSB_ERROR_NOT_FOUND;
 
-	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
-	if (r < 0)
-		goto out;
+	locked = domain_begin_modify(domain);
+	ctx_begin_modify(ctx);
 
-	/* arm for next timeout*/
-	r = arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (dev_handle->event_domain == domain) {
+		ipollfd = domain_detach_handle(domain, dev_handle);
+		if (ipollfd)
+			pollfd = ipollfd->pollfd;
+	} else {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_unlock(&ctx->pollfds_lock);
 
-out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	ctx_end_modify(ctx);
+	domain_end_modify(domain, locked);
+
+	if (ipollfd && ctx->fd_added_cb)
+		ctx->fd_added_cb(pollfd.fd, pollfd.events, ctx->fd_cb_user_data);
 	return r;
 }
-#endif
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/* refresh domain->poll_fds if the set of member handles has changed since
+ * the last time. must be called with the domain's events lock held. */
+static int update_domain_poll_fds(struct libusb_event_domain *domain)
 {
-	int r;
+	struct libusb_context *ctx = domain->ctx;
 	struct usbi_pollfd *ipollfd;
-	POLL_NFDS_TYPE nfds = 0;
-	struct pollfd *fds = NULL;
-	int i = -1;
-	int timeout_ms;
-	int special_event;
+	unsigned int cnt = 1;
+	unsigned int i = 1;
+	int r = 0;
 
 	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (!domain->fds_modified)
+		goto out;
+
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		nfds++;
+		if (ipollfd->domain == domain)
+			cnt++;
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	if (nfds != 0)
-		fds = malloc(sizeof(*fds) * nfds);
-	if (!fds) {
-		usbi_mutex_unlock(&ctx->pollfds_lock);
-		return LIBUSB_ERROR_NO_MEM;
+	if (cnt > domain->poll_fds_size) {
+		struct pollfd *fds = realloc(domain->poll_fds, cnt * sizeof(*fds));
+		if (!fds) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		domain->poll_fds = fds;
+		domain->poll_fds_size = cnt;
 	}
 
+	/* fds[0] is always the domain's ctrl pipe */
+	domain->poll_fds[0].fd = domain->ctrl_pipe[0];
+	domain->poll_fds[0].events = POLLIN;
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
-		struct libusb_pollfd *pollfd = &ipollfd->pollfd;
-		int fd = pollfd->fd;
+		if (ipollfd->domain != domain)
+			continue;
+		domain->poll_fds[i].fd = ipollfd->pollfd.fd;
+		domain->poll_fds[i].events = ipollfd->pollfd.events;
 		i++;
-		fds[i].fd = fd;
-		fds[i].events = pollfd->events;
-		fds[i].revents = 0;
 	}
-	usbi_mutex_unlock(&ctx->pollfds_lock);
+	domain->poll_fds_cnt = i;
+	domain->fds_modified = 0;
 
-	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+out:
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+	return r;
+}
 
-	/* round up to next millisecond */
-	if (tv->tv_usec % 1000)
-		timeout_ms++;
+/* compute how long the domain's event handler may poll, at most tv and no
+ * longer than until the next timeout, and publish the resulting deadline so
+ * that submitting a transfer which times out earlier interrupts the poll.
+ * returns 1 if a timeout has already expired, in which case nothing is
+ * published */
+static int arm_domain_timeout(struct libusb_event_domain *domain,
+	const struct timeval *tv, struct timeval *poll_timeout)
+{
+	struct libusb_context *ctx = domain->ctx;
+	struct timespec now_ts;
+	struct timeval now, deadline;
+	int r = 0;
 
-redo_poll:
-	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
-	r = usbi_poll(fds, nfds, timeout_ms);
-	usbi_dbg("poll() returned %d", r);
-	if (r == 0) {
-		free(fds);
-		return handle_timeouts(ctx);
-	} else if (r == -1 && errno == EINTR) {
-		free(fds);
-		return LIBUSB_ERROR_INTERRUPTED;
-	} else if (r < 0) {
-		free(fds);
-		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
-		return LIBUSB_ERROR_IO;
+	*poll_timeout = *tv;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts) < 0) {
+		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+		return 0;
 	}
+	TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+	timeradd(&now, tv, &deadline);
 
-	special_event = 0;
-
-	/* fd[0] is always the ctrl pipe */
-	if (fds[0].revents) {
-		/* another thread wanted to interrupt event handling, and it succeeded!
-		 * handle any other events that cropped up at the same time, and
-		 * simply return */
-		usbi_dbg("caught a fish on the control pipe");
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (ctx->timeout_heap_len) {
+		struct timeval *next_timeout = &ctx->timeout_heap[0]->timeout;
 
-		if (r == 1) {
-			r = 0;
-			goto handled;
-		} else {
-			/* prevent OS backend from trying to handle events on ctrl pipe */
-			fds[0].revents = 0;
-			r--;
-		}
+		if (!timercmp(&now, next_timeout, <))
+			r = 1;
+		else if (timercmp(next_timeout, &deadline, <))
+			deadline = *next_timeout;
 	}
+	if (!r) {
+		domain->timeout_armed = deadline;
+		timersub(&deadline, &now, poll_timeout);
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
 
-	/* fd[1] is always the hotplug pipe */
-	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && fds[1].revents) {
-		libusb_hotplug_message message;
-		ssize_t ret;
-
-		usbi_dbg("caught a fish on the hotplug pipe");
-		special_event = 1;
-
-		/* read the message from the hotplug thread */
-		ret = usbi_read(ctx->hotplug_pipe[0], &message, sizeof (message));
-		if (ret != sizeof(message)) {
-			usbi_err(ctx, "hotplug pipe read error %d != %u",
-				 ret, sizeof(message));
-			r = LIBUSB_ERROR_OTHER;
-			goto handled;
-		}
+/* the domain's event handler is done polling */
+static void disarm_domain_timeout(struct libusb_event_domain *domain)
+{
+	struct libusb_context *ctx = domain->ctx;
 
-		usbi_hotplug_match(ctx, message.device, message.event);
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	timerclear(&domain->timeout_armed);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+}
 
-		/* the device left. dereference the device */
-		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message.event)
-			libusb_unref_device(message.device);
+/* read the byte of a wakeup by wake_domain_for_timeout(), if there was one.
+ * bytes written by domain_begin_modify() are read by that function */
+static void consume_timeout_wake(struct libusb_event_domain *domain)
+{
+	struct libusb_context *ctx = domain->ctx;
+	unsigned char dummy;
+	int wake;
 
-		fds[1].revents = 0;
-		if (1 == r--)
-			goto handled;
-	} /* else there shouldn't be anything on this pipe */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	wake = domain->timeout_wakes > 0;
+	if (wake)
+		domain->timeout_wakes--;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-#ifdef USBI_TIMERFD_AVAILABLE
-	/* on timerfd configurations, fds[2] is the timerfd */
-	if (usbi_using_timerfd(ctx) && fds[2].revents) {
-		/* timerfd indicates that a timeout has expired */
-		int ret;
-		usbi_dbg("timerfd triggered");
-		special_event = 1;
+	if (wake && usbi_read(domain->ctrl_pipe[0], &dummy, sizeof(dummy)) <= 0)
+		usbi_warn(ctx, "internal signalling read failed");
+}
 
-		ret = handle_timerfd_trigger(ctx);
-		if (ret < 0) {
-			/* return error code */
-			r = ret;
-			goto handled;
-		} else if (r == 1) {
-			/* no more active file descriptors, nothing more to do */
-			r = 0;
-			goto handled;
-		} else {
-			/* more events pending...
-			 * prevent OS backend from trying to handle events on timerfd */
-			fds[2].revents = 0;
-			r--;
-		}
-	}
-#endif
+/* hand the handles whose fds report POLLERR back to the context, so that the
+ * disconnect is handled by the context's event handler with the context's
+ * events lock held, like that of any other handle. the fds get added to the
+ * context's poll set and its handler is woken up to poll them. returns the
+ * number of fds handed back, whose revents are cleared */
+static int domain_hand_back_errors(struct libusb_event_domain *domain,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds)
+{
+	struct libusb_context *ctx = domain->ctx;
+	POLL_NFDS_TYPE i;
+	int cnt = 0;
 
-	r = usbi_backend->handle_events(ctx, fds, nfds, r);
-	if (r)
-		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	for (i = 0; i < nfds; i++) {
+		struct libusb_device_handle *handle;
+		struct usbi_pollfd *ipollfd = NULL;
+		struct libusb_pollfd pollfd = { -1, 0 };
 
-handled:
-        if (r == 0 && special_event) {
-                timeout_ms = 0;
-                goto redo_poll;
-        }
+		if (!(fds[i].revents & POLLERR))
+			continue;
+		fds[i].revents = 0;
+		cnt++;
 
-	free(fds);
-	return r;
+		usbi_mutex_lock(&ctx->pollfds_lock);
+		list_for_each_entry(handle, &domain->handles, event_domain_list,
+				struct libusb_device_handle) {
+			if (usbi_backend->handle_event_fd(handle) != fds[i].fd)
+				continue;
+			usbi_dbg("handing disconnected fd %d back to the context",
+				fds[i].fd);
+			ipollfd = domain_detach_handle(domain, handle);
+			if (ipollfd) {
+				pollfd = ipollfd->pollfd;
+				wake_handler(ctx, &ctx->handler_wake,
+					ctx->ctrl_pipe[1]);
+			}
+			break;
+		}
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+
+		if (ipollfd && ctx->fd_added_cb)
+			ctx->fd_added_cb(pollfd.fd, pollfd.events,
+				ctx->fd_cb_user_data);
+	}
+	return cnt;
 }
 
-/* returns the smallest of:
- *  1. timeout of next URB
- *  2. user-supplied timeout
- * returns 1 if there is an already-expired timeout, otherwise returns 0
- * and populates out
- */
-static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
-	struct timeval *out)
+/* handle_events() for a domain. assumes that no other thread is concurrently
+ * doing the same thing for this domain. */
+static int handle_domain_events(struct libusb_event_domain *domain,
+	struct timeval *tv)
 {
-	struct timeval timeout;
-	int r = libusb_get_next_timeout(ctx, &timeout);
-	if (r) {
-		/* timeout already expired? */
-		if (!timerisset(&timeout))
-			return 1;
+	struct libusb_context *ctx = domain->ctx;
+	struct pollfd *fds;
+	POLL_NFDS_TYPE nfds;
+	int r;
 
-		/* choose the smallest of next URB timeout or user specified timeout */
-		if (timercmp(&timeout, tv, <))
-			*out = timeout;
-		else
-			*out = *tv;
-	} else {
-		*out = *tv;
+	r = update_domain_poll_fds(domain);
+	if (r < 0)
+		return r;
+	fds = domain->poll_fds;
+	nfds = (POLL_NFDS_TYPE)domain->poll_fds_cnt;
+
+	usbi_dbg("poll() on domain with timeout %ld.%06lds", (long)tv->tv_sec,
+		(long)tv->tv_usec);
+	r = poll_fds_timeout(fds, nfds, tv);
+	usbi_dbg("poll() returned %d", r);
+	if (r == 0) {
+		return handle_timeouts(ctx);
+	} else if (r == -1 && errno == EINTR) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	} else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
 	}
-	return 0;
+
+	/* fds[0] is always the domain's ctrl pipe */
+	if (fds[0].revents) {
+		usbi_dbg("caught a fish on the domain control pipe");
+		consume_timeout_wake(domain);
+		consume_handler_wake(ctx, &domain->handler_wake,
+			domain->ctrl_pipe[0]);
+		if (r == 1)
+			return 0;
+		fds[0].revents = 0;
+		r--;
+	}
+
+	r -= domain_hand_back_errors(domain, fds + 1, nfds - 1);
+	if (r == 0)
+		return 0;
+
+	r = usbi_backend->handle_events(ctx, fds + 1, nfds - 1, r);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	return r;
 }
 
 /** \ingroup poll
- * Handle any pending events.
- *
- * libusb determines "pending events" by checking if any timeouts have expired
- * and by checking the set of file descriptors for activity.
- *
- * If a zero timeval is passed, this function will handle any already-pending
- * events and then immediately return in non-blocking style.
- *
- * If a non-zero timeval is passed and no events are currently pending, this
- * function will block waiting for events to handle up until the specified
- * timeout. If an event arrives or a signal is raised, this function will
- * return early.
+ * Handle any pending events of the device handles in an event domain. This
+ * behaves like libusb_handle_events_timeout_completed(), using the event
+ * handling lock and event waiters of the domain instead of those of the
+ * context, so it can run concurrently with the event handling of the
+ * context and of other domains.
  *
- * If the parameter completed is not NULL then <em>after obtaining the event
- * handling lock</em> this function will return immediately if the integer
- * pointed to is not 0. This allows for race free waiting for the completion
- * of a specific transfer.
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
- * \param ctx the context to operate on, or NULL for the default context
+ * \param domain the domain to handle events for
  * \param tv the maximum time to block waiting for events, or an all zero
  * timeval struct for non-blocking mode
  * \param completed pointer to completion integer to check, or NULL
  * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref mtasync
  */
-int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
-	struct timeval *tv, int *completed)
+int API_EXPORTED libusb_handle_domain_events_timeout_completed(
+	libusb_event_domain *domain, struct timeval *tv, int *completed)
 {
-	int r;
+	struct libusb_context *ctx;
+	struct timeval timeout;
 	struct timeval poll_timeout;
+	int r;
 
-	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
-	if (r) {
-		/* timeout already expired */
-		return handle_timeouts(ctx);
+	if (!domain || !tv)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* the domain's fds do not include the timerfd, so poll no longer than
+	 * until the next timeout, whichever way the context tracks them */
+	ctx = domain->ctx;
+	poll_timeout = *tv;
+	if (get_pending_timeout(ctx, &timeout)) {
+		if (!timerisset(&timeout))
+			return handle_timeouts(ctx);
+		if (timercmp(&timeout, tv, <))
+			poll_timeout = timeout;
 	}
 
 retry:
-	if (libusb_try_lock_events(ctx) == 0) {
+	if (domain_try_lock_events(domain) == 0) {
+		r = 0;
 		if (completed == NULL || !*completed) {
-			/* we obtained the event lock: do our own event handling */
-			usbi_dbg("doing our own event handling");
-			r = handle_events(ctx, &poll_timeout);
+			usbi_dbg("doing our own domain event handling");
+			if (arm_domain_timeout(domain, tv, &poll_timeout)) {
+				r = handle_timeouts(ctx);
+			} else {
+				r = handle_domain_events(domain, &poll_timeout);
+				disarm_domain_timeout(domain);
+			}
 		}
-		libusb_unlock_events(ctx);
+		domain_unlock_events(domain);
 		return r;
 	}
 
-	/* another thread is doing event handling. wait for thread events that
-	 * notify event completion. */
-	libusb_lock_event_waiters(ctx);
+	/* another thread is doing event handling for the domain */
+	usbi_mutex_lock(&domain->event_waiters_lock);
 
+	r = 0;
 	if (completed && *completed)
 		goto already_done;
 
-	if (!libusb_event_handler_active(ctx)) {
-		/* we hit a race: whoever was event handling earlier finished in the
-		 * time it took us to reach this point. try the cycle again. */
-		libusb_unlock_event_waiters(ctx);
-		usbi_dbg("event handler was active but went away, retrying");
+	if (!domain->event_handler_active) {
+		usbi_mutex_unlock(&domain->event_waiters_lock);
+		usbi_dbg("domain event handler was active but went away, retrying");
 		goto retry;
 	}
 
-	usbi_dbg("another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	usbi_dbg("another thread is doing domain event handling");
+	r = wait_for_cond(ctx, &domain->event_waiters_cond,
+		&domain->event_waiters_lock, &poll_timeout);
 
 already_done:
-	libusb_unlock_event_waiters(ctx);
+	usbi_mutex_unlock(&domain->event_waiters_lock);
 
 	if (r < 0)
 		return r;
@@ -2206,358 +6348,866 @@ already_done:
 		return 0;
 }
 
+static void *event_thread_main(void *arg)
+{
+	struct usbi_event_thread *event_thread = arg;
+	struct libusb_context *ctx = event_thread->ctx;
+	struct timeval tv = { 60, 0 };
+	int r;
+
+	usbi_dbg("event thread started");
+	while (!ctx->event_threads_stop) {
+		if (event_thread->domain)
+			r = libusb_handle_domain_events_timeout_completed(
+				event_thread->domain, &tv, &ctx->event_threads_stop);
+		else
+			r = libusb_handle_events_timeout_completed(ctx, &tv,
+				&ctx->event_threads_stop);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_warn(ctx, "event handling failed with error %d", r);
+	}
+	usbi_dbg("event thread stopping");
+	return NULL;
+}
+
+static int event_thread_error(int err)
+{
+	switch (err) {
+	case ENOSYS:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	case EPERM:
+		return LIBUSB_ERROR_ACCESS;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* tell the given event threads to return, interrupt their event handling
+ * and wait for them, then free them along with their domains. must be
+ * called with the event_threads_lock held */
+static void stop_event_threads(struct libusb_context *ctx,
+	struct usbi_event_thread *threads, int num_threads)
+{
+	int i;
+
+	ctx->event_threads_stop = 1;
+	for (i = 1; i < num_threads; i++) {
+		if (threads[i].started) {
+			int locked = domain_begin_modify(threads[i].domain);
+			domain_end_modify(threads[i].domain, locked);
+		}
+	}
+	if (threads[0].started)
+		usbi_fd_notification(ctx);
+
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i].started)
+			usbi_thread_join(threads[i].thread);
+		libusb_free_event_domain(threads[i].domain);
+	}
+	free(threads);
+}
+
 /** \ingroup poll
- * Handle any pending events
+ * Start threads owned by libusb which handle the events of a context, so
+ * that the application does not need to write its own event handling
+ * thread as described in \ref mtasync. The threads run until
+ * libusb_stop_event_thread() or libusb_exit() is called.
  *
- * Like libusb_handle_events_timeout_completed(), but without the completed
- * parameter, calling this function is equivalent to calling
- * libusb_handle_events_timeout_completed() with a NULL completed parameter.
+ * With more than one thread, each thread past the first handles the events
+ * of an event domain of its own, which libusb_get_event_thread_domain()
+ * returns. Handles moved to such a domain with
+ * libusb_event_domain_add_handle() have their events handled concurrently
+ * with those of the rest of the context.
  *
- * This function is kept primarily for backwards compatibility.
- * All new code should call libusb_handle_events_completed() or
- * libusb_handle_events_timeout_completed() to avoid race conditions.
+ * The threads can be pinned to a set of CPUs and given a real-time
+ * scheduling policy, e.g. to run next to the thread consuming the data.
+ * This may need privileges the process lacks, in which case no thread is
+ * started.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or an all zero
- * timeval struct for non-blocking mode
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \param options options for the threads, or NULL for a single thread
+ * with the default affinity and scheduling
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if event threads have already been started
+ * \returns LIBUSB_ERROR_INVALID_PARAM if an option is not valid
+ * \returns LIBUSB_ERROR_ACCESS if the process may not set the scheduling
+ * policy or priority
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot set the CPU
+ * affinity, or does not support event domains and more than one thread was
+ * asked for
+ * \returns another LIBUSB_ERROR code on other failure
  */
-int API_EXPORTED libusb_handle_events_timeout(libusb_context *ctx,
-	struct timeval *tv)
+int API_EXPORTED libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_options *options)
 {
-	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+	struct libusb_event_thread_options defaults;
+	struct usbi_event_thread *threads;
+	int num_threads, i, r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!options) {
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
+	}
+
+	num_threads = options->num_threads ? options->num_threads : 1;
+	if (num_threads < 0
+			|| options->sched_policy < LIBUSB_EVENT_THREAD_SCHED_DEFAULT
+			|| options->sched_policy > LIBUSB_EVENT_THREAD_SCHED_RR)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->event_threads_lock);
+	if (ctx->event_threads) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ctx->event_threads_stop = 0;
+	for (i = 0; i < num_threads; i++) {
+		threads[i].ctx = ctx;
+		if (i > 0) {
+			r = libusb_alloc_event_domain(ctx, &threads[i].domain);
+			if (r < 0)
+				goto err;
+		}
+
+		r = usbi_thread_create(&threads[i].thread, event_thread_main,
+			&threads[i]);
+		if (r) {
+			r = event_thread_error(r);
+			goto err;
+		}
+		threads[i].started = 1;
+
+		if (options->cpu_affinity)
+			r = usbi_thread_set_affinity(threads[i].thread,
+				options->cpu_affinity);
+		if (!r)
+			r = usbi_thread_set_sched(threads[i].thread,
+				options->sched_policy, options->sched_priority);
+		if (r) {
+			usbi_err(ctx, "setting up event thread failed errno=%d", r);
+			r = event_thread_error(r);
+			goto err;
+		}
+	}
+
+	usbi_dbg("started %d event threads", num_threads);
+	ctx->event_threads = threads;
+	ctx->num_event_threads = num_threads;
+	goto out;
+
+err:
+	stop_event_threads(ctx, threads, num_threads);
+out:
+	usbi_mutex_unlock(&ctx->event_threads_lock);
+	return r;
 }
 
 /** \ingroup poll
- * Handle any pending events in blocking mode. There is currently a timeout
- * hardcoded at 60 seconds but we plan to make it unlimited in future. For
- * finer control over whether this function is blocking or non-blocking, or
- * for control over the timeout, use libusb_handle_events_timeout_completed()
- * instead.
+ * Stop the threads started with libusb_start_event_thread() and wait for
+ * them to return. Handles in the event domains of the threads are handed
+ * back to the context. This is called by libusb_exit(), and does nothing
+ * if no event threads are running.
  *
- * This function is kept primarily for backwards compatibility.
- * All new code should call libusb_handle_events_completed() or
- * libusb_handle_events_timeout_completed() to avoid race conditions.
+ * This function must not be called from a transfer or hotplug callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
  */
-int API_EXPORTED libusb_handle_events(libusb_context *ctx)
+void API_EXPORTED libusb_stop_event_thread(libusb_context *ctx)
 {
-	struct timeval tv;
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
-	return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_threads_lock);
+	if (ctx->event_threads) {
+		usbi_dbg("stopping %d event threads", ctx->num_event_threads);
+		stop_event_threads(ctx, ctx->event_threads, ctx->num_event_threads);
+		ctx->event_threads = NULL;
+		ctx->num_event_threads = 0;
+	}
+	usbi_mutex_unlock(&ctx->event_threads_lock);
 }
 
 /** \ingroup poll
- * Handle any pending events in blocking mode.
+ * Get the event domain handled by one of the threads started with
+ * libusb_start_event_thread(). The domain belongs to libusb, and is freed
+ * when the threads are stopped.
  *
- * Like libusb_handle_events(), with the addition of a completed parameter
- * to allow for race free waiting for the completion of a specific transfer.
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
- * See libusb_handle_events_timeout_completed() for details on the completed
- * parameter.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param thread the index of the thread, from 1 to the number of threads
+ * minus one. Thread 0 handles the events of the context itself.
+ * \returns the event domain, or NULL if there is no such thread
+ */
+DEFAULT_VISIBILITY
+libusb_event_domain * LIBUSB_CALL libusb_get_event_thread_domain(
+	libusb_context *ctx, int thread)
+{
+	libusb_event_domain *domain = NULL;
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_threads_lock);
+	if (thread > 0 && thread < ctx->num_event_threads)
+		domain = ctx->event_threads[thread].domain;
+	usbi_mutex_unlock(&ctx->event_threads_lock);
+	return domain;
+}
+
+static void *callback_worker_main(void *arg)
+{
+	struct usbi_callback_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	struct libusb_device_handle *handle;
+	struct usbi_callback_queue *queue;
+	struct usbi_transfer *itransfer;
+	int resubmit;
+
+	usbi_dbg("callback worker started");
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	while (1) {
+		while (list_empty(&ctx->ready_callback_queues)
+				&& !ctx->callback_workers_stop)
+			usbi_cond_wait(&ctx->callback_workers_cond,
+				&ctx->callback_workers_lock);
+		if (list_empty(&ctx->ready_callback_queues))
+			break;
+
+		queue = list_entry(ctx->ready_callback_queues.next,
+			struct usbi_callback_queue, list);
+		list_del(&queue->list);
+		itransfer = list_entry(queue->transfers.next, struct usbi_transfer,
+			list);
+		list_del(&itransfer->list);
+		usbi_mutex_unlock(&ctx->callback_workers_lock);
+
+		/* libusb_close() waits for the handle's deferred callbacks, so it
+		 * outlives the transfer, which the callback may free */
+		handle = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+		resubmit = itransfer->flags & USBI_TRANSFER_DEFERRED_RESUBMIT;
+		finish_completion(ctx, itransfer, resubmit);
+		wake_for_callback(ctx, handle);
+
+		usbi_mutex_lock(&ctx->callback_workers_lock);
+		/* the next callback of the endpoint goes to the back of the line,
+		 * behind the endpoints that were waiting meanwhile */
+		if (list_empty(&queue->transfers))
+			queue->busy = 0;
+		else
+			list_add_tail(&queue->list, &ctx->ready_callback_queues);
+		if (--handle->deferred_callbacks == 0)
+			usbi_cond_broadcast(&ctx->callback_idle_cond);
+	}
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+	usbi_dbg("callback worker stopping");
+	return NULL;
+}
+
+/* tell the given callback workers to return once the queued callbacks ran,
+ * wait for them and free them. must be called with the
+ * callback_workers_lock held, which is dropped meanwhile */
+static void stop_callback_workers(struct libusb_context *ctx,
+	struct usbi_callback_worker *workers, int num_workers)
+{
+	int i;
+
+	ctx->callback_workers_stop = 1;
+	usbi_cond_broadcast(&ctx->callback_workers_cond);
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].started)
+			usbi_thread_join(workers[i].thread);
+	}
+	free(workers);
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	ctx->callback_workers_stop = 0;
+}
+
+/** \ingroup asyncio
+ * Start threads owned by libusb which invoke the callbacks of transfers
+ * flagged with \ref libusb_transfer_flags::LIBUSB_TRANSFER_DEFER_CALLBACK
+ * "LIBUSB_TRANSFER_DEFER_CALLBACK", so that the thread handling events only
+ * reaps completions and resubmits transfers. The threads run until
+ * libusb_stop_callback_workers() or libusb_exit() is called.
+ *
+ * Each endpoint of a device handle has a queue of its own, which is served
+ * by one worker at a time, so that the callbacks of an endpoint are invoked
+ * in completion order. With more than one thread, the callbacks of
+ * different endpoints run concurrently.
+ *
+ * A device handle is only closed by libusb_close() after the deferred
+ * callbacks of its transfers returned, so it must not be closed from such
+ * a callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param completed pointer to completion integer to check, or NULL
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref mtasync
+ * \param num_threads the number of threads to start
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if callback workers have already been started
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_threads is not positive
+ * \returns another LIBUSB_ERROR code on other failure
  */
-int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
-	int *completed)
+int API_EXPORTED libusb_start_callback_workers(libusb_context *ctx,
+	int num_threads)
 {
-	struct timeval tv;
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
-	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+	struct usbi_callback_worker *workers;
+	int i, r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	if (num_threads <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	if (ctx->callback_workers || ctx->callback_workers_stop) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	workers = calloc(num_threads, sizeof(*workers));
+	if (!workers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		workers[i].ctx = ctx;
+		r = usbi_thread_create(&workers[i].thread, callback_worker_main,
+			&workers[i]);
+		if (r) {
+			usbi_err(ctx, "starting callback worker failed errno=%d", r);
+			r = event_thread_error(r);
+			stop_callback_workers(ctx, workers, i);
+			goto out;
+		}
+		workers[i].started = 1;
+	}
+
+	usbi_dbg("started %d callback workers", num_threads);
+	ctx->callback_workers = workers;
+	ctx->num_callback_workers = num_threads;
+
+out:
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+	return r;
 }
 
-/** \ingroup poll
- * Handle any pending events by polling file descriptors, without checking if
- * any other threads are already doing so. Must be called with the event lock
- * held, see libusb_lock_events().
+/** \ingroup asyncio
+ * Stop the threads started with libusb_start_callback_workers(), after they
+ * invoked the callbacks already handed to them. Callbacks of transfers
+ * completing from then on are invoked by the thread handling events. This
+ * is called by libusb_exit(), and does nothing if no callback workers are
+ * running.
  *
- * This function is designed to be called under the situation where you have
- * taken the event lock and are calling poll()/select() directly on libusb's
- * file descriptors (as opposed to using libusb_handle_events() or similar).
- * You detect events on libusb's descriptors, so you then call this function
- * with a zero timeout value (while still holding the event lock).
+ * This function must not be called from a transfer callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or zero for
- * non-blocking mode
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref mtasync
  */
-int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
-	struct timeval *tv)
+void API_EXPORTED libusb_stop_callback_workers(libusb_context *ctx)
 {
-	int r;
-	struct timeval poll_timeout;
+	struct usbi_callback_worker *workers;
+	int num_workers;
 
 	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
-	if (r) {
-		/* timeout already expired */
-		return handle_timeouts(ctx);
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	workers = ctx->callback_workers;
+	num_workers = ctx->num_callback_workers;
+	if (workers) {
+		usbi_dbg("stopping %d callback workers", num_workers);
+		/* no more callbacks are queued from here on, while the workers
+		 * run those already queued */
+		ctx->callback_workers = NULL;
+		ctx->num_callback_workers = 0;
+		stop_callback_workers(ctx, workers, num_workers);
 	}
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
+}
 
-	return handle_events(ctx, &poll_timeout);
+/* wait until the deferred callbacks of the transfers of a device handle
+ * returned, before it is closed. callbacks of transfers that complete from
+ * now on are invoked by the event handler, which libusb_close() keeps away
+ * from the handle */
+void usbi_wait_deferred_callbacks(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+
+	usbi_mutex_lock(&ctx->callback_workers_lock);
+	dev_handle->callbacks_closing = 1;
+	while (dev_handle->deferred_callbacks)
+		usbi_cond_wait(&ctx->callback_idle_cond,
+			&ctx->callback_workers_lock);
+	usbi_mutex_unlock(&ctx->callback_workers_lock);
 }
 
 /** \ingroup poll
- * Determines whether your application must apply special timing considerations
- * when monitoring libusb's file descriptors.
- *
- * This function is only useful for applications which retrieve and poll
- * libusb's file descriptors in their own main loop (\ref pollmain).
+ * Set the maximum number of transfer completions that the event handler may
+ * collect before dispatching them.
  *
- * Ordinarily, libusb's event handler needs to be called into at specific
- * moments in time (in addition to times when there is activity on the file
- * descriptor set). The usual approach is to use libusb_get_next_timeout()
- * to learn about when the next timeout occurs, and to adjust your
- * poll()/select() timeout accordingly so that you can make a call into the
- * library at that time.
+ * By default, each completion is processed and its callback invoked as soon
+ * as the backend has retrieved it from the OS. With a batch size greater than
+ * 1, backends which support it first retrieve up to that many completions
+ * from every device with pending events, and only then process them and
+ * invoke the callbacks, in the order the completions were retrieved. This
+ * reduces interleaving of system calls and callbacks when many transfers
+ * complete at once, at the expense of a slightly higher latency for the
+ * first completions of a batch.
  *
- * Some platforms supported by libusb do not come with this baggage - any
- * events relevant to timing will be represented by activity on the file
- * descriptor set, and libusb_get_next_timeout() will always return 0.
- * This function allows you to detect whether you are running on such a
- * platform.
+ * Batching is currently implemented by the Linux backend only. On other
+ * platforms this setting is accepted but has no effect.
  *
- * Since v1.0.5.
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 if you must call into libusb at times determined by
- * libusb_get_next_timeout(), or 1 if all timeout events are handled internally
- * or through regular activity on the file descriptors.
- * \ref pollmain "Polling libusb file descriptors for event handling"
+ * \param batch_size maximum number of completions per batch, or 0 to
+ * disable batching
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if batch_size is negative
+ * \see libusb_get_event_stats()
  */
-int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
+int API_EXPORTED libusb_set_event_batch_size(libusb_context *ctx,
+	int batch_size)
 {
-#if defined(USBI_TIMERFD_AVAILABLE)
+	if (batch_size < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
 	USBI_GET_CONTEXT(ctx);
-	return usbi_using_timerfd(ctx);
-#else
-	(void)ctx;
+	ctx->event_batch_size = batch_size;
 	return 0;
-#endif
 }
 
 /** \ingroup poll
- * Determine the next internal timeout that libusb needs to handle. You only
- * need to use this function if you are calling poll() or select() or similar
- * on libusb's file descriptors yourself - you do not need to use it if you
- * are calling libusb_handle_events() or a variant directly.
+ * Let the event handler busy-poll a device handle for completions before
+ * it sleeps in poll(), which saves the scheduler latency of being woken up
+ * at the cost of CPU time. This is meant for latency-critical interrupt and
+ * bulk endpoints.
  *
- * You should call this function in your main loop in order to determine how
- * long to wait for select() or poll() to return results. libusb needs to be
- * called into at this timeout, so you should use it as an upper bound on
- * your select() or poll() call.
+ * While transfers are in flight on the handle, each round of event
+ * handling first spins checking the handle for a completion, for up to
+ * budget_us microseconds or the event handling timeout, whichever is
+ * shorter. If no transfer completed by then, the event handler goes on to
+ * poll() as usual. Other file descriptors are not looked at while
+ * spinning, so their events may be delayed by up to the budget.
  *
- * When the timeout has expired, call into libusb_handle_events_timeout()
- * (perhaps in non-blocking mode) so that libusb can handle the timeout.
+ * The busy_poll_hits and busy_poll_sleeps fields of \ref libusb_event_stats
+ * count how often spinning paid off.
  *
- * This function may return 1 (success) and an all-zero timeval. If this is
- * the case, it indicates that libusb has a timeout that has already expired
- * so you should call libusb_handle_events_timeout() or similar immediately.
- * A return code of 0 indicates that there are no pending timeouts.
+ * Busy-polling is currently implemented by the Linux backend only.
  *
- * On some platforms, this function will always returns 0 (no pending
- * timeouts). See \ref polltime.
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param budget_us the longest time in microseconds to spin per round of
+ * event handling, or 0 to disable busy-polling for the handle
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot busy-poll
+ * \see libusb_get_event_stats()
+ */
+int API_EXPORTED libusb_set_busy_poll(libusb_device_handle *dev_handle,
+	unsigned int budget_us)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+
+	if (!usbi_backend->busy_poll)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_dbg("budget %uus", budget_us);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (!dev_handle->busy_poll_budget && budget_us)
+		ctx->busy_poll_handles++;
+	else if (dev_handle->busy_poll_budget && !budget_us)
+		ctx->busy_poll_handles--;
+	dev_handle->busy_poll_budget = budget_us;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+}
+
+/** \ingroup poll
+ * Give a device handle a thread of its own which waits for the completions
+ * of its transfers and processes them as soon as the kernel reports them.
+ * The handle is taken out of the file descriptors monitored by the event
+ * handler, so that its transfers are neither delayed by the wakeup of the
+ * event handler, nor by the completions of other devices handled in the
+ * same round. This is meant to isolate a latency-critical device from busy
+ * devices in the same process.
+ *
+ * With a dedicated reaper, the callbacks of the handle's transfers are
+ * called from that thread, concurrently with the callbacks of other
+ * handles called by the event handler, unless the transfers are flagged
+ * with \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+ * "LIBUSB_TRANSFER_QUEUE_COMPLETION". Events must still be handled as usual
+ * for transfer timeouts and hotplug notifications. The handle must not be
+ * closed from the callback of one of its transfers.
+ *
+ * libusb_close() stops the reaper of the handle first. Stopping it sends a
+ * GET_STATUS request to the device, so that the reaper wakes up, and waits
+ * for the callback the reaper may be running to return. A reaper which
+ * stopped on its own, after an error, is started again by enabling it.
+ * Synchronous transfers on the handle can not be performed from the
+ * callbacks the reaper calls, since only the reaper could complete them.
+ * They fail with LIBUSB_ERROR_BUSY.
+ *
+ * Dedicated reapers are currently implemented by the Linux backend only.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param enable non-zero to start a reaper for the handle, 0 to stop it
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the handle belongs to an event domain, if
+ * another thread is stopping the reaper, or if called from the reaper
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform has no dedicated
+ * reapers
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_dedicated_reaper(libusb_device_handle *dev_handle,
+	int enable)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int stop = 0;
+	int r = 0;
+
+	if (!usbi_backend->set_dedicated_reaper)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_dbg("enable %d", enable);
+	ctx_begin_modify(ctx);
+	if (dev_handle->event_domain
+			|| dev_handle->dedicated_reaper == USBI_REAPER_STOPPING) {
+		r = LIBUSB_ERROR_BUSY;
+	} else if (enable) {
+		/* also restarts a reaper which stopped on its own */
+		r = usbi_backend->set_dedicated_reaper(dev_handle, 1);
+		if (r == 0)
+			dev_handle->dedicated_reaper = USBI_REAPER_RUNNING;
+	} else if (dev_handle->dedicated_reaper == USBI_REAPER_RUNNING) {
+		dev_handle->dedicated_reaper = USBI_REAPER_STOPPING;
+		stop = 1;
+	}
+	ctx_end_modify(ctx);
+
+	if (!stop)
+		return r;
+
+	/* the reaper is joined without the events lock, which its callbacks
+	 * may take */
+	r = usbi_backend->set_dedicated_reaper(dev_handle, 0);
+
+	ctx_begin_modify(ctx);
+	dev_handle->dedicated_reaper = r == 0 ? USBI_REAPER_OFF
+		: USBI_REAPER_RUNNING;
+	ctx_end_modify(ctx);
+	return r;
+}
+
+/** \ingroup poll
+ * Retrieve event handling statistics for a context. This can be used to
+ * evaluate the effect of settings such as libusb_set_event_batch_size().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param tv output location for a relative time against the current
- * clock in which libusb must be called into in order to process timeout events
- * \returns 0 if there are no pending timeouts, 1 if a timeout was returned,
- * or LIBUSB_ERROR_OTHER on failure
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
  */
-int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
-	struct timeval *tv)
+int API_EXPORTED libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats)
 {
-	struct usbi_transfer *transfer;
-	struct timespec cur_ts;
-	struct timeval cur_tv;
-	struct timeval *next_timeout;
-	int r;
-	int found = 0;
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
 	USBI_GET_CONTEXT(ctx);
-	if (usbi_using_timerfd(ctx))
-		return 0;
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	*stats = ctx->event_stats;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+	return 0;
+}
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
+/* Backends call this after dispatching a batch of completions, see
+ * libusb_set_event_batch_size(). */
+void usbi_record_event_batch(struct libusb_context *ctx,
+	unsigned int num_completions, uint64_t elapsed_ns)
+{
+	struct libusb_event_stats *stats = &ctx->event_stats;
+
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	stats->batches++;
+	stats->batched_completions += num_completions;
+	if (num_completions > stats->max_batch_completions)
+		stats->max_batch_completions = num_completions;
+	stats->batch_time += elapsed_ns;
+	if (elapsed_ns > stats->max_batch_time)
+		stats->max_batch_time = elapsed_ns;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+}
 
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+/* the largest trace ring libusb_set_trace() allocates */
+#define MAX_TRACE_EVENTS (1 << 24)
 
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
+/* record a trace event which happened at the given monotonic time, or at an
+ * unknown time if it is NULL */
+static void trace_event_at(struct libusb_context *ctx,
+	const struct timespec *when, enum libusb_trace_event_type type,
+	struct libusb_transfer *transfer, unsigned char endpoint, int length,
+	int status)
+{
+	struct usbi_trace_slot *slots = ctx->trace_slots;
+	struct usbi_trace_slot *slot;
+	unsigned long seq;
 
-		found = 1;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (!slots)
+		return;
 
-	if (!found) {
-		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
-		return 0;
-	}
+	seq = (unsigned long)usbi_atomic_inc(&ctx->trace_head);
+	slot = &slots[seq & ctx->trace_mask];
+	slot->seq = 0;
+	usbi_memory_barrier();
 
-	next_timeout = &transfer->timeout;
+	if (when)
+		slot->event.timestamp = (uint64_t)when->tv_sec * 1000000000
+			+ when->tv_nsec;
+	else
+		slot->event.timestamp = 0;
+	slot->event.transfer = transfer;
+	slot->event.sequence = (uint32_t)seq;
+	slot->event.type = (uint8_t)type;
+	slot->event.endpoint = endpoint;
+	slot->event.length = length;
+	slot->event.status = status;
+
+	usbi_memory_barrier();
+	slot->seq = seq;
+}
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
-	if (r < 0) {
-		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+void usbi_trace_event(struct libusb_context *ctx,
+	enum libusb_trace_event_type type, struct libusb_transfer *transfer,
+	unsigned char endpoint, int length, int status)
+{
+	struct timespec now;
+
+	trace_event_at(ctx,
+		usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) == 0
+			? &now : NULL,
+		type, transfer, endpoint, length, status);
+}
+
+/* record a synchronous transfer which the backend carried out by itself, as
+ * a submission at start followed by a reap with its transfer status */
+void usbi_trace_sync_transfer(struct libusb_context *ctx,
+	unsigned char endpoint, int length, int transferred,
+	enum libusb_transfer_status status, const struct timespec *start)
+{
+	trace_event_at(ctx, start->tv_sec || start->tv_nsec ? start : NULL,
+		LIBUSB_TRACE_SUBMIT, NULL, endpoint, length, 0);
+	usbi_trace_event(ctx, LIBUSB_TRACE_REAP, NULL, endpoint, transferred,
+		status);
+}
+
+/** \ingroup poll
+ * Enable or disable the trace ring of a context. While enabled, libusb
+ * records the lifecycle of every transfer, from its submission to the
+ * return of its callback, as small binary events in a ring of the given
+ * size, overwriting the oldest events once it is full. Recording an event
+ * takes a clock reading and an atomic increment, and no lock, so tracing can
+ * stay enabled under load. While disabled, the cost is a single test per
+ * event.
+ *
+ * The ring is allocated the first time tracing is enabled, and kept until
+ * the context is destroyed, so that events recorded before tracing was
+ * disabled can still be dumped with libusb_dump_trace() or
+ * libusb_dump_trace_to_file(). A single ring is shared by all threads of
+ * the context.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_events size of the ring, rounded up to a power of two, or 0
+ * to disable tracing. The size of an existing ring is not changed
+ * \returns the size of the ring if tracing was enabled, 0 if it was
+ * disabled
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_events is negative
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_set_trace(libusb_context *ctx, int num_events)
+{
+	struct usbi_trace_slot *slots;
+	unsigned int size = 1;
+	int r;
+
+	if (num_events < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!num_events) {
+		ctx->trace_enabled = 0;
 		return 0;
 	}
-	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
-		usbi_dbg("first timeout already expired");
-		timerclear(tv);
-	} else {
-		timersub(next_timeout, &cur_tv, tv);
-		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	if (!ctx->trace_slots) {
+		while (size < (unsigned int)num_events && size < MAX_TRACE_EVENTS)
+			size <<= 1;
+		slots = calloc(size, sizeof(*slots));
+		if (!slots) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		/* publish the ring only once it is fully set up */
+		ctx->trace_mask = size - 1;
+		usbi_memory_barrier();
+		ctx->trace_slots = slots;
 	}
+	usbi_memory_barrier();
+	ctx->trace_enabled = 1;
+	r = (int)(ctx->trace_mask + 1);
+	usbi_dbg("trace ring of %d events", r);
 
-	return 1;
+out:
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+	return r;
 }
 
 /** \ingroup poll
- * Register notification functions for file descriptor additions/removals.
- * These functions will be invoked for every new or removed file descriptor
- * that libusb uses as an event source.
- *
- * To remove notifiers, pass NULL values for the function pointers.
- *
- * Note that file descriptors may have been added even before you register
- * these notifiers (e.g. at libusb_init() time).
+ * Pass the events held by the trace ring of a context to a callback, oldest
+ * first. This may be called while events are being recorded; an event
+ * which gets overwritten while it is read is skipped.
  *
- * Additionally, note that the removal notifier may be called during
- * libusb_exit() (e.g. when it is closing file descriptors that were opened
- * and added to the poll set at libusb_init() time). If you don't want this,
- * remove the notifiers immediately before calling libusb_exit().
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \param added_cb pointer to function for addition notifications
- * \param removed_cb pointer to function for removal notifications
- * \param user_data User data to be passed back to callbacks (useful for
- * passing context information)
+ * \param callback function called for each event
+ * \param user_data user data to pass to the callback
+ * \returns the number of events passed to the callback
+ * \returns LIBUSB_ERROR_INVALID_PARAM if callback is NULL
  */
-void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
-	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
-	void *user_data)
+int API_EXPORTED libusb_dump_trace(libusb_context *ctx,
+	libusb_trace_cb_fn callback, void *user_data)
 {
+	struct usbi_trace_slot *slots;
+	struct libusb_trace_event event;
+	unsigned long head, seq, count, i;
+	unsigned int mask;
+	int n = 0;
+
+	if (!callback)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
 	USBI_GET_CONTEXT(ctx);
-	ctx->fd_added_cb = added_cb;
-	ctx->fd_removed_cb = removed_cb;
-	ctx->fd_cb_user_data = user_data;
-}
+	usbi_mutex_lock(&ctx->event_stats_lock);
+	slots = ctx->trace_slots;
+	mask = ctx->trace_mask;
+	usbi_mutex_unlock(&ctx->event_stats_lock);
+	if (!slots)
+		return 0;
 
-/* Add a file descriptor to the list of file descriptors to be monitored.
- * events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
-{
-	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
-	if (!ipollfd)
-		return LIBUSB_ERROR_NO_MEM;
+	head = (unsigned long)ctx->trace_head;
+	count = head < (unsigned long)mask + 1 ? head : (unsigned long)mask + 1;
+	for (i = count; i > 0; i--) {
+		struct usbi_trace_slot *slot;
 
-	usbi_dbg("add fd %d events %d", fd, events);
-	ipollfd->pollfd.fd = fd;
-	ipollfd->pollfd.events = events;
-	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_add_tail(&ipollfd->list, &ctx->pollfds);
-	usbi_mutex_unlock(&ctx->pollfds_lock);
+		seq = head - i + 1;
+		slot = &slots[seq & mask];
+		if (slot->seq != seq)
+			continue;
+		usbi_memory_barrier();
+		event = slot->event;
+		usbi_memory_barrier();
+		if (slot->seq != seq)
+			continue;
 
-	if (ctx->fd_added_cb)
-		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
-	return 0;
+		callback(&event, user_data);
+		n++;
+	}
+
+	return n;
 }
 
-/* Remove a file descriptor from the list of file descriptors to be polled. */
-void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
+static const char *trace_event_name(uint8_t type)
 {
-	struct usbi_pollfd *ipollfd;
-	int found = 0;
-
-	usbi_dbg("remove fd %d", fd);
-	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		if (ipollfd->pollfd.fd == fd) {
-			found = 1;
-			break;
-		}
-
-	if (!found) {
-		usbi_dbg("couldn't find fd %d to remove", fd);
-		usbi_mutex_unlock(&ctx->pollfds_lock);
-		return;
+	switch (type) {
+	case LIBUSB_TRACE_SUBMIT:
+		return "submit";
+	case LIBUSB_TRACE_BACKEND_SUBMIT:
+		return "backend-submit";
+	case LIBUSB_TRACE_REAP:
+		return "reap";
+	case LIBUSB_TRACE_TIMEOUT:
+		return "timeout";
+	case LIBUSB_TRACE_CANCEL:
+		return "cancel";
+	case LIBUSB_TRACE_CALLBACK_ENTER:
+		return "callback-enter";
+	case LIBUSB_TRACE_CALLBACK_EXIT:
+		return "callback-exit";
+	default:
+		return "unknown";
 	}
+}
 
-	list_del(&ipollfd->list);
-	usbi_mutex_unlock(&ctx->pollfds_lock);
-	free(ipollfd);
-	if (ctx->fd_removed_cb)
-		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
+static void LIBUSB_CALL write_trace_event(
+	const struct libusb_trace_event *event, void *user_data)
+{
+	FILE *f = user_data;
+
+	fprintf(f, "%u %llu.%09llu %s transfer=%p ep=%02x length=%d status=%d\n",
+		(unsigned int)event->sequence,
+		(unsigned long long)(event->timestamp / 1000000000),
+		(unsigned long long)(event->timestamp % 1000000000),
+		trace_event_name(event->type), (void *)event->transfer,
+		event->endpoint, event->length, event->status);
 }
 
 /** \ingroup poll
- * Retrieve a list of file descriptors that should be polled by your main loop
- * as libusb event sources.
- *
- * The returned list is NULL-terminated and should be freed with free() when
- * done. The actual list contents must not be touched.
+ * Write the events held by the trace ring of a context to a file, oldest
+ * first, one line of text per event: its sequence number, timestamp in
+ * seconds, type, transfer address, endpoint, length and status.
  *
- * As file descriptors are a Unix-specific concept, this function is not
- * available on Windows and will always return NULL.
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \returns a NULL-terminated list of libusb_pollfd structures
- * \returns NULL on error
- * \returns NULL on platforms where the functionality is not available
+ * \param filename path of the file to create or truncate
+ * \returns the number of events written
+ * \returns LIBUSB_ERROR_INVALID_PARAM if filename is NULL
+ * \returns LIBUSB_ERROR_IO if the file could not be written
  */
-DEFAULT_VISIBILITY
-const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
-	libusb_context *ctx)
+int API_EXPORTED libusb_dump_trace_to_file(libusb_context *ctx,
+	const char *filename)
 {
-#ifndef OS_WINDOWS
-	struct libusb_pollfd **ret = NULL;
-	struct usbi_pollfd *ipollfd;
-	size_t i = 0;
-	size_t cnt = 0;
-	USBI_GET_CONTEXT(ctx);
-
-	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		cnt++;
+	FILE *f;
+	int r;
 
-	ret = calloc(cnt + 1, sizeof(struct libusb_pollfd *));
-	if (!ret)
-		goto out;
+	if (!filename)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		ret[i++] = (struct libusb_pollfd *) ipollfd;
-	ret[cnt] = NULL;
+	f = fopen(filename, "w");
+	if (!f) {
+		usbi_err(ctx, "failed to open %s (errno %d)", filename, errno);
+		return LIBUSB_ERROR_IO;
+	}
 
-out:
-	usbi_mutex_unlock(&ctx->pollfds_lock);
-	return (const struct libusb_pollfd **) ret;
-#else
-	usbi_err(ctx, "external polling of libusb's internal descriptors "\
-		"is not yet supported on Windows platforms");
-	return NULL;
-#endif
+	r = libusb_dump_trace(ctx, write_trace_event, f);
+	if (fclose(f) != 0 && r >= 0)
+		r = LIBUSB_ERROR_IO;
+	return r;
 }
 
 /* Backends may call this from handle_events to report disconnection of a
@@ -46,6 +46,7 @@
 typedef unsigned __int8   uint8_t;
 typedef unsigned __int16  uint16_t;
 typedef unsigned __int32  uint32_t;
+typedef unsigned __int64  uint64_t;
 #else
 #include <stdint.h>
 #endif
@@ -144,7 +145,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x01000103
+#define LIBUSB_API_VERSION 0x01000104
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -865,6 +866,55 @@ struct libusb_container_id_descriptor {
 	uint8_t  ContainerID[16];
 };
 
+/** \ingroup desc
+ * A cursor over the raw descriptors of a configuration, set up with
+ * libusb_init_descriptor_iterator() and advanced with
+ * libusb_next_descriptor(). Walking a configuration this way does not
+ * allocate any memory.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_descriptor_iterator {
+	/** The raw bytes of the current descriptor, bLength bytes long */
+	const unsigned char *raw;
+
+	/** Size of the current descriptor (in bytes) */
+	uint8_t bLength;
+
+	/** Type of the current descriptor, see \ref libusb_descriptor_type */
+	uint8_t bDescriptorType;
+
+	/** bInterfaceNumber of the interface descriptor the current
+	 * descriptor follows, or -1 if it precedes all interfaces */
+	int interface_number;
+
+	/** bAlternateSetting of the interface descriptor the current
+	 * descriptor follows, or -1 if it precedes all interfaces */
+	int altsetting;
+
+	/** A copy of the current descriptor with multiple-byte fields in
+	 * host-endian format, valid for the member matching bDescriptorType:
+	 * config for \ref libusb_descriptor_type::LIBUSB_DT_CONFIG
+	 * "LIBUSB_DT_CONFIG", interface for \ref
+	 * libusb_descriptor_type::LIBUSB_DT_INTERFACE "LIBUSB_DT_INTERFACE",
+	 * endpoint for \ref libusb_descriptor_type::LIBUSB_DT_ENDPOINT
+	 * "LIBUSB_DT_ENDPOINT" and ss_ep_comp for \ref
+	 * libusb_descriptor_type::LIBUSB_DT_SS_ENDPOINT_COMPANION
+	 * "LIBUSB_DT_SS_ENDPOINT_COMPANION". Pointer members and extra are
+	 * always NULL. Other descriptors are only available through raw. */
+	union {
+		struct libusb_config_descriptor config;
+		struct libusb_interface_descriptor interface;
+		struct libusb_endpoint_descriptor endpoint;
+		struct libusb_ss_endpoint_companion_descriptor ss_ep_comp;
+	} desc;
+
+	/* private data, do not touch */
+	const unsigned char *next;
+	int remaining;
+	int host_endian;
+};
+
 /** \ingroup asyncio
  * Setup packet for control transfers. */
 struct libusb_control_setup {
@@ -1172,6 +1222,106 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Do not invoke the transfer callback on completion, but queue the
+	 * transfer on the completion queue of its context instead, from where
+	 * it is retrieved with libusb_reap_completions(). The callback field is
+	 * ignored, and the user_data field can be used to tag the transfer.
+	 *
+	 * A queued transfer must not be resubmitted or freed before it has been
+	 * reaped. \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+	 * "LIBUSB_TRANSFER_FREE_TRANSFER" is ignored for such transfers.
+	 * The flag cannot be used on handles which belong to an event domain,
+	 * see libusb_event_domain_add_handle().
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_QUEUE_COMPLETION = 1 << 4,
+
+	/** Interpret the timeout field of the transfer in microseconds rather
+	 * than milliseconds, for deadlines shorter than a millisecond or not
+	 * on a millisecond boundary.
+	 *
+	 * Where the operating system handles transfer timeouts itself, as the
+	 * Darwin and BSD backends do, the timeout is rounded up to the next
+	 * millisecond. On Linux, the deadline is honoured with the full
+	 * resolution of the timerfd, or of ppoll() and epoll_pwait2() when
+	 * those are available.
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_TIMEOUT_USEC = 1 << 5,
+
+	/** Resubmit the transfer as soon as its callback returns, for polling
+	 * interrupt endpoints or streaming from bulk endpoints without having
+	 * to call libusb_submit_transfer() from the callback. This is cheaper
+	 * than resubmitting by hand: the timer used for transfer timeouts is
+	 * only reprogrammed once, after the transfer was submitted again, and
+	 * only if the earliest timeout changed. The transfer still leaves the
+	 * list of pending transfers while its callback runs, and is added again
+	 * by its new timeout.
+	 *
+	 * The transfer is only resubmitted after completing with
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED". On any other status, including
+	 * cancellation and disconnection of the device, the callback is invoked
+	 * as usual and the transfer is left alone. To stop resubmission from
+	 * the callback, clear this flag or cancel the transfer after it was
+	 * resubmitted. If resubmission fails, the callback is invoked once more
+	 * with \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR
+	 * "LIBUSB_TRANSFER_ERROR", or with
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_NO_DEVICE
+	 * "LIBUSB_TRANSFER_NO_DEVICE" if the device is gone.
+	 *
+	 * The callback must neither free nor resubmit a transfer which still
+	 * has this flag set. It cannot be combined with
+	 * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+	 * "LIBUSB_TRANSFER_FREE_TRANSFER" or
+	 * \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+	 * "LIBUSB_TRANSFER_QUEUE_COMPLETION".
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_AUTO_RESUBMIT = 1 << 6,
+
+	/** Do not invoke the transfer callback from the thread handling
+	 * events, but hand it to the callback workers started with
+	 * libusb_start_callback_workers(). The event handler then only reaps
+	 * the completion and goes on with the next one, so that a slow callback
+	 * does not hold up the completions of other endpoints and devices.
+	 *
+	 * The callbacks of the transfers of one endpoint of a device handle are
+	 * run one at a time, in the order the transfers completed. Callbacks of
+	 * different endpoints may run concurrently. If no callback workers are
+	 * running, the callback is invoked by the event handler as usual.
+	 *
+	 * The thread handling events is woken up when a deferred callback
+	 * returns, so libusb_handle_events_completed() sees a flag set by the
+	 * callback, and so do threads waiting in libusb_wait_for_event(). Once
+	 * libusb_close() was called on the handle, callbacks are invoked by the
+	 * event handler again. This flag is ignored
+	 * together with \ref libusb_transfer_flags::LIBUSB_TRANSFER_QUEUE_COMPLETION
+	 * "LIBUSB_TRANSFER_QUEUE_COMPLETION".
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_DEFER_CALLBACK = 1 << 7,
+};
+
+/** \ingroup asyncio
+ * Priority classes of transfers, see libusb_set_handle_priority() and
+ * libusb_transfer_set_priority(). */
+enum libusb_priority {
+	/** Background traffic, such as bulk logging, whose callbacks make way
+	 * for pending completions of high-priority handles */
+	LIBUSB_PRIORITY_LOW = -1,
+
+	/** The default class */
+	LIBUSB_PRIORITY_NORMAL = 0,
+
+	/** Latency-sensitive traffic, such as control requests or interrupt
+	 * endpoints, whose completions are reaped and dispatched first */
+	LIBUSB_PRIORITY_HIGH = 1,
 };
 
 /** \ingroup asyncio
@@ -1302,15 +1452,64 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Callback receiving the messages logged by libusb, see libusb_set_log_cb().
+ * \param ctx the context which logged the message
+ * \param level the level of the message
+ * \param str the formatted message, including its header and line end
+ */
+typedef void (LIBUSB_CALL *libusb_log_cb)(libusb_context *ctx,
+	enum libusb_log_level level, const char *str);
+
+/** \ingroup lib
+ * Flags for libusb_set_log_cb()
+ */
+enum libusb_log_cb_flag {
+	/** Pass messages to the callback from a background thread, so that the
+	 * thread logging a message only formats and queues it */
+	LIBUSB_LOG_CB_ASYNC = 1 << 0,
+};
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
+	int flags);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
 int LIBUSB_CALL libusb_setlocale(const char *locale);
 const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode);
 
+/** \ingroup misc
+ * Contention statistics of one of the internal locks of libusb, as returned
+ * by libusb_get_lock_stats(). Times are in nanoseconds.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_lock_stats {
+	/** Name of the lock, valid for the lifetime of the process */
+	const char *name;
+
+	/** Number of times the lock was taken */
+	uint64_t acquisitions;
+
+	/** Number of times the lock was held by another thread when taken */
+	uint64_t contended;
+
+	/** Total time spent waiting for the lock */
+	uint64_t wait_ns;
+
+	/** Total time the lock was held */
+	uint64_t hold_ns;
+
+	/** Longest time the lock was held at once */
+	uint64_t max_hold_ns;
+};
+
+int LIBUSB_CALL libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int max_stats);
+
 void LIBUSB_CALL libusb_set_device_user_data(libusb_device *device, 
 	void *user_data);
 void * LIBUSB_CALL libusb_get_device_user_data(libusb_device *device);
@@ -1318,6 +1517,42 @@ ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list);
 void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
 	int unref_devices);
+int LIBUSB_CALL libusb_get_device_list_generation(libusb_context *ctx,
+	unsigned int *generation);
+
+/** \ingroup dev
+ * Memory held for the devices of a context, as returned by
+ * libusb_get_memory_stats(). All sizes are in bytes.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_memory_stats {
+	/** Number of devices the context knows of */
+	uint64_t devices;
+
+	/** Size of the device records, including the private data of the
+	 * platform backend */
+	uint64_t device_bytes;
+
+	/** Descriptors and other data held by the backend for the devices.
+	 * Data shared with identical devices, or with the same device in other
+	 * contexts, is divided between its holders */
+	uint64_t descriptor_bytes;
+
+	/** Parsed configuration descriptors and cached string descriptors */
+	uint64_t cache_bytes;
+
+	/** The device list kept by the context for libusb_get_device_list().
+	 * Lists returned to the application are not included */
+	uint64_t device_list_bytes;
+
+	/** All of the data shared between devices, of every context in the
+	 * process */
+	uint64_t shared_bytes;
+};
+
+int LIBUSB_CALL libusb_get_memory_stats(libusb_context *ctx,
+	struct libusb_memory_stats *stats);
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev);
 void LIBUSB_CALL libusb_unref_device(libusb_device *dev);
 
@@ -1333,6 +1568,10 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+void LIBUSB_CALL libusb_init_descriptor_iterator(
+	const struct libusb_config_descriptor *config,
+	struct libusb_descriptor_iterator *iter);
+int LIBUSB_CALL libusb_next_descriptor(struct libusb_descriptor_iterator *iter);
 int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
 	struct libusb_context *ctx,
 	const struct libusb_endpoint_descriptor *endpoint,
@@ -1397,6 +1636,26 @@ int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
 int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
 	unsigned char *endpoints, int num_endpoints);
 
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length);
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length);
+
+/** \ingroup dev
+ * Size for libusb_set_bulk_urb_size() asking for transfers to be split into
+ * as few units as the kernel allows.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+#define LIBUSB_BULK_URB_SIZE_UNLIMITED	(-1)
+
+int LIBUSB_CALL libusb_set_bulk_urb_size(libusb_device_handle *dev,
+	unsigned char endpoint, int size);
+int LIBUSB_CALL libusb_get_bulk_urb_size(libusb_device_handle *dev,
+	unsigned char endpoint);
+int LIBUSB_CALL libusb_set_raw_io(libusb_device_handle *dev,
+	unsigned char endpoint, int enable);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
@@ -1479,14 +1738,276 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 	setup->wLength = libusb_cpu_to_le16(wLength);
 }
 
+/** \ingroup asyncio
+ * Structure representing a pool of preallocated transfers. This is an opaque
+ * type for which you are only ever provided with a pointer, usually
+ * originating from libusb_alloc_transfer_pool().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+typedef struct libusb_transfer_pool libusb_transfer_pool;
+
+/** \ingroup poll
+ * Structure representing an event domain, a set of device handles whose
+ * events are handled separately from those of the rest of the context. This
+ * is an opaque type for which you are only ever provided with a pointer,
+ * usually originating from libusb_alloc_event_domain().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+typedef struct libusb_event_domain libusb_event_domain;
+
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results);
+int LIBUSB_CALL libusb_reap_completions(libusb_context *ctx,
+	struct libusb_transfer **transfers, int max_transfers, struct timeval *tv);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint);
+int LIBUSB_CALL libusb_cancel_handle_transfers(
+	libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_get_iso_packet_time(struct libusb_transfer *transfer,
+	unsigned int packet, struct timeval *tv);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_alloc_transfer_pool(libusb_context *ctx,
+	int num_transfers, int iso_packets, int max_length,
+	libusb_transfer_pool **pool);
+struct libusb_transfer * LIBUSB_CALL libusb_pool_get_transfer(
+	libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_free_transfer_pool(libusb_transfer_pool *pool);
+
+/** \ingroup asyncio
+ * Structure representing a streaming ring, which keeps an IN endpoint
+ * continuously busy with a ring of buffers. This is an opaque type for which
+ * you are only ever provided with a pointer, usually originating from
+ * libusb_alloc_ring().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+typedef struct libusb_ring libusb_ring;
+
+/** \ingroup asyncio
+ * Ring notification callback function pointer type. Called from the event
+ * handler whenever a ring buffer has been filled with data. The callback
+ * must not block; it typically wakes up the thread consuming the data.
+ *
+ * \param ring the ring which has data available
+ * \param user_data user data provided to libusb_alloc_ring()
+ */
+typedef void (LIBUSB_CALL *libusb_ring_cb_fn)(libusb_ring *ring,
+	void *user_data);
+
+/** \ingroup asyncio
+ * Counters of a streaming ring, as returned by libusb_get_ring_stats().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_ring_stats {
+	/** Number of transfers which completed with data */
+	uint64_t transfers;
+
+	/** Number of bytes received */
+	uint64_t bytes;
+
+	/** Number of times a transfer completed while no free buffer was left
+	 * to resubmit, i.e. the consumer fell behind and fewer transfers than
+	 * the queue depth were in flight until it caught up */
+	uint64_t overruns;
+
+	/** Number of transfers which completed with an error */
+	uint64_t errors;
+
+	/** Number of transfers currently in flight */
+	int in_flight;
+
+	/** Number of filled buffers waiting to be consumed */
+	int filled;
+};
+
+int LIBUSB_CALL libusb_alloc_ring(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_buffers, int queue_depth,
+	int buffer_length, int num_iso_packets, libusb_ring_cb_fn callback,
+	void *user_data, libusb_ring **ring);
+int LIBUSB_CALL libusb_start_ring(libusb_ring *ring);
+int LIBUSB_CALL libusb_stop_ring(libusb_ring *ring);
+void LIBUSB_CALL libusb_free_ring(libusb_ring *ring);
+int LIBUSB_CALL libusb_ring_read(libusb_ring *ring, unsigned char **data,
+	int *length);
+void LIBUSB_CALL libusb_ring_release(libusb_ring *ring);
+/** \ingroup asyncio
+ * Transfer settings of a streaming ring, as returned by
+ * libusb_get_ring_tuning().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_ring_tuning {
+	/** Throughput over the last measurement window, in bytes per second.
+	 * Only measured while autotuning is enabled */
+	uint64_t throughput;
+
+	/** Average time from submission to completion of the transfers of the
+	 * last measurement window, in microseconds. Only measured while
+	 * autotuning is enabled */
+	uint64_t latency_us;
+
+	/** Number of transfers the ring keeps in flight */
+	int queue_depth;
+
+	/** Length of each transfer */
+	int transfer_length;
+
+	/** 1 while autotuning is still trying out settings, 0 once it settled
+	 * on the ones above or if it is disabled */
+	int warming_up;
+};
+
+int LIBUSB_CALL libusb_get_ring_stats(libusb_ring *ring,
+	struct libusb_ring_stats *stats);
+int LIBUSB_CALL libusb_set_ring_autotune(libusb_ring *ring, int enable);
+int LIBUSB_CALL libusb_get_ring_tuning(libusb_ring *ring,
+	struct libusb_ring_tuning *tuning);
+
+/** \ingroup asyncio
+ * Structure representing a stream scheduler, which spreads the transfers of
+ * a USB 3 bulk endpoint over its streams. This is an opaque type for which
+ * you are only ever provided with a pointer, usually originating from
+ * libusb_alloc_stream_scheduler().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+typedef struct libusb_stream_scheduler libusb_stream_scheduler;
+
+/** \ingroup asyncio
+ * Counters of a stream, or of all streams of a scheduler, as returned by
+ * libusb_get_stream_stats().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_stream_stats {
+	/** Number of transfers which completed successfully */
+	uint64_t transfers;
+
+	/** Number of bytes transferred */
+	uint64_t bytes;
+
+	/** Number of transfers which completed with another status */
+	uint64_t errors;
+
+	/** Average time between the submission of a transfer to the stream
+	 * and its completion, in microseconds */
+	uint64_t avg_latency_us;
+
+	/** Longest time between the submission of a transfer to the stream and
+	 * its completion, in microseconds */
+	uint64_t max_latency_us;
+
+	/** Number of transfers currently in flight on the stream */
+	int in_flight;
+
+	/** Number of transfers waiting for room on a stream. Only reported
+	 * for the whole scheduler, i.e. stream ID 0 */
+	int queued;
+};
+
+int LIBUSB_CALL libusb_alloc_stream_scheduler(libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t num_streams, int queue_depth,
+	libusb_stream_scheduler **sched);
+int LIBUSB_CALL libusb_stream_submit(libusb_stream_scheduler *sched,
+	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_get_stream_stats(libusb_stream_scheduler *sched,
+	uint32_t stream_id, struct libusb_stream_stats *stats);
+void LIBUSB_CALL libusb_free_stream_scheduler(libusb_stream_scheduler *sched);
+
+/** \ingroup asyncio
+ * Number of buckets of the latency histogram of
+ * \ref libusb_endpoint_stats.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+#define LIBUSB_LATENCY_BUCKETS 32
+
+/** \ingroup asyncio
+ * Counters of the transfers of an endpoint, as returned by
+ * libusb_get_endpoint_stats().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_endpoint_stats {
+	/** Number of transfers submitted, including automatic
+	 * resubmissions */
+	uint64_t submitted;
+
+	/** Number of transfers which completed with status
+	 * \ref LIBUSB_TRANSFER_COMPLETED */
+	uint64_t completed;
+
+	/** Number of bytes transferred, whatever the status of the
+	 * transfers */
+	uint64_t bytes;
+
+	/** Number of completed transfers which transferred less data than
+	 * requested */
+	uint64_t short_transfers;
+
+	/** Number of transfers which timed out */
+	uint64_t timeouts;
+
+	/** Number of transfers which completed with a stall */
+	uint64_t stalls;
+
+	/** Number of transfers which were cancelled */
+	uint64_t cancelled;
+
+	/** Number of transfers which completed with another error */
+	uint64_t errors;
+
+	/** Number of transfers currently in flight */
+	int in_flight;
+
+	/** Largest number of transfers that were in flight at once */
+	int max_in_flight;
+
+	/** Histogram of the time from the submission of a transfer to its
+	 * completion being handed to the application. Bucket 0 counts the
+	 * transfers which took less than 2 microseconds, bucket i those which
+	 * took from 2^i to 2^(i+1) - 1 microseconds, and the last bucket also
+	 * counts everything slower */
+	uint64_t latency_us[LIBUSB_LATENCY_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats);
+
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_set_handle_priority(libusb_device_handle *dev_handle,
+	int priority);
+int LIBUSB_CALL libusb_transfer_set_priority(struct libusb_transfer *transfer,
+	int priority);
+int LIBUSB_CALL libusb_transfer_get_priority(struct libusb_transfer *transfer);
+
+/** \ingroup asyncio
+ * A segment of the data of a scatter/gather transfer, see
+ * libusb_fill_bulk_transfer_iov().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_iovec {
+	/** Start of the segment */
+	unsigned char *base;
+
+	/** Length of the segment in bytes */
+	int len;
+};
+
+int LIBUSB_CALL libusb_fill_bulk_transfer_iov(struct libusb_transfer *transfer,
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	const struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1746,6 +2267,46 @@ int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
 
+/** \ingroup syncio
+ * A control request of a batch performed with
+ * libusb_control_transfer_batch(). The wValue, wIndex and wLength fields
+ * are given in host-endian byte order.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_control_request {
+	/** Request type field for the setup packet. Its direction bit tells
+	 * whether data is written to or read from the device. */
+	uint8_t bmRequestType;
+
+	/** Request field for the setup packet */
+	uint8_t bRequest;
+
+	/** Value field for the setup packet */
+	uint16_t wValue;
+
+	/** Index field for the setup packet */
+	uint16_t wIndex;
+
+	/** Length field for the setup packet. The data buffer must be at least
+	 * this size. */
+	uint16_t wLength;
+
+	/** Data buffer for either output or input */
+	unsigned char *data;
+
+	/** Set on return: the number of bytes actually transferred, or a
+	 * LIBUSB_ERROR code as libusb_control_transfer() would return it.
+	 * \ref libusb_error::LIBUSB_ERROR_INTERRUPTED "LIBUSB_ERROR_INTERRUPTED"
+	 * means the request was not performed, or was cancelled, because an
+	 * earlier request of the batch failed. */
+	int result;
+};
+
+int LIBUSB_CALL libusb_control_transfer_batch(libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests,
+	int max_in_flight, unsigned int timeout);
+
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
@@ -1798,6 +2359,10 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_device_strings_ascii(libusb_device_handle *dev,
+	unsigned char *manufacturer, unsigned char *product,
+	unsigned char *serial_number, int length);
+void LIBUSB_CALL libusb_set_string_cache(libusb_device *dev, int enable);
 
 /* polling and timeouts */
 
@@ -1865,6 +2430,194 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
+int LIBUSB_CALL libusb_process_ready(libusb_context *ctx);
+
+/** \ingroup poll
+ * Event handling statistics for a context, as returned by
+ * libusb_get_event_stats(). All times are in nanoseconds.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_event_stats {
+	/** Number of completion batches dispatched by the event handler.
+	 * See libusb_set_event_batch_size(). */
+	uint64_t batches;
+
+	/** Total number of completions dispatched as part of a batch */
+	uint64_t batched_completions;
+
+	/** Number of completions in the largest batch */
+	uint64_t max_batch_completions;
+
+	/** Total time spent reaping and dispatching batches */
+	uint64_t batch_time;
+
+	/** Time spent on the longest batch */
+	uint64_t max_batch_time;
+
+	/** Number of times the timer used for transfer timeouts was armed or
+	 * disarmed. This only counts on platforms where libusb uses a timerfd,
+	 * and stays 0 elsewhere. */
+	uint64_t timerfd_reprograms;
+
+	/** Number of times the event handler busy-polled handles and handled a
+	 * completion before its budget ran out. See libusb_set_busy_poll(). */
+	uint64_t busy_poll_hits;
+
+	/** Number of times the event handler busy-polled handles for its whole
+	 * budget without a completion, and went on to sleep in poll() */
+	uint64_t busy_poll_sleeps;
+};
+
+/** \ingroup poll
+ * Transfer lifecycle events recorded by the trace ring, see
+ * libusb_set_trace().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+enum libusb_trace_event_type {
+	/** The application submitted the transfer. length is its length */
+	LIBUSB_TRACE_SUBMIT = 0,
+
+	/** The backend returned from submitting the transfer. status is the
+	 * result of the submission */
+	LIBUSB_TRACE_BACKEND_SUBMIT = 1,
+
+	/** The backend reaped part of the transfer from the operating system,
+	 * e.g. one URB on Linux. length is the amount of data it carried */
+	LIBUSB_TRACE_REAP = 2,
+
+	/** The timeout of the transfer expired */
+	LIBUSB_TRACE_TIMEOUT = 3,
+
+	/** The transfer was cancelled. status is the result of the
+	 * cancellation */
+	LIBUSB_TRACE_CANCEL = 4,
+
+	/** The callback of the transfer is about to be called. length is its
+	 * actual length and status its status */
+	LIBUSB_TRACE_CALLBACK_ENTER = 5,
+
+	/** The callback of the transfer returned. The transfer may have been
+	 * freed by then, so only its address is recorded */
+	LIBUSB_TRACE_CALLBACK_EXIT = 6,
+};
+
+/** \ingroup poll
+ * An event of the trace ring, as passed to a \ref libusb_trace_cb_fn.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_trace_event {
+	/** Time of the event on the monotonic clock, in nanoseconds */
+	uint64_t timestamp;
+
+	/** Address of the transfer. Only to be compared with other events, as
+	 * the transfer may no longer exist. NULL for a synchronous transfer
+	 * which the backend carried out without a libusb_transfer, which is
+	 * recorded as a \ref LIBUSB_TRACE_SUBMIT "LIBUSB_TRACE_SUBMIT" event
+	 * followed by a \ref LIBUSB_TRACE_REAP "LIBUSB_TRACE_REAP" event whose
+	 * status is a \ref libusb_transfer_status */
+	struct libusb_transfer *transfer;
+
+	/** Sequence number of the event, which grows by one per event */
+	uint32_t sequence;
+
+	/** Event type, see \ref libusb_trace_event_type */
+	uint8_t type;
+
+	/** Endpoint address of the transfer */
+	unsigned char endpoint;
+
+	/** Length in bytes, meaning depends on the event type */
+	int length;
+
+	/** Status or result code, meaning depends on the event type */
+	int status;
+};
+
+/** \ingroup poll
+ * Callback function pointer type for libusb_dump_trace().
+ *
+ * \param event the event, only valid during the call
+ * \param user_data user data passed to libusb_dump_trace()
+ */
+typedef void (LIBUSB_CALL *libusb_trace_cb_fn)(
+	const struct libusb_trace_event *event, void *user_data);
+
+int LIBUSB_CALL libusb_set_trace(libusb_context *ctx, int num_events);
+int LIBUSB_CALL libusb_dump_trace(libusb_context *ctx,
+	libusb_trace_cb_fn callback, void *user_data);
+int LIBUSB_CALL libusb_dump_trace_to_file(libusb_context *ctx,
+	const char *filename);
+
+int LIBUSB_CALL libusb_set_event_batch_size(libusb_context *ctx,
+	int batch_size);
+int LIBUSB_CALL libusb_set_busy_poll(libusb_device_handle *dev_handle,
+	unsigned int budget_us);
+int LIBUSB_CALL libusb_set_dedicated_reaper(libusb_device_handle *dev_handle,
+	int enable);
+int LIBUSB_CALL libusb_alloc_event_domain(libusb_context *ctx,
+	libusb_event_domain **domain);
+void LIBUSB_CALL libusb_free_event_domain(libusb_event_domain *domain);
+int LIBUSB_CALL libusb_event_domain_add_handle(libusb_event_domain *domain,
+	libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_event_domain_remove_handle(
+	libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_handle_domain_events_timeout_completed(
+	libusb_event_domain *domain, struct timeval *tv, int *completed);
+
+int LIBUSB_CALL libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats);
+
+/** \ingroup poll
+ * Scheduling policies for the threads started by libusb_start_event_thread().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+enum libusb_event_thread_sched {
+	/** Keep the policy and priority inherited from the calling thread */
+	LIBUSB_EVENT_THREAD_SCHED_DEFAULT = 0,
+
+	/** First-in first-out real-time scheduling (SCHED_FIFO) */
+	LIBUSB_EVENT_THREAD_SCHED_FIFO = 1,
+
+	/** Round-robin real-time scheduling (SCHED_RR) */
+	LIBUSB_EVENT_THREAD_SCHED_RR = 2,
+};
+
+/** \ingroup poll
+ * Options for libusb_start_event_thread().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_event_thread_options {
+	/** Number of threads to start. The first one handles the events of the
+	 * context, each further one those of an event domain of its own, see
+	 * libusb_get_event_thread_domain(). 0 is the same as 1. */
+	int num_threads;
+
+	/** CPUs the threads may run on, bit n standing for CPU n, or 0 to
+	 * leave their affinity alone */
+	uint64_t cpu_affinity;
+
+	/** Scheduling policy, a value of \ref libusb_event_thread_sched */
+	int sched_policy;
+
+	/** Scheduling priority for the real-time policies. On Windows, this is
+	 * a THREAD_PRIORITY_* value */
+	int sched_priority;
+};
+
+int LIBUSB_CALL libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_options *options);
+void LIBUSB_CALL libusb_stop_event_thread(libusb_context *ctx);
+int LIBUSB_CALL libusb_start_callback_workers(libusb_context *ctx,
+	int num_threads);
+void LIBUSB_CALL libusb_stop_callback_workers(libusb_context *ctx);
+libusb_event_domain * LIBUSB_CALL libusb_get_event_thread_domain(
+	libusb_context *ctx, int thread);
 
 /** \ingroup hotplug
  *
@@ -1956,6 +2709,11 @@ typedef struct libusb_hotplug libusb_hotplug;
  * from libusb_handle_events(); and/or your callback may be called for the
  * removal of a device for which an arrived call was never made.
  *
+ * A new device is offered to the matching drivers, most recently registered
+ * first, until the connect function of one of them returns 0. That driver
+ * then owns the device and is the only one whose disconnect function is
+ * called for it.
+ *
  * Since version 1.0.16, \ref LIBUSB_API_VERSION >= 0x01000102
  *
  * \param[in] ctx context to register this callback with
@@ -57,6 +57,8 @@
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+/* submit_transfer() takes scatter/gather transfers, see usbi_transfer_uses_iov() */
+#define USBI_CAP_BULK_IOV						0x00040000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -158,6 +160,11 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
         } while (0)
 #endif
 
+/* the most verbose level any context logs at. the logging macros check it
+ * before calling into usbi_log(), so that messages nobody will see cost a
+ * single load */
+extern volatile int usbi_log_threshold;
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...);
 
@@ -167,7 +174,11 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+#define _usbi_log(ctx, level, ...) \
+	do { \
+		if (usbi_log_threshold >= (level)) \
+			usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__); \
+	} while (0)
 #define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
@@ -184,6 +195,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #define LOG_BODY(ctxt, level) \
 {                             \
 	va_list args;             \
+	if (usbi_log_threshold < (level)) \
+		return;               \
 	va_start (args, format);  \
 	usbi_log_v(ctxt, level, "", format, args); \
 	va_end(args);             \
@@ -228,16 +241,61 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+/* number of buckets in each of the hotplug driver indexes */
+#define USBI_HOTPLUG_BUCKETS	32
+
+/* number of buckets in the session ID index of the device list */
+#define USBI_SESSION_BUCKETS	64
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* application log callback. while the log thread runs, messages are
+	 * queued on log_queue and passed to the callback by that thread */
+	libusb_log_cb log_cb;
+	usbi_mutex_t log_lock;
+	usbi_cond_t log_cond;
+	struct list_head log_queue;
+	unsigned int log_queued;
+	unsigned int log_dropped;
+	int log_thread_running;
+	int log_thread_stop;
+	usbi_thread_t log_thread;
+
 	/* internal control pipe, used for interrupting event handling when
 	 * something needs to modify poll fds. */
 	int ctrl_pipe[2];
 
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
+	/* the same devices, hashed by session ID. protected by usb_devs_lock */
+	struct list_head usb_devs_by_session[USBI_SESSION_BUCKETS];
+
+	/* bumped whenever a device joins or leaves usb_devs, and the devices of
+	 * usb_devs as of device_list_generation, NULL-terminated, for
+	 * libusb_get_device_list(). the cached list holds no references, its
+	 * devices are kept alive by usb_devs for as long as the generations
+	 * match. all protected by usb_devs_lock */
+	unsigned int usb_devs_generation;
+	struct libusb_device **device_list;
+	ssize_t device_list_len;
+	unsigned int device_list_generation;
+
+	/* set by backends that share enumeration between contexts once the
+	 * initial scan has filled usb_devs, so that later contexts can copy the
+	 * list rather than scan again */
+	int devices_scanned;
+
+	/* used by backends that share one stream of hotplug events between
+	 * contexts: the events up to devices_seq have been applied to usb_devs.
+	 * a context with hotplug drivers is linked into the backend's list of
+	 * subscribers through hotplug_subscriber, and has hotplug_subscribed
+	 * set, while the events reach every other context only when it next
+	 * looks at its devices. see the sync_devices backend function */
+	unsigned long devices_seq;
+	struct list_head hotplug_subscriber;
+	int hotplug_subscribed;
 
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
@@ -247,24 +305,124 @@ struct libusb_context {
 	/* A list of registered hotplug callbacks */
 	struct list_head hotplug_drivers;
 	usbi_mutex_t hotplug_drivers_lock;
+	/* the same drivers, indexed by the vid and pid they match. see
+	 * hotplug.c. protected by hotplug_drivers_lock */
+	struct list_head hotplug_by_id[USBI_HOTPLUG_BUCKETS];
+	struct list_head hotplug_by_vid[USBI_HOTPLUG_BUCKETS];
+	struct list_head hotplug_wildcard;
+	unsigned long hotplug_seq;
+	int num_hotplug_drivers;
+	/* hotplug messages waiting for libusb_handle_events(). hotplug_pipe is
+	 * written to when this queue becomes non-empty */
+	struct list_head hotplug_msgs;
+	usbi_mutex_t hotplug_msgs_lock;
 	int hotplug_pipe[2];
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* this is a list of all in-flight transfer handles, in no particular
+	 * order. Transfers with a pending timeout are additionally kept in
+	 * timeout_heap, a binary min-heap ordered by timeout expiration, so the
+	 * URB to timeout the soonest is always at timeout_heap[0]. Transfers with
+	 * infinite timeout, transfers which have already timed out and transfers
+	 * whose timeout is handled by the OS only live in the list. Both are
+	 * protected by flying_transfers_lock. */
 	struct list_head flying_transfers;
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
 	usbi_mutex_t flying_transfers_lock;
 
 	/* list of poll fds */
 	struct list_head pollfds;
 	usbi_mutex_t pollfds_lock;
 
+	/* number of entries in the pollfds list, and a flag raised whenever the
+	 * list changes so that the event handler knows to refresh poll_fds. Both
+	 * are protected by pollfds_lock. */
+	unsigned int pollfds_cnt;
+	int pollfds_modified;
+
+	/* array of fds passed to poll() and to the backend's handle_events(),
+	 * reused across calls. only accessed by the thread holding events_lock */
+	struct pollfd *poll_fds;
+	unsigned int poll_fds_cnt;
+	unsigned int poll_fds_size;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* when available, every poll fd is also registered with this epoll
+	 * instance, so that waiting for events does not need to look at idle
+	 * fds. epoll_events is the receive buffer for epoll_wait() and is only
+	 * accessed by the thread holding events_lock */
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+	unsigned int epoll_events_size;
+#endif
+
 	/* a counter that is set when we want to interrupt event handling, in order
 	 * to modify the poll fd set. and a lock to protect it. */
 	unsigned int pollfd_modify;
 	usbi_mutex_t pollfd_modify_lock;
 
+	/* maximum number of completions the backend may reap before dispatching
+	 * them, or 0 to dispatch each completion as soon as it is reaped */
+	int event_batch_size;
+
+	/* number of open handles with a busy-poll budget, see
+	 * libusb_set_busy_poll(). protected by open_devs_lock */
+	int busy_poll_handles;
+
+	/* number of flying transfers of a class other than
+	 * LIBUSB_PRIORITY_NORMAL. while it is 0, backends reap and dispatch
+	 * completions in any order. protected by flying_transfers_lock, read
+	 * without it by the event handler */
+	int priority_transfers;
+
+	/* threads started with libusb_start_event_thread(), and the flag
+	 * telling them to return. protected by event_threads_lock */
+	struct usbi_event_thread *event_threads;
+	int num_event_threads;
+	int event_threads_stop;
+	usbi_mutex_t event_threads_lock;
+
+	/* threads started with libusb_start_callback_workers(), the endpoint
+	 * queues with deferred callbacks to run, in the order they are to be
+	 * served, and the flag telling the workers to return once those ran.
+	 * callback_idle_cond is signalled when the last deferred callback of a
+	 * device handle returned. protected by callback_workers_lock */
+	struct usbi_callback_worker *callback_workers;
+	int num_callback_workers;
+	struct list_head ready_callback_queues;
+	int callback_workers_stop;
+	usbi_mutex_t callback_workers_lock;
+	usbi_cond_t callback_workers_cond;
+	usbi_cond_t callback_idle_cond;
+
+	/* whether a byte was written to the ctrl pipe which the event handler
+	 * has not read yet, by a callback worker after a deferred callback
+	 * returned or by an event domain handing back a disconnected handle.
+	 * protected by pollfds_lock */
+	int handler_wake;
+
+	/* statistics returned by libusb_get_event_stats() */
+	struct libusb_event_stats event_stats;
+	usbi_mutex_t event_stats_lock;
+
+	/* trace ring, see libusb_set_trace(). trace_slots is allocated by the
+	 * first call enabling tracing, under event_stats_lock, and only freed
+	 * with the context; trace_enabled is read without the lock by
+	 * usbi_trace(). trace_head is the sequence number of the last event,
+	 * taken with usbi_atomic_inc() */
+	int trace_enabled;
+	struct usbi_trace_slot *trace_slots;
+	unsigned int trace_mask;
+	volatile long trace_head;
+
+	/* completed transfers flagged with LIBUSB_TRANSFER_QUEUE_COMPLETION,
+	 * linked through usbi_transfer.list in completion order, waiting for
+	 * libusb_reap_completions(). protected by completion_queue_lock */
+	struct list_head completion_queue;
+	int num_queued_completions;
+	usbi_mutex_t completion_queue_lock;
+
 	/* user callbacks for pollfd changes */
 	libusb_pollfd_added_cb fd_added_cb;
 	libusb_pollfd_removed_cb fd_removed_cb;
@@ -281,10 +439,21 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* internal waiters which are woken up individually, rather than
+	 * through event_waiters_cond. protected by event_waiters_lock */
+	struct list_head targeted_waiters;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
 	 * this timerfd is maintained to trigger on the next pending timeout */
 	int timerfd;
+
+	/* the deadline the timerfd is currently armed for, valid when
+	 * timerfd_armed is 1. timerfd_armed is 0 when the timerfd is disarmed,
+	 * and -1 when its state is unknown because it has just fired and must
+	 * be reprogrammed. protected by flying_transfers_lock */
+	struct timeval timerfd_deadline;
+	int timerfd_armed;
 #endif
 
 	struct list_head list;
@@ -296,28 +465,48 @@ struct libusb_context {
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
-struct libusb_device {	
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
-	usbi_mutex_t lock;
-	int refcnt;
-
-	struct libusb_context *ctx;
-	void *user_data;
+#ifdef USBI_EPOLL_AVAILABLE
+#define usbi_using_epoll(ctx) ((ctx)->epoll_fd >= 0)
+#else
+#define usbi_using_epoll(ctx) (0)
+#endif
 
+struct libusb_device {
+	/* the fields looked at while scanning the device lists, by session
+	 * or by bus/address/IDs, come first so that a scan touches as few
+	 * cache lines per device as possible. all of them are finalized at
+	 * initialization time. */
+	struct list_head list;
+	struct list_head session_list; /* ctx->usb_devs_by_session entry */
+	unsigned long session_data;
 	uint8_t bus_number;
 	uint8_t port_number;
-	struct libusb_device* parent_dev;
 	uint8_t device_address;
 	uint8_t num_configurations;
+	int attached;
+	struct libusb_device_descriptor device_descriptor;
 	enum libusb_speed speed;
+	struct libusb_context *ctx;
+	struct libusb_device* parent_dev;
+
+	/* lock protects refcnt */
+	usbi_mutex_t lock;
+	int refcnt;
+
+	void *user_data;
 
-	struct list_head list;
 	struct list_head driver_dev_list; /* List associated with the driver */
-	unsigned long session_data;
+	/* the hotplug driver that claimed this device, protected by
+	 * ctx->hotplug_drivers_lock */
+	struct hotplug_list *hotplug_driver;
 
-	struct libusb_device_descriptor device_descriptor;
-	int attached;
+	/* parsed config descriptors, protected by a lock in descriptor.c */
+	struct usbi_cached_config *config_cache;
+
+	/* string descriptors read while string_cache_enabled is set, see
+	 * libusb_set_string_cache(). protected by a lock in descriptor.c */
+	int string_cache_enabled;
+	struct usbi_cached_string *string_cache;
 
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
@@ -328,6 +517,25 @@ struct libusb_device {
 	;
 };
 
+/* the completed transfers of an endpoint flagged with
+ * LIBUSB_TRANSFER_DEFER_CALLBACK, linked through usbi_transfer.list in
+ * completion order. a queue is on ctx->ready_callback_queues, or being
+ * served by a callback worker, while busy is set, so that the callbacks of
+ * an endpoint run one at a time. protected by ctx->callback_workers_lock */
+struct usbi_callback_queue {
+	struct list_head transfers;
+	struct list_head list;
+	int busy;
+};
+
+/* values of libusb_device_handle.dedicated_reaper */
+enum usbi_reaper_state {
+	USBI_REAPER_OFF = 0,
+	USBI_REAPER_RUNNING,
+	/* stopped by libusb_set_dedicated_reaper(), without the events lock */
+	USBI_REAPER_STOPPING,
+};
+
 struct libusb_device_handle {
 	/* lock protects claimed_interfaces */
 	usbi_mutex_t lock;
@@ -336,6 +544,50 @@ struct libusb_device_handle {
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* the event domain this handle belongs to, or NULL if its events are
+	 * handled by the context. protected by ctx->pollfds_lock, as is
+	 * event_domain_list */
+	struct libusb_event_domain *event_domain;
+	struct list_head event_domain_list;
+
+	/* transfer and control transfer buffer kept across calls to the
+	 * synchronous API, so that back-to-back requests do not allocate.
+	 * protected by lock; NULL while in use by a synchronous call */
+	struct libusb_transfer *sync_transfer;
+	unsigned char *sync_buffer;
+	size_t sync_buffer_size;
+
+	/* time in microseconds the event handler may spin reaping completions
+	 * of this handle before sleeping, or 0. written with ctx->open_devs_lock
+	 * held, read without it by the event handler */
+	unsigned int busy_poll_budget;
+
+	/* set while the completions of this handle are reaped by a thread of
+	 * its own, see libusb_set_dedicated_reaper(). reaper_tid is the id of
+	 * that thread, set by the backend while it runs */
+	int dedicated_reaper;
+	int reaper_tid;
+
+	/* the class of the handle's transfers, see libusb_set_handle_priority().
+	 * written with ctx->open_devs_lock held, read without it by the event
+	 * handler */
+	int priority;
+
+	/* counters of each endpoint, indexed by usbi_ep_stats_index() and
+	 * allocated on the first submission to the endpoint. protected by
+	 * stats_lock */
+	usbi_mutex_t stats_lock;
+	struct libusb_endpoint_stats *ep_stats[32];
+
+	/* deferred callbacks of each endpoint, indexed like ep_stats, and the
+	 * number of them queued or running. protected by
+	 * ctx->callback_workers_lock */
+	struct usbi_callback_queue callback_queues[32];
+	int deferred_callbacks;
+	/* set once libusb_close() started, callbacks are no longer deferred */
+	int callbacks_closing;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -367,9 +619,42 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct timeval timeout;
+	/* position in ctx->timeout_heap, or -1 if not in the heap */
+	int timeout_idx;
 	int transferred;
 	uint32_t stream_id;
 	uint8_t flags;
+	/* the class set by libusb_transfer_set_priority(), if priority_set, and
+	 * the class in effect while the transfer is in flight, which falls back
+	 * to the class of its handle */
+	int8_t priority;
+	uint8_t priority_set;
+	int8_t active_priority;
+	/* when the transfer was last submitted, for the latency counters of
+	 * libusb_get_endpoint_stats(). zero if the clock could not be read */
+	struct timespec submitted;
+
+	/* the pool this transfer was allocated from, or NULL. while a pooled
+	 * transfer is idle, it is linked into the pool's free list through the
+	 * list member above */
+	struct libusb_transfer_pool *pool;
+
+	/* the stream scheduler this transfer was handed to, or NULL. while it
+	 * is owned by the scheduler, the application's callback is kept in
+	 * stream_callback, and a transfer waiting for room on a stream is
+	 * linked into the scheduler's queue through the list member above */
+	struct libusb_stream_scheduler *stream_sched;
+	libusb_transfer_cb_fn stream_callback;
+
+	/* the segments set by libusb_fill_bulk_transfer_iov(), which points
+	 * transfer->buffer at the array, and the largest packet of the
+	 * endpoint at that time. when the backend cannot take the segments as
+	 * they are, the transfer is submitted with the contiguous copy in
+	 * iov_bounce as its buffer, which is undone at completion */
+	const struct libusb_iovec *iov;
+	int num_iov;
+	int iov_max_packet;
+	unsigned char *iov_bounce;
 
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
@@ -381,6 +666,157 @@ struct usbi_transfer {
 	usbi_mutex_t lock;
 };
 
+struct libusb_transfer_pool {
+	struct libusb_context *ctx;
+
+	/* protects free_list, num_busy and destroyed */
+	usbi_mutex_t lock;
+	struct list_head free_list;
+
+	/* number of transfers handed out and not given back yet */
+	int num_busy;
+
+	/* set by libusb_free_transfer_pool(). if transfers are still busy at
+	 * that point, the last one to be freed destroys the pool */
+	int destroyed;
+
+	/* all transfers live in one block of num_transfers * transfer_size
+	 * bytes */
+	int num_transfers;
+	size_t transfer_size;
+	unsigned char *mem;
+};
+
+enum usbi_ring_slot_state {
+	/* free for the next submission */
+	USBI_RING_SLOT_EMPTY,
+	USBI_RING_SLOT_IN_FLIGHT,
+	/* completed, waiting to be consumed */
+	USBI_RING_SLOT_FILLED,
+	/* handed to the consumer by libusb_ring_read() */
+	USBI_RING_SLOT_CONSUMING,
+};
+
+struct usbi_ring_slot {
+	struct libusb_ring *ring;
+	struct libusb_transfer *transfer;
+	enum usbi_ring_slot_state state;
+	/* number of bytes of data at the start of the buffer once filled */
+	int length;
+};
+
+enum usbi_ring_tune_phase {
+	USBI_RING_TUNE_OFF,
+	/* growing the transfer length at the full queue depth */
+	USBI_RING_TUNE_LENGTH,
+	/* shrinking the queue depth at the chosen transfer length */
+	USBI_RING_TUNE_DEPTH,
+	/* done, watching for the throughput to degrade */
+	USBI_RING_TUNE_SETTLED,
+};
+
+/* Slots are submitted, completed and consumed strictly in ring order: the
+ * kernel completes the transfers of an endpoint in submission order, and a
+ * slot which completes without data is still kept in line, with a zero
+ * length, and skipped by the consumer. */
+struct libusb_ring {
+	struct libusb_device_handle *dev_handle;
+	libusb_ring_cb_fn callback;
+	void *user_data;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	struct usbi_ring_slot *slots;
+	int num_slots;
+	int queue_depth;
+	int buffer_length;
+	int num_iso_packets;
+
+	/* the limits set at allocation. queue_depth and transfer_length are
+	 * what the ring currently runs with, which autotuning may lower, see
+	 * libusb_set_ring_autotune() */
+	int max_queue_depth;
+	int transfer_length;
+
+	/* autotuning state. tune_best is the best throughput of the current
+	 * phase in bytes per second, tune_unit the step transfer lengths are
+	 * multiples of */
+	enum usbi_ring_tune_phase tune_phase;
+	int tune_unit;
+	int tune_degraded;
+	/* the setting in use before the one being tried */
+	int tune_prev;
+	uint64_t tune_best;
+
+	/* the measurement window being filled, and the results of the last
+	 * complete one. win_skip transfers still in flight from before the
+	 * window started are left out */
+	struct timespec win_start;
+	int win_skip;
+	int win_transfers;
+	uint64_t win_bytes;
+	uint64_t win_latency_us;
+	uint64_t throughput;
+	uint64_t latency_us;
+
+	/* next slot to submit, and oldest slot not yet consumed */
+	int next_submit;
+	int next_read;
+	int in_flight;
+	int filled;
+
+	/* set while new transfers may be submitted. error holds the reason the
+	 * ring stopped on its own, if it did */
+	int running;
+	int error;
+
+	/* all buffers, in one block obtained with libusb_dev_mem_alloc() when
+	 * dev_mem is set, with malloc() otherwise */
+	unsigned char *buffers;
+	int dev_mem;
+	libusb_transfer_pool *pool;
+
+	struct libusb_ring_stats stats;
+};
+
+struct usbi_stream {
+	int in_flight;
+	uint64_t transfers;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t total_latency_us;
+	uint64_t max_latency_us;
+};
+
+/* Transfers are queued in submission order, and each is started on the
+ * least busy stream as soon as one has fewer than queue_depth transfers in
+ * flight. Streams complete independently of each other, so the transfers
+ * of different streams complete out of order. */
+struct libusb_stream_scheduler {
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	/* stream n has stream ID n + 1 */
+	struct usbi_stream *streams;
+	int num_streams;
+	int queue_depth;
+	/* stream to look at first for the next transfer, so that ties are
+	 * broken round robin */
+	int next_stream;
+
+	/* transfers waiting for room on a stream */
+	struct list_head queue;
+	int queued;
+	int in_flight;
+
+	/* set by libusb_free_stream_scheduler() */
+	int closing;
+};
+
 enum usbi_transfer_flags {
 	/* The transfer has timed out */
 	USBI_TRANSFER_TIMED_OUT = 1 << 0,
@@ -396,8 +832,23 @@ enum usbi_transfer_flags {
 
 	/* Set by backend submit_transfer() if the fds in use have been updated */
 	USBI_TRANSFER_UPDATED_FDS = 1 << 4,
+
+	/* Marked for cancellation by aborting its endpoint as a whole, see
+	 * libusb_cancel_endpoint_transfers() */
+	USBI_TRANSFER_ENDPOINT_ABORT = 1 << 5,
+
+	/* Completed with LIBUSB_TRANSFER_AUTO_RESUBMIT set, to be resubmitted
+	 * after its deferred callback */
+	USBI_TRANSFER_DEFERRED_RESUBMIT = 1 << 6,
 };
 
+/* whether the backend is to submit the transfer from the segments in
+ * itransfer->iov rather than from transfer->buffer. only ever true for
+ * backends with USBI_CAP_BULK_IOV */
+#define usbi_transfer_uses_iov(itransfer) \
+	((itransfer)->iov && (const unsigned char *)(itransfer)->iov \
+		== USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->buffer)
+
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer) \
 	((struct libusb_transfer *)(((unsigned char *)(transfer)) \
 		+ sizeof(struct usbi_transfer)))
@@ -413,6 +864,16 @@ static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 			* sizeof(struct libusb_iso_packet_descriptor));
 }
 
+/* the timeout of the transfer in milliseconds, rounded up, for backends
+ * which pass it on to the operating system */
+static inline unsigned int usbi_transfer_timeout_ms(
+	struct libusb_transfer *transfer)
+{
+	if (transfer->flags & LIBUSB_TRANSFER_TIMEOUT_USEC)
+		return transfer->timeout / 1000 + (transfer->timeout % 1000 != 0);
+	return transfer->timeout;
+}
+
 /* bus structures */
 
 /* All standard descriptors have these 2 fields in common */
@@ -433,21 +894,94 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
 
+/* A thread waiting for one specific event, typically the completion of its
+ * own synchronous transfer. While another thread is handling events, it
+ * sleeps on its own condition variable instead of event_waiters_cond, and is
+ * only woken up when its event happens or when the events lock becomes
+ * available for it to take over event handling. */
+struct usbi_event_waiter {
+	struct list_head list;
+	usbi_cond_t cond;
+	int completed;
+};
+
+void usbi_init_event_waiter(struct usbi_event_waiter *waiter);
+void usbi_destroy_event_waiter(struct usbi_event_waiter *waiter);
+void usbi_signal_event_waiter(struct libusb_context *ctx,
+	struct usbi_event_waiter *waiter);
+int usbi_handle_events_for_waiter(struct libusb_context *ctx,
+	struct timeval *tv, struct usbi_event_waiter *waiter);
+
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+void usbi_wait_deferred_callbacks(struct libusb_device_handle *dev_handle);
+void usbi_count_sync_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, int transferred, int r,
+	const struct timespec *start);
+int usbi_remove_from_flying_list(struct usbi_transfer *itransfer);
+void usbi_record_event_batch(struct libusb_context *ctx,
+	unsigned int num_completions, uint64_t elapsed_ns);
+
+/* a trace ring entry. seq is written last, once the event is complete, so
+ * that a reader can tell a finished entry from one being overwritten */
+struct usbi_trace_slot {
+	volatile unsigned long seq;
+	struct libusb_trace_event event;
+};
+
+void usbi_trace_event(struct libusb_context *ctx,
+	enum libusb_trace_event_type type, struct libusb_transfer *transfer,
+	unsigned char endpoint, int length, int status);
+void usbi_trace_sync_transfer(struct libusb_context *ctx,
+	unsigned char endpoint, int length, int transferred,
+	enum libusb_transfer_status status, const struct timespec *start);
+
+/* record a trace event, at the cost of a single load while tracing is
+ * disabled */
+#define usbi_trace(ctx, type, transfer, endpoint, length, status) \
+	do { \
+		if ((ctx)->trace_enabled) \
+			usbi_trace_event((ctx), (type), (transfer), \
+				(endpoint), (length), (status)); \
+	} while (0)
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_device_cache_descriptor(libusb_device *dev);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
+int usbi_get_endpoint_type(struct libusb_device *dev, unsigned char endpoint);
+void usbi_clear_config_cache(struct libusb_device *dev);
+void usbi_clear_string_cache(struct libusb_device *dev);
+size_t usbi_device_cache_size(struct libusb_device *dev);
+const struct libusb_endpoint_descriptor *usbi_find_endpoint(
+	struct libusb_config_descriptor *config, unsigned char endpoint);
+
+/* an immutable block of data shared by all devices (in any context) that
+ * hold the same bytes, see usbi_share_blob(). the data follows the
+ * structure in the same allocation. */
+struct usbi_shared_blob {
+	struct usbi_shared_blob *next;
+	unsigned int hash;
+	int refcnt;
+	int len;
+};
+
+#define SHARED_BLOB_DATA(blob) ((unsigned char *) ((blob) + 1))
+
+struct usbi_shared_blob *usbi_share_blob(const void *data, int len);
+struct usbi_shared_blob *usbi_ref_blob(struct usbi_shared_blob *blob);
+void usbi_unref_blob(struct usbi_shared_blob *blob);
+size_t usbi_blob_share(struct usbi_shared_blob *blob);
+size_t usbi_shared_blob_bytes(void);
 
 void usbi_connect_device (struct libusb_device *dev);
 void usbi_disconnect_device (struct libusb_device *dev);
 
 /* Internal abstraction for poll (needs struct usbi_transfer on Windows) */
-#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD) || defined(OS_NETBSD)
+#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD) || defined(OS_NETBSD) \
+	|| defined(OS_NULL)
 #include <unistd.h>
 #include "os/poll_posix.h"
 #elif defined(OS_WINDOWS) || defined(OS_WINCE)
@@ -472,6 +1006,71 @@ struct usbi_pollfd {
 	struct libusb_pollfd pollfd;
 
 	struct list_head list;
+
+	/* the event domain which polls this fd, or NULL if it is part of the
+	 * context's own poll set. protected by ctx->pollfds_lock */
+	struct libusb_event_domain *domain;
+};
+
+/* a thread started with libusb_start_event_thread(). the first one of a
+ * context handles the events of the context, the others those of their own
+ * event domain */
+struct usbi_event_thread {
+	struct libusb_context *ctx;
+	struct libusb_event_domain *domain;
+	usbi_thread_t thread;
+	int started;
+};
+
+/* a thread started with libusb_start_callback_workers() */
+struct usbi_callback_worker {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	int started;
+};
+
+/* An event domain has the events of a set of device handles handled apart
+ * from, and concurrently with, those of the rest of the context. The pollfds
+ * of the member handles stay in ctx->pollfds, marked with the domain, but are
+ * left out of the context's own poll set. */
+struct libusb_event_domain {
+	struct libusb_context *ctx;
+
+	/* used to interrupt the domain's event handler. always the first entry
+	 * of poll_fds */
+	int ctrl_pipe[2];
+
+	/* member handles, linked through event_domain_list. protected by
+	 * ctx->pollfds_lock, as are fds_modified and fds_modifying, the number
+	 * of threads waiting to change the set of member handles */
+	struct list_head handles;
+	int fds_modified;
+	int fds_modifying;
+
+	/* the same roles as the context's events_lock, event_handler_active
+	 * and event waiters, for this domain alone */
+	usbi_mutex_t events_lock;
+	int event_handler_active;
+	int event_handler_tid;
+	usbi_mutex_t event_waiters_lock;
+	usbi_cond_t event_waiters_cond;
+
+	/* the time until which the domain's event handler polls, or 0 if it is
+	 * not polling, and the number of bytes written to the ctrl pipe to
+	 * interrupt that poll for an earlier timeout, which the handler reads
+	 * itself. protected by ctx->flying_transfers_lock */
+	struct timeval timeout_armed;
+	unsigned int timeout_wakes;
+
+	/* like ctx->handler_wake, for the domain's handles. protected by
+	 * ctx->pollfds_lock */
+	int handler_wake;
+
+	/* the ctrl pipe followed by the fds of the member handles. only
+	 * accessed by the holder of events_lock */
+	struct pollfd *poll_fds;
+	unsigned int poll_fds_cnt;
+	unsigned int poll_fds_size;
 };
 
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
@@ -600,6 +1199,28 @@ struct usbi_os_backend {
 	 */
 	void (*hotplug_poll)(void);
 
+	/* Apply the hotplug events received so far to ctx->usb_devs. Called
+	 * by libusb_get_device_list() after hotplug_poll(), and wherever else
+	 * the device list of a context must be current.
+	 *
+	 * Backends implementing this may defer updating the device list of a
+	 * context until it is called, rather than doing it for every context
+	 * as each event arrives, unless the context is subscribed (see below).
+	 *
+	 * Optional.
+	 */
+	void (*sync_devices)(struct libusb_context *ctx);
+
+	/* Called whenever the number of hotplug drivers registered with ctx
+	 * may have gone from or to zero. While ctx has drivers, the backend
+	 * must apply each hotplug event to it as the event arrives, so that
+	 * the drivers are notified. Subscribing a context syncs its devices
+	 * first.
+	 *
+	 * Optional, needed if sync_devices() is implemented.
+	 */
+	void (*update_hotplug_subscription)(struct libusb_context *ctx);
+
 	/* Open a device for I/O and other USB operations. The device handle
 	 * is preallocated for you, you can retrieve the device in question
 	 * through handle->dev.
@@ -854,6 +1475,77 @@ struct usbi_os_backend {
 	int (*free_streams)(struct libusb_device_handle *handle,
 		unsigned char *endpoints, int num_endpoints);
 
+	/* Allocate memory for transfer buffers which the kernel can transfer
+	 * to and from directly, without copying it to or from a bounce buffer.
+	 * Optional.
+	 *
+	 * Return the allocated buffer, or NULL if the memory could not be
+	 * allocated or the running system does not support it.
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Free memory allocated with dev_mem_alloc. Optional, but must be
+	 * implemented if dev_mem_alloc is.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
+	/* Set the size of the units bulk and interrupt transfers on an endpoint
+	 * of a device handle are split into by the operating system, see
+	 * libusb_set_bulk_urb_size(). An endpoint of 0 sets the size for all
+	 * endpoints without a size of their own. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_bulk_urb_size)(struct libusb_device_handle *handle,
+		unsigned char endpoint, int size);
+
+	/* Get the size of the units transfers on an endpoint are currently
+	 * split into. Optional, but must be implemented if set_bulk_urb_size is.
+	 *
+	 * Return:
+	 * - the size in bytes of each unit
+	 * - 0 if transfers are not split
+	 */
+	int (*get_bulk_urb_size)(struct libusb_device_handle *handle,
+		unsigned char endpoint);
+
+	/* Enable or disable raw I/O on a bulk or interrupt IN endpoint, see
+	 * libusb_set_raw_io(). Optional.
+	 *
+	 * Return:
+	 * - the largest transfer length accepted while raw I/O is enabled,
+	 *   or 0 if it was disabled
+	 * - LIBUSB_ERROR_NOT_FOUND if no claimed interface has the endpoint
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the driver has no raw I/O mode
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_raw_io)(struct libusb_device_handle *handle,
+		unsigned char endpoint, int enable);
+
+	/* Start or stop a thread which waits for and processes the
+	 * completions of a device handle on its own, see
+	 * libusb_set_dedicated_reaper(). While the thread runs, the handle
+	 * must not be reported to handle_events() nor busy_poll(), and
+	 * handle->reaper_tid must be its usbi_get_tid(). Starting a thread
+	 * which stopped on its own restarts it. Called with the events lock
+	 * held when starting, and without it when stopping, since the
+	 * callbacks run by the thread may take it. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on failure
+	 */
+	int (*set_dedicated_reaper)(struct libusb_device_handle *handle,
+		int enable);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -910,6 +1602,15 @@ struct usbi_os_backend {
 	 */
 	void (*destroy_device)(struct libusb_device *dev);
 
+	/* Return the number of bytes the backend holds for a device outside
+	 * of its private data area, such as descriptors and paths, for
+	 * libusb_get_memory_stats(). Data shared with other devices should be
+	 * counted with usbi_blob_share().
+	 *
+	 * This function is optional.
+	 */
+	size_t (*device_memory)(struct libusb_device *dev);
+
 	/* Submit a transfer. Your implementation should take the transfer,
 	 * morph it into whatever form your platform requires, and submit it
 	 * asynchronously.
@@ -933,6 +1634,27 @@ struct usbi_os_backend {
 	 */
 	int (*cancel_transfer)(struct usbi_transfer *itransfer);
 
+	/* Cancel every transfer in flight on a bulk, interrupt or isochronous
+	 * endpoint of the handle with a single operation, such as aborting the
+	 * pipe. The transfers have already been marked as being cancelled, and
+	 * their cancellation must complete as for cancel_transfer().
+	 *
+	 * This function must not block.
+	 *
+	 * This function gets called with the flying_transfers_lock locked!
+	 *
+	 * This function is optional. If it is missing or fails, the transfers
+	 * are cancelled one by one through cancel_transfer().
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the endpoint cannot be aborted as a
+	 *   whole
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*abort_endpoint)(struct libusb_device_handle *handle,
+		unsigned char endpoint);
+
 	/* Clear a transfer as if it has completed or cancelled, but do not
 	 * report any completion/cancellation to the library. You should free
 	 * all private data from the transfer as if you were just about to report
@@ -945,6 +1667,84 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Preallocate the backend resources needed to submit the transfer with
+	 * a buffer of up to max_length bytes and up to the number of iso
+	 * packets the transfer was allocated with, so that submitting it later
+	 * does not need to allocate any memory.
+	 *
+	 * This is called for every transfer of a transfer pool when the pool
+	 * is created. The resources should be kept across submissions until
+	 * destroy_transfer() is called.
+	 *
+	 * This function is optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_MEM on memory allocation failure
+	 */
+	int (*prealloc_transfer)(struct usbi_transfer *itransfer, int max_length);
+
+	/* Release any resources kept in the transfer's private data across
+	 * submissions, such as those set up by prealloc_transfer(). Called just
+	 * before the memory of the transfer is freed.
+	 *
+	 * This function is optional.
+	 */
+	void (*destroy_transfer)(struct usbi_transfer *itransfer);
+
+	/* Retrieve the time at which the given packet of the last submission
+	 * of an isochronous transfer was completed, as measured by the
+	 * USBI_CLOCK_MONOTONIC clock. Only called for isochronous transfers
+	 * which are not in flight, with a packet index that is in range.
+	 *
+	 * This function is optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if no time was recorded for the packet
+	 */
+	int (*get_iso_packet_time)(struct usbi_transfer *itransfer, int packet,
+		struct timeval *tv);
+
+	/* Perform a control transfer by blocking in the calling thread until
+	 * it completes, bypassing transfer submission and event handling.
+	 * Used by libusb_control_transfer() when waiting in the calling thread
+	 * cannot delay the completion of any other transfer.
+	 *
+	 * The data buffer holds wLength bytes for either direction, and the
+	 * timeout has the same meaning as for the synchronous API.
+	 *
+	 * This function is optional.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the request cannot be performed this
+	 *   way, in which case libusb falls back to an asynchronous transfer
+	 * - another LIBUSB_ERROR code as libusb_control_transfer() would
+	 *   return it
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer with no timeout by blocking in
+	 * the calling thread until it completes, as for sync_control_transfer().
+	 * Only called with a timeout of 0, since there is no way to report the
+	 * data transferred before a timeout expired.
+	 *
+	 * This function is optional.
+	 *
+	 * Return:
+	 * - 0 on success, with transferred set
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the request cannot be performed this
+	 *   way, in which case libusb falls back to an asynchronous transfer
+	 * - another LIBUSB_ERROR code as libusb_bulk_transfer() would return it
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred);
+
 	/* Handle any pending events. This involves monitoring any active
 	 * transfers and processing their completion or cancellation.
 	 *
@@ -974,6 +1774,32 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready);
 
+	/* Return the file descriptor, previously registered with
+	 * usbi_add_pollfd(), on which all the events of the given device handle
+	 * and of no other handle are signalled. Optional.
+	 *
+	 * Implementing this allows the handle to be moved to an event domain,
+	 * in which case handle_events() is called with only this fd, from a
+	 * thread which may run concurrently with the one handling the events of
+	 * the rest of the context.
+	 *
+	 * Return the fd, or LIBUSB_ERROR_NOT_SUPPORTED.
+	 */
+	int (*handle_event_fd)(struct libusb_device_handle *handle);
+
+	/* Handle at most one completion of the given device handle without
+	 * blocking. Called repeatedly by the event handler, with the events
+	 * lock held, while it busy-polls handles for which
+	 * libusb_set_busy_poll() was called. Optional.
+	 *
+	 * Return:
+	 * - 1 if a completion was handled
+	 * - 0 if no completion was ready
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*busy_poll)(struct libusb_device_handle *handle);
+
 	/* Get time from specified clock. At least two clocks must be implemented
 	   by the backend: USBI_CLOCK_REALTIME, and USBI_CLOCK_MONOTONIC.
 
@@ -1020,6 +1846,7 @@ extern const struct usbi_os_backend openbsd_backend;
 extern const struct usbi_os_backend netbsd_backend;
 extern const struct usbi_os_backend windows_backend;
 extern const struct usbi_os_backend wince_backend;
+extern const struct usbi_os_backend null_backend;
 
 extern struct list_head active_contexts_list;
 extern usbi_mutex_static_t active_contexts_lock;
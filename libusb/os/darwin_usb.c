@@ -62,9 +62,11 @@ static pthread_t libusb_darwin_at;
 
 static int darwin_get_config_descriptor(struct libusb_device *dev, uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian);
 static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int iface);
+static void darwin_ll_destroy_interface (struct darwin_device_handle_priv *priv, uint8_t iface);
 static int darwin_release_interface(struct libusb_device_handle *dev_handle, int iface);
 static int darwin_reset_device(struct libusb_device_handle *dev_handle);
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0);
+static void darwin_clear_transfer_priv (struct usbi_transfer *itransfer);
 
 static int darwin_scan_devices(struct libusb_context *ctx);
 static int process_new_device (struct libusb_context *ctx, io_service_t service);
@@ -976,8 +978,14 @@ static int darwin_open (struct libusb_device_handle *dev_handle) {
   /* create a file descriptor for notifications */
   pipe (priv->fds);
 
-  /* set the pipe to be non-blocking */
-  fcntl (priv->fds[1], F_SETFD, O_NONBLOCK);
+  /* set the pipe to be non-blocking. the read end is drained completely on each event */
+  fcntl (priv->fds[0], F_SETFL, fcntl (priv->fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (priv->fds[1], F_SETFL, fcntl (priv->fds[1], F_GETFL) | O_NONBLOCK);
+  priv->completed = NULL;
+
+  usbi_mutex_init (&priv->ll_lock, NULL);
+  list_init (&priv->ll_buffers);
+  list_init (&priv->ll_framelists);
 
   usbi_add_pollfd(HANDLE_CTX(dev_handle), priv->fds[0], POLLIN);
 
@@ -1031,6 +1039,9 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
   close (priv->fds[0]);
 
   priv->fds[0] = priv->fds[1] = -1;
+
+  /* low latency buffers went away with the interfaces */
+  usbi_mutex_destroy (&priv->ll_lock);
 }
 
 static int darwin_get_configuration(struct libusb_device_handle *dev_handle, int *config) {
@@ -1261,6 +1272,9 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
   if (!cInterface->interface)
     return LIBUSB_SUCCESS;
 
+  /* low latency buffers are tied to the interface */
+  darwin_ll_destroy_interface (priv, (uint8_t) iface);
+
   /* clean up endpoint data */
   cInterface->num_endpoints = 0;
 
@@ -1478,11 +1492,11 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
 
     if (IS_XFERIN(transfer))
       ret = (*(cInterface->interface))->ReadPipeAsyncTO(cInterface->interface, pipeRef, transfer->buffer,
-                                                        transfer->length, transfer->timeout, transfer->timeout,
+                                                        transfer->length, usbi_transfer_timeout_ms(transfer), usbi_transfer_timeout_ms(transfer),
                                                         darwin_async_io_callback, (void *)itransfer);
     else
       ret = (*(cInterface->interface))->WritePipeAsyncTO(cInterface->interface, pipeRef, transfer->buffer,
-                                                         transfer->length, transfer->timeout, transfer->timeout,
+                                                         transfer->length, usbi_transfer_timeout_ms(transfer), usbi_transfer_timeout_ms(transfer),
                                                          darwin_async_io_callback, (void *)itransfer);
   }
 
@@ -1510,12 +1524,12 @@ static int submit_stream_transfer(struct usbi_transfer *itransfer) {
 
   if (IS_XFERIN(transfer))
     ret = (*(cInterface->interface))->ReadStreamsPipeAsyncTO(cInterface->interface, pipeRef, itransfer->stream_id,
-                                                             transfer->buffer, transfer->length, transfer->timeout,
-                                                             transfer->timeout, darwin_async_io_callback, (void *)itransfer);
+                                                             transfer->buffer, transfer->length, usbi_transfer_timeout_ms(transfer),
+                                                             usbi_transfer_timeout_ms(transfer), darwin_async_io_callback, (void *)itransfer);
   else
     ret = (*(cInterface->interface))->WriteStreamsPipeAsyncTO(cInterface->interface, pipeRef, itransfer->stream_id,
-                                                              transfer->buffer, transfer->length, transfer->timeout,
-                                                              transfer->timeout, darwin_async_io_callback, (void *)itransfer);
+                                                              transfer->buffer, transfer->length, usbi_transfer_timeout_ms(transfer),
+                                                              usbi_transfer_timeout_ms(transfer), darwin_async_io_callback, (void *)itransfer);
 
   if (ret)
     usbi_err (TRANSFER_CTX (transfer), "bulk stream transfer failed (dir = %s): %s (code = 0x%08x)", IS_XFERIN(transfer) ? "In" : "Out",
@@ -1525,12 +1539,187 @@ static int submit_stream_transfer(struct usbi_transfer *itransfer) {
 }
 #endif
 
+/* find the low latency buffer holding [buffer, buffer + length). call with ll_lock held */
+static struct darwin_ll_buffer *darwin_ll_find_buffer (struct darwin_device_handle_priv *priv, uint8_t iface,
+                                                       unsigned char *buffer, size_t length, UInt32 type) {
+  struct darwin_ll_buffer *ll;
+
+  list_for_each_entry(ll, &priv->ll_buffers, list, struct darwin_ll_buffer) {
+    if (ll->iface == iface && ll->type == type && buffer >= ll->buffer &&
+        buffer + length <= ll->buffer + ll->length)
+      return ll;
+  }
+
+  return NULL;
+}
+
+/* get an unused low latency frame list of at least num_frames entries. call with ll_lock held */
+static struct darwin_ll_buffer *darwin_ll_get_framelist (struct darwin_device_handle_priv *priv, uint8_t iface,
+                                                         int num_frames) {
+  struct darwin_interface *cInterface = &priv->interfaces[iface];
+  size_t length = num_frames * sizeof (IOUSBLowLatencyIsocFrame);
+  struct darwin_ll_buffer *ll;
+  IOReturn kresult;
+  void *buffer;
+
+  list_for_each_entry(ll, &priv->ll_framelists, list, struct darwin_ll_buffer) {
+    if (!ll->in_use && ll->iface == iface && ll->length >= length) {
+      ll->in_use = 1;
+      return ll;
+    }
+  }
+
+  ll = calloc (1, sizeof (*ll));
+  if (!ll)
+    return NULL;
+
+  kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &buffer, length,
+                                                                kUSBLowLatencyFrameListBuffer);
+  if (kresult != kIOReturnSuccess) {
+    usbi_dbg ("could not create low latency frame list: %s", darwin_error_str (kresult));
+    free (ll);
+    return NULL;
+  }
+
+  ll->buffer = buffer;
+  ll->length = length;
+  ll->iface = iface;
+  ll->type = kUSBLowLatencyFrameListBuffer;
+  ll->in_use = 1;
+  list_add (&ll->list, &priv->ll_framelists);
+
+  return ll;
+}
+
+static void darwin_ll_put_framelist (struct darwin_device_handle_priv *priv, struct darwin_ll_buffer *ll) {
+  usbi_mutex_lock (&priv->ll_lock);
+  ll->in_use = 0;
+  usbi_mutex_unlock (&priv->ll_lock);
+}
+
+/* destroy the low latency buffers and frame lists of an interface before it is closed */
+static void darwin_ll_destroy_interface (struct darwin_device_handle_priv *priv, uint8_t iface) {
+  struct darwin_interface *cInterface = &priv->interfaces[iface];
+  struct darwin_ll_buffer *ll, *tmp;
+
+  usbi_mutex_lock (&priv->ll_lock);
+  list_for_each_entry_safe(ll, tmp, &priv->ll_buffers, list, struct darwin_ll_buffer) {
+    if (ll->iface == iface) {
+      (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, ll->buffer);
+      list_del (&ll->list);
+      free (ll);
+    }
+  }
+  list_for_each_entry_safe(ll, tmp, &priv->ll_framelists, list, struct darwin_ll_buffer) {
+    if (ll->iface == iface) {
+      (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, ll->buffer);
+      list_del (&ll->list);
+      free (ll);
+    }
+  }
+  usbi_mutex_unlock (&priv->ll_lock);
+}
+
+/* Memory for isochronous transfers is allocated with LowLatencyCreateBuffer, which maps it
+ * into the kernel once instead of wiring it down on each submission. Low latency buffers
+ * belong to an interface and are typed by direction, so they are created on the claimed
+ * interface with an isochronous IN endpoint (the first claimed interface otherwise) for
+ * reading. Transfers to other endpoints still work with the memory, through the regular
+ * path. */
+static unsigned char *darwin_dev_mem_alloc (struct libusb_device_handle *dev_handle, size_t len) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface;
+  uint8_t direction, number, interval, transferType;
+  uint16_t maxPacketSize;
+  struct darwin_ll_buffer *ll;
+  int iface, chosen = -1, i;
+  IOReturn kresult;
+  void *buffer;
+
+  for (iface = 0 ; iface < USB_MAXINTERFACES && chosen < 0 ; iface++) {
+    cInterface = &priv->interfaces[iface];
+
+    if (!(dev_handle->claimed_interfaces & (1 << iface)) || !cInterface->interface)
+      continue;
+
+    for (i = 0 ; i < cInterface->num_endpoints ; i++) {
+      (*(cInterface->interface))->GetPipeProperties (cInterface->interface, i + 1, &direction, &number,
+                                                     &transferType, &maxPacketSize, &interval);
+      if (kUSBIsoc == transferType && kUSBIn == direction) {
+        chosen = iface;
+        break;
+      }
+    }
+  }
+
+  for (iface = 0 ; iface < USB_MAXINTERFACES && chosen < 0 ; iface++)
+    if ((dev_handle->claimed_interfaces & (1 << iface)) && priv->interfaces[iface].interface)
+      chosen = iface;
+
+  if (chosen < 0) {
+    usbi_dbg ("no claimed interface to create low latency buffers on");
+    return NULL;
+  }
+
+  ll = calloc (1, sizeof (*ll));
+  if (!ll)
+    return NULL;
+
+  cInterface = &priv->interfaces[chosen];
+  kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &buffer, len,
+                                                                kUSBLowLatencyReadBuffer);
+  if (kresult != kIOReturnSuccess) {
+    usbi_dbg ("LowLatencyCreateBuffer: %s", darwin_error_str (kresult));
+    free (ll);
+    return NULL;
+  }
+
+  ll->buffer = buffer;
+  ll->length = len;
+  ll->iface = (uint8_t) chosen;
+  ll->type = kUSBLowLatencyReadBuffer;
+
+  usbi_mutex_lock (&priv->ll_lock);
+  list_add (&ll->list, &priv->ll_buffers);
+  usbi_mutex_unlock (&priv->ll_lock);
+
+  usbi_dbg ("created %lu byte low latency buffer on interface %d", (unsigned long) len, chosen);
+
+  return ll->buffer;
+}
+
+static int darwin_dev_mem_free (struct libusb_device_handle *dev_handle, unsigned char *buffer, size_t len) {
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
+  struct darwin_interface *cInterface;
+  struct darwin_ll_buffer *ll;
+
+  UNUSED(len);
+
+  usbi_mutex_lock (&priv->ll_lock);
+  list_for_each_entry(ll, &priv->ll_buffers, list, struct darwin_ll_buffer) {
+    if (ll->buffer == buffer) {
+      cInterface = &priv->interfaces[ll->iface];
+      (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, ll->buffer);
+      list_del (&ll->list);
+      usbi_mutex_unlock (&priv->ll_lock);
+      free (ll);
+      return LIBUSB_SUCCESS;
+    }
+  }
+  usbi_mutex_unlock (&priv->ll_lock);
+
+  /* the buffer was destroyed along with its interface */
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
+  IOUSBLowLatencyIsocFrame *ll_frames = NULL;
 
   IOReturn kresult;
-  uint8_t direction, number, interval, pipeRef, transferType;
+  uint8_t direction, number, interval, pipeRef, transferType, iface;
   uint16_t maxPacketSize;
   UInt64 frame;
   AbsoluteTime atTime;
@@ -1538,44 +1727,57 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
 
   struct darwin_interface *cInterface;
 
-  /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
-  if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
-    free(tpriv->isoc_framelist);
-    tpriv->isoc_framelist = NULL;
-  }
-
-  if (!tpriv->isoc_framelist) {
-    tpriv->num_iso_packets = transfer->num_iso_packets;
-    tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
-    if (!tpriv->isoc_framelist)
-      return LIBUSB_ERROR_NO_MEM;
-  }
-
-  /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
-  for (i = 0 ; i < transfer->num_iso_packets ; i++)
-    tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
-
   /* determine the interface/endpoint to use */
-  if (ep_to_pipeRef (transfer->dev_handle, transfer->endpoint, &pipeRef, NULL, &cInterface) != 0) {
+  if (ep_to_pipeRef (transfer->dev_handle, transfer->endpoint, &pipeRef, &iface, &cInterface) != 0) {
     usbi_err (TRANSFER_CTX (transfer), "endpoint not found on any open interface");
 
     return LIBUSB_ERROR_NOT_FOUND;
   }
 
-  /* determine the properties of this endpoint and the speed of the device */
-  (*(cInterface->interface))->GetPipeProperties (cInterface->interface, pipeRef, &direction, &number,
-                                                 &transferType, &maxPacketSize, &interval);
+  /* use the low latency path if the buffer was obtained from darwin_dev_mem_alloc() */
+  tpriv->ll_framelist = NULL;
+  usbi_mutex_lock (&priv->ll_lock);
+  if (darwin_ll_find_buffer (priv, iface, transfer->buffer, transfer->length,
+                             IS_XFERIN(transfer) ? kUSBLowLatencyReadBuffer : kUSBLowLatencyWriteBuffer))
+    tpriv->ll_framelist = darwin_ll_get_framelist (priv, iface, transfer->num_iso_packets);
+  usbi_mutex_unlock (&priv->ll_lock);
+
+  if (tpriv->ll_framelist) {
+    ll_frames = (IOUSBLowLatencyIsocFrame *) tpriv->ll_framelist->buffer;
+    for (i = 0 ; i < transfer->num_iso_packets ; i++) {
+      ll_frames[i].frStatus = 0;
+      ll_frames[i].frReqCount = transfer->iso_packet_desc[i].length;
+      ll_frames[i].frActCount = 0;
+    }
+  } else {
+    /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
+    if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
+      free(tpriv->isoc_framelist);
+      tpriv->isoc_framelist = NULL;
+    }
+
+    if (!tpriv->isoc_framelist) {
+      tpriv->num_iso_packets = transfer->num_iso_packets;
+      tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
+      if (!tpriv->isoc_framelist)
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
+    for (i = 0 ; i < transfer->num_iso_packets ; i++)
+      tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
+  }
 
   /* Last but not least we need the bus frame number */
   kresult = (*(cInterface->interface))->GetBusFrameNumber(cInterface->interface, &frame, &atTime);
   if (kresult) {
     usbi_err (TRANSFER_CTX (transfer), "failed to get bus frame number: %d", kresult);
-    free(tpriv->isoc_framelist);
-    tpriv->isoc_framelist = NULL;
+    darwin_clear_transfer_priv (itransfer);
 
     return darwin_to_libusb (kresult);
   }
 
+  /* determine the properties of this endpoint and the speed of the device */
   (*(cInterface->interface))->GetPipeProperties (cInterface->interface, pipeRef, &direction, &number,
                                                  &transferType, &maxPacketSize, &interval);
 
@@ -1585,8 +1787,16 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
     frame = cInterface->frames[transfer->endpoint];
 
-  /* submit the request */
-  if (IS_XFERIN(transfer))
+  /* submit the request. low latency frame lists are updated every millisecond */
+  if (tpriv->ll_framelist && IS_XFERIN(transfer))
+    kresult = (*(cInterface->interface))->LowLatencyReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
+                                                                       transfer->num_iso_packets, 1, ll_frames,
+                                                                       darwin_async_io_callback, itransfer);
+  else if (tpriv->ll_framelist)
+    kresult = (*(cInterface->interface))->LowLatencyWriteIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
+                                                                        transfer->num_iso_packets, 1, ll_frames,
+                                                                        darwin_async_io_callback, itransfer);
+  else if (IS_XFERIN(transfer))
     kresult = (*(cInterface->interface))->ReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
                                                              transfer->num_iso_packets, tpriv->isoc_framelist, darwin_async_io_callback,
                                                              itransfer);
@@ -1605,8 +1815,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   if (kresult != kIOReturnSuccess) {
     usbi_err (TRANSFER_CTX (transfer), "isochronous transfer failed (dir: %s): %s", IS_XFERIN(transfer) ? "In" : "Out",
                darwin_error_str(kresult));
-    free (tpriv->isoc_framelist);
-    tpriv->isoc_framelist = NULL;
+    darwin_clear_transfer_priv (itransfer);
   }
 
   return darwin_to_libusb (kresult);
@@ -1631,8 +1840,8 @@ static int submit_control_transfer(struct usbi_transfer *itransfer) {
   tpriv->req.wLength           = OSSwapLittleToHostInt16 (setup->wLength);
   /* data is stored after the libusb control block */
   tpriv->req.pData             = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
-  tpriv->req.completionTimeout = transfer->timeout;
-  tpriv->req.noDataTimeout     = transfer->timeout;
+  tpriv->req.completionTimeout = usbi_transfer_timeout_ms(transfer);
+  tpriv->req.noDataTimeout     = usbi_transfer_timeout_ms(transfer);
 
   itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
 
@@ -1732,6 +1941,31 @@ static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
   return darwin_to_libusb (kresult);
 }
 
+static int darwin_abort_endpoint (struct libusb_device_handle *dev_handle, unsigned char endpoint) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  struct darwin_interface *cInterface;
+  uint8_t pipeRef, iface;
+  IOReturn kresult;
+
+  if (ep_to_pipeRef (dev_handle, endpoint, &pipeRef, &iface, &cInterface) != 0) {
+    usbi_err (HANDLE_CTX (dev_handle), "endpoint not found on any open interface");
+
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  if (!dpriv->device)
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  usbi_dbg ("aborting all transactions on interface %d pipe %d", iface, pipeRef);
+
+  (*(cInterface->interface))->AbortPipe (cInterface->interface, pipeRef);
+
+  /* as in darwin_abort_transfers, reset the data toggle bit */
+  kresult = (*(cInterface->interface))->ClearPipeStallBothEnds(cInterface->interface, pipeRef);
+
+  return darwin_to_libusb (kresult);
+}
+
 static int darwin_cancel_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
@@ -1756,14 +1990,55 @@ static void darwin_clear_transfer_priv (struct usbi_transfer *itransfer) {
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
   }
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && tpriv->ll_framelist) {
+    darwin_ll_put_framelist ((struct darwin_device_handle_priv *)transfer->dev_handle->os_priv, tpriv->ll_framelist);
+    tpriv->ll_framelist = NULL;
+  }
+}
+
+/* push a completed transfer on the handle's completion list (called from the event thread) */
+static void darwin_queue_completion (struct darwin_device_handle_priv *priv, struct usbi_transfer *itransfer) {
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  struct usbi_transfer *head;
+  char doorbell = 0;
+
+  do {
+    head = priv->completed;
+    tpriv->next_completed = head;
+  } while (!OSAtomicCompareAndSwapPtrBarrier (head, itransfer, (void * volatile *) &priv->completed));
+
+  /* if the list was not empty the event handler has not taken it yet, and will see this transfer too */
+  if (NULL == head)
+    write (priv->fds[1], &doorbell, sizeof (doorbell));
+}
+
+/* take all the completed transfers of a handle, oldest first */
+static struct usbi_transfer *darwin_take_completions (struct darwin_device_handle_priv *priv) {
+  struct usbi_transfer *head, *next, *list = NULL;
+  struct darwin_transfer_priv *tpriv;
+
+  do {
+    head = priv->completed;
+  } while (!OSAtomicCompareAndSwapPtrBarrier (head, NULL, (void * volatile *) &priv->completed));
+
+  /* the list is built in reverse order of completion */
+  while (head) {
+    tpriv = usbi_transfer_get_os_priv(head);
+    next = tpriv->next_completed;
+    tpriv->next_completed = list;
+    list = head;
+    head = next;
+  }
+
+  return list;
 }
 
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0) {
   struct usbi_transfer *itransfer = (struct usbi_transfer *)refcon;
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
-  struct darwin_msg_async_io_complete message = {.itransfer = itransfer, .result = result,
-                                                 .size = (UInt32) (uintptr_t) arg0};
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 
   usbi_dbg ("an async io operation has completed");
 
@@ -1777,8 +2052,11 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
     (*(cInterface->interface))->WritePipe (cInterface->interface, pipeRef, transfer->buffer, 0);
   }
 
-  /* send a completion message to the device's file descriptor */
-  write (priv->fds[1], &message, sizeof (message));
+  tpriv->result = result;
+  tpriv->size = (UInt32) (uintptr_t) arg0;
+
+  /* hand the transfer over to the thread handling events for this device */
+  darwin_queue_completion (priv, itransfer);
 }
 
 static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_t result) {
@@ -1825,7 +2103,16 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
              isControl ? "control" : isBulk ? "bulk" : isIsoc ? "isoc" : "interrupt", result);
 
   if (kIOReturnSuccess == result || kIOReturnUnderrun == result) {
-    if (isIsoc && tpriv->isoc_framelist) {
+    if (isIsoc && tpriv->ll_framelist) {
+      /* copy isochronous results back from the low latency frame list */
+      IOUSBLowLatencyIsocFrame *ll_frames = (IOUSBLowLatencyIsocFrame *) tpriv->ll_framelist->buffer;
+
+      for (i = 0; i < transfer->num_iso_packets ; i++) {
+        struct libusb_iso_packet_descriptor *lib_desc = &transfer->iso_packet_desc[i];
+        lib_desc->status = darwin_to_libusb (ll_frames[i].frStatus);
+        lib_desc->actual_length = ll_frames[i].frActCount;
+      }
+    } else if (isIsoc && tpriv->isoc_framelist) {
       /* copy isochronous results back */
 
       for (i = 0; i < transfer->num_iso_packets ; i++) {
@@ -1837,14 +2124,23 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
       itransfer->transferred += io_size;
   }
 
+  /* the frame list can be reused now (the completion callback may resubmit this transfer) */
+  if (isIsoc && tpriv->ll_framelist) {
+    darwin_ll_put_framelist ((struct darwin_device_handle_priv *)transfer->dev_handle->os_priv, tpriv->ll_framelist);
+    tpriv->ll_framelist = NULL;
+  }
+
   /* it is ok to handle cancelled transfers without calling usbi_handle_transfer_cancellation (we catch timeout transfers) */
   usbi_handle_transfer_completion (itransfer, darwin_transfer_status (itransfer, result));
 }
 
 static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready) {
-  struct darwin_msg_async_io_complete message;
+  struct libusb_device_handle *handle;
+  struct darwin_device_handle_priv *hpriv = NULL;
+  struct darwin_transfer_priv *tpriv;
+  struct usbi_transfer *itransfer, *next;
+  char doorbell[16];
   POLL_NFDS_TYPE i = 0;
-  ssize_t ret;
 
   usbi_mutex_lock(&ctx->open_devs_lock);
 
@@ -1863,14 +2159,25 @@ static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL
       continue;
     }
 
-    /* there is only one type of message */
-    ret = read (pollfd->fd, &message, sizeof (message));
-    if (ret < (ssize_t) sizeof (message)) {
-      usbi_dbg ("WARNING: short read on async io completion pipe\n");
+    list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+      hpriv = (struct darwin_device_handle_priv *)handle->os_priv;
+      if (hpriv->fds[0] == pollfd->fd)
+        break;
+    }
+
+    if (&handle->list == &ctx->open_devs) {
+      usbi_dbg ("WARNING: no device handle for completion fd %i\n", pollfd->fd);
       continue;
     }
 
-    darwin_handle_callback (message.itransfer, message.result, message.size);
+    /* clear the doorbell before taking the list so that later completions ring it again */
+    while (read (pollfd->fd, doorbell, sizeof (doorbell)) > 0);
+
+    for (itransfer = darwin_take_completions (hpriv) ; itransfer ; itransfer = next) {
+      tpriv = usbi_transfer_get_os_priv(itransfer);
+      next = tpriv->next_completed;
+      darwin_handle_callback (itransfer, tpriv->result, tpriv->size);
+    }
   }
 
   usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1996,8 +2303,12 @@ const struct usbi_os_backend darwin_backend = {
 
         .submit_transfer = darwin_submit_transfer,
         .cancel_transfer = darwin_cancel_transfer,
+        .abort_endpoint = darwin_abort_endpoint,
         .clear_transfer_priv = darwin_clear_transfer_priv,
 
+        .dev_mem_alloc = darwin_dev_mem_alloc,
+        .dev_mem_free = darwin_dev_mem_free,
+
         .handle_events = op_handle_events,
 
         .clock_gettime = darwin_clock_gettime,
@@ -127,11 +127,31 @@ struct darwin_device_priv {
   struct darwin_cached_device *dev;
 };
 
+/* memory obtained with LowLatencyCreateBuffer: buffers handed out by
+ * darwin_dev_mem_alloc and frame lists reused by isochronous transfers */
+struct darwin_ll_buffer {
+  struct list_head list;
+  unsigned char   *buffer;
+  size_t           length;
+  uint8_t          iface;
+  UInt32           type;
+  int              in_use;
+};
+
 struct darwin_device_handle_priv {
   int                  is_open;
   CFRunLoopSourceRef   cfSource;
   int                  fds[2];
 
+  /* lock-free list of completed transfers, filled by the event thread. fds[1] is
+   * only written to when the list goes from empty to non-empty. */
+  struct usbi_transfer * volatile completed;
+
+  /* low latency buffers and frame lists, protected by ll_lock */
+  usbi_mutex_t         ll_lock;
+  struct list_head     ll_buffers;
+  struct list_head     ll_framelists;
+
   struct darwin_interface {
     usb_interface_t    **interface;
     uint8_t              num_endpoints;
@@ -145,16 +165,15 @@ struct darwin_transfer_priv {
   /* Isoc */
   IOUSBIsocFrame *isoc_framelist;
   int num_iso_packets;
+  struct darwin_ll_buffer *ll_framelist;
 
   /* Control */
   IOUSBDevRequestTO req;
 
   /* Bulk */
-};
 
-/* structure for signaling io completion */
-struct darwin_msg_async_io_complete {
-  struct usbi_transfer *itransfer;
+  /* Completion */
+  struct usbi_transfer *next_completed;
   IOReturn result;
   UInt32 size;
 };
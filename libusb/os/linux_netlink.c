@@ -90,6 +90,68 @@ static int set_fd_cloexec_nb (int fd)
 	return 0;
 }
 
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/* Kernel uevents start with an "action@devpath" header, followed by the
+ * ACTION, DEVPATH and SUBSYSTEM variables, always in that order. So if the
+ * header ends at offset i, SUBSYSTEM= starts at 2 * i + 17. Classic BPF has
+ * no loops, so the search for the end of the header is unrolled up to
+ * FILTER_MAX_HEADER; events with longer headers are let through and left to
+ * linux_netlink_parse(). */
+#define FILTER_MIN_HEADER	5	/* "add@/" */
+#define FILTER_MAX_HEADER	256
+#define FILTER_ACTION_LEN	8
+#define FILTER_SCAN_LEN		(4 * (FILTER_MAX_HEADER - FILTER_MIN_HEADER + 1) + 1)
+#define FILTER_SUBSYSTEM_LEN	10
+#define FILTER_LEN		(FILTER_ACTION_LEN + FILTER_SCAN_LEN + FILTER_SUBSYSTEM_LEN)
+
+static struct sock_filter netlink_filter[FILTER_LEN];
+
+/* only pass "add" and "remove" events of the "usb" subsystem */
+static int linux_netlink_attach_filter(void)
+{
+	struct sock_filter *insn = netlink_filter;
+	struct sock_fprog fprog = { .len = FILTER_LEN, .filter = netlink_filter };
+	unsigned int subsystem = FILTER_ACTION_LEN + FILTER_SCAN_LEN;
+	unsigned int i;
+
+	/* the action, "add@" or "remove@" */
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440, 6, 0);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f, 0, 4);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x7665, 0, 2);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x40, 1, 0);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+	/* find the end of the header and point X at SUBSYSTEM= */
+	for (i = FILTER_MIN_HEADER ; i <= FILTER_MAX_HEADER ; i++) {
+		*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, i);
+		*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2);
+		*insn++ = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 2 * i + 17);
+		*insn = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA,
+			subsystem - (unsigned int) (insn - netlink_filter) - 1);
+		insn++;
+	}
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	/* "SUBSYSTEM=usb\0" */
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x53554253, 0, 7);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_IND, 4);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x59535445, 0, 5);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_IND, 8);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x4d3d7573, 0, 3);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_IND, 12);
+	*insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x6200, 0, 1);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	*insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+	return setsockopt(linux_netlink_socket, SOL_SOCKET, SO_ATTACH_FILTER,
+			  &fprog, sizeof(fprog));
+}
+#endif
+
 int linux_netlink_start_event_monitor(void)
 {
 	int socktype = SOCK_RAW;
@@ -126,6 +188,13 @@ int linux_netlink_start_event_monitor(void)
 		return LIBUSB_ERROR_OTHER;
 	}
 
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+	/* not fatal, linux_netlink_parse() still checks every event */
+	if (0 != linux_netlink_attach_filter()) {
+		usbi_dbg("could not attach netlink socket filter, errno=%d", errno);
+	}
+#endif
+
 	/* TODO -- add authentication */
 	/* setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)); */
 
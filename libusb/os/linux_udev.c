@@ -70,7 +70,9 @@ int linux_udev_start_event_monitor(void)
 		goto err_free_ctx;
 	}
 
-	r = udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, "usb", 0);
+	/* interfaces have no device node and are ignored anyway, so keep
+	 * their events from waking the event thread */
+	r = udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, "usb", "usb_device");
 	if (r) {
 		usbi_err(NULL, "could not initialize udev monitor filter for \"usb\" subsystem");
 		goto err_free_monitor;
@@ -243,7 +245,9 @@ static void udev_hotplug_event(struct udev_device* udev_dev)
 		} else if (detached) {
 			linux_device_disconnected(busnum, devaddr, sys_name);
 		} else {
-			usbi_err(NULL, "ignoring udev action %s", udev_action);
+			/* e.g. "change", "bind" or "unbind": the device may have
+			 * been reconfigured */
+			linux_device_changed(busnum, devaddr);
 		}
 	} while (0);
 
@@ -267,6 +271,7 @@ int linux_udev_scan_devices(struct libusb_context *ctx)
 	}
 
 	udev_enumerate_add_match_subsystem(enumerator, "usb");
+	udev_enumerate_add_match_property(enumerator, "DEVTYPE", "usb_device");
 	udev_enumerate_scan_devices(enumerator);
 	devices = udev_enumerate_get_list_entry(enumerator);
 
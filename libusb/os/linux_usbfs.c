@@ -28,11 +28,13 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -118,6 +120,22 @@ static int sysfs_can_relate_devices = -1;
  * descriptors file, so from then on we can use them. */
 static int sysfs_has_descriptors = -1;
 
+/* Whether op_init() has looked for the sysfs mount yet. */
+static int sysfs_checked = 0;
+
+/* Set from the LIBUSB_LAZY_DESCRIPTORS environment variable when the first
+ * context is initialized. Enumeration then only reads the device descriptor
+ * of each device, and the config descriptors (and, without
+ * sysfs_can_relate_devices, the active config, which costs a control
+ * transfer) are read when they are first asked for. Config descriptors of a
+ * device that has since been unplugged can then no longer be obtained. */
+static int lazy_descriptors = 0;
+static usbi_mutex_static_t descriptors_lock = USBI_MUTEX_INITIALIZER;
+
+/* protects the sysfs fds and the cached bConfigurationValue of all
+ * devices */
+static usbi_mutex_static_t sysfs_fd_lock = USBI_MUTEX_INITIALIZER;
+
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
 
@@ -126,26 +144,118 @@ usbi_mutex_static_t linux_hotplug_startstop_lock = USBI_MUTEX_INITIALIZER;
 /* Serialize scan-devices, event-thread, and poll */
 usbi_mutex_static_t linux_hotplug_lock = USBI_MUTEX_INITIALIZER;
 
+/* Hotplug events are appended to this log as they arrive rather than being
+ * applied to every context straight away. Contexts with hotplug drivers are
+ * on hotplug_subscribers and catch up as each event is logged, every other
+ * context only once it looks at its devices, see linux_sync_devices(). When
+ * the log reaches HOTPLUG_LOG_MAX entries, all contexts catch up and it is
+ * emptied. All of this is protected by linux_hotplug_lock. */
+#define HOTPLUG_LOG_MAX	256
+
+enum hotplug_log_type {
+	HOTPLUG_LOG_ARRIVED,
+	HOTPLUG_LOG_LEFT,
+	HOTPLUG_LOG_CHANGED,
+};
+
+struct hotplug_log_entry {
+	struct list_head list;
+	unsigned long seq;
+	enum hotplug_log_type type;
+	uint8_t busnum;
+	uint8_t devaddr;
+	/* points into the same allocation, or is NULL */
+	const char *sys_name;
+};
+
+static struct list_head hotplug_log = { &hotplug_log, &hotplug_log };
+static unsigned int hotplug_log_len = 0;
+/* sequence number of the newest event, logged or not */
+static unsigned long hotplug_log_seq = 0;
+static struct list_head hotplug_subscribers = { &hotplug_subscribers,
+	&hotplug_subscribers };
+
+/* Map from usbfs fd to the device handle which owns it, so that the event
+ * handler can go straight from a ready fd to its handle. fds are unique
+ * within the process, so a single table serves all contexts. */
+static struct libusb_device_handle **fd_handles = NULL;
+static int fd_handles_size = 0;
+static usbi_mutex_static_t fd_handles_lock = USBI_MUTEX_INITIALIZER;
+
+/* handles_closed is bumped by op_close(). batched event handling keeps
+ * handles across transfer callbacks, any of which may close one, and looks
+ * for closed handles whenever the count changed. handles_opened numbers
+ * handles as they are opened, so that a new handle at the address and fd of
+ * a closed one is told apart from it */
+static volatile long handles_closed;
+static volatile long handles_opened;
+
 static int linux_start_event_monitor(void);
 static int linux_stop_event_monitor(void);
 static int linux_scan_devices(struct libusb_context *ctx);
+static int linux_clone_devices(struct libusb_context *ctx);
+static void linux_sync_devices_locked(struct libusb_context *ctx);
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname);
+static int get_descriptors(struct libusb_device *dev);
 static int detach_kernel_driver_and_claim(struct libusb_device_handle *, int);
 
 #if !defined(USE_UDEV)
 static int linux_default_scan_devices (struct libusb_context *ctx);
 #endif
 
+/* the sysfs directory name (nul-terminated) and the raw descriptors of a
+ * device never change once read, and are shared with every identical device
+ * and every clone of the device in other contexts, see usbi_share_blob() */
 struct linux_device_priv {
-	char *sysfs_dir;
-	unsigned char *descriptors;
-	int descriptors_len;
+	struct usbi_shared_blob *sysfs_dir;
+	struct usbi_shared_blob *descriptors;
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
+	int descriptors_loaded; /* protected by descriptors_lock */
+
+	/* the sysfs directory of the device and its bConfigurationValue
+	 * attribute, opened on first use and kept open until the device is
+	 * destroyed, or -1 */
+	int sysfs_dir_fd;
+	int sysfs_config_fd;
+	/* bConfigurationValue as last read through sysfs_config_fd, valid
+	 * while sysfs_config_cached is set. set_configuration, reset and
+	 * hotplug events clear it and bump sysfs_config_gen, so that a read
+	 * racing with them does not cache a stale value */
+	int sysfs_config;
+	int sysfs_config_cached;
+	unsigned int sysfs_config_gen;
 };
 
+#define PRIV_SYSFS_DIR(priv) ((priv)->sysfs_dir \
+	? (const char *) SHARED_BLOB_DATA((priv)->sysfs_dir) : NULL)
+#define PRIV_DESCRIPTORS(priv) SHARED_BLOB_DATA((priv)->descriptors)
+
+/* index into bulk_urb_size: the endpoint number, plus 16 for IN. index 0
+ * holds the size used for endpoints without an entry of their own */
+#define BULK_URB_SIZE_INDEX(endpoint) \
+	(((endpoint) & LIBUSB_ENDPOINT_ADDRESS_MASK) \
+	| (((endpoint) & LIBUSB_ENDPOINT_DIR_MASK) ? 16 : 0))
+
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
+	/* URB size set with libusb_set_bulk_urb_size(), 0 for the default
+	 * policy or LIBUSB_BULK_URB_SIZE_UNLIMITED */
+	int bulk_urb_size[32];
+
+	/* thread blocking in REAPURB on fd, see op_set_dedicated_reaper().
+	 * reaper_wake is a GET_STATUS request submitted to make the thread
+	 * notice reaper_stop. reaper_exited is set by the thread if it stopped
+	 * on its own, after a disconnect or error */
+	pthread_t reaper;
+	int reaper_running;
+	int reaper_stop;
+	int reaper_exited;
+	struct usbfs_urb reaper_wake;
+	unsigned char reaper_wake_buf[LIBUSB_CONTROL_SETUP_SIZE + 2];
+
+	/* taken from handles_opened by op_open() */
+	long serial;
 };
 
 enum reap_action {
@@ -177,6 +287,20 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* URB storage, preallocated by op_prealloc_transfer() or grown at
+	 * submission time, and kept until op_destroy_transfer() */
+	unsigned char *urb_mem;
+	size_t urb_mem_size;
+
+	/* the iso URBs are always carved out of urb_mem, and are kept there
+	 * across submissions for as long as the transfer keeps the same buffer,
+	 * endpoint and packet lengths. iso_layout_urbs is the number of URBs
+	 * of the kept layout, or 0 if urb_mem holds none */
+	int iso_layout_urbs;
+	int iso_layout_packets;
+	unsigned char *iso_layout_buffer;
+	unsigned char iso_layout_endpoint;
 };
 
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
@@ -369,7 +493,10 @@ static int op_init(struct libusb_context *ctx)
 	struct stat statbuf;
 	int r;
 
-	usbfs_path = find_usbfs_path();
+	/* the probes below only depend on the system, they are done by the
+	 * first context and taken as they are by every later one */
+	if (!usbfs_path)
+		usbfs_path = find_usbfs_path();
 	if (!usbfs_path) {
 		usbi_err(ctx, "could not find usbfs");
 		return LIBUSB_ERROR_OTHER;
@@ -420,7 +547,8 @@ static int op_init(struct libusb_context *ctx)
 		}
 	}
 
-	if (sysfs_can_relate_devices || sysfs_has_descriptors) {
+	if (!sysfs_checked && (sysfs_can_relate_devices || sysfs_has_descriptors)) {
+		sysfs_checked = 1;
 		r = stat(SYSFS_DEVICE_PATH, &statbuf);
 		if (r != 0 || !S_ISDIR(statbuf.st_mode)) {
 			usbi_warn(ctx, "sysfs not mounted");
@@ -438,6 +566,11 @@ static int op_init(struct libusb_context *ctx)
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	r = LIBUSB_SUCCESS;
 	if (init_count == 0) {
+		char *lazy = getenv("LIBUSB_LAZY_DESCRIPTORS");
+		lazy_descriptors = lazy && atoi(lazy) != 0;
+		if (lazy_descriptors)
+			usbi_dbg("descriptors are read on first use");
+
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
 	}
@@ -459,8 +592,26 @@ static void op_exit(void)
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	assert(init_count != 0);
 	if (!--init_count) {
+		struct hotplug_log_entry *entry, *next;
+
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
+
+		/* no context is left to catch up with the log */
+		usbi_mutex_static_lock(&linux_hotplug_lock);
+		list_for_each_entry_safe(entry, next, &hotplug_log, list,
+				struct hotplug_log_entry) {
+			list_del(&entry->list);
+			free(entry);
+		}
+		hotplug_log_len = 0;
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+		usbi_mutex_static_lock(&fd_handles_lock);
+		free(fd_handles);
+		fd_handles = NULL;
+		fd_handles_size = 0;
+		usbi_mutex_static_unlock(&fd_handles_lock);
 	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 }
@@ -489,11 +640,20 @@ static int linux_scan_devices(struct libusb_context *ctx)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 
+	/* the event monitor keeps the devices of the other contexts up to
+	 * date, so a copy of them is as good as a scan */
+	ret = linux_clone_devices(ctx);
+	if (ret == LIBUSB_ERROR_NOT_FOUND) {
 #if defined(USE_UDEV)
-	ret = linux_udev_scan_devices(ctx);
+		ret = linux_udev_scan_devices(ctx);
 #else
-	ret = linux_default_scan_devices(ctx);
+		ret = linux_default_scan_devices(ctx);
 #endif
+	}
+	if (ret == LIBUSB_SUCCESS) {
+		ctx->devices_scanned = 1;
+		ctx->devices_seq = hotplug_log_seq;
+	}
 
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 
@@ -509,36 +669,76 @@ static void op_hotplug_poll(void)
 #endif
 }
 
+/* open the sysfs directory of a device on first use, so that its attributes
+ * can be opened with openat() without resolving the whole path again. must
+ * be called with sysfs_fd_lock held */
+static int _get_sysfs_dir_fd(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	char dirname[PATH_MAX];
+
+	if (priv->sysfs_dir_fd >= 0)
+		return priv->sysfs_dir_fd;
+
+	snprintf(dirname, PATH_MAX, "%s/%s", SYSFS_DEVICE_PATH,
+		PRIV_SYSFS_DIR(priv));
+	priv->sysfs_dir_fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	if (priv->sysfs_dir_fd < 0) {
+		usbi_err(DEVICE_CTX(dev), "open %s failed errno=%d", dirname,
+			errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return priv->sysfs_dir_fd;
+}
+
 static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	char filename[PATH_MAX];
-	int fd;
+	int dir_fd, fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
-	fd = open(filename, O_RDONLY);
+	usbi_mutex_static_lock(&sysfs_fd_lock);
+	dir_fd = _get_sysfs_dir_fd(dev);
+	usbi_mutex_static_unlock(&sysfs_fd_lock);
+	if (dir_fd < 0)
+		return dir_fd;
+
+	fd = openat(dir_fd, attr, O_RDONLY);
 	if (fd < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"open %s failed ret=%d errno=%d", filename, fd, errno);
+		usbi_err(DEVICE_CTX(dev), "open %s/%s/%s failed ret=%d errno=%d",
+			SYSFS_DEVICE_PATH, PRIV_SYSFS_DIR(priv), attr, fd, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
 	return fd;
 }
 
+/* forget the cached bConfigurationValue of a device */
+static void sysfs_invalidate_config(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+
+	usbi_mutex_static_lock(&sysfs_fd_lock);
+	priv->sysfs_config_cached = 0;
+	priv->sysfs_config_gen++;
+	usbi_mutex_static_unlock(&sysfs_fd_lock);
+}
+
 /* Note only suitable for attributes which always read >= 0, < 0 is error */
 static int __read_sysfs_attr(struct libusb_context *ctx,
 	const char *devname, const char *attr)
 {
 	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	char buf[16];
+	char *endptr;
+	long value;
+	ssize_t r;
+	int fd;
 
 	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
 		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
 		if (errno == ENOENT) {
 			/* File doesn't exist. Assume the device has been
 			   disconnected (see trac ticket #70). */
@@ -548,18 +748,27 @@ static int __read_sysfs_attr(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	/* read the value in one go rather than through stdio, which would
+	 * also fstat() the file and allocate a buffer for it */
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0) {
+		usbi_err(ctx, "read %s returned %d, errno=%d", attr, (int) r, errno);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
+	buf[r] = 0;
+
+	value = strtol(buf, &endptr, 10);
+	if (endptr == buf || value > INT_MAX) {
+		usbi_err(ctx, "error converting %s '%s' to integer", attr, buf);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
 	if (value < 0) {
 		usbi_err(ctx, "%s contains a negative value", filename);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return (int) value;
 }
 
 static int op_get_device_descriptor(struct libusb_device *dev,
@@ -568,26 +777,52 @@ static int op_get_device_descriptor(struct libusb_device *dev,
 	struct linux_device_priv *priv = _device_priv(dev);
 
 	*host_endian = sysfs_has_descriptors ? 0 : 1;
-	memcpy(buffer, priv->descriptors, DEVICE_DESC_LENGTH);
+	memcpy(buffer, PRIV_DESCRIPTORS(priv), DEVICE_DESC_LENGTH);
 
 	return 0;
 }
 
-/* read the bConfigurationValue for a device */
-static int sysfs_get_active_config(struct libusb_device *dev, int *config)
+/* read the bConfigurationValue for a device. the attribute is kept open and
+ * read again with pread(), and with use_cache set, the value read last is
+ * returned unless it has been invalidated since */
+static int sysfs_get_active_config(struct libusb_device *dev, int *config,
+	int use_cache)
 {
+	struct linux_device_priv *priv = _device_priv(dev);
 	char *endptr;
 	char tmp[5] = {0, 0, 0, 0, 0};
+	unsigned int gen;
 	long num;
-	int fd;
+	int dir_fd, fd;
 	ssize_t r;
 
-	fd = _open_sysfs_attr(dev, "bConfigurationValue");
-	if (fd < 0)
-		return fd;
+	usbi_mutex_static_lock(&sysfs_fd_lock);
+	if (use_cache && priv->sysfs_config_cached) {
+		*config = priv->sysfs_config;
+		usbi_mutex_static_unlock(&sysfs_fd_lock);
+		return 0;
+	}
+	if (priv->sysfs_config_fd < 0) {
+		dir_fd = _get_sysfs_dir_fd(dev);
+		if (dir_fd < 0) {
+			usbi_mutex_static_unlock(&sysfs_fd_lock);
+			return dir_fd;
+		}
+		priv->sysfs_config_fd = openat(dir_fd, "bConfigurationValue",
+			O_RDONLY);
+		if (priv->sysfs_config_fd < 0) {
+			usbi_err(DEVICE_CTX(dev),
+				"open bConfigurationValue failed errno=%d", errno);
+			usbi_mutex_static_unlock(&sysfs_fd_lock);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+	fd = priv->sysfs_config_fd;
+	gen = priv->sysfs_config_gen;
+	usbi_mutex_static_unlock(&sysfs_fd_lock);
 
-	r = read(fd, tmp, sizeof(tmp));
-	close(fd);
+	/* sysfs regenerates the attribute on every read from offset 0 */
+	r = pread(fd, tmp, sizeof(tmp), 0);
 	if (r < 0) {
 		usbi_err(DEVICE_CTX(dev),
 			"read bConfigurationValue failed ret=%d errno=%d", r, errno);
@@ -595,7 +830,7 @@ static int sysfs_get_active_config(struct libusb_device *dev, int *config)
 	} else if (r == 0) {
 		usbi_dbg("device unconfigured");
 		*config = -1;
-		return 0;
+		goto out;
 	}
 
 	if (tmp[sizeof(tmp) - 1] != 0) {
@@ -613,6 +848,14 @@ static int sysfs_get_active_config(struct libusb_device *dev, int *config)
 	}
 
 	*config = (int) num;
+
+out:
+	usbi_mutex_static_lock(&sysfs_fd_lock);
+	if (priv->sysfs_config_gen == gen) {
+		priv->sysfs_config = *config;
+		priv->sysfs_config_cached = 1;
+	}
+	usbi_mutex_static_unlock(&sysfs_fd_lock);
 	return 0;
 }
 
@@ -747,11 +990,16 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int size = priv->descriptors_len;
+	unsigned char *descriptors;
+	int r, size;
 	struct libusb_config_descriptor *config;
 
 	*buffer = NULL;
+	r = get_descriptors(dev);
+	if (r < 0)
+		return r;
+	descriptors = PRIV_DESCRIPTORS(priv);
+	size = priv->descriptors->len;
 	/* Unlike the device desc. config descs. are always in raw format */
 	*host_endian = 0;
 
@@ -781,12 +1029,15 @@ static int op_get_active_config_descriptor(struct libusb_device *dev,
 	unsigned char *config_desc;
 
 	if (sysfs_can_relate_devices) {
-		r = sysfs_get_active_config(dev, &config);
+		r = sysfs_get_active_config(dev, &config, 1);
 		if (r < 0)
 			return r;
 	} else {
 		/* Use cached bConfigurationValue */
 		struct linux_device_priv *priv = _device_priv(dev);
+		r = get_descriptors(dev);
+		if (r < 0)
+			return r;
 		config = priv->active_config;
 	}
 	if (config == -1)
@@ -806,12 +1057,18 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int i, r, size = priv->descriptors_len;
+	unsigned char *descriptors;
+	int i, r, size;
 
 	/* Unlike the device desc. config descs. are always in raw format */
 	*host_endian = 0;
 
+	r = get_descriptors(dev);
+	if (r < 0)
+		return r;
+	descriptors = PRIV_DESCRIPTORS(priv);
+	size = priv->descriptors->len;
+
 	/* Skip device header */
 	descriptors += DEVICE_DESC_LENGTH;
 	size -= DEVICE_DESC_LENGTH;
@@ -862,40 +1119,19 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
-static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir)
+/* read the descriptors file of a device into priv->descriptors. with
+ * device_desc_only, only the leading device descriptor is read. */
+static int read_descriptors(struct libusb_device *dev, int device_desc_only)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
-	int fd, speed;
+	unsigned char *descriptors = NULL;
+	int descriptors_len = 0;
+	struct usbi_shared_blob *blob;
+	int fd;
 	ssize_t r;
 
-	dev->bus_number = busnum;
-	dev->device_address = devaddr;
-
-	if (sysfs_dir) {
-		priv->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
-		if (!priv->sysfs_dir)
-			return LIBUSB_ERROR_NO_MEM;
-		strcpy(priv->sysfs_dir, sysfs_dir);
-
-		/* Note speed can contain 1.5, in this case __read_sysfs_attr
-		   will stop parsing at the '.' and return 1 */
-		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
-		if (speed >= 0) {
-			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
-			default:
-				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
-			}
-		}
-	}
-
-	/* cache descriptors in memory */
 	if (sysfs_has_descriptors)
 		fd = _open_sysfs_attr(dev, "descriptors");
 	else
@@ -904,52 +1140,67 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		return fd;
 
 	do {
-		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
-						  descriptors_size);
-		if (!priv->descriptors) {
+		if (device_desc_only)
+			descriptors_size = DEVICE_DESC_LENGTH;
+		else
+			descriptors_size *= 2;
+		descriptors = usbi_reallocf(descriptors, descriptors_size);
+		if (!descriptors) {
 			close(fd);
 			return LIBUSB_ERROR_NO_MEM;
 		}
 		/* usbfs has holes in the file */
 		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
+			memset(descriptors + descriptors_len,
+			       0, descriptors_size - descriptors_len);
 		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
+		r = read(fd, descriptors + descriptors_len,
+			 descriptors_size - descriptors_len);
 		if (r < 0) {
 			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
 				 fd, errno);
+			free(descriptors);
 			close(fd);
 			return LIBUSB_ERROR_IO;
 		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
+		descriptors_len += r;
+	} while (!device_desc_only && descriptors_len == descriptors_size);
 
 	close(fd);
 
-	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
-		usbi_err(ctx, "short descriptor read (%d)",
-			 priv->descriptors_len);
+	if (descriptors_len < DEVICE_DESC_LENGTH) {
+		usbi_err(ctx, "short descriptor read (%d)", descriptors_len);
+		free(descriptors);
 		return LIBUSB_ERROR_IO;
 	}
 
-	if (sysfs_can_relate_devices)
-		return LIBUSB_SUCCESS;
+	blob = usbi_share_blob(descriptors, descriptors_len);
+	free(descriptors);
+	if (!blob)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_unref_blob(priv->descriptors);
+	priv->descriptors = blob;
+	return LIBUSB_SUCCESS;
+}
+
+static int cache_active_config(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int fd, r;
 
-	/* cache active config */
 	fd = _get_usbfs_fd(dev, O_RDWR, 1);
 	if (fd < 0) {
 		/* cannot send a control message to determine the active
 		 * config. just assume the first one is active. */
 		usbi_warn(ctx, "Missing rw usbfs access; cannot determine "
 			       "active configuration descriptor");
-		if (priv->descriptors_len >=
+		if (priv->descriptors->len >=
 				(DEVICE_DESC_LENGTH + LIBUSB_DT_CONFIG_SIZE)) {
 			struct libusb_config_descriptor config;
 			usbi_parse_descriptor(
-				priv->descriptors + DEVICE_DESC_LENGTH,
+				PRIV_DESCRIPTORS(priv) + DEVICE_DESC_LENGTH,
 				"bbwbbbbb", &config, 0);
 			priv->active_config = config.bConfigurationValue;
 		} else
@@ -984,6 +1235,85 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	return r;
 }
 
+/* cache all descriptors, and the active config when sysfs can't tell us */
+static int load_descriptors(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	int r;
+
+	r = read_descriptors(dev, 0);
+	if (r < 0)
+		return r;
+
+	if (!sysfs_can_relate_devices) {
+		r = cache_active_config(dev);
+		if (r < 0)
+			return r;
+	}
+
+	priv->descriptors_loaded = 1;
+	return LIBUSB_SUCCESS;
+}
+
+/* make sure the config descriptors of a device enumerated in lazy mode have
+ * been read before they are looked at */
+static int get_descriptors(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&descriptors_lock);
+	if (!priv->descriptors_loaded) {
+		usbi_dbg("loading descriptors of %d.%d", dev->bus_number,
+			 dev->device_address);
+		r = load_descriptors(dev);
+	}
+	usbi_mutex_static_unlock(&descriptors_lock);
+
+	return r;
+}
+
+static int initialize_device(struct libusb_device *dev, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	int speed;
+
+	priv->sysfs_dir_fd = -1;
+	priv->sysfs_config_fd = -1;
+	dev->bus_number = busnum;
+	dev->device_address = devaddr;
+
+	if (sysfs_dir) {
+		priv->sysfs_dir = usbi_share_blob(sysfs_dir,
+			strlen(sysfs_dir) + 1);
+		if (!priv->sysfs_dir)
+			return LIBUSB_ERROR_NO_MEM;
+
+		/* Note speed can contain 1.5, in this case __read_sysfs_attr
+		   will stop parsing at the '.' and return 1 */
+		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
+		if (speed >= 0) {
+			switch (speed) {
+			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
+			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
+			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
+			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
+			default:
+				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
+			}
+		}
+	}
+
+	/* in lazy mode the device descriptor is all that is needed to identify
+	 * the device, the rest is read by get_descriptors() on first use */
+	if (lazy_descriptors)
+		return read_descriptors(dev, 1);
+
+	/* cache descriptors in memory */
+	return load_descriptors(dev);
+}
+
 static int linux_get_parent_info(struct libusb_device *dev, const char *sysfs_dir)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -1024,7 +1354,8 @@ retry:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry(it, &ctx->usb_devs, list, struct libusb_device) {
 		struct linux_device_priv *priv = _device_priv(it);
-		if (0 == strcmp (priv->sysfs_dir, parent_sysfs_dir)) {
+		if (priv->sysfs_dir && 0 == strcmp ((const char *)
+				SHARED_BLOB_DATA(priv->sysfs_dir), parent_sysfs_dir)) {
 			dev->parent_dev = libusb_ref_device(it);
 			break;
 		}
@@ -1065,6 +1396,8 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	if (dev) {
 		/* device already exists in the context */
 		usbi_dbg("session_id %ld already exists", session_id);
+		if (sysfs_can_relate_devices)
+			sysfs_invalidate_config(dev);
 		libusb_unref_device(dev);
 		return LIBUSB_SUCCESS;
 	}
@@ -1094,98 +1427,358 @@ out:
 	return r;
 }
 
-void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+/* add a copy of a device of another context to ctx. nothing is read from
+ * the device, what enumeration found out about it is taken from src */
+static int linux_clone_device(struct libusb_context *ctx,
+	struct libusb_device *src)
 {
-	struct libusb_context *ctx;
+	struct linux_device_priv *src_priv = _device_priv(src);
+	struct linux_device_priv *priv;
+	struct libusb_device *dev;
+	int r;
 
-	usbi_mutex_static_lock(&active_contexts_lock);
-	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
-		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+	dev = usbi_get_device_by_session_id(ctx, src->session_data);
+	if (dev) {
+		/* device already reported by the event monitor */
+		libusb_unref_device(dev);
+		return LIBUSB_SUCCESS;
 	}
-	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	dev = usbi_alloc_device(ctx, src->session_data);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+	priv = _device_priv(dev);
+	priv->sysfs_dir_fd = -1;
+	priv->sysfs_config_fd = -1;
+
+	dev->bus_number = src->bus_number;
+	dev->port_number = src->port_number;
+	dev->device_address = src->device_address;
+	dev->speed = src->speed;
+
+	if (src_priv->sysfs_dir)
+		priv->sysfs_dir = usbi_ref_blob(src_priv->sysfs_dir);
+
+	/* the descriptors of a lazily enumerated device may be loaded by
+	 * get_descriptors() at any time */
+	usbi_mutex_static_lock(&descriptors_lock);
+	priv->descriptors = usbi_ref_blob(src_priv->descriptors);
+	priv->active_config = src_priv->active_config;
+	priv->descriptors_loaded = src_priv->descriptors_loaded;
+	usbi_mutex_static_unlock(&descriptors_lock);
+
+	r = usbi_sanitize_device(dev);
+	if (r < 0)
+		goto out;
+
+	if (src->parent_dev) {
+		dev->parent_dev = usbi_get_device_by_session_id(ctx,
+			src->parent_dev->session_data);
+		if (!dev->parent_dev)
+			r = linux_get_parent_info(dev, PRIV_SYSFS_DIR(priv));
+	}
+out:
+	if (r < 0)
+		libusb_unref_device(dev);
+	else
+		usbi_connect_device(dev);
+
+	return r;
 }
 
-void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+/* fill the device list of a new context from a context that has already
+ * been scanned, after bringing that one up to date. called with
+ * linux_hotplug_lock held, so that no hotplug event is processed halfway
+ * through. returns LIBUSB_ERROR_NOT_FOUND if there is no context to copy
+ * from */
+static int linux_clone_devices(struct libusb_context *ctx)
 {
-	struct libusb_context *ctx;
-	struct libusb_device *dev;
-	unsigned long session_id = busnum << 8 | devaddr;
+	struct libusb_context *src = NULL, *it;
+	struct list_head *pos;
+	int r = LIBUSB_ERROR_NOT_FOUND;
 
 	usbi_mutex_static_lock(&active_contexts_lock);
-	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
-		dev = usbi_get_device_by_session_id (ctx, session_id);
-		if (NULL != dev) {
-			usbi_disconnect_device (dev);
-			libusb_unref_device(dev);
-		} else {
-			usbi_dbg("device not found for session %x", session_id);
+	list_for_each_entry(it, &active_contexts_list, list, struct libusb_context) {
+		if (it != ctx && it->devices_scanned) {
+			src = it;
+			break;
 		}
 	}
+
+	if (src) {
+		usbi_dbg("copying devices of context %p", src);
+		r = LIBUSB_SUCCESS;
+		linux_sync_devices_locked(src);
+
+		/* usb_devs has the most recently connected device first, walk it
+		 * backwards so that parents are copied before their children */
+		usbi_mutex_lock(&src->usb_devs_lock);
+		for (pos = src->usb_devs.prev; pos != &src->usb_devs;
+		     pos = pos->prev) {
+			r = linux_clone_device(ctx,
+				list_entry(pos, struct libusb_device, list));
+			if (r < 0)
+				break;
+		}
+		usbi_mutex_unlock(&src->usb_devs_lock);
+	}
 	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	return r;
 }
 
-#if !defined(USE_UDEV)
-/* open a bus directory and adds all discovered devices to the context */
-static int usbfs_scan_busdir(struct libusb_context *ctx, uint8_t busnum)
+static void hotplug_apply(struct libusb_context *ctx,
+	const struct hotplug_log_entry *entry)
 {
-	DIR *dir;
-	char dirpath[PATH_MAX];
-	struct dirent *entry;
-	int r = LIBUSB_ERROR_IO;
+	unsigned long session_id = entry->busnum << 8 | entry->devaddr;
+	struct libusb_device *dev;
 
-	snprintf(dirpath, PATH_MAX, "%s/%03d", usbfs_path, busnum);
-	usbi_dbg("%s", dirpath);
-	dir = opendir(dirpath);
-	if (!dir) {
-		usbi_err(ctx, "opendir '%s' failed, errno=%d", dirpath, errno);
-		/* FIXME: should handle valid race conditions like hub unplugged
-		 * during directory iteration - this is not an error */
-		return r;
+	if (entry->type == HOTPLUG_LOG_ARRIVED) {
+		linux_enumerate_device(ctx, entry->busnum, entry->devaddr,
+			entry->sys_name);
+		return;
 	}
 
-	while ((entry = readdir(dir))) {
-		int devaddr;
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (!dev) {
+		if (entry->type == HOTPLUG_LOG_LEFT)
+			usbi_dbg("device not found for session %x", session_id);
+		return;
+	}
 
-		if (entry->d_name[0] == '.')
-			continue;
+	if (sysfs_can_relate_devices)
+		sysfs_invalidate_config(dev);
+	if (entry->type == HOTPLUG_LOG_LEFT)
+		usbi_disconnect_device(dev);
+	libusb_unref_device(dev);
+}
 
-		devaddr = atoi(entry->d_name);
-		if (devaddr == 0) {
-			usbi_dbg("unknown dir entry %s", entry->d_name);
-			continue;
-		}
+/* has the device that arrived with this entry left again in a later one? */
+static int hotplug_log_left_later(const struct hotplug_log_entry *entry)
+{
+	struct list_head *pos;
 
-		if (linux_enumerate_device(ctx, busnum, (uint8_t) devaddr, NULL)) {
-			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
-			continue;
-		}
+	for (pos = entry->list.next; pos != &hotplug_log; pos = pos->next) {
+		struct hotplug_log_entry *later = list_entry(pos,
+			struct hotplug_log_entry, list);
 
-		r = 0;
+		if (later->type == HOTPLUG_LOG_LEFT &&
+		    later->busnum == entry->busnum &&
+		    later->devaddr == entry->devaddr)
+			return 1;
 	}
-
-	closedir(dir);
-	return r;
+	return 0;
 }
 
-static int usbfs_get_device_list(struct libusb_context *ctx)
+/* apply the logged events that ctx has not seen yet. a device that came and
+ * went in the meantime is not enumerated at all. called with
+ * linux_hotplug_lock held */
+static void linux_sync_devices_locked(struct libusb_context *ctx)
 {
-	struct dirent *entry;
-	DIR *buses = opendir(usbfs_path);
-	int r = 0;
+	struct list_head *pos;
 
-	if (!buses) {
-		usbi_err(ctx, "opendir buses failed errno=%d", errno);
-		return LIBUSB_ERROR_IO;
+	if (!ctx->devices_scanned || ctx->devices_seq == hotplug_log_seq)
+		return;
+
+	/* subscribers are only ever one event behind, so look for the first
+	 * unseen entry from the newest end */
+	for (pos = hotplug_log.prev; pos != &hotplug_log; pos = pos->prev) {
+		if (list_entry(pos, struct hotplug_log_entry, list)->seq <=
+		    ctx->devices_seq)
+			break;
 	}
 
-	while ((entry = readdir(buses))) {
-		int busnum;
+	for (pos = pos->next; pos != &hotplug_log; pos = pos->next) {
+		struct hotplug_log_entry *entry = list_entry(pos,
+			struct hotplug_log_entry, list);
 
-		if (entry->d_name[0] == '.')
+		if (entry->type == HOTPLUG_LOG_ARRIVED &&
+		    hotplug_log_left_later(entry))
 			continue;
+		hotplug_apply(ctx, entry);
+	}
+	ctx->devices_seq = hotplug_log_seq;
+}
 
-		if (usbdev_names) {
-			int devaddr;
+/* bring every context up to date and empty the log. called with
+ * linux_hotplug_lock held */
+static void hotplug_log_flush(void)
+{
+	struct libusb_context *ctx;
+	struct hotplug_log_entry *entry, *next;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context)
+		linux_sync_devices_locked(ctx);
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	list_for_each_entry_safe(entry, next, &hotplug_log, list,
+			struct hotplug_log_entry) {
+		list_del(&entry->list);
+		free(entry);
+	}
+	hotplug_log_len = 0;
+}
+
+/* log a hotplug event and pass it on to the subscribed contexts. called with
+ * linux_hotplug_lock held */
+static void hotplug_log_event(enum hotplug_log_type type, uint8_t busnum,
+	uint8_t devaddr, const char *sys_name)
+{
+	size_t name_len = sys_name ? strlen(sys_name) + 1 : 0;
+	struct hotplug_log_entry *entry;
+	struct libusb_context *ctx;
+
+	if (hotplug_log_len >= HOTPLUG_LOG_MAX)
+		hotplug_log_flush();
+
+	entry = malloc(sizeof(*entry) + name_len);
+	if (!entry) {
+		struct hotplug_log_entry direct;
+
+		/* no room in the log, hand the event to everyone now */
+		usbi_warn(NULL, "out of memory logging hotplug event");
+		hotplug_log_flush();
+		direct.type = type;
+		direct.busnum = busnum;
+		direct.devaddr = devaddr;
+		direct.sys_name = sys_name;
+		usbi_mutex_static_lock(&active_contexts_lock);
+		list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+			if (ctx->devices_scanned)
+				hotplug_apply(ctx, &direct);
+		}
+		usbi_mutex_static_unlock(&active_contexts_lock);
+		return;
+	}
+
+	entry->seq = ++hotplug_log_seq;
+	entry->type = type;
+	entry->busnum = busnum;
+	entry->devaddr = devaddr;
+	entry->sys_name = NULL;
+	if (sys_name) {
+		memcpy(entry + 1, sys_name, name_len);
+		entry->sys_name = (const char *)(entry + 1);
+	}
+	list_add_tail(&entry->list, &hotplug_log);
+	hotplug_log_len++;
+
+	list_for_each_entry(ctx, &hotplug_subscribers, hotplug_subscriber,
+			struct libusb_context)
+		linux_sync_devices_locked(ctx);
+}
+
+void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+{
+	hotplug_log_event(HOTPLUG_LOG_ARRIVED, busnum, devaddr, sys_name);
+}
+
+void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+{
+	UNUSED(sys_name);
+	hotplug_log_event(HOTPLUG_LOG_LEFT, busnum, devaddr, NULL);
+}
+
+void linux_device_changed(uint8_t busnum, uint8_t devaddr)
+{
+	if (!sysfs_can_relate_devices)
+		return;
+
+	hotplug_log_event(HOTPLUG_LOG_CHANGED, busnum, devaddr, NULL);
+}
+
+static void op_sync_devices(struct libusb_context *ctx)
+{
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	linux_sync_devices_locked(ctx);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+}
+
+static void op_update_hotplug_subscription(struct libusb_context *ctx)
+{
+	int subscribe;
+
+	/* both are read under linux_hotplug_lock, so concurrent updates
+	 * settle on the last state */
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	usbi_mutex_lock(&ctx->hotplug_drivers_lock);
+	subscribe = ctx->num_hotplug_drivers > 0;
+	usbi_mutex_unlock(&ctx->hotplug_drivers_lock);
+
+	if (subscribe && !ctx->hotplug_subscribed) {
+		linux_sync_devices_locked(ctx);
+		list_add_tail(&ctx->hotplug_subscriber, &hotplug_subscribers);
+		ctx->hotplug_subscribed = 1;
+	} else if (!subscribe && ctx->hotplug_subscribed) {
+		list_del(&ctx->hotplug_subscriber);
+		ctx->hotplug_subscribed = 0;
+	}
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+}
+
+#if !defined(USE_UDEV)
+/* open a bus directory and adds all discovered devices to the context */
+static int usbfs_scan_busdir(struct libusb_context *ctx, uint8_t busnum)
+{
+	DIR *dir;
+	char dirpath[PATH_MAX];
+	struct dirent *entry;
+	int r = LIBUSB_ERROR_IO;
+
+	snprintf(dirpath, PATH_MAX, "%s/%03d", usbfs_path, busnum);
+	usbi_dbg("%s", dirpath);
+	dir = opendir(dirpath);
+	if (!dir) {
+		usbi_err(ctx, "opendir '%s' failed, errno=%d", dirpath, errno);
+		/* FIXME: should handle valid race conditions like hub unplugged
+		 * during directory iteration - this is not an error */
+		return r;
+	}
+
+	while ((entry = readdir(dir))) {
+		int devaddr;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		devaddr = atoi(entry->d_name);
+		if (devaddr == 0) {
+			usbi_dbg("unknown dir entry %s", entry->d_name);
+			continue;
+		}
+
+		if (linux_enumerate_device(ctx, busnum, (uint8_t) devaddr, NULL)) {
+			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
+			continue;
+		}
+
+		r = 0;
+	}
+
+	closedir(dir);
+	return r;
+}
+
+static int usbfs_get_device_list(struct libusb_context *ctx)
+{
+	struct dirent *entry;
+	DIR *buses = opendir(usbfs_path);
+	int r = 0;
+
+	if (!buses) {
+		usbi_err(ctx, "opendir buses failed errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	while ((entry = readdir(buses))) {
+		int busnum;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		if (usbdev_names) {
+			int devaddr;
 			if (!_is_usbdev_entry(entry, &busnum, &devaddr))
 				continue;
 
@@ -1275,6 +1868,44 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 }
 #endif
 
+static int set_fd_handle(int fd, struct libusb_device_handle *handle)
+{
+	int r = 0;
+
+	usbi_mutex_static_lock(&fd_handles_lock);
+	if (fd >= fd_handles_size) {
+		int new_size = fd_handles_size ? fd_handles_size : 64;
+		struct libusb_device_handle **new_handles;
+
+		while (new_size <= fd)
+			new_size *= 2;
+		new_handles = realloc(fd_handles, new_size * sizeof(*new_handles));
+		if (!new_handles) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		memset(new_handles + fd_handles_size, 0,
+			(new_size - fd_handles_size) * sizeof(*new_handles));
+		fd_handles = new_handles;
+		fd_handles_size = new_size;
+	}
+	fd_handles[fd] = handle;
+out:
+	usbi_mutex_static_unlock(&fd_handles_lock);
+	return r;
+}
+
+static struct libusb_device_handle *get_fd_handle(int fd)
+{
+	struct libusb_device_handle *handle = NULL;
+
+	usbi_mutex_static_lock(&fd_handles_lock);
+	if (fd >= 0 && fd < fd_handles_size)
+		handle = fd_handles[fd];
+	usbi_mutex_static_unlock(&fd_handles_lock);
+	return handle;
+}
+
 static int op_open(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
@@ -1290,6 +1921,7 @@ static int op_open(struct libusb_device_handle *handle)
 				usbi_dbg("open failed with no device, but device still attached");
 				linux_device_disconnected(handle->dev->bus_number,
 						handle->dev->device_address, NULL);
+				linux_sync_devices_locked(HANDLE_CTX(handle));
 			}
 			usbi_mutex_static_unlock(&linux_hotplug_lock);
 		}
@@ -1309,13 +1941,30 @@ static int op_open(struct libusb_device_handle *handle)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	hpriv->serial = usbi_atomic_inc(&handles_opened);
+	r = set_fd_handle(hpriv->fd, handle);
+	if (r < 0)
+		goto err_close;
+
+	r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r < 0) {
+		set_fd_handle(hpriv->fd, NULL);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(hpriv->fd);
+	return r;
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
 	int fd = _device_handle_priv(dev_handle)->fd;
 	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
+	set_fd_handle(fd, NULL);
+	usbi_atomic_inc(&handles_closed);
 	close(fd);
 }
 
@@ -1325,7 +1974,9 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 	int r;
 
 	if (sysfs_can_relate_devices) {
-		r = sysfs_get_active_config(handle->dev, config);
+		/* an explicit query refreshes the cache, in case another
+		 * process changed the configuration */
+		r = sysfs_get_active_config(handle->dev, config, 0);
 	} else {
 		r = usbfs_get_active_config(handle->dev,
 					    _device_handle_priv(handle)->fd);
@@ -1360,6 +2011,8 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 
 	/* update our cached active config descriptor */
 	priv->active_config = config;
+	if (sysfs_can_relate_devices)
+		sysfs_invalidate_config(handle->dev);
 
 	return LIBUSB_SUCCESS;
 }
@@ -1472,6 +2125,9 @@ static int op_reset_device(struct libusb_device_handle *handle)
 		goto out;
 	}
 
+	if (sysfs_can_relate_devices)
+		sysfs_invalidate_config(handle->dev);
+
 	/* And re-claim any interfaces which were claimed before the reset */
 	for (i = 0; i < USB_MAXINTERFACES; i++) {
 		if (handle->claimed_interfaces & (1L << i)) {
@@ -1545,6 +2201,111 @@ static int op_free_streams(struct libusb_device_handle *handle,
 				endpoints, num_endpoints);
 }
 
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	unsigned char *buffer;
+
+	/* older kernels either fail the mmap or, worse, let it succeed on
+	 * drivers where transfers would not use the mapping */
+	if (!(hpriv->caps & USBFS_CAP_MMAP)) {
+		usbi_dbg("usbfs mmap not supported");
+		return NULL;
+	}
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_err(HANDLE_CTX(handle), "alloc dev mem failed errno %d",
+			errno);
+		return NULL;
+	}
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	if (munmap(buffer, len) != 0) {
+		usbi_err(HANDLE_CTX(handle), "free dev mem failed errno %d",
+			errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+static int op_set_bulk_urb_size(struct libusb_device_handle *handle,
+	unsigned char endpoint, int size)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	if (size > 0) {
+		size -= size % BULK_URB_SIZE_ALIGN;
+		if (size == 0)
+			size = BULK_URB_SIZE_ALIGN;
+	}
+	hpriv->bulk_urb_size[BULK_URB_SIZE_INDEX(endpoint)] = size;
+	return 0;
+}
+
+/* choose how to split bulk transfers on an endpoint. returns the size of
+ * each URB, or 0 if a transfer is submitted as a single URB whatever its
+ * length */
+static int get_bulk_urb_size(struct linux_device_handle_priv *hpriv,
+	unsigned char endpoint, int *use_bulk_continuation)
+{
+	int size = hpriv->bulk_urb_size[BULK_URB_SIZE_INDEX(endpoint)];
+
+	if (size == 0)
+		size = hpriv->bulk_urb_size[0];
+
+	*use_bulk_continuation = 0;
+	if (size > 0) {
+		/* a size chosen by the application, which old kernels cannot
+		 * take beyond the 16k limit */
+		if (size > MAX_BULK_BUFFER_LENGTH && !(hpriv->caps &
+				(USBFS_CAP_BULK_SCATTER_GATHER | USBFS_CAP_NO_PACKET_SIZE_LIM)))
+			size = MAX_BULK_BUFFER_LENGTH;
+		*use_bulk_continuation = !!(hpriv->caps & USBFS_CAP_BULK_CONTINUATION);
+		return size;
+	}
+
+	if (hpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
+		/* Good! Just submit everything in one go */
+		return 0;
+	} else if (size == LIBUSB_BULK_URB_SIZE_UNLIMITED
+			&& (hpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM)) {
+		/* fewest URBs asked for: rather than splitting with
+		   bulk-continuation, let the kernel alloc the whole buffer */
+		return 0;
+	} else if (hpriv->caps & USBFS_CAP_BULK_CONTINUATION) {
+		/* Split the transfers and use bulk-continuation to
+		   avoid issues with short-transfers */
+		*use_bulk_continuation = 1;
+		return MAX_BULK_BUFFER_LENGTH;
+	} else if (hpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) {
+		/* Don't split, assume the kernel can alloc the buffer
+		   (otherwise the submit will fail with -ENOMEM) */
+		return 0;
+	}
+
+	/* Bad, splitting without bulk-continuation, short transfers
+	   which end before the last urb will not work reliable! */
+	/* Note we don't warn here as this is "normal" on kernels <
+	   2.6.32 and not a problem for most applications */
+	return MAX_BULK_BUFFER_LENGTH;
+}
+
+static int op_get_bulk_urb_size(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	int use_bulk_continuation;
+
+	return get_bulk_urb_size(_device_handle_priv(handle), endpoint,
+		&use_bulk_continuation);
+}
+
 static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	int interface)
 {
@@ -1695,10 +2456,24 @@ static int op_release_interface(struct libusb_device_handle *handle, int iface)
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (priv->descriptors)
-		free(priv->descriptors);
-	if (priv->sysfs_dir)
-		free(priv->sysfs_dir);
+	usbi_unref_blob(priv->descriptors);
+	usbi_unref_blob(priv->sysfs_dir);
+	if (priv->sysfs_config_fd >= 0)
+		close(priv->sysfs_config_fd);
+	if (priv->sysfs_dir_fd >= 0)
+		close(priv->sysfs_dir_fd);
+}
+
+static size_t op_device_memory(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	size_t size;
+
+	size = usbi_blob_share(priv->sysfs_dir);
+	usbi_mutex_static_lock(&descriptors_lock);
+	size += usbi_blob_share(priv->descriptors);
+	usbi_mutex_static_unlock(&descriptors_lock);
+	return size;
 }
 
 /* URBs are discarded in reverse order of submission to avoid races. */
@@ -1738,17 +2513,63 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+/* make urb_mem at least size bytes large. its contents are lost if it has
+ * to grow */
+static int reserve_urb_mem(struct linux_transfer_priv *tpriv, size_t size)
 {
-	int i;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
-		if (!urb)
-			break;
-		free(urb);
-	}
+	unsigned char *mem;
+
+	if (tpriv->urb_mem && size <= tpriv->urb_mem_size)
+		return 0;
+
+	mem = malloc(size);
+	if (!mem)
+		return LIBUSB_ERROR_NO_MEM;
+	free(tpriv->urb_mem);
+	tpriv->urb_mem = mem;
+	tpriv->urb_mem_size = size;
+	tpriv->iso_layout_urbs = 0;
+	return 0;
+}
+
+/* the URBs of a transfer are kept in urb_mem until the transfer is freed, so
+ * that resubmitting it, e.g. with LIBUSB_TRANSFER_AUTO_RESUBMIT, does not
+ * allocate */
+static void *alloc_urb_mem(struct linux_transfer_priv *tpriv, size_t size)
+{
+	if (reserve_urb_mem(tpriv, size) < 0)
+		return NULL;
+	tpriv->iso_layout_urbs = 0;
+	memset(tpriv->urb_mem, 0, size);
+	return tpriv->urb_mem;
+}
+
+static void free_urb_mem(struct linux_transfer_priv *tpriv, void *ptr)
+{
+	if (ptr != tpriv->urb_mem)
+		free(ptr);
+}
+
+#define URB_MEM_ALIGN(size)	(((size) + 7) & ~(size_t)7)
+
+/* iso URB layout in urb_mem: the URB pointer array, then the time at which
+ * each URB was reaped, then the URBs themselves */
+#define ISO_URB_TIMES(tpriv, num_urbs) ((struct timeval *) \
+	((tpriv)->urb_mem + URB_MEM_ALIGN((num_urbs) * sizeof(struct usbfs_urb *))))
+
+/* upper bound on the memory needed to carve the URB pointer array, the reap
+ * times and the URBs themselves for an iso transfer out of a single block */
+static size_t iso_urb_mem_size(int num_urbs, int num_packets)
+{
+	return URB_MEM_ALIGN(num_urbs * sizeof(struct usbfs_urb *))
+		+ URB_MEM_ALIGN(num_urbs * sizeof(struct timeval))
+		+ (num_urbs * URB_MEM_ALIGN(sizeof(struct usbfs_urb)))
+		+ (num_packets * URB_MEM_ALIGN(sizeof(struct usbfs_iso_packet_desc)));
+}
 
-	free(tpriv->iso_urbs);
+/* the URBs stay in urb_mem for the next submission */
+static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+{
 	tpriv->iso_urbs = NULL;
 }
 
@@ -1760,11 +2581,14 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
+	struct libusb_iovec single;
+	const struct libusb_iovec *segs;
+	int num_segs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
 	int bulk_buffer_len, use_bulk_continuation;
 	int r;
-	int i;
+	int i, j, k;
 	size_t alloc_size;
 
 	if (tpriv->urbs)
@@ -1792,43 +2616,38 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	 * Last, there is the issue of short-transfers when splitting, for
 	 * short split-transfers to work reliable USBFS_CAP_BULK_CONTINUATION
 	 * is needed, but this is not always available.
+	 *
+	 * The application can override the choice made from these with
+	 * libusb_set_bulk_urb_size(), see get_bulk_urb_size().
 	 */
-	if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
-		/* Good! Just submit everything in one go */
-		bulk_buffer_len = transfer->length ? transfer->length : 1;
-		use_bulk_continuation = 0;
-	} else if (dpriv->caps & USBFS_CAP_BULK_CONTINUATION) {
-		/* Split the transfers and use bulk-continuation to
-		   avoid issues with short-transfers */
-		bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
-		use_bulk_continuation = 1;
-	} else if (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) {
-		/* Don't split, assume the kernel can alloc the buffer
-		   (otherwise the submit will fail with -ENOMEM) */
+	bulk_buffer_len = get_bulk_urb_size(dpriv, transfer->endpoint,
+		&use_bulk_continuation);
+	if (bulk_buffer_len == 0)
 		bulk_buffer_len = transfer->length ? transfer->length : 1;
-		use_bulk_continuation = 0;
+
+	/* the URBs of a scatter/gather transfer follow its segments, each of
+	 * which is split further at bulk_buffer_len. the core only hands such
+	 * a transfer over if the segments end on packet boundaries */
+	if (usbi_transfer_uses_iov(itransfer)) {
+		segs = itransfer->iov;
+		num_segs = itransfer->num_iov;
 	} else {
-		/* Bad, splitting without bulk-continuation, short transfers
-		   which end before the last urb will not work reliable! */
-		/* Note we don't warn here as this is "normal" on kernels <
-		   2.6.32 and not a problem for most applications */
-		bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
-		use_bulk_continuation = 0;
+		single.base = transfer->buffer;
+		single.len = transfer->length;
+		segs = &single;
+		num_segs = 1;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
+	int num_urbs = 0;
 
-	if (transfer->length == 0) {
+	for (j = 0; j < num_segs; j++)
+		num_urbs += (segs[j].len + bulk_buffer_len - 1) / bulk_buffer_len;
+	if (num_urbs == 0)
 		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
-	}
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
 	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
+	urbs = alloc_urb_mem(tpriv, alloc_size);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -1837,6 +2656,15 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
+	/* a zero length transfer keeps its single, empty URB */
+	urbs[0].buffer = segs[0].base;
+	for (i = 0, j = 0; j < num_segs; j++) {
+		for (k = 0; k < segs[j].len; k += bulk_buffer_len, i++) {
+			urbs[i].buffer = segs[j].base + k;
+			urbs[i].buffer_length = MIN(segs[j].len - k, bulk_buffer_len);
+		}
+	}
+
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb = &urbs[i];
 		urb->usercontext = itransfer;
@@ -1854,16 +2682,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
 
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
@@ -1887,7 +2708,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
+				free_urb_mem(tpriv, urbs);
 				tpriv->urbs = NULL;
 				return r;
 			}
@@ -1929,26 +2750,56 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	return 0;
 }
 
-static int submit_iso_transfer(struct usbi_transfer *itransfer)
+/* reset the URBs kept from the previous submission of an iso transfer if
+ * they match the transfer as it is now. returns 1 if they can be submitted
+ * again, 0 if the layout has to be rebuilt */
+static int reuse_iso_urbs(struct libusb_transfer *transfer,
+	struct linux_transfer_priv *tpriv)
+{
+	struct usbfs_urb **urbs = (struct usbfs_urb **)tpriv->urb_mem;
+	int i, j, k = 0;
+
+	if (!tpriv->iso_layout_urbs
+			|| tpriv->iso_layout_buffer != transfer->buffer
+			|| tpriv->iso_layout_endpoint != transfer->endpoint
+			|| tpriv->iso_layout_packets != transfer->num_iso_packets)
+		return 0;
+
+	for (i = 0; i < tpriv->iso_layout_urbs; i++) {
+		struct usbfs_urb *urb = urbs[i];
+
+		for (j = 0; j < urb->number_of_packets; j++, k++) {
+			struct usbfs_iso_packet_desc *desc = &urb->iso_frame_desc[j];
+
+			if (desc->length != transfer->iso_packet_desc[k].length)
+				return 0;
+			desc->actual_length = 0;
+			desc->status = 0;
+		}
+		urb->status = 0;
+		urb->actual_length = 0;
+		urb->start_frame = 0;
+		urb->error_count = 0;
+	}
+	return 1;
+}
+
+/* split the packets of an iso transfer across URBs in urb_mem */
+static int build_iso_urbs(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
-	struct linux_device_handle_priv *dpriv =
-		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb **urbs;
-	size_t alloc_size;
+	size_t alloc_size, carve_size, carve_offset;
 	int num_packets = transfer->num_iso_packets;
-	int i;
+	int i, r;
 	int this_urb_len = 0;
 	int num_urbs = 1;
 	int packet_offset = 0;
 	unsigned int packet_len;
 	unsigned char *urb_buffer = transfer->buffer;
 
-	if (tpriv->iso_urbs)
-		return LIBUSB_ERROR_BUSY;
-
 	/* usbfs places a 32kb limit on iso URBs. we divide up larger requests
 	 * into smaller units to meet such restriction, then fire off all the
 	 * units at once. it would be simpler if we just fired one unit at a time,
@@ -1974,18 +2825,18 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	}
 	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
 
-	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
-
-	tpriv->iso_urbs = urbs;
-	tpriv->num_urbs = num_urbs;
-	tpriv->num_retired = 0;
-	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
+	/* the pointer array, the reap times and all URBs are carved out of a
+	 * single block, which is kept with the transfer */
+	carve_size = iso_urb_mem_size(num_urbs, num_packets);
+	r = reserve_urb_mem(tpriv, carve_size);
+	if (r < 0)
+		return r;
+	memset(tpriv->urb_mem, 0, carve_size);
+	urbs = (struct usbfs_urb **)tpriv->urb_mem;
+	carve_offset = URB_MEM_ALIGN(num_urbs * sizeof(*urbs))
+		+ URB_MEM_ALIGN(num_urbs * sizeof(struct timeval));
 
-	/* allocate + initialize each URB with the correct number of packets */
+	/* initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb;
 		unsigned int space_remaining_in_urb = MAX_ISO_BUFFER_LENGTH;
@@ -2011,11 +2862,8 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		alloc_size = sizeof(*urb)
 			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
+		urb = (struct usbfs_urb *)(tpriv->urb_mem + carve_offset);
+		carve_offset += URB_MEM_ALIGN(alloc_size);
 		urbs[i] = urb;
 
 		/* populate packet lengths */
@@ -2034,12 +2882,51 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		urb->buffer = urb_buffer_orig;
 	}
 
-	/* submit URBs */
-	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
-		if (r < 0) {
-			if (errno == ENODEV) {
-				r = LIBUSB_ERROR_NO_DEVICE;
+	tpriv->iso_layout_urbs = num_urbs;
+	tpriv->iso_layout_packets = num_packets;
+	tpriv->iso_layout_buffer = transfer->buffer;
+	tpriv->iso_layout_endpoint = transfer->endpoint;
+	return 0;
+}
+
+static int submit_iso_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	struct usbfs_urb **urbs;
+	int num_urbs;
+	int i;
+
+	if (tpriv->iso_urbs)
+		return LIBUSB_ERROR_BUSY;
+
+	/* resubmitting with the same layout only needs the status fields of
+	 * the URBs reset */
+	if (!reuse_iso_urbs(transfer, tpriv)) {
+		int r = build_iso_urbs(itransfer);
+		if (r < 0)
+			return r;
+	}
+
+	urbs = (struct usbfs_urb **)tpriv->urb_mem;
+	num_urbs = tpriv->iso_layout_urbs;
+	tpriv->iso_urbs = urbs;
+	tpriv->num_urbs = num_urbs;
+	tpriv->num_retired = 0;
+	tpriv->reap_action = NORMAL;
+	tpriv->iso_packet_offset = 0;
+	for (i = 0; i < num_urbs; i++)
+		timerclear(&ISO_URB_TIMES(tpriv, num_urbs)[i]);
+
+	/* submit URBs */
+	for (i = 0; i < num_urbs; i++) {
+		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		if (r < 0) {
+			if (errno == ENODEV) {
+				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
 					"submiturb failed error %d errno=%d", r, errno);
@@ -2099,7 +2986,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = alloc_urb_mem(tpriv, sizeof(struct usbfs_urb));
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2114,7 +3001,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
+		free_urb_mem(tpriv, urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2191,7 +3078,7 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		usbi_mutex_lock(&itransfer->lock);
 		if (tpriv->urbs)
-			free(tpriv->urbs);
+			free_urb_mem(tpriv, tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		break;
@@ -2207,6 +3094,167 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+static int op_prealloc_transfer(struct usbi_transfer *itransfer,
+	int max_length)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int num_packets = itransfer->num_iso_packets;
+	int num_bulk_urbs;
+	size_t size;
+
+	/* a bulk transfer is split into at most this many URBs, control and
+	 * interrupt transfers always use a single one. an iso transfer needs at
+	 * most one URB per packet */
+	num_bulk_urbs = (max_length + MAX_BULK_BUFFER_LENGTH - 1)
+		/ MAX_BULK_BUFFER_LENGTH;
+	if (num_bulk_urbs < 1)
+		num_bulk_urbs = 1;
+	size = num_bulk_urbs * sizeof(struct usbfs_urb);
+	if (num_packets) {
+		size_t iso_size = iso_urb_mem_size(num_packets, num_packets);
+		if (iso_size > size)
+			size = iso_size;
+	}
+
+	tpriv->urb_mem = malloc(size);
+	if (!tpriv->urb_mem)
+		return LIBUSB_ERROR_NO_MEM;
+	tpriv->urb_mem_size = size;
+	return 0;
+}
+
+static void op_destroy_transfer(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	free(tpriv->urb_mem);
+	tpriv->urb_mem = NULL;
+	tpriv->urb_mem_size = 0;
+	tpriv->iso_layout_urbs = 0;
+}
+
+static int op_get_iso_packet_time(struct usbi_transfer *itransfer,
+	int packet, struct timeval *tv)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct usbfs_urb **urbs;
+	int i, r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (!tpriv->iso_layout_urbs || tpriv->iso_urbs
+			|| packet >= tpriv->iso_layout_packets)
+		goto out;
+
+	/* find the URB that carried the packet */
+	urbs = (struct usbfs_urb **)tpriv->urb_mem;
+	for (i = 0; i < tpriv->iso_layout_urbs; i++) {
+		if (packet < urbs[i]->number_of_packets) {
+			*tv = ISO_URB_TIMES(tpriv, tpriv->iso_layout_urbs)[i];
+			r = timerisset(tv) ? 0 : LIBUSB_ERROR_NOT_FOUND;
+			break;
+		}
+		packet -= urbs[i]->number_of_packets;
+	}
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+static int sync_transfer_status(struct libusb_device_handle *handle,
+	const char *what)
+{
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		usbi_err(HANDLE_CTX(handle), "%s failed errno %d", what, errno);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* the blocking usbfs requests complete in the kernel without a URB to reap,
+ * so they do not interfere with the asynchronous transfers of the handle */
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	int fd = _device_handle_priv(handle)->fd;
+	struct usbfs_ctrltransfer ctrl;
+	int r;
+
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	r = ioctl(fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_status(handle, "control transfer");
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred)
+{
+	int fd = _device_handle_priv(handle)->fd;
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	if (length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = length;
+	bulk.timeout = 0;
+	bulk.data = data;
+
+	*transferred = 0;
+	r = ioctl(fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_transfer_status(handle, "bulk transfer");
+	*transferred = r;
+	return 0;
+}
+
+/* move surplus data received by a URB of a scatter/gather transfer to the
+ * given offset across its segments, closing the hole left by the URBs which
+ * completed short. the offset is never past the data */
+static void move_iov_data(struct usbi_transfer *itransfer, int offset,
+	const unsigned char *data, int len)
+{
+	const struct libusb_iovec *iov = itransfer->iov;
+	int i, n;
+
+	for (i = 0; i < itransfer->num_iov && len > 0; i++) {
+		if (offset >= iov[i].len) {
+			offset -= iov[i].len;
+			continue;
+		}
+		n = MIN(len, iov[i].len - offset);
+		if (iov[i].base + offset != data)
+			memmove(iov[i].base + offset, data, n);
+		data += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2240,7 +3288,12 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * (closing any holes), so that libusb reports the total amount of
 		 * transferred data and presents it in a contiguous chunk.
 		 */
-		if (urb->actual_length > 0) {
+		if (urb->actual_length > 0 && usbi_transfer_uses_iov(itransfer)) {
+			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
+			move_iov_data(itransfer, itransfer->transferred, urb->buffer,
+				urb->actual_length);
+			itransfer->transferred += urb->actual_length;
+		} else if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
 			if (urb->buffer != target) {
@@ -2335,7 +3388,7 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
+	free_urb_mem(tpriv, tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
@@ -2352,6 +3405,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	int num_urbs = tpriv->num_urbs;
 	int urb_idx = 0;
 	int i;
+	struct timespec reap_time;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
 	usbi_mutex_lock(&itransfer->lock);
@@ -2370,6 +3424,13 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
+	/* usbfs does not report the frame an ASAP URB was started in, so the
+	 * time it was reaped is kept instead */
+	if (clock_gettime(monotonic_clkid, &reap_time) == 0) {
+		TIMESPEC_TO_TIMEVAL(&ISO_URB_TIMES(tpriv, num_urbs)[urb_idx - 1],
+			&reap_time);
+	}
+
 	/* copy isochronous results back in */
 
 	for (i = 0; i < urb->number_of_packets; i++) {
@@ -2479,7 +3540,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
+		free_urb_mem(tpriv, tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2520,21 +3581,20 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
+	free_urb_mem(tpriv, tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+/* retrieve one completed URB from the kernel. returns 0 and fills *urb if one
+ * was available, 1 if there was nothing to reap, or a LIBUSB_ERROR code */
+static int reap_urb(struct libusb_device_handle *handle, struct usbfs_urb **urb)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
-	struct usbfs_urb *urb;
-	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
+	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, urb);
 	if (r == -1 && errno == EAGAIN)
 		return 1;
 	if (r < 0) {
@@ -2546,12 +3606,27 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 		return LIBUSB_ERROR_IO;
 	}
 
-	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	return 0;
+}
+
+static int handle_reaped_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
+{
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer;
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
 
+	/* a reaper wakeup left for the event handler by a reaper thread which
+	 * gave up */
+	if (urb == &_device_handle_priv(handle)->reaper_wake)
+		return 0;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	usbi_trace(HANDLE_CTX(handle), LIBUSB_TRACE_REAP, transfer,
+		transfer->endpoint, urb->actual_length, urb->status);
+
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		return handle_iso_completion(itransfer, urb);
@@ -2568,44 +3643,533 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+static int reap_for_handle(struct libusb_device_handle *handle)
+{
+	struct usbfs_urb *urb;
+	int r;
+
+	r = reap_urb(handle, &urb);
+	if (r)
+		return r;
+
+	return handle_reaped_urb(handle, urb);
+}
+
+static void handle_disconnect(struct libusb_device_handle *handle)
+{
+	usbi_handle_disconnect(handle);
+	/* device will still be marked as attached if hotplug monitor thread
+	 * hasn't processed remove event yet */
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	if (handle->dev->attached) {
+		linux_device_disconnected(handle->dev->bus_number,
+				handle->dev->device_address, NULL);
+		linux_sync_devices_locked(HANDLE_CTX(handle));
+	}
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+}
+
+static void handle_pollerr(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
+	handle_disconnect(handle);
+}
+
+static void *reaper_thread_main(void *arg)
+{
+	struct libusb_device_handle *handle = arg;
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_urb *urb;
+	int r;
+
+	usbi_dbg("reaper for fd %d running", hpriv->fd);
+	handle->reaper_tid = usbi_get_tid();
+	for (;;) {
+		r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURB, &urb);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENODEV) {
+				/* still owning the fd, so that enabling the
+				 * reaper again, with the events lock which the
+				 * disconnect callbacks may take, does not join
+				 * this thread meanwhile */
+				handle_disconnect(handle);
+				hpriv->reaper_exited = 1;
+			} else {
+				/* hand the handle back to the event handler, so
+				 * that its transfers still complete */
+				hpriv->reaper_exited = 1;
+				usbi_err(HANDLE_CTX(handle),
+					"blocking reap failed errno=%d", errno);
+				usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd,
+					POLLOUT);
+			}
+			break;
+		}
+
+		if (urb == &hpriv->reaper_wake) {
+			if (hpriv->reaper_stop)
+				break;
+			continue;
+		}
+
+		handle_reaped_urb(handle, urb);
+	}
+
+	usbi_dbg("reaper for fd %d exiting", hpriv->fd);
+	handle->reaper_tid = 0;
+	return NULL;
+}
+
+/* make the reaper thread return from REAPURB with a request every device
+ * answers */
+static int wake_reaper(struct linux_device_handle_priv *hpriv)
+{
+	struct usbfs_urb *urb = &hpriv->reaper_wake;
+
+	memset(urb, 0, sizeof(*urb));
+	libusb_fill_control_setup(hpriv->reaper_wake_buf,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD
+		| LIBUSB_RECIPIENT_DEVICE, LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	urb->type = USBFS_URB_TYPE_CONTROL;
+	urb->endpoint = 0;
+	urb->buffer = hpriv->reaper_wake_buf;
+	urb->buffer_length = sizeof(hpriv->reaper_wake_buf);
+
+	if (ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb) < 0)
+		return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+	return 0;
+}
+
+/* whether the reaper thread is reaping the fd. a thread that stopped on its
+ * own stays reaper_running until it is joined, but has handed the fd back to
+ * the event handler */
+static int reaper_owns_fd(struct linux_device_handle_priv *hpriv)
+{
+	return hpriv->reaper_running && !hpriv->reaper_exited;
+}
+
+/* called with the events lock held when enabling, so that no event handler is
+ * looking at the fd while it is handed over. stopping is called without it,
+ * so that the callback the thread may be running can take it */
+static int op_set_dedicated_reaper(struct libusb_device_handle *handle,
+	int enable)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	int r;
+
+	if (enable) {
+		if (reaper_owns_fd(hpriv))
+			return 0;
+		if (hpriv->reaper_running) {
+			/* collect a thread that stopped on its own */
+			pthread_join(hpriv->reaper, NULL);
+			hpriv->reaper_running = 0;
+		}
+
+		hpriv->reaper_stop = 0;
+		hpriv->reaper_exited = 0;
+		usbi_remove_pollfd(ctx, hpriv->fd);
+		r = pthread_create(&hpriv->reaper, NULL, reaper_thread_main,
+			handle);
+		if (r) {
+			usbi_err(ctx, "failed to create reaper thread (%d)", r);
+			usbi_add_pollfd(ctx, hpriv->fd, POLLOUT);
+			return LIBUSB_ERROR_OTHER;
+		}
+		hpriv->reaper_running = 1;
+		return 0;
+	}
+
+	if (!hpriv->reaper_running)
+		return 0;
+	if (pthread_equal(hpriv->reaper, pthread_self()))
+		return LIBUSB_ERROR_BUSY;
+
+	/* the ioctl orders the store to reaper_stop before the wakeup */
+	hpriv->reaper_stop = 1;
+	if (!hpriv->reaper_exited) {
+		r = wake_reaper(hpriv);
+		if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ctx, "failed to wake reaper thread (%d)", r);
+	}
+	pthread_join(hpriv->reaper, NULL);
+	hpriv->reaper_running = 0;
+
+	if (!hpriv->reaper_exited)
+		usbi_add_pollfd(ctx, hpriv->fd, POLLOUT);
+	return 0;
+}
+
+/* the fd the events of a handle arrive on, for event domains. the fd is
+ * not available while a dedicated reaper thread reaps it */
+static int op_handle_event_fd(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	if (reaper_owns_fd(hpriv))
+		return LIBUSB_ERROR_BUSY;
+	return hpriv->fd;
+}
+
+static int op_busy_poll(struct libusb_device_handle *handle)
+{
+	int r;
+
+	if (reaper_owns_fd(_device_handle_priv(handle)))
+		return 0;
+
+	r = reap_for_handle(handle);
+
+	/* reap_for_handle() returns 1 when no URB was ready */
+	if (r == 0)
+		return 1;
+	else if (r == 1)
+		return 0;
+	return r;
+}
+
+/* find the device handle for a ready fd. open_devs_lock is not needed here:
+ * handles are only closed with the events lock held, which the callers of
+ * op_handle_events() hold, so the handle cannot go away while we work on it */
+static struct libusb_device_handle *handle_for_pollfd(struct libusb_context *ctx,
+	struct pollfd *pollfd)
+{
+	struct libusb_device_handle *handle = get_fd_handle(pollfd->fd);
+
+	if (!handle || HANDLE_CTX(handle) != ctx) {
+		usbi_err(ctx, "cannot find handle for fd %d\n", pollfd->fd);
+		return NULL;
+	}
+	return handle;
+}
+
+/* the most URBs reaped before being dispatched in batched mode, regardless
+ * of the configured batch size, so that the batch can live on the stack */
+#define MAX_REAP_BATCH 256
+
+/* a handle kept across transfer callbacks, with what identifies it once a
+ * callback may have closed it */
+struct reap_handle {
+	struct libusb_device_handle *handle;
+	int fd;
+	long serial;
+};
+
+static void set_reap_handle(struct reap_handle *ref,
+	struct libusb_device_handle *handle)
+{
+	ref->handle = handle;
+	ref->fd = _device_handle_priv(handle)->fd;
+	ref->serial = _device_handle_priv(handle)->serial;
+}
+
+/* whether the handle is still open. a handle found in the fd table cannot
+ * be closed under us: the events lock is held, and a callback closing it
+ * would run in this thread */
+static int reap_handle_open(const struct reap_handle *ref)
+{
+	struct libusb_device_handle *handle = get_fd_handle(ref->fd);
+
+	return handle == ref->handle
+		&& _device_handle_priv(handle)->serial == ref->serial;
+}
+
+struct reaped_urb {
+	struct reap_handle ref;
+	struct usbfs_urb *urb;
+	/* the class of the URB's transfer, read when it was reaped since the
+	 * transfer may be gone by the time the entry is looked at again */
+	int priority;
+};
+
+/* the LIBUSB_PRIORITY_HIGH handles which had events in a round of event
+ * handling. they are reaped again before each callback of a
+ * LIBUSB_PRIORITY_LOW transfer, see libusb_set_handle_priority() */
+#define MAX_YIELD_HANDLES 8
+
+struct reap_yield {
+	struct reap_handle handles[MAX_YIELD_HANDLES];
+	unsigned int num_handles;
+};
+
+static int reaped_urb_priority(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
+{
+	struct usbi_transfer *itransfer = urb->usercontext;
+
+	if (urb == &_device_handle_priv(handle)->reaper_wake)
+		return LIBUSB_PRIORITY_NORMAL;
+	return itransfer->active_priority;
+}
+
+/* forget the reaped URBs and the yield handles of the handles closed since
+ * *closed_seen was taken. do_close() has already dropped their transfers.
+ * returns whether any handle was closed */
+static int drop_closed_handles(struct reaped_urb *batch,
+	unsigned int num_reaped, struct reap_yield *yield, long *closed_seen)
+{
+	long closed = handles_closed;
+	unsigned int i;
+
+	if (closed == *closed_seen)
+		return 0;
+	*closed_seen = closed;
+
+	for (i = 0; i < num_reaped; i++)
+		if (batch[i].urb && !reap_handle_open(&batch[i].ref))
+			batch[i].urb = NULL;
+
+	i = 0;
+	while (yield && i < yield->num_handles) {
+		if (!reap_handle_open(&yield->handles[i]))
+			yield->handles[i] = yield->handles[--yield->num_handles];
+		else
+			i++;
+	}
+	return 1;
+}
+
+/* handle what completed on the high-priority handles meanwhile. only URBs
+ * of LIBUSB_PRIORITY_HIGH transfers are handled right away, those all were
+ * dispatched from the batch already. URBs of other transfers are appended to
+ * the batch so that they complete in order after the earlier URBs of their
+ * transfer and endpoint. a handle which fails to reap, or whose URBs no
+ * longer fit in the batch, is left alone for the rest of the round, and
+ * handles closed by a callback are dropped from the list */
+static void reap_yield_handles(struct reap_yield *yield,
+	struct reaped_urb *batch, unsigned int *num_reaped, long *closed_seen)
+{
+	struct libusb_device_handle *handle;
+	struct usbfs_urb *urb;
+	unsigned int i = 0;
+	int n, priority, r, closed;
+
+	while (i < yield->num_handles) {
+		handle = yield->handles[i].handle;
+		n = 0;
+		closed = 0;
+		do {
+			if (*num_reaped == MAX_REAP_BATCH) {
+				r = LIBUSB_ERROR_OVERFLOW;
+				break;
+			}
+			r = reap_urb(handle, &urb);
+			if (r)
+				break;
+
+			priority = reaped_urb_priority(handle, urb);
+			if (priority == LIBUSB_PRIORITY_HIGH) {
+				r = handle_reaped_urb(handle, urb);
+				closed = drop_closed_handles(batch, *num_reaped,
+					yield, closed_seen);
+			} else {
+				batch[*num_reaped].ref = yield->handles[i];
+				batch[*num_reaped].urb = urb;
+				batch[*num_reaped].priority = priority;
+				(*num_reaped)++;
+			}
+		} while (r == 0 && !closed && ++n < MAX_REAP_BATCH);
+
+		/* the callback closed handles, and the yield list may have
+		 * changed under us. go over what is left of it again */
+		if (closed)
+			i = 0;
+		else if (r < 0)
+			yield->handles[i] = yield->handles[--yield->num_handles];
+		else
+			i++;
+	}
+}
+
+/* dispatch a batch of reaped URBs in the order they were reaped or, with
+ * yield, from the highest class down. the last pass dispatches everything
+ * left, including URBs appended by reap_yield_handles(). the first error is
+ * returned, but the remaining URBs are still handled so that none of them
+ * get lost. URBs of handles closed by a callback are skipped */
+static int dispatch_reap_batch(struct libusb_context *ctx,
+	struct reaped_urb *batch, unsigned int *num_reaped,
+	const struct timespec *start, struct reap_yield *yield,
+	long *closed_seen)
+{
+	struct timespec end;
+	unsigned int i;
+	int pass = yield ? LIBUSB_PRIORITY_HIGH : LIBUSB_PRIORITY_LOW;
+	int r, ret = 0;
+
+	do {
+		for (i = 0; i < *num_reaped; i++) {
+			drop_closed_handles(batch, *num_reaped, yield,
+				closed_seen);
+			if (!batch[i].urb)
+				continue;
+			if (pass != LIBUSB_PRIORITY_LOW
+					&& batch[i].priority != pass)
+				continue;
+			if (pass == LIBUSB_PRIORITY_LOW && yield
+					&& yield->num_handles
+					&& batch[i].priority == LIBUSB_PRIORITY_LOW) {
+				reap_yield_handles(yield, batch, num_reaped,
+					closed_seen);
+				drop_closed_handles(batch, *num_reaped, yield,
+					closed_seen);
+				if (!batch[i].urb)
+					continue;
+			}
+
+			r = handle_reaped_urb(batch[i].ref.handle,
+				batch[i].urb);
+			if (r < 0 && !ret)
+				ret = r;
+			batch[i].urb = NULL;
+		}
+	} while (--pass >= LIBUSB_PRIORITY_LOW);
+
+	if (*num_reaped) {
+		clock_gettime(monotonic_clkid, &end);
+		usbi_record_event_batch(ctx, *num_reaped,
+			(uint64_t)(end.tv_sec - start->tv_sec) * 1000000000
+			+ end.tv_nsec - start->tv_nsec);
+	}
+
+	*num_reaped = 0;
+	return ret;
+}
+
+/* batched flavour of op_handle_events(): drain all completed URBs of every
+ * ready handle first, then process them and invoke the transfer callbacks.
+ * when the batch fills up, it is dispatched before reaping more. while
+ * transfers of other classes than LIBUSB_PRIORITY_NORMAL are in flight, the
+ * handles are reaped in one pass per class, the highest first, and the
+ * batch is dispatched by class. */
+static int handle_events_batched(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready,
+	unsigned int batch_size)
+{
+	struct reaped_urb batch[MAX_REAP_BATCH];
+	unsigned int num_reaped = 0;
+	struct reap_yield yield_handles, *yield = NULL;
+	int pass = LIBUSB_PRIORITY_NORMAL;
+	long closed_seen = handles_closed;
+	struct timespec start;
+	unsigned int i;
+	int r;
+
+	if (batch_size > MAX_REAP_BATCH)
+		batch_size = MAX_REAP_BATCH;
+
+	if (ctx->priority_transfers) {
+		yield = &yield_handles;
+		yield->num_handles = 0;
+		pass = LIBUSB_PRIORITY_HIGH;
+	}
+
+	do {
+		for (i = 0; i < nfds && num_ready > 0; i++) {
+			struct pollfd *pollfd = &fds[i];
+			struct libusb_device_handle *handle;
+			struct reap_handle ref;
+			short revents = pollfd->revents;
+
+			if (!revents)
+				continue;
+
+			handle = handle_for_pollfd(ctx, pollfd);
+			if (handle && yield && handle->priority != pass)
+				continue;
+
+			/* the fd is done with for this round */
+			pollfd->revents = 0;
+			num_ready--;
+			if (!handle)
+				continue;
+			set_reap_handle(&ref, handle);
+
+			if (revents & POLLERR) {
+				/* disconnect handling frees the URBs of all the
+				 * transfers of this handle, so dispatch what we
+				 * have reaped first */
+				r = dispatch_reap_batch(ctx, batch, &num_reaped,
+					&start, yield, &closed_seen);
+				if (r < 0)
+					return r;
+				if (reap_handle_open(&ref))
+					handle_pollerr(handle);
+				continue;
+			}
+
+			if (pass == LIBUSB_PRIORITY_HIGH
+					&& yield->num_handles < MAX_YIELD_HANDLES)
+				yield->handles[yield->num_handles++] = ref;
+
+			do {
+				struct usbfs_urb *urb;
+
+				r = reap_urb(handle, &urb);
+				if (r)
+					break;
+
+				if (!num_reaped)
+					clock_gettime(monotonic_clkid, &start);
+				batch[num_reaped].ref = ref;
+				batch[num_reaped].urb = urb;
+				batch[num_reaped].priority =
+					reaped_urb_priority(handle, urb);
+				if (++num_reaped == batch_size) {
+					r = dispatch_reap_batch(ctx, batch,
+						&num_reaped, &start, yield,
+						&closed_seen);
+					if (r < 0)
+						return r;
+					/* a callback closed the handle */
+					if (!reap_handle_open(&ref))
+						break;
+				}
+			} while (1);
+
+			if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE) {
+				dispatch_reap_batch(ctx, batch, &num_reaped, &start,
+					yield, &closed_seen);
+				return r;
+			}
+		}
+	} while (yield && --pass >= LIBUSB_PRIORITY_LOW && num_ready > 0);
+
+	return dispatch_reap_batch(ctx, batch, &num_reaped, &start, yield,
+		&closed_seen);
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
 	int r;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	/* completions are ordered by class in batches */
+	if (ctx->event_batch_size > 1 || ctx->priority_transfers)
+		return handle_events_batched(ctx, fds, nfds, num_ready,
+			ctx->event_batch_size > 1 ?
+			(unsigned int)ctx->event_batch_size : MAX_REAP_BATCH);
+
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
-
-		if (!hpriv || hpriv->fd != pollfd->fd) {
-			usbi_err(ctx, "cannot find handle for fd %d\n",
-				 pollfd->fd);
+		handle = handle_for_pollfd(ctx, pollfd);
+		if (!handle)
 			continue;
-		}
 
 		if (pollfd->revents & POLLERR) {
-			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
-			usbi_handle_disconnect(handle);
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			if (handle->dev->attached)
-				linux_device_disconnected(handle->dev->bus_number,
-						handle->dev->device_address, NULL);
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
+			handle_pollerr(handle);
 			continue;
 		}
 
@@ -2615,13 +4179,10 @@ static int op_handle_events(struct libusb_context *ctx,
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2646,11 +4207,13 @@ static clockid_t op_get_timerfd_clockid(void)
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_BULK_IOV,
 	.init = op_init,
 	.exit = op_exit,
 	.get_device_list = NULL,
 	.hotplug_poll = op_hotplug_poll,
+	.sync_devices = op_sync_devices,
+	.update_hotplug_subscription = op_update_hotplug_subscription,
 	.get_device_descriptor = op_get_device_descriptor,
 	.get_active_config_descriptor = op_get_active_config_descriptor,
 	.get_config_descriptor = op_get_config_descriptor,
@@ -2670,17 +4233,31 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.alloc_streams = op_alloc_streams,
 	.free_streams = op_free_streams,
 
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+	.set_bulk_urb_size = op_set_bulk_urb_size,
+	.get_bulk_urb_size = op_get_bulk_urb_size,
+	.set_dedicated_reaper = op_set_dedicated_reaper,
+
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
 	.attach_kernel_driver = op_attach_kernel_driver,
 
 	.destroy_device = op_destroy_device,
+	.device_memory = op_device_memory,
 
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.prealloc_transfer = op_prealloc_transfer,
+	.destroy_transfer = op_destroy_transfer,
+	.get_iso_packet_time = op_get_iso_packet_time,
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 
 	.handle_events = op_handle_events,
+	.handle_event_fd = op_handle_event_fd,
+	.busy_poll = op_busy_poll,
 
 	.clock_gettime = op_clock_gettime,
 
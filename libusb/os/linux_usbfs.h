@@ -85,6 +85,11 @@ struct usbfs_iso_packet_desc {
 #define MAX_BULK_BUFFER_LENGTH		16384
 #define MAX_CTRL_BUFFER_LENGTH		4096
 
+/* bulk URB sizes set by the application are rounded down to a multiple of
+ * this, so that only the last URB of a transfer can end in a short packet
+ * whatever the maximum packet size of the endpoint */
+#define BULK_URB_SIZE_ALIGN		1024
+
 struct usbfs_urb {
 	unsigned char type;
 	unsigned char endpoint;
@@ -125,6 +130,8 @@ struct usbfs_hub_portinfo {
 #define USBFS_CAP_BULK_CONTINUATION	0x02
 #define USBFS_CAP_NO_PACKET_SIZE_LIM	0x04
 #define USBFS_CAP_BULK_SCATTER_GATHER	0x08
+#define USBFS_CAP_REAP_AFTER_DISCONNECT	0x10
+#define USBFS_CAP_MMAP			0x20
 
 #define USBFS_DISCONNECT_CLAIM_IF_DRIVER	0x01
 #define USBFS_DISCONNECT_CLAIM_EXCEPT_DRIVER	0x02
@@ -182,6 +189,7 @@ void linux_netlink_hotplug_poll(void);
 
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name);
+void linux_device_changed(uint8_t busnum, uint8_t devaddr);
 
 int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
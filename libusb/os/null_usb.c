@@ -0,0 +1,996 @@
+/*
+ * libusb null backend, emulating USB devices in software
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This backend is built instead of the OS backend with
+ * ./configure --enable-null-backend. It talks to no hardware: it exposes
+ * virtual high speed devices and completes their transfers in software, so
+ * that the cost of the core (event handling, timeouts, locking, the
+ * synchronous API) can be measured and profiled without device timing
+ * hiding it.
+ *
+ * Each device has a single configuration with one interface, holding a
+ * bulk (0x01/0x81), an interrupt (0x02/0x82) and an isochronous
+ * (0x03/0x83) endpoint pair. Standard control requests are answered from
+ * the descriptors, vendor and class requests always succeed.
+ *
+ * The devices are set up from environment variables read by libusb_init():
+ *  - LIBUSB_NULL_DEVICES: comma separated list of vid:pid pairs, in hex,
+ *    one per device to expose (default "1d6b:0104")
+ *  - LIBUSB_NULL_MAX_PACKET: wMaxPacketSize of the bulk endpoints
+ *    (default 512)
+ *  - LIBUSB_NULL_DELAY_US: time between the submission and completion of a
+ *    transfer, in microseconds. transfers complete as soon as events are
+ *    handled by default
+ *  - LIBUSB_NULL_LOOPBACK: if nonzero, data written to an OUT endpoint is
+ *    returned by the IN endpoint of the same number, and vendor and class
+ *    IN control requests return the data of the last such OUT request.
+ *    otherwise IN transfers complete with their full length, leaving the
+ *    buffer untouched
+ *
+ * In loopback mode, an IN transfer gets the data buffered when it is
+ * submitted, which may be none: it completes short rather than waiting for
+ * an OUT transfer.
+ *
+ * Bulk streams can be allocated on the bulk endpoints, up to
+ * NULL_MAX_STREAMS of them, even though the devices are not SuperSpeed.
+ * The transfers of all streams of an endpoint share its data and complete
+ * in submission order.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+#include "libusbi.h"
+
+#define NULL_MAX_DEVICES	32
+
+/* the most bytes buffered per endpoint in loopback mode. data written
+ * beyond this is dropped */
+#define NULL_MAX_LOOPBACK	(1 << 20)
+
+/* the most data returned by vendor and class IN requests in loopback mode */
+#define NULL_MAX_CONTROL_DATA	4096
+
+/* the most bulk streams allocated per endpoint */
+#define NULL_MAX_STREAMS	16
+
+#define NULL_NUM_ENDPOINTS	6
+#define NULL_CONFIG_DESC_LENGTH	(LIBUSB_DT_CONFIG_SIZE + \
+	LIBUSB_DT_INTERFACE_SIZE + NULL_NUM_ENDPOINTS * LIBUSB_DT_ENDPOINT_SIZE)
+
+struct null_fifo {
+	unsigned char *buf;
+	size_t head;
+	size_t len;
+	size_t size;
+};
+
+struct device_priv {
+	unsigned char ddesc[LIBUSB_DT_DEVICE_SIZE];
+	unsigned char cdesc[NULL_CONFIG_DESC_LENGTH];
+	int configuration;			/* 0 when unconfigured */
+
+	/* loopback buffers, shared by all handles of the device */
+	pthread_mutex_t lock;
+	struct null_fifo fifos[16];		/* by endpoint number */
+	unsigned char control_data[NULL_MAX_CONTROL_DATA];
+	int control_len;
+};
+
+struct handle_priv {
+	int pipe[2];				/* readable while completed is not empty */
+
+	pthread_mutex_t lock;			/* protects the lists below */
+	pthread_cond_t cond;
+	struct list_head delayed;		/* waiting for their completion time */
+	struct list_head completed;		/* waiting for handle_events */
+
+	/* moves delayed transfers to completed when they are due */
+	pthread_t timer;
+	int timer_running;
+	int stopping;
+
+	/* number of streams allocated on the bulk OUT and IN endpoints */
+	uint32_t num_streams[2];
+};
+
+enum null_transfer_state {
+	NULL_TRANSFER_IDLE = 0,
+	NULL_TRANSFER_DELAYED,
+	NULL_TRANSFER_COMPLETED,
+};
+
+struct transfer_priv {
+	struct usbi_transfer *itransfer;
+	struct list_head list;
+	enum null_transfer_state state;
+	enum libusb_transfer_status status;
+	struct timespec due;			/* CLOCK_REALTIME */
+};
+
+static struct {
+	uint16_t vid;
+	uint16_t pid;
+} null_ids[NULL_MAX_DEVICES];
+static int null_num_devices;
+static uint16_t null_max_packet;
+static unsigned int null_delay_us;
+static int null_loopback;
+
+static const char *null_strings[] = {
+	NULL,			/* languages */
+	"libusb",
+	"Null device",
+};
+
+static inline struct device_priv *_device_priv(struct libusb_device *dev)
+{
+	return (struct device_priv *)dev->os_priv;
+}
+
+static inline struct handle_priv *_handle_priv(
+	struct libusb_device_handle *handle)
+{
+	return (struct handle_priv *)handle->os_priv;
+}
+
+static void _parse_devices(const char *list)
+{
+	const char *p = list;
+	unsigned int vid, pid;
+
+	null_num_devices = 0;
+	while (p && *p && null_num_devices < NULL_MAX_DEVICES) {
+		if (sscanf(p, "%x:%x", &vid, &pid) == 2) {
+			null_ids[null_num_devices].vid = (uint16_t)vid;
+			null_ids[null_num_devices].pid = (uint16_t)pid;
+			null_num_devices++;
+		} else {
+			usbi_warn(NULL, "ignoring invalid device '%s'", p);
+		}
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+}
+
+static int null_init(struct libusb_context *ctx)
+{
+	const char *env;
+
+	_parse_devices(getenv("LIBUSB_NULL_DEVICES"));
+	if (!null_num_devices) {
+		null_ids[0].vid = 0x1d6b;
+		null_ids[0].pid = 0x0104;
+		null_num_devices = 1;
+	}
+
+	env = getenv("LIBUSB_NULL_MAX_PACKET");
+	null_max_packet = env ? (uint16_t)atoi(env) : 0;
+	if (!null_max_packet || null_max_packet > 1024)
+		null_max_packet = 512;
+
+	env = getenv("LIBUSB_NULL_DELAY_US");
+	null_delay_us = env ? (unsigned int)strtoul(env, NULL, 10) : 0;
+
+	env = getenv("LIBUSB_NULL_LOOPBACK");
+	null_loopback = env ? atoi(env) != 0 : 0;
+
+	usbi_dbg("%d devices, bulk max packet %u, delay %uus, loopback %d",
+		null_num_devices, null_max_packet, null_delay_us, null_loopback);
+	UNUSED(ctx);
+	return LIBUSB_SUCCESS;
+}
+
+static void _put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static unsigned char *_put_endpoint(unsigned char *p, uint8_t address,
+	uint8_t attributes, uint16_t max_packet, uint8_t interval)
+{
+	p[0] = LIBUSB_DT_ENDPOINT_SIZE;
+	p[1] = LIBUSB_DT_ENDPOINT;
+	p[2] = address;
+	p[3] = attributes;
+	_put_le16(p + 4, max_packet);
+	p[6] = interval;
+	return p + LIBUSB_DT_ENDPOINT_SIZE;
+}
+
+static void _build_descriptors(struct device_priv *dpriv, int index)
+{
+	unsigned char *d = dpriv->ddesc;
+	unsigned char *c = dpriv->cdesc;
+
+	d[0] = LIBUSB_DT_DEVICE_SIZE;
+	d[1] = LIBUSB_DT_DEVICE;
+	_put_le16(d + 2, 0x0200);		/* bcdUSB */
+	d[4] = LIBUSB_CLASS_PER_INTERFACE;
+	d[5] = 0;
+	d[6] = 0;
+	d[7] = 64;				/* bMaxPacketSize0 */
+	_put_le16(d + 8, null_ids[index].vid);
+	_put_le16(d + 10, null_ids[index].pid);
+	_put_le16(d + 12, 0x0100);		/* bcdDevice */
+	d[14] = 1;				/* iManufacturer */
+	d[15] = 2;				/* iProduct */
+	d[16] = 3;				/* iSerialNumber */
+	d[17] = 1;				/* bNumConfigurations */
+
+	c[0] = LIBUSB_DT_CONFIG_SIZE;
+	c[1] = LIBUSB_DT_CONFIG;
+	_put_le16(c + 2, NULL_CONFIG_DESC_LENGTH);
+	c[4] = 1;				/* bNumInterfaces */
+	c[5] = 1;				/* bConfigurationValue */
+	c[6] = 0;
+	c[7] = 0x80;				/* bus powered */
+	c[8] = 50;				/* 100mA */
+	c += LIBUSB_DT_CONFIG_SIZE;
+
+	c[0] = LIBUSB_DT_INTERFACE_SIZE;
+	c[1] = LIBUSB_DT_INTERFACE;
+	c[2] = 0;
+	c[3] = 0;
+	c[4] = NULL_NUM_ENDPOINTS;
+	c[5] = LIBUSB_CLASS_VENDOR_SPEC;
+	c[6] = 0;
+	c[7] = 0;
+	c[8] = 0;
+	c += LIBUSB_DT_INTERFACE_SIZE;
+
+	c = _put_endpoint(c, 0x01, LIBUSB_TRANSFER_TYPE_BULK, null_max_packet, 0);
+	c = _put_endpoint(c, 0x81, LIBUSB_TRANSFER_TYPE_BULK, null_max_packet, 0);
+	c = _put_endpoint(c, 0x02, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64, 1);
+	c = _put_endpoint(c, 0x82, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64, 1);
+	c = _put_endpoint(c, 0x03, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 1024, 1);
+	_put_endpoint(c, 0x83, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 1024, 1);
+
+	dpriv->configuration = 1;
+}
+
+static int null_get_device_list(struct libusb_context *ctx,
+	struct discovered_devs **discdevs)
+{
+	struct discovered_devs *ddd;
+	struct libusb_device *dev;
+	struct device_priv *dpriv;
+	unsigned long session_id;
+	int i;
+
+	for (i = 0; i < null_num_devices; i++) {
+		session_id = (1 << 8) | (i + 1);
+		dev = usbi_get_device_by_session_id(ctx, session_id);
+		if (!dev) {
+			dev = usbi_alloc_device(ctx, session_id);
+			if (!dev)
+				return LIBUSB_ERROR_NO_MEM;
+
+			dpriv = _device_priv(dev);
+			pthread_mutex_init(&dpriv->lock, NULL);
+			_build_descriptors(dpriv, i);
+
+			dev->bus_number = 1;
+			dev->port_number = i + 1;
+			dev->device_address = i + 1;
+			dev->speed = LIBUSB_SPEED_HIGH;
+
+			if (usbi_sanitize_device(dev)) {
+				libusb_unref_device(dev);
+				continue;
+			}
+		}
+
+		ddd = discovered_devs_append(*discdevs, dev);
+		libusb_unref_device(dev);
+		if (!ddd)
+			return LIBUSB_ERROR_NO_MEM;
+		*discdevs = ddd;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void _timespec_add_us(struct timespec *ts, unsigned int us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (long)(us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int _timespec_due(const struct timespec *due, const struct timespec *now)
+{
+	return now->tv_sec > due->tv_sec ||
+		(now->tv_sec == due->tv_sec && now->tv_nsec >= due->tv_nsec);
+}
+
+/* hand a transfer over to handle_events. must be called with the handle
+ * lock held */
+static void _complete_locked(struct handle_priv *hpriv,
+	struct transfer_priv *tpriv)
+{
+	int was_empty = list_empty(&hpriv->completed);
+	char dummy = 1;
+
+	tpriv->state = NULL_TRANSFER_COMPLETED;
+	list_add_tail(&tpriv->list, &hpriv->completed);
+
+	/* the pipe holds a byte for as long as the list is not empty. a byte
+	 * left behind by a drained list only costs a spurious wakeup */
+	if (was_empty && write(hpriv->pipe[1], &dummy, 1) < 0 && errno != EAGAIN)
+		usbi_warn(NULL, "failed to signal completion (errno %d)", errno);
+}
+
+static void *_timer_main(void *arg)
+{
+	struct handle_priv *hpriv = arg;
+	struct transfer_priv *tpriv;
+	struct timespec now;
+
+	pthread_mutex_lock(&hpriv->lock);
+	while (!hpriv->stopping) {
+		if (list_empty(&hpriv->delayed)) {
+			pthread_cond_wait(&hpriv->cond, &hpriv->lock);
+			continue;
+		}
+
+		/* all transfers have the same delay, so the list is sorted */
+		tpriv = list_entry(hpriv->delayed.next, struct transfer_priv, list);
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (!_timespec_due(&tpriv->due, &now)) {
+			pthread_cond_timedwait(&hpriv->cond, &hpriv->lock,
+				&tpriv->due);
+			continue;
+		}
+
+		list_del(&tpriv->list);
+		_complete_locked(hpriv, tpriv);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+	return NULL;
+}
+
+static int null_open(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+	int r;
+
+	if (pipe(hpriv->pipe) < 0)
+		return LIBUSB_ERROR_OTHER;
+	fcntl(hpriv->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(hpriv->pipe[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&hpriv->lock, NULL);
+	pthread_cond_init(&hpriv->cond, NULL);
+	list_init(&hpriv->delayed);
+	list_init(&hpriv->completed);
+	hpriv->stopping = 0;
+	hpriv->timer_running = 0;
+	hpriv->num_streams[0] = hpriv->num_streams[1] = 0;
+
+	if (null_delay_us) {
+		if (pthread_create(&hpriv->timer, NULL, _timer_main, hpriv) != 0) {
+			r = LIBUSB_ERROR_OTHER;
+			goto err_destroy;
+		}
+		hpriv->timer_running = 1;
+	}
+
+	r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
+	if (r < 0)
+		goto err_stop;
+	return LIBUSB_SUCCESS;
+
+err_stop:
+	if (hpriv->timer_running) {
+		pthread_mutex_lock(&hpriv->lock);
+		hpriv->stopping = 1;
+		pthread_cond_signal(&hpriv->cond);
+		pthread_mutex_unlock(&hpriv->lock);
+		pthread_join(hpriv->timer, NULL);
+	}
+err_destroy:
+	pthread_cond_destroy(&hpriv->cond);
+	pthread_mutex_destroy(&hpriv->lock);
+	close(hpriv->pipe[0]);
+	close(hpriv->pipe[1]);
+	return r;
+}
+
+static void null_close(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+
+	if (hpriv->timer_running) {
+		pthread_mutex_lock(&hpriv->lock);
+		hpriv->stopping = 1;
+		pthread_cond_signal(&hpriv->cond);
+		pthread_mutex_unlock(&hpriv->lock);
+		pthread_join(hpriv->timer, NULL);
+	}
+
+	usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
+	close(hpriv->pipe[0]);
+	close(hpriv->pipe[1]);
+	pthread_cond_destroy(&hpriv->cond);
+	pthread_mutex_destroy(&hpriv->lock);
+}
+
+static int null_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	memcpy(buffer, _device_priv(dev)->ddesc, LIBUSB_DT_DEVICE_SIZE);
+	*host_endian = 0;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len,
+	int *host_endian)
+{
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	len = MIN(len, NULL_CONFIG_DESC_LENGTH);
+	memcpy(buffer, _device_priv(dev)->cdesc, len);
+	*host_endian = 0;
+	return (int)len;
+}
+
+static int null_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	if (!_device_priv(dev)->configuration)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return null_get_config_descriptor(dev, 0, buffer, len, host_endian);
+}
+
+static int null_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	*config = _device_priv(handle->dev)->configuration;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	if (config != -1 && config != 0 && config != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	_device_priv(handle->dev)->configuration = config == 1;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_claim_interface(struct libusb_device_handle *handle,
+	int interface_number)
+{
+	UNUSED(handle);
+	return interface_number == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int null_release_interface(struct libusb_device_handle *handle,
+	int interface_number)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+
+	if (interface_number != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* releasing the interface frees its streams */
+	hpriv->num_streams[0] = hpriv->num_streams[1] = 0;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_set_interface_altsetting(struct libusb_device_handle *handle,
+	int interface_number, int altsetting)
+{
+	UNUSED(handle);
+	if (interface_number != 0 || altsetting != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	UNUSED(handle);
+	UNUSED(endpoint);
+	return LIBUSB_SUCCESS;
+}
+
+static int null_reset_device(struct libusb_device_handle *handle)
+{
+	_device_priv(handle->dev)->configuration = 1;
+	return LIBUSB_SUCCESS;
+}
+
+static void null_destroy_device(struct libusb_device *dev)
+{
+	struct device_priv *dpriv = _device_priv(dev);
+	int i;
+
+	for (i = 0; i < 16; i++)
+		free(dpriv->fifos[i].buf);
+	pthread_mutex_destroy(&dpriv->lock);
+}
+
+/* buffer OUT data for the IN endpoint of the same number. must be called
+ * with the device lock held */
+static void _fifo_write(struct null_fifo *fifo, const unsigned char *data,
+	size_t len)
+{
+	unsigned char *buf;
+	size_t want;
+
+	if (fifo->head && fifo->head + fifo->len + len > fifo->size) {
+		memmove(fifo->buf, fifo->buf + fifo->head, fifo->len);
+		fifo->head = 0;
+	}
+
+	want = fifo->len + len;
+	if (want > NULL_MAX_LOOPBACK) {
+		len = NULL_MAX_LOOPBACK - fifo->len;
+		want = NULL_MAX_LOOPBACK;
+	}
+	if (want > fifo->size) {
+		buf = realloc(fifo->buf, want);
+		if (!buf)
+			return;
+		fifo->buf = buf;
+		fifo->size = want;
+	}
+
+	memcpy(fifo->buf + fifo->head + fifo->len, data, len);
+	fifo->len += len;
+}
+
+static size_t _fifo_read(struct null_fifo *fifo, unsigned char *data,
+	size_t len)
+{
+	len = MIN(len, fifo->len);
+	memcpy(data, fifo->buf + fifo->head, len);
+	fifo->len -= len;
+	fifo->head = fifo->len ? fifo->head + len : 0;
+	return len;
+}
+
+/* move data through an endpoint, returning the number of bytes transferred */
+static int _transfer_data(struct device_priv *dpriv, unsigned char endpoint,
+	unsigned char *data, int length)
+{
+	struct null_fifo *fifo = &dpriv->fifos[endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK];
+
+	if (!null_loopback || length <= 0)
+		return length;
+
+	pthread_mutex_lock(&dpriv->lock);
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+		length = (int)_fifo_read(fifo, data, (size_t)length);
+	else
+		_fifo_write(fifo, data, (size_t)length);
+	pthread_mutex_unlock(&dpriv->lock);
+	return length;
+}
+
+static int _string_descriptor(struct libusb_device *dev, uint8_t index,
+	unsigned char *data, int length)
+{
+	unsigned char desc[2 + 2 * 32];
+	char serial[16];
+	const char *str;
+	int len, i;
+
+	if (index == 0) {
+		desc[2] = 0x09;			/* US English */
+		desc[3] = 0x04;
+		len = 4;
+	} else {
+		if (index < ARRAYSIZE(null_strings)) {
+			str = null_strings[index];
+		} else if (index == ARRAYSIZE(null_strings)) {
+			snprintf(serial, sizeof(serial), "%08x",
+				(unsigned int)dev->device_address);
+			str = serial;
+		} else {
+			return LIBUSB_ERROR_PIPE;
+		}
+		for (i = 0; str[i] && i < 32; i++) {
+			desc[2 + 2 * i] = (unsigned char)str[i];
+			desc[3 + 2 * i] = 0;
+		}
+		len = 2 + 2 * i;
+	}
+	desc[0] = (unsigned char)len;
+	desc[1] = LIBUSB_DT_STRING;
+
+	len = MIN(len, length);
+	memcpy(data, desc, len);
+	return len;
+}
+
+/* answer a control request, returning the length of the data stage or
+ * LIBUSB_ERROR_PIPE to stall */
+static int _control_request(struct libusb_device_handle *handle,
+	struct libusb_control_setup *setup, unsigned char *data)
+{
+	struct device_priv *dpriv = _device_priv(handle->dev);
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	int length = libusb_le16_to_cpu(setup->wLength);
+	int len;
+
+	if ((setup->bmRequestType & (0x03 << 5)) != LIBUSB_REQUEST_TYPE_STANDARD) {
+		if (!null_loopback)
+			return length;
+
+		pthread_mutex_lock(&dpriv->lock);
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+			length = MIN(length, dpriv->control_len);
+			memcpy(data, dpriv->control_data, length);
+		} else {
+			dpriv->control_len = MIN(length, NULL_MAX_CONTROL_DATA);
+			memcpy(dpriv->control_data, data, dpriv->control_len);
+		}
+		pthread_mutex_unlock(&dpriv->lock);
+		return length;
+	}
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			len = MIN(length, LIBUSB_DT_DEVICE_SIZE);
+			memcpy(data, dpriv->ddesc, len);
+			return len;
+		case LIBUSB_DT_CONFIG:
+			if ((value & 0xff) != 0)
+				return LIBUSB_ERROR_PIPE;
+			len = MIN(length, NULL_CONFIG_DESC_LENGTH);
+			memcpy(data, dpriv->cdesc, len);
+			return len;
+		case LIBUSB_DT_STRING:
+			return _string_descriptor(handle->dev, value & 0xff, data,
+				length);
+		default:
+			return LIBUSB_ERROR_PIPE;
+		}
+	case LIBUSB_REQUEST_GET_STATUS:
+		len = MIN(length, 2);
+		memset(data, 0, len);
+		return len;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (length >= 1)
+			data[0] = (unsigned char)dpriv->configuration;
+		return MIN(length, 1);
+	case LIBUSB_REQUEST_GET_INTERFACE:
+		if (length >= 1)
+			data[0] = 0;
+		return MIN(length, 1);
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		if (value > 1)
+			return LIBUSB_ERROR_PIPE;
+		dpriv->configuration = value;
+		return 0;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+	case LIBUSB_REQUEST_SET_ADDRESS:
+		return 0;
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+static int _valid_endpoint(unsigned char endpoint, uint8_t type)
+{
+	switch (endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) {
+	case 1:
+		return type == LIBUSB_TRANSFER_TYPE_BULK;
+	case 2:
+		return type == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	case 3:
+		return type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+	default:
+		return 0;
+	}
+}
+
+static int null_alloc_streams(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+	int i;
+
+	if (num_streams > NULL_MAX_STREAMS)
+		num_streams = NULL_MAX_STREAMS;
+
+	for (i = 0; i < num_endpoints; i++)
+		if (!_valid_endpoint(endpoints[i], LIBUSB_TRANSFER_TYPE_BULK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < num_endpoints; i++)
+		hpriv->num_streams[!!(endpoints[i] & LIBUSB_ENDPOINT_IN)] =
+			num_streams;
+	return (int)num_streams;
+}
+
+static int null_free_streams(struct libusb_device_handle *handle,
+	unsigned char *endpoints, int num_endpoints)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+	int i;
+
+	for (i = 0; i < num_endpoints; i++)
+		if (!_valid_endpoint(endpoints[i], LIBUSB_TRANSFER_TYPE_BULK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < num_endpoints; i++)
+		hpriv->num_streams[!!(endpoints[i] & LIBUSB_ENDPOINT_IN)] = 0;
+	return LIBUSB_SUCCESS;
+}
+
+static int null_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct handle_priv *hpriv = _handle_priv(transfer->dev_handle);
+	struct device_priv *dpriv = _device_priv(transfer->dev_handle->dev);
+	int i, r;
+
+	tpriv->itransfer = itransfer;
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	itransfer->transferred = 0;
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		if (transfer->length < LIBUSB_CONTROL_SETUP_SIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		r = _control_request(transfer->dev_handle,
+			(struct libusb_control_setup *)transfer->buffer,
+			transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE);
+		if (r < 0)
+			tpriv->status = LIBUSB_TRANSFER_STALL;
+		else
+			itransfer->transferred = r;
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (!_valid_endpoint(transfer->endpoint,
+				transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM ?
+				LIBUSB_TRANSFER_TYPE_BULK : transfer->type))
+			return LIBUSB_ERROR_NOT_FOUND;
+		if (itransfer->stream_id > hpriv->num_streams[
+				!!(transfer->endpoint & LIBUSB_ENDPOINT_IN)])
+			return LIBUSB_ERROR_INVALID_PARAM;
+		itransfer->transferred = _transfer_data(dpriv, transfer->endpoint,
+			transfer->buffer, transfer->length);
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		if (!_valid_endpoint(transfer->endpoint, transfer->type))
+			return LIBUSB_ERROR_NOT_FOUND;
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pkt =
+				&transfer->iso_packet_desc[i];
+
+			pkt->actual_length = _transfer_data(dpriv,
+				transfer->endpoint,
+				libusb_get_iso_packet_buffer(transfer, i),
+				(int)pkt->length);
+			pkt->status = LIBUSB_TRANSFER_COMPLETED;
+			itransfer->transferred += pkt->actual_length;
+		}
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (null_delay_us) {
+		clock_gettime(CLOCK_REALTIME, &tpriv->due);
+		_timespec_add_us(&tpriv->due, null_delay_us);
+		tpriv->state = NULL_TRANSFER_DELAYED;
+		if (list_empty(&hpriv->delayed))
+			pthread_cond_signal(&hpriv->cond);
+		list_add_tail(&tpriv->list, &hpriv->delayed);
+	} else {
+		_complete_locked(hpriv, tpriv);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int null_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct handle_priv *hpriv = _handle_priv(transfer->dev_handle);
+	int r = LIBUSB_SUCCESS;
+
+	pthread_mutex_lock(&hpriv->lock);
+	switch (tpriv->state) {
+	case NULL_TRANSFER_DELAYED:
+		list_del(&tpriv->list);
+		tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+		_complete_locked(hpriv, tpriv);
+		break;
+	case NULL_TRANSFER_COMPLETED:
+		tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+		break;
+	default:
+		r = LIBUSB_ERROR_NOT_FOUND;
+		break;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return r;
+}
+
+static void null_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	tpriv->state = NULL_TRANSFER_IDLE;
+}
+
+static int _handle_completions(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = _handle_priv(handle);
+	struct transfer_priv *tpriv;
+	struct usbi_transfer *itransfer;
+	enum libusb_transfer_status status;
+	char buf[16];
+	int r;
+
+	while (read(hpriv->pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	while (1) {
+		pthread_mutex_lock(&hpriv->lock);
+		if (list_empty(&hpriv->completed)) {
+			pthread_mutex_unlock(&hpriv->lock);
+			return LIBUSB_SUCCESS;
+		}
+		tpriv = list_entry(hpriv->completed.next, struct transfer_priv, list);
+		list_del(&tpriv->list);
+		tpriv->state = NULL_TRANSFER_IDLE;
+		status = tpriv->status;
+		pthread_mutex_unlock(&hpriv->lock);
+
+		itransfer = tpriv->itransfer;
+		if (status == LIBUSB_TRANSFER_CANCELLED)
+			r = usbi_handle_transfer_cancellation(itransfer);
+		else
+			r = usbi_handle_transfer_completion(itransfer, status);
+		if (r < 0)
+			return r;
+	}
+}
+
+static int null_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	struct libusb_device_handle *handle;
+	POLL_NFDS_TYPE i;
+	int found, r;
+
+	for (i = 0; i < nfds && num_ready > 0; i++) {
+		if (!fds[i].revents)
+			continue;
+		num_ready--;
+
+		found = 0;
+		usbi_mutex_lock(&ctx->open_devs_lock);
+		list_for_each_entry(handle, &ctx->open_devs, list,
+				struct libusb_device_handle) {
+			if (_handle_priv(handle)->pipe[0] == fds[i].fd) {
+				found = 1;
+				break;
+			}
+		}
+		usbi_mutex_unlock(&ctx->open_devs_lock);
+
+		if (!found) {
+			usbi_err(ctx, "cannot find handle for fd %d", fds[i].fd);
+			continue;
+		}
+
+		r = _handle_completions(handle);
+		if (r < 0)
+			return r;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static int null_clock_gettime(int clkid, struct timespec *tp)
+{
+	switch (clkid) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t null_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
+#endif
+
+const struct usbi_os_backend null_backend = {
+	.name = "Null backend",
+	.caps = 0,
+	.init = null_init,
+	.get_device_list = null_get_device_list,
+	.open = null_open,
+	.close = null_close,
+	.get_device_descriptor = null_get_device_descriptor,
+	.get_active_config_descriptor = null_get_active_config_descriptor,
+	.get_config_descriptor = null_get_config_descriptor,
+
+	.get_configuration = null_get_configuration,
+	.set_configuration = null_set_configuration,
+	.claim_interface = null_claim_interface,
+	.release_interface = null_release_interface,
+	.set_interface_altsetting = null_set_interface_altsetting,
+	.clear_halt = null_clear_halt,
+	.reset_device = null_reset_device,
+
+	.alloc_streams = null_alloc_streams,
+	.free_streams = null_free_streams,
+
+	.destroy_device = null_destroy_device,
+
+	.submit_transfer = null_submit_transfer,
+	.cancel_transfer = null_cancel_transfer,
+	.clear_transfer_priv = null_clear_transfer_priv,
+
+	.handle_events = null_handle_events,
+
+	.clock_gettime = null_clock_gettime,
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = null_get_timerfd_clockid,
+#endif
+
+	.device_priv_size = sizeof(struct device_priv),
+	.device_handle_priv_size = sizeof(struct handle_priv),
+	.transfer_priv_size = sizeof(struct transfer_priv),
+	.add_iso_packet_size = 0,
+};
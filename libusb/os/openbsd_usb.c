@@ -21,9 +21,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <dev/usb/usb.h>
@@ -39,9 +41,33 @@ struct device_priv {
 	usb_device_descriptor_t ddesc;		/* usb device descriptor */
 };
 
+struct endpoint_worker {
+	struct libusb_device_handle *handle;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct usbi_transfer *head;		/* queued transfers */
+	struct usbi_transfer *tail;
+	int stopping;
+	int exited;
+};
+
 struct handle_priv {
 	int pipe[2];				/* for event notification */
 	int endpoints[USB_MAX_ENDPOINTS];
+
+	/*
+	 * Transfers are performed synchronously by one worker thread per
+	 * endpoint number (0 for control transfers), so that transfers on
+	 * different endpoints overlap and submission does not block.
+	 */
+	pthread_mutex_t workers_lock;
+	struct endpoint_worker *workers[USB_MAX_ENDPOINTS];
+};
+
+struct transfer_priv {
+	struct usbi_transfer *next;		/* in the worker queue */
+	enum libusb_transfer_status status;	/* set by the worker */
 };
 
 /*
@@ -85,18 +111,23 @@ static int _errno_to_libusb(int);
 static int _cache_active_config_descriptor(struct libusb_device *);
 static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
+static int _queue_transfer(struct usbi_transfer *);
+static void _stop_workers(struct handle_priv *);
+static void _worker_signal_init(void);
 static int _access_endpoint(struct libusb_transfer *);
 
 static int _bus_open(int);
 
 
 const struct usbi_os_backend openbsd_backend = {
-	"Synchronous OpenBSD backend",
+	"OpenBSD backend",
 	0,
 	NULL,				/* init() */
 	NULL,				/* exit() */
 	obsd_get_device_list,
 	NULL,				/* hotplug_poll */
+	NULL,				/* sync_devices() */
+	NULL,				/* update_hotplug_subscription() */
 	obsd_open,
 	obsd_close,
 
@@ -118,22 +149,38 @@ const struct usbi_os_backend openbsd_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc() */
+	NULL,				/* dev_mem_free() */
+	NULL,				/* set_bulk_urb_size() */
+	NULL,				/* get_bulk_urb_size() */
+	NULL,				/* set_raw_io() */
+	NULL,				/* set_dedicated_reaper() */
+
 	NULL,				/* kernel_driver_active() */
 	NULL,				/* detach_kernel_driver() */
 	NULL,				/* attach_kernel_driver() */
 
 	obsd_destroy_device,
+	NULL,				/* device_memory() */
 
 	obsd_submit_transfer,
 	obsd_cancel_transfer,
+	NULL,				/* abort_endpoint() */
 	obsd_clear_transfer_priv,
+	NULL,				/* prealloc_transfer() */
+	NULL,				/* destroy_transfer() */
+	NULL,				/* get_iso_packet_time() */
+	NULL,				/* sync_control_transfer() */
+	NULL,				/* sync_bulk_transfer() */
 
 	obsd_handle_events,
+	NULL,				/* handle_event_fd() */
+	NULL,				/* busy_poll() */
 
 	obsd_clock_gettime,
 	sizeof(struct device_priv),
 	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	sizeof(struct transfer_priv),
 	0,				/* add_iso_packet_size */
 };
 
@@ -265,6 +312,9 @@ obsd_open(struct libusb_device_handle *handle)
 	if (pipe(hpriv->pipe) < 0)
 		return _errno_to_libusb(errno);
 
+	pthread_mutex_init(&hpriv->workers_lock, NULL);
+	memset(hpriv->workers, 0, sizeof(hpriv->workers));
+
 	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
 }
 
@@ -274,6 +324,8 @@ obsd_close(struct libusb_device_handle *handle)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
 
+	_stop_workers(hpriv);
+
 	if (dpriv->devname) {
 		usbi_dbg("close: fd %d", dpriv->fd);
 
@@ -478,17 +530,16 @@ int
 obsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
-	struct handle_priv *hpriv;
+	struct device_priv *dpriv;
 	int err = 0;
 
 	usbi_dbg("");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -496,7 +547,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -505,28 +555,73 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		err = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
 	}
 
+	/* Only control transfers are possible without ugen(4) */
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL &&
+	    dpriv->devname == NULL)
+		err = LIBUSB_ERROR_NOT_SUPPORTED;
+
 	if (err)
 		return (err);
 
-	if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
-		return _errno_to_libusb(errno);
-
-	return (LIBUSB_SUCCESS);
+	return _queue_transfer(itransfer);
 }
 
 int
 obsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv, *ptpriv = NULL;
+	struct endpoint_worker *worker;
+	struct usbi_transfer *cur, *prev = NULL;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	pthread_mutex_lock(&hpriv->workers_lock);
+	worker = hpriv->workers[UE_GET_ADDR(transfer->endpoint)];
+	pthread_mutex_unlock(&hpriv->workers_lock);
+	if (worker == NULL)
+		return (LIBUSB_ERROR_NOT_FOUND);
+
+	/*
+	 * Only transfers still waiting in the queue can be cancelled, the
+	 * one being performed runs until it completes or times out.
+	 */
+	pthread_mutex_lock(&worker->lock);
+	for (cur = worker->head; cur != NULL; cur = ptpriv->next) {
+		ptpriv = usbi_transfer_get_os_priv(cur);
+		if (cur == itransfer)
+			break;
+		prev = cur;
+	}
+	if (cur == NULL) {
+		pthread_mutex_unlock(&worker->lock);
+		return (LIBUSB_ERROR_NOT_SUPPORTED);
+	}
+	if (prev == NULL)
+		worker->head = tpriv->next;
+	else
+		((struct transfer_priv *)usbi_transfer_get_os_priv(prev))->next =
+		    tpriv->next;
+	if (worker->tail == itransfer)
+		worker->tail = prev;
+	pthread_mutex_unlock(&worker->lock);
+
+	tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+	if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+		return _errno_to_libusb(errno);
+
+	return (LIBUSB_SUCCESS);
 }
 
 void
@@ -544,6 +639,7 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 	struct libusb_device_handle *handle;
 	struct handle_priv *hpriv = NULL;
 	struct usbi_transfer *itransfer;
+	struct transfer_priv *tpriv;
 	struct pollfd *pollfd;
 	int i, err = 0;
 
@@ -585,8 +681,13 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 			break;
 		}
 
-		if ((err = usbi_handle_transfer_completion(itransfer,
-		    LIBUSB_TRANSFER_COMPLETED)))
+		tpriv = usbi_transfer_get_os_priv(itransfer);
+		if (tpriv->status == LIBUSB_TRANSFER_CANCELLED)
+			err = usbi_handle_transfer_cancellation(itransfer);
+		else
+			err = usbi_handle_transfer_completion(itransfer,
+			    tpriv->status);
+		if (err)
 			break;
 	}
 	pthread_mutex_unlock(&ctx->open_devs_lock);
@@ -692,6 +793,7 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 	struct libusb_control_setup *setup;
 	struct device_priv *dpriv;
 	struct usb_ctl_request req;
+	int timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
@@ -733,7 +835,8 @@ _sync_control_transfer(struct usbi_transfer *itransfer)
 		}
 		close(fd);
 	} else {
-		if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+		timeout = usbi_transfer_timeout_ms(transfer);
+		if ((ioctl(dpriv->fd, USB_SET_TIMEOUT, &timeout)) < 0)
 			return _errno_to_libusb(errno);
 
 		if ((ioctl(dpriv->fd, USB_DO_REQUEST, &req)) < 0)
@@ -785,7 +888,7 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
 	struct device_priv *dpriv;
-	int fd, nr = 1;
+	int fd, nr = 1, timeout;
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	dpriv = (struct device_priv *)transfer->dev_handle->dev->os_priv;
@@ -800,7 +903,8 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 	if ((fd = _access_endpoint(transfer)) < 0)
 		return _errno_to_libusb(errno);
 
-	if ((ioctl(fd, USB_SET_TIMEOUT, &transfer->timeout)) < 0)
+	timeout = usbi_transfer_timeout_ms(transfer);
+	if ((ioctl(fd, USB_SET_TIMEOUT, &timeout)) < 0)
 		return _errno_to_libusb(errno);
 
 	if (IS_XFERIN(transfer)) {
@@ -821,6 +925,213 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 	return (0);
 }
 
+static enum libusb_transfer_status
+_transfer_status(int err)
+{
+	switch (err) {
+	case 0:
+		return (LIBUSB_TRANSFER_COMPLETED);
+	case LIBUSB_ERROR_TIMEOUT:
+		return (LIBUSB_TRANSFER_TIMED_OUT);
+	case LIBUSB_ERROR_PIPE:
+		return (LIBUSB_TRANSFER_STALL);
+	case LIBUSB_ERROR_NO_DEVICE:
+		return (LIBUSB_TRANSFER_NO_DEVICE);
+	case LIBUSB_ERROR_OVERFLOW:
+		return (LIBUSB_TRANSFER_OVERFLOW);
+	}
+
+	return (LIBUSB_TRANSFER_ERROR);
+}
+
+/*
+ * _stop_workers() interrupts a worker blocked in the ugen(4) calls with this
+ * signal, ugen(4) sleeps interruptibly.  Workers block every other signal.
+ */
+#define WORKER_SIGNAL	SIGUSR2
+
+static pthread_once_t worker_signal_once = PTHREAD_ONCE_INIT;
+
+static void
+_worker_signal_handler(int sig)
+{
+	(void)sig;
+}
+
+static void
+_worker_signal_setup(void)
+{
+	struct sigaction sa;
+
+	/*
+	 * Leave a handler installed by the application alone.  An ignored
+	 * signal would not interrupt the worker, so SIG_IGN is replaced.
+	 */
+	if (sigaction(WORKER_SIGNAL, NULL, &sa) < 0 ||
+	    (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN))
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _worker_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;			/* no SA_RESTART */
+	sigaction(WORKER_SIGNAL, &sa, NULL);
+}
+
+void
+_worker_signal_init(void)
+{
+	pthread_once(&worker_signal_once, _worker_signal_setup);
+}
+
+static void *
+_worker_main(void *arg)
+{
+	struct endpoint_worker *worker = arg;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	struct libusb_transfer *transfer;
+	struct usbi_transfer *itransfer;
+	sigset_t mask;
+	int err;
+
+	hpriv = (struct handle_priv *)worker->handle->os_priv;
+
+	sigfillset(&mask);
+	sigdelset(&mask, WORKER_SIGNAL);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;) {
+		while (worker->head == NULL && !worker->stopping)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		if (worker->stopping)
+			break;
+
+		itransfer = worker->head;
+		tpriv = usbi_transfer_get_os_priv(itransfer);
+		worker->head = tpriv->next;
+		if (worker->head == NULL)
+			worker->tail = NULL;
+		pthread_mutex_unlock(&worker->lock);
+
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			err = _sync_control_transfer(itransfer);
+		else
+			err = _sync_gen_transfer(itransfer);
+		tpriv->status = _transfer_status(err);
+
+		usbi_dbg("endpoint %02x: transfer done, err %d",
+		    transfer->endpoint, err);
+
+		/* This is atomic, every worker of the handle shares the pipe */
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+			usbi_err(HANDLE_CTX(worker->handle),
+			    "could not signal transfer completion: %d", errno);
+
+		pthread_mutex_lock(&worker->lock);
+	}
+	worker->exited = 1;
+	pthread_mutex_unlock(&worker->lock);
+
+	return (NULL);
+}
+
+int
+_queue_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	struct endpoint_worker *worker;
+	int endpt;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+	endpt = UE_GET_ADDR(transfer->endpoint);
+
+	pthread_mutex_lock(&hpriv->workers_lock);
+	worker = hpriv->workers[endpt];
+	if (worker == NULL) {
+		worker = calloc(1, sizeof(*worker));
+		if (worker == NULL) {
+			pthread_mutex_unlock(&hpriv->workers_lock);
+			return (LIBUSB_ERROR_NO_MEM);
+		}
+		worker->handle = transfer->dev_handle;
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		_worker_signal_init();
+		if (pthread_create(&worker->thread, NULL, _worker_main,
+		    worker) != 0) {
+			pthread_cond_destroy(&worker->cond);
+			pthread_mutex_destroy(&worker->lock);
+			free(worker);
+			pthread_mutex_unlock(&hpriv->workers_lock);
+			return (LIBUSB_ERROR_OTHER);
+		}
+		usbi_dbg("started worker for endpoint %d", endpt);
+		hpriv->workers[endpt] = worker;
+	}
+	pthread_mutex_unlock(&hpriv->workers_lock);
+
+	tpriv->next = NULL;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == NULL)
+		worker->head = itransfer;
+	else
+		((struct transfer_priv *)usbi_transfer_get_os_priv(
+		    worker->tail))->next = itransfer;
+	worker->tail = itransfer;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	return (LIBUSB_SUCCESS);
+}
+
+void
+_stop_workers(struct handle_priv *hpriv)
+{
+	struct endpoint_worker *worker;
+	struct timespec delay = { 0, 10000000 };
+	int i, exited;
+
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		worker = hpriv->workers[i];
+		if (worker == NULL)
+			continue;
+
+		/*
+		 * Queued transfers are not performed anymore.  The running
+		 * one may block for as long as its timeout, or forever, so
+		 * interrupt it.  The signal is sent again until the thread
+		 * exits, in case it arrived before the worker blocked.
+		 */
+		pthread_mutex_lock(&worker->lock);
+		worker->stopping = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+		for (;;) {
+			pthread_mutex_lock(&worker->lock);
+			exited = worker->exited;
+			pthread_mutex_unlock(&worker->lock);
+			if (exited)
+				break;
+			pthread_kill(worker->thread, WORKER_SIGNAL);
+			nanosleep(&delay, NULL);
+		}
+		pthread_join(worker->thread, NULL);
+
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker);
+		hpriv->workers[i] = NULL;
+	}
+	pthread_mutex_destroy(&hpriv->workers_lock);
+}
+
 int
 _bus_open(int number)
 {
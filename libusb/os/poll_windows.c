@@ -75,6 +75,12 @@ struct {
 	// Additional variables for XP CancelIoEx partial emulation
 	HANDLE original_handle;
 	DWORD thread_id;
+	// I/O completion port the I/O of a transfer fd completes to, or that
+	// writes to a pipe wake up (see usbi_poll)
+	HANDLE port;
+	// completion port waited on by usbi_poll when this pipe is the first fd
+	// of the set, created on first use
+	HANDLE owned_port;
 } _poll_fd[MAX_FDS];
 
 // globals
@@ -89,12 +95,27 @@ static volatile LONG compat_spinlock = 0;
 static BOOL (__stdcall *pCancelIoEx)(HANDLE, LPOVERLAPPED) = NULL;
 #define Use_Duplicate_Handles (pCancelIoEx == NULL)
 
+// GetQueuedCompletionStatusEx, which dequeues many completions at once, is
+// also Vista and later only. OVERLAPPED_ENTRY is missing from older headers.
+typedef struct {
+	ULONG_PTR lpCompletionKey;
+	LPOVERLAPPED lpOverlapped;
+	ULONG_PTR Internal;
+	DWORD dwNumberOfBytesTransferred;
+} usbi_overlapped_entry;
+static BOOL (__stdcall *pGetQueuedCompletionStatusEx)(HANDLE,
+	usbi_overlapped_entry *, ULONG, PULONG, DWORD, BOOL) = NULL;
+#define COMPLETION_BATCH_SIZE	64
+
 static inline void setup_cancel_io(void)
 {
 	HMODULE hKernel32 = GetModuleHandleA("KERNEL32");
 	if (hKernel32 != NULL) {
 		pCancelIoEx = (BOOL (__stdcall *)(HANDLE,LPOVERLAPPED))
 			GetProcAddress(hKernel32, "CancelIoEx");
+		pGetQueuedCompletionStatusEx = (BOOL (__stdcall *)(HANDLE,
+			usbi_overlapped_entry *, ULONG, PULONG, DWORD, BOOL))
+			GetProcAddress(hKernel32, "GetQueuedCompletionStatusEx");
 	}
 	usbi_dbg("Will use CancelIo%s for I/O cancellation",
 		Use_Duplicate_Handles?"":"Ex");
@@ -163,6 +184,8 @@ void init_polling(void)
 			poll_fd[i] = INVALID_WINFD;
 			_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
 			_poll_fd[i].thread_id = 0;
+			_poll_fd[i].port = NULL;
+			_poll_fd[i].owned_port = NULL;
 			InitializeCriticalSection(&_poll_fd[i].mutex);
 		}
 		is_polling_set = TRUE;
@@ -171,27 +194,168 @@ void init_polling(void)
 }
 
 // Internal function to retrieve the table index (and lock the fd mutex)
+// fds are allocated as their own index in the table
 static int _fd_to_index_and_lock(int fd)
 {
-	int i;
+	if ((fd < 0) || (fd >= MAX_FDS))
+		return -1;
 
-	if (fd < 0)
+	EnterCriticalSection(&_poll_fd[fd].mutex);
+	// fd might have been freed before we got to critical
+	if (poll_fd[fd].fd != fd) {
+		LeaveCriticalSection(&_poll_fd[fd].mutex);
 		return -1;
+	}
+	return fd;
+}
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have changed before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			return i;
+#if !defined(_WIN32_WCE)
+/*
+ * Completion ports are only used to wake usbi_poll() up: whatever completed
+ * is still found out from the OVERLAPPED of each fd. This way a poll set is
+ * not limited to the MAXIMUM_WAIT_OBJECTS handles of WaitForMultipleObjects,
+ * and completion packets that nobody is interested in anymore are harmless.
+ *
+ * The port of a poll set belongs to its first fd, which is the control pipe
+ * of a context or event domain. The files the transfers of a context do their
+ * I/O on are associated with the port of its control pipe by usbi_associate_fd(),
+ * and the other pipes of a poll set post to its port when written to.
+ */
+
+// Return the port owned by a pipe, creating it if need be
+static HANDLE pipe_port(int fd)
+{
+	HANDLE port = NULL;
+	int _index = _fd_to_index_and_lock(fd);
+
+	if (_index < 0)
+		return NULL;
+	if (poll_fd[_index].handle == DUMMY_HANDLE) {
+		if (_poll_fd[_index].owned_port == NULL) {
+			_poll_fd[_index].owned_port =
+				CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+			if (_poll_fd[_index].owned_port == NULL)
+				usbi_dbg("could not create completion port: %d", (int)GetLastError());
 		}
+		port = _poll_fd[_index].owned_port;
+	}
+	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	return port;
+}
+
+// Return the port that the I/O of a transfer should complete to, after
+// associating the handle with it, or NULL if that isn't possible
+static HANDLE transfer_port(HANDLE handle, struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	HANDLE port;
+
+	if ((itransfer == NULL) || (handle == NULL) || (handle == INVALID_HANDLE_VALUE))
+		return NULL;
+
+	// A handle can only ever be associated with a single port, and may move
+	// between a context and its event domains. Only the ports of contexts
+	// are used, so that a handle turning out to be associated already is
+	// known to be associated with the port of its context.
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	if (transfer->dev_handle->event_domain != NULL)
+		return NULL;
+
+	port = pipe_port(ITRANSFER_CTX(itransfer)->ctrl_pipe[0]);
+	if (port == NULL)
+		return NULL;
+	if ((CreateIoCompletionPort(handle, port, 0, 0) == NULL)
+	  && (GetLastError() != ERROR_INVALID_PARAMETER)) {
+		usbi_dbg("could not associate handle with completion port: %d", (int)GetLastError());
+		return NULL;
+	}
+	return port;
+}
+
+// Dequeue all the completion packets of a port, waiting up to timeout ms for
+// the first one. Returns 1 if any were dequeued, 0 on timeout, -1 on error
+static int drain_port(HANDLE port, DWORD timeout)
+{
+	usbi_overlapped_entry entries[COMPLETION_BATCH_SIZE];
+	ULONG removed;
+	DWORD size;
+	ULONG_PTR key;
+	LPOVERLAPPED overlapped;
+	BOOL ret;
+	int r = 0;
+
+	for (;;) {
+		if (pGetQueuedCompletionStatusEx != NULL) {
+			ret = (*pGetQueuedCompletionStatusEx)(port, entries,
+				COMPLETION_BATCH_SIZE, &removed, timeout, FALSE);
+		} else {
+			overlapped = NULL;
+			ret = GetQueuedCompletionStatus(port, &size, &key, &overlapped, timeout);
+			// a failed I/O operation makes for a dequeued packet too
+			if (!ret && (overlapped != NULL))
+				ret = TRUE;
+		}
+		if (!ret) {
+			if (GetLastError() == WAIT_TIMEOUT)
+				return r;
+			return -1;
+		}
+		poll_dbg("dequeued completion packet(s)");
+		r = 1;
+		timeout = 0;
 	}
-	return -1;
 }
 
+// Flag the fds whose I/O has completed, as the pre-wait check of usbi_poll
+static int check_completed(struct pollfd *fds, unsigned int nfds)
+{
+	unsigned i;
+	int _index, triggered = 0;
+
+	for (i = 0; i < nfds; ++i) {
+		_index = _fd_to_index_and_lock(fds[i].fd);
+		if (_index < 0)
+			continue;
+		if ( (poll_fd[_index].overlapped != NULL)
+		  && ( (HasOverlappedIoCompleted(poll_fd[_index].overlapped))
+		    || (HasOverlappedIoCompletedSync(poll_fd[_index].overlapped)) ) ) {
+			fds[i].revents = fds[i].events;
+			triggered++;
+		}
+		LeaveCriticalSection(&_poll_fd[_index].mutex);
+	}
+	return triggered;
+}
+
+// Wait on a poll set through its completion port
+static int wait_on_port(HANDLE port, struct pollfd *fds, unsigned int nfds, int timeout)
+{
+	DWORD start = GetTickCount();
+	DWORD elapsed, wait;
+	int r, triggered;
+
+	for (;;) {
+		if (timeout < 0) {
+			wait = INFINITE;
+		} else {
+			elapsed = GetTickCount() - start;
+			wait = (elapsed >= (DWORD)timeout) ? 0 : (DWORD)timeout - elapsed;
+		}
+		r = drain_port(port, wait);
+		if (r < 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (r == 0)
+			return 0;	// 0 = timeout
+		// packets may be left over from I/O that has been dealt with
+		triggered = check_completed(fds, nfds);
+		if (triggered)
+			return triggered;
+	}
+}
+#endif
+
 static OVERLAPPED *create_overlapped(void)
 {
 	OVERLAPPED *overlapped = (OVERLAPPED*) calloc(1, sizeof(OVERLAPPED));
@@ -382,6 +546,30 @@ struct winfd usbi_create_fd(HANDLE handle, int access_mode, struct usbi_transfer
 	return INVALID_WINFD;
 }
 
+#if !defined(_WIN32_WCE)
+/*
+ * Have the I/O of a transfer fd complete to the completion port of its context,
+ * so that usbi_poll() can wait on the port. file_handle is the file the I/O is
+ * issued on, which isn't the handle the fd was created with for WinUSB. fds that
+ * are not associated are waited on through their event.
+ */
+void usbi_associate_fd(int fd, HANDLE file_handle)
+{
+	struct winfd wfd = fd_to_winfd(fd);
+	HANDLE port;
+	int _index;
+
+	// takes the lock of the control pipe, so do this before taking ours
+	port = transfer_port(file_handle, wfd.itransfer);
+
+	_index = _fd_to_index_and_lock(fd);
+	if (_index < 0)
+		return;
+	_poll_fd[_index].port = port;
+	LeaveCriticalSection(&_poll_fd[_index].mutex);
+}
+#endif
+
 static void _free_index(int _index)
 {
 	// Cancel any async IO (Don't care about the validity of our handles for this)
@@ -394,6 +582,7 @@ static void _free_index(int _index)
 		_poll_fd[_index].original_handle = INVALID_HANDLE_VALUE;
 		_poll_fd[_index].thread_id = 0;
 	}
+	_poll_fd[_index].port = NULL;
 	free_overlapped(poll_fd[_index].overlapped);
 	poll_fd[_index] = INVALID_WINFD;
 }
@@ -423,28 +612,18 @@ void usbi_free_fd(struct winfd *wfd)
  */
 struct winfd fd_to_winfd(int fd)
 {
-	int i;
+	int _index;
 	struct winfd wfd;
 
 	CHECK_INIT_POLLING;
 
-	if (fd < 0)
+	_index = _fd_to_index_and_lock(fd);
+	if (_index < 0)
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been deleted before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return wfd;
-		}
-	}
-	return INVALID_WINFD;
+	memcpy(&wfd, &poll_fd[_index], sizeof(struct winfd));
+	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	return wfd;
 }
 
 struct winfd handle_to_winfd(HANDLE handle)
@@ -512,9 +691,19 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 	int *handle_to_index;
 	DWORD nb_handles_to_wait_on = 0;
 	DWORD ret;
+	HANDLE port = NULL;
+	BOOL use_port = FALSE;
 
 	CHECK_INIT_POLLING;
 
+#if !defined(_WIN32_WCE)
+	// The completion port can only be waited on instead of the events if
+	// the I/O of every fd is reported to it
+	if (nfds > 0)
+		port = pipe_port(fds[0].fd);
+	use_port = (port != NULL);
+#endif
+
 	triggered = 0;
 	handles_to_wait_on = (HANDLE*) calloc(nfds+1, sizeof(HANDLE));	// +1 for fd_update
 	handle_to_index = (int*) calloc(nfds, sizeof(int));
@@ -570,6 +759,13 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 			goto poll_exit;
 		}
 
+		if (port != NULL) {
+			if (poll_fd[_index].handle == DUMMY_HANDLE)
+				_poll_fd[_index].port = port;
+			else if (_poll_fd[_index].port != port)
+				use_port = FALSE;
+		}
+
 		// The following macro only works if overlapped I/O was reported pending
 		if ( (HasOverlappedIoCompleted(poll_fd[_index].overlapped))
 		  || (HasOverlappedIoCompletedSync(poll_fd[_index].overlapped)) ) {
@@ -586,6 +782,12 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 	}
 
 	// If nothing was triggered, wait on all fds that require it
+#if !defined(_WIN32_WCE)
+	if ((timeout != 0) && (triggered == 0) && (nb_handles_to_wait_on != 0) && use_port) {
+		poll_dbg("starting wait on completion port for %d handles...", (int)nb_handles_to_wait_on);
+		triggered = wait_on_port(port, fds, nfds, timeout);
+	} else
+#endif
 	if ((timeout != 0) && (triggered == 0) && (nb_handles_to_wait_on != 0)) {
 		if (timeout < 0) {
 			poll_dbg("starting infinite wait for %d handles...", (int)nb_handles_to_wait_on);
@@ -614,6 +816,11 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 	}
 
 poll_exit:
+#if !defined(_WIN32_WCE)
+	// don't let packets pile up in a port that wasn't waited on
+	if ((port != NULL) && !use_port)
+		drain_port(port, 0);
+#endif
 	if (handles_to_wait_on != NULL) {
 		free(handles_to_wait_on);
 	}
@@ -628,8 +835,9 @@ poll_exit:
  */
 int usbi_close(int fd)
 {
-	int _index;
+	int _index, i;
 	int r = -1;
+	HANDLE port;
 
 	CHECK_INIT_POLLING;
 
@@ -640,7 +848,21 @@ int usbi_close(int fd)
 	} else {
 		free_overlapped(poll_fd[_index].overlapped);
 		poll_fd[_index] = INVALID_WINFD;
+		port = _poll_fd[_index].owned_port;
+		_poll_fd[_index].owned_port = NULL;
+		_poll_fd[_index].port = NULL;
 		LeaveCriticalSection(&_poll_fd[_index].mutex);
+
+		if (port != NULL) {
+			// nothing may post to the port once its handle value is reused
+			for (i=0; i<MAX_FDS; i++) {
+				EnterCriticalSection(&_poll_fd[i].mutex);
+				if (_poll_fd[i].port == port)
+					_poll_fd[i].port = NULL;
+				LeaveCriticalSection(&_poll_fd[i].mutex);
+			}
+			CloseHandle(port);
+		}
 	}
 	return r;
 }
@@ -676,6 +898,11 @@ ssize_t usbi_write(int fd, const void *buf, size_t count)
 	// If two threads write on the pipe at the same time, we need to
 	// process two separate reads => use the overlapped as a counter
 	poll_fd[_index].overlapped->InternalHigh++;
+#if !defined(_WIN32_WCE)
+	// wake up a usbi_poll() waiting on the completion port of the poll set
+	if (_poll_fd[_index].port != NULL)
+		PostQueuedCompletionStatus(_poll_fd[_index].port, 0, 0, NULL);
+#endif
 
 	LeaveCriticalSection(&_poll_fd[_index].mutex);
 	return sizeof(unsigned char);
@@ -55,7 +55,7 @@ enum windows_version {
 };
 extern int windows_version;
 
-#define MAX_FDS     256
+#define MAX_FDS     1024
 
 #define POLLIN      0x0001    /* There is data to read */
 #define POLLPRI     0x0002    /* There is urgent data to read */
@@ -100,6 +100,9 @@ void init_polling(void);
 void exit_polling(void);
 struct winfd usbi_create_fd(HANDLE handle, int access_mode, 
 	struct usbi_transfer *transfer, cancel_transfer *cancel_fn);
+#if !defined(_WIN32_WCE)
+void usbi_associate_fd(int fd, HANDLE file_handle);
+#endif
 void usbi_free_fd(struct winfd* winfd);
 struct winfd fd_to_winfd(int fd);
 struct winfd handle_to_winfd(HANDLE handle);
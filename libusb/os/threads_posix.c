@@ -19,9 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <config.h>
+
 #if defined(__linux__) || defined(__OpenBSD__)
 # if defined(__linux__)
-#  define _GNU_SOURCE
+#  ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#  endif
 # else
 #  define _BSD_SOURCE
 # endif
@@ -33,9 +37,22 @@
 # include <windows.h>
 #endif
 
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
 #include "threads_posix.h"
 
-int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
+/* bionic has no pthread_setaffinity_np() */
+#if defined(__linux__) && !defined(__ANDROID__)
+#define HAVE_PTHREAD_SETAFFINITY_NP 1
+#endif
+
+static int init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 {
 	int err;
 	pthread_mutexattr_t stack_attr;
@@ -60,6 +77,13 @@ finish:
 	return err;
 }
 
+#ifndef ENABLE_LOCK_PROFILING
+int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
+{
+	return init_recursive(mutex, attr);
+}
+#endif
+
 int usbi_get_tid(void)
 {
 	int ret = -1;
@@ -80,3 +104,329 @@ int usbi_get_tid(void)
 /* TODO: NetBSD thread ID support */
 	return ret;
 }
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg)
+{
+	return pthread_create(thread, NULL, start, arg);
+}
+
+int usbi_thread_join(usbi_thread_t thread)
+{
+	return pthread_join(thread, NULL);
+}
+
+/* bit n of cpus stands for CPU n. returns 0, or an errno value such as
+ * ENOSYS where threads cannot be pinned */
+int usbi_thread_set_affinity(usbi_thread_t thread, uint64_t cpus)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < 64 && i < CPU_SETSIZE; i++)
+		if (cpus & ((uint64_t)1 << i))
+			CPU_SET(i, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+	(void)thread;
+	(void)cpus;
+	return ENOSYS;
+#endif
+}
+
+/* policy is one of enum libusb_event_thread_sched */
+int usbi_thread_set_sched(usbi_thread_t thread, int policy, int priority)
+{
+	struct sched_param param;
+
+	switch (policy) {
+	case LIBUSB_EVENT_THREAD_SCHED_DEFAULT:
+		return 0;
+	case LIBUSB_EVENT_THREAD_SCHED_FIFO:
+		policy = SCHED_FIFO;
+		break;
+	case LIBUSB_EVENT_THREAD_SCHED_RR:
+		policy = SCHED_RR;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	return pthread_setschedparam(thread, policy, &param);
+}
+
+#ifdef ENABLE_LOCK_PROFILING
+/* the counters of all the mutexes with the same name. the profiles live
+ * for the lifetime of the process, so that the names and counters of
+ * destroyed contexts remain available */
+struct usbi_lock_profile {
+	struct usbi_lock_profile *next;
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+};
+
+/* the profile of each static mutex, found by its address. slots are never
+ * freed, and the mutex pointer of a slot is only set once the rest of it is
+ * valid, so that lookups need no lock */
+#define STATIC_PROFILES 64
+
+struct static_profile {
+	pthread_mutex_t *mutex;
+	struct usbi_lock_profile *profile;
+	uint64_t acquired_ns;
+};
+
+static struct static_profile static_profiles[STATIC_PROFILES];
+
+/* protects lock_profiles and the creation of static profile slots */
+static pthread_mutex_t lock_profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbi_lock_profile *lock_profiles;
+static int num_lock_profiles;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* find or create the profile of name, skipping the '&' of the expression it
+ * was taken from. must be called with lock_profiles_lock held. returns NULL
+ * if out of memory, in which case the mutex just isn't profiled */
+static struct usbi_lock_profile *get_profile_locked(const char *name)
+{
+	struct usbi_lock_profile *profile, **tail = &lock_profiles;
+
+	if (name[0] == '&')
+		name++;
+
+	for (profile = lock_profiles; profile; profile = profile->next) {
+		if (!strcmp(profile->name, name))
+			return profile;
+		tail = &profile->next;
+	}
+
+	profile = calloc(1, sizeof(*profile));
+	if (!profile)
+		return NULL;
+	profile->name = name;
+	*tail = profile;
+	num_lock_profiles++;
+	return profile;
+}
+
+static void count_acquisition(struct usbi_lock_profile *profile,
+	int contended, uint64_t wait_ns)
+{
+	if (!profile)
+		return;
+
+	__sync_fetch_and_add(&profile->acquisitions, 1);
+	if (contended) {
+		__sync_fetch_and_add(&profile->contended, 1);
+		__sync_fetch_and_add(&profile->wait_ns, wait_ns);
+	}
+}
+
+static void count_hold(struct usbi_lock_profile *profile, uint64_t hold_ns)
+{
+	uint64_t max;
+
+	if (!profile)
+		return;
+
+	__sync_fetch_and_add(&profile->hold_ns, hold_ns);
+	max = profile->max_hold_ns;
+	while (hold_ns > max) {
+		if (__sync_bool_compare_and_swap(&profile->max_hold_ns, max,
+				hold_ns))
+			break;
+		max = profile->max_hold_ns;
+	}
+}
+
+/* take mutex, trying without blocking first so that contention can be
+ * told apart, and count the acquisition. returns like pthread_mutex_lock() */
+static int lock_counted(pthread_mutex_t *mutex,
+	struct usbi_lock_profile *profile, uint64_t *acquired_ns)
+{
+	uint64_t start = 0;
+	int contended = 0;
+	int r;
+
+	r = pthread_mutex_trylock(mutex);
+	if (r == EBUSY) {
+		contended = 1;
+		start = now_ns();
+		r = pthread_mutex_lock(mutex);
+	}
+	if (r)
+		return r;
+
+	*acquired_ns = now_ns();
+	count_acquisition(profile, contended, *acquired_ns - start);
+	return 0;
+}
+
+static struct static_profile *get_static_profile(pthread_mutex_t *mutex,
+	const char *name)
+{
+	unsigned int i, n = (unsigned int)((uintptr_t)mutex / sizeof(void *));
+	struct static_profile *slot;
+
+	for (i = 0; i < STATIC_PROFILES; i++) {
+		slot = &static_profiles[(n + i) % STATIC_PROFILES];
+		if (slot->mutex == mutex)
+			return slot;
+		if (slot->mutex)
+			continue;
+
+		/* not seen yet; the slot may have been taken meanwhile */
+		pthread_mutex_lock(&lock_profiles_lock);
+		if (!slot->mutex) {
+			slot->profile = name ? get_profile_locked(name) : NULL;
+			__sync_synchronize();
+			slot->mutex = mutex;
+		}
+		pthread_mutex_unlock(&lock_profiles_lock);
+		if (slot->mutex == mutex)
+			return slot;
+	}
+
+	return NULL; /* table full, not profiled */
+}
+
+int usbi_profiled_static_lock(pthread_mutex_t *mutex, const char *name)
+{
+	struct static_profile *slot = get_static_profile(mutex, name);
+	uint64_t acquired_ns;
+	int r;
+
+	r = lock_counted(mutex, slot ? slot->profile : NULL, &acquired_ns);
+	if (r == 0 && slot)
+		slot->acquired_ns = acquired_ns;
+	return r;
+}
+
+int usbi_profiled_static_unlock(pthread_mutex_t *mutex)
+{
+	struct static_profile *slot = get_static_profile(mutex, NULL);
+
+	if (slot)
+		count_hold(slot->profile, now_ns() - slot->acquired_ns);
+	return pthread_mutex_unlock(mutex);
+}
+
+int usbi_profiled_mutex_init(usbi_profiled_mutex_t *mutex,
+	pthread_mutexattr_t *attr, const char *name, int recursive)
+{
+	int r;
+
+	if (recursive)
+		r = init_recursive(&mutex->mutex, attr);
+	else
+		r = pthread_mutex_init(&mutex->mutex, attr);
+	if (r)
+		return r;
+
+	pthread_mutex_lock(&lock_profiles_lock);
+	mutex->profile = get_profile_locked(name);
+	pthread_mutex_unlock(&lock_profiles_lock);
+	mutex->depth = 0;
+	mutex->acquired_ns = 0;
+	return 0;
+}
+
+int usbi_profiled_mutex_lock(usbi_profiled_mutex_t *mutex)
+{
+	uint64_t acquired_ns;
+	int r;
+
+	r = lock_counted(&mutex->mutex, mutex->profile, &acquired_ns);
+	if (r == 0 && mutex->depth++ == 0)
+		mutex->acquired_ns = acquired_ns;
+	return r;
+}
+
+int usbi_profiled_mutex_trylock(usbi_profiled_mutex_t *mutex)
+{
+	int r;
+
+	r = pthread_mutex_trylock(&mutex->mutex);
+	if (r)
+		return r;
+
+	count_acquisition(mutex->profile, 0, 0);
+	if (mutex->depth++ == 0)
+		mutex->acquired_ns = now_ns();
+	return 0;
+}
+
+int usbi_profiled_mutex_unlock(usbi_profiled_mutex_t *mutex)
+{
+	if (--mutex->depth == 0)
+		count_hold(mutex->profile, now_ns() - mutex->acquired_ns);
+	return pthread_mutex_unlock(&mutex->mutex);
+}
+
+/* the time spent waiting on a condition does not count as holding the
+ * mutex, nor does taking it back count as another acquisition */
+int usbi_profiled_cond_wait(pthread_cond_t *cond,
+	usbi_profiled_mutex_t *mutex)
+{
+	int depth = mutex->depth;
+	int r;
+
+	mutex->depth = 0;
+	count_hold(mutex->profile, now_ns() - mutex->acquired_ns);
+	r = pthread_cond_wait(cond, &mutex->mutex);
+	mutex->depth = depth;
+	mutex->acquired_ns = now_ns();
+	return r;
+}
+
+int usbi_profiled_cond_timedwait(pthread_cond_t *cond,
+	usbi_profiled_mutex_t *mutex, const struct timespec *abstime)
+{
+	int depth = mutex->depth;
+	int r;
+
+	mutex->depth = 0;
+	count_hold(mutex->profile, now_ns() - mutex->acquired_ns);
+	r = pthread_cond_timedwait(cond, &mutex->mutex, abstime);
+	mutex->depth = depth;
+	mutex->acquired_ns = now_ns();
+	return r;
+}
+
+/* copy the counters of up to max_stats profiles, in the order the locks
+ * were first seen. returns the number of profiles */
+int usbi_get_lock_stats(struct libusb_lock_stats *stats, int max_stats)
+{
+	struct usbi_lock_profile *profile;
+	int i = 0, n;
+
+	pthread_mutex_lock(&lock_profiles_lock);
+	for (profile = lock_profiles; profile && i < max_stats;
+			profile = profile->next, i++) {
+		stats[i].name = profile->name;
+		stats[i].acquisitions = profile->acquisitions;
+		stats[i].contended = profile->contended;
+		stats[i].wait_ns = profile->wait_ns;
+		stats[i].hold_ns = profile->hold_ns;
+		stats[i].max_hold_ns = profile->max_hold_ns;
+	}
+	n = num_lock_profiles;
+	pthread_mutex_unlock(&lock_profiles_lock);
+	return n;
+}
+#endif /* ENABLE_LOCK_PROFILING */
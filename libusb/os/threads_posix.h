@@ -22,7 +22,11 @@
 #define LIBUSB_THREADS_POSIX_H
 
 #include <pthread.h>
+#ifdef ENABLE_LOCK_PROFILING
+#include <stdint.h>
+#endif
 
+#ifndef ENABLE_LOCK_PROFILING
 #define usbi_mutex_static_t		pthread_mutex_t
 #define USBI_MUTEX_INITIALIZER		PTHREAD_MUTEX_INITIALIZER
 #define usbi_mutex_static_lock		pthread_mutex_lock
@@ -35,16 +39,79 @@
 #define usbi_mutex_trylock		pthread_mutex_trylock
 #define usbi_mutex_destroy		pthread_mutex_destroy
 
-#define usbi_cond_t			pthread_cond_t
-#define usbi_cond_init			pthread_cond_init
 #define usbi_cond_wait			pthread_cond_wait
 #define usbi_cond_timedwait		pthread_cond_timedwait
+#else
+/* with lock profiling, each usbi_mutex_t counts its acquisitions in the
+ * profile named after the expression it was initialized with, so that e.g.
+ * the locks of all transfers are counted together. static mutexes are
+ * named after the expression they are locked with. see
+ * libusb_get_lock_stats() */
+struct usbi_lock_profile;
+
+typedef struct usbi_profiled_mutex {
+	pthread_mutex_t mutex;
+	struct usbi_lock_profile *profile;
+	/* only touched by the thread holding the mutex: the nesting depth of
+	 * a recursive mutex, and when it was taken */
+	int depth;
+	uint64_t acquired_ns;
+} usbi_profiled_mutex_t;
+
+#define usbi_mutex_static_t		pthread_mutex_t
+#define USBI_MUTEX_INITIALIZER		PTHREAD_MUTEX_INITIALIZER
+#define usbi_mutex_static_lock(m)	usbi_profiled_static_lock((m), #m)
+#define usbi_mutex_static_unlock(m)	usbi_profiled_static_unlock((m))
+
+#define usbi_mutex_t			usbi_profiled_mutex_t
+#define usbi_mutex_init(m, attr)	usbi_profiled_mutex_init((m), (attr), #m, 0)
+#define usbi_mutex_init_recursive(m, attr) \
+	usbi_profiled_mutex_init((m), (attr), #m, 1)
+#define usbi_mutex_lock			usbi_profiled_mutex_lock
+#define usbi_mutex_unlock		usbi_profiled_mutex_unlock
+#define usbi_mutex_trylock		usbi_profiled_mutex_trylock
+#define usbi_mutex_destroy(m)		pthread_mutex_destroy(&(m)->mutex)
+
+#define usbi_cond_wait			usbi_profiled_cond_wait
+#define usbi_cond_timedwait		usbi_profiled_cond_timedwait
+
+int usbi_profiled_static_lock(pthread_mutex_t *mutex, const char *name);
+int usbi_profiled_static_unlock(pthread_mutex_t *mutex);
+int usbi_profiled_mutex_init(usbi_profiled_mutex_t *mutex,
+	pthread_mutexattr_t *attr, const char *name, int recursive);
+int usbi_profiled_mutex_lock(usbi_profiled_mutex_t *mutex);
+int usbi_profiled_mutex_unlock(usbi_profiled_mutex_t *mutex);
+int usbi_profiled_mutex_trylock(usbi_profiled_mutex_t *mutex);
+int usbi_profiled_cond_wait(pthread_cond_t *cond,
+	usbi_profiled_mutex_t *mutex);
+int usbi_profiled_cond_timedwait(pthread_cond_t *cond,
+	usbi_profiled_mutex_t *mutex, const struct timespec *abstime);
+
+struct libusb_lock_stats;
+int usbi_get_lock_stats(struct libusb_lock_stats *stats, int max_stats);
+#endif
+
+#define usbi_cond_t			pthread_cond_t
+#define usbi_cond_init			pthread_cond_init
 #define usbi_cond_broadcast		pthread_cond_broadcast
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+#define usbi_thread_t			pthread_t
+
+#define usbi_atomic_inc(p)		__sync_add_and_fetch((p), 1)
+#define usbi_memory_barrier()		__sync_synchronize()
+
+#ifndef ENABLE_LOCK_PROFILING
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
+#endif
 
 int usbi_get_tid(void);
 
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+int usbi_thread_set_affinity(usbi_thread_t thread, uint64_t cpus);
+int usbi_thread_set_sched(usbi_thread_t thread, int policy, int priority);
+
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -210,3 +210,61 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
+
+struct usbi_thread_start {
+	void *(*start)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI usbi_thread_proc(LPVOID param)
+{
+	struct usbi_thread_start thread_start = *(struct usbi_thread_start *)param;
+
+	free(param);
+	thread_start.start(thread_start.arg);
+	return 0;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg)
+{
+	struct usbi_thread_start *thread_start = malloc(sizeof(*thread_start));
+
+	if (!thread_start)
+		return ENOMEM;
+	thread_start->start = start;
+	thread_start->arg = arg;
+
+	*thread = CreateThread(NULL, 0, usbi_thread_proc, thread_start, 0, NULL);
+	if (*thread == NULL) {
+		free(thread_start);
+		return EAGAIN;
+	}
+	return 0;
+}
+
+int usbi_thread_join(usbi_thread_t thread)
+{
+	if (WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0)
+		return EINVAL;
+	CloseHandle(thread);
+	return 0;
+}
+
+int usbi_thread_set_affinity(usbi_thread_t thread, uint64_t cpus)
+{
+	if (!SetThreadAffinityMask(thread, (DWORD_PTR)cpus))
+		return EINVAL;
+	return 0;
+}
+
+// Windows has no scheduling policies, both real-time ones map to the
+// THREAD_PRIORITY_* value given as priority
+int usbi_thread_set_sched(usbi_thread_t thread, int policy, int priority)
+{
+	if (policy == LIBUSB_EVENT_THREAD_SCHED_DEFAULT)
+		return 0;
+	if (!SetThreadPriority(thread, priority))
+		return EINVAL;
+	return 0;
+}
@@ -21,11 +21,20 @@
 #ifndef LIBUSB_THREADS_WINDOWS_H
 #define LIBUSB_THREADS_WINDOWS_H
 
+#ifdef ENABLE_LOCK_PROFILING
+#error "lock profiling is only implemented with POSIX threads"
+#endif
+
 #define usbi_mutex_static_t     volatile LONG
 #define USBI_MUTEX_INITIALIZER  0
 
 #define usbi_mutex_t            HANDLE
 
+#define usbi_thread_t           HANDLE
+
+#define usbi_atomic_inc(p)      InterlockedIncrement((volatile LONG *)(p))
+#define usbi_memory_barrier()   MemoryBarrier()
+
 struct usbi_cond_perthread {
 	struct list_head list;
 	DWORD            tid;
@@ -84,4 +93,10 @@ int usbi_cond_signal(usbi_cond_t *cond);
 
 int usbi_get_tid(void);
 
+int usbi_thread_create(usbi_thread_t *thread, void *(*start)(void *),
+	void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+int usbi_thread_set_affinity(usbi_thread_t thread, uint64_t cpus);
+int usbi_thread_set_sched(usbi_thread_t thread, int policy, int priority);
+
 #endif /* LIBUSB_THREADS_WINDOWS_H */
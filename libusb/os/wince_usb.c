@@ -992,6 +992,8 @@ const struct usbi_os_backend wince_backend = {
 
         wince_get_device_list,
 	NULL,				/* hotplug_poll */
+	NULL,				/* sync_devices() */
+	NULL,				/* update_hotplug_subscription() */
         wince_open,
         wince_close,
 
@@ -1012,17 +1014,33 @@ const struct usbi_os_backend wince_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc() */
+	NULL,				/* dev_mem_free() */
+	NULL,				/* set_bulk_urb_size() */
+	NULL,				/* get_bulk_urb_size() */
+	NULL,				/* set_raw_io() */
+	NULL,				/* set_dedicated_reaper() */
+
         wince_kernel_driver_active,
         wince_detach_kernel_driver,
         wince_attach_kernel_driver,
 
         wince_destroy_device,
+        NULL,				/* device_memory() */
 
         wince_submit_transfer,
         wince_cancel_transfer,
+        NULL,				/* abort_endpoint() */
         wince_clear_transfer_priv,
+        NULL,				/* prealloc_transfer() */
+        NULL,				/* destroy_transfer() */
+        NULL,				/* get_iso_packet_time() */
+        NULL,				/* sync_control_transfer() */
+        NULL,				/* sync_bulk_transfer() */
 
         wince_handle_events,
+        NULL,				/* handle_event_fd() */
+        NULL,				/* busy_poll() */
 
         wince_clock_gettime,
         sizeof(struct wince_device_priv),
@@ -33,6 +33,11 @@
 #include <inttypes.h>
 #include <objbase.h>
 #include <winioctl.h>
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
 
 #include "libusbi.h"
 #include "poll_windows.h"
@@ -46,6 +51,11 @@
 static int windows_get_active_config_descriptor(struct libusb_device *dev, unsigned char *buffer, size_t len, int *host_endian);
 static int windows_clock_gettime(int clk_id, struct timespec *tp);
 unsigned __stdcall windows_clock_gettime_threaded(void* param);
+// Enumeration cache
+struct enum_record;
+static void enum_cache_init(struct libusb_context *ctx);
+static void enum_record_set_descriptors(struct enum_record *rec, struct libusb_device *dev);
+static int enum_record_get_descriptors(struct enum_record *rec, struct libusb_device *dev);
 // Common calls
 static int common_configure_endpoints(int sub_api, struct libusb_device_handle *dev_handle, int iface);
 
@@ -62,9 +72,13 @@ static int winusbx_set_interface_altsetting(int sub_api, struct libusb_device_ha
 static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint);
 static int winusbx_abort_transfers(int sub_api, struct usbi_transfer *itransfer);
+static int windows_abort_endpoint(struct libusb_device_handle *dev_handle, unsigned char endpoint);
 static int winusbx_abort_control(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_handle);
 static int winusbx_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size);
+static int winusbx_set_raw_io(int sub_api, struct libusb_device_handle *dev_handle, int iface, unsigned char endpoint, int enable);
+static int interface_by_endpoint(struct windows_device_priv *priv,
+	struct windows_device_handle_priv *handle_priv, uint8_t endpoint_address);
 // HID API prototypes
 static int hid_init(int sub_api, struct libusb_context *ctx);
 static int hid_exit(int sub_api);
@@ -98,13 +112,46 @@ static int composite_copy_transfer_data(int sub_api, struct usbi_transfer *itran
 
 
 // Global variables
-uint64_t hires_frequency, hires_ticks_to_ps;
+uint64_t hires_frequency;
+// Set when QueryPerformanceCounter can be read from any core, without the timer thread
+static bool hires_direct = false;
 const uint64_t epoch_time = UINT64_C(116444736000000000);	// 1970.01.01 00:00:000 in MS Filetime
 int windows_version = WINDOWS_UNDEFINED;
 static char windows_version_str[128] = "Windows Undefined";
 // Concurrency
 static int concurrent_usage = -1;
 usbi_mutex_t autoclaim_lock;
+// Enumeration cache
+#define HCD_PASS 0
+#define HUB_PASS 1
+#define GEN_PASS 2
+#define DEV_PASS 3
+#define HID_PASS 4
+#define MAX_ENUM_GUIDS 64
+struct enum_record {
+	unsigned int pass;
+	unsigned int index;					// position in the pass (bus number for HCDs)
+	DEVINST devinst;
+	DWORD port_nr;
+	int api;
+	int sub_api;
+	char *dev_id_path;
+	char *dev_interface_path;
+	// GEN pass only: descriptors read by the first init_device for this device
+	USB_DEVICE_DESCRIPTOR dev_descriptor;
+	uint8_t num_configurations;
+	unsigned char **config_descriptor;
+};
+static struct {
+	struct enum_record *record;
+	unsigned int nb_records;
+	unsigned int size;
+	LONG generation;					// device_change_count when the records were taken
+	bool valid;
+} enum_cache;
+static usbi_mutex_t enum_cache_lock;
+static volatile LONG device_change_count = 0;
+static LIBUSB_HCMNOTIFICATION device_notification[2] = { NULL, NULL };
 // Timer thread
 // NB: index 0 is for monotonic and 1 is for the thread exit event
 HANDLE timer_thread = NULL;
@@ -245,6 +292,9 @@ static int init_dlls(void)
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Child, TRUE);
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Sibling, TRUE);
 	DLL_LOAD(Cfgmgr32.dll, CM_Get_Device_IDA, TRUE);
+	// Device notifications are only used to cache the enumeration, and require Windows 8
+	DLL_LOAD(Cfgmgr32.dll, CM_Register_Notification, FALSE);
+	DLL_LOAD(Cfgmgr32.dll, CM_Unregister_Notification, FALSE);
 	// Prefixed to avoid conflict with header files
 	DLL_LOAD_PREFIXED(OLE32.dll, p, CLSIDFromString, TRUE);
 	DLL_LOAD_PREFIXED(SetupAPI.dll, p, SetupDiGetClassDevsA, TRUE);
@@ -917,6 +967,49 @@ static void get_windows_version(void)
 		safe_sprintf(vptr, vlen, "%s %s", w, w64);
 }
 
+/*
+ * Find out if we have access to a monotonic (hires) timer, and whether it can be
+ * read from any thread. QueryPerformanceCounter is only guaranteed to be consistent
+ * across cores from Windows 7 onwards, and on x86 only if the TSC is invariant
+ * (other platforms that run Windows 8 or later use a platform timer). When it is
+ * not, the timer thread glued to the first core is used instead.
+ */
+static void init_hires_clock(void)
+{
+	LARGE_INTEGER li_frequency;
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	int regs[4];
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	unsigned int regs[4];
+#endif
+
+	if (!QueryPerformanceFrequency(&li_frequency)) {
+		usbi_dbg("no hires timer available on this platform");
+		hires_frequency = 0;
+		hires_direct = false;
+		return;
+	}
+	hires_frequency = li_frequency.QuadPart;
+	usbi_dbg("hires timer available (Frequency: %"PRIu64" Hz)", hires_frequency);
+
+	hires_direct = false;
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	__cpuid(regs, 0x80000000);
+	if ((windows_version >= WINDOWS_7) && ((unsigned int)regs[0] >= 0x80000007)) {
+		__cpuid(regs, 0x80000007);
+		hires_direct = ((regs[3] & (1 << 8)) != 0);
+	}
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	if ((windows_version >= WINDOWS_7)
+	  && __get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3])) {
+		hires_direct = ((regs[3] & (1 << 8)) != 0);
+	}
+#else
+	hires_direct = (windows_version >= WINDOWS_8);
+#endif
+	usbi_dbg("hires timer is %s", hires_direct ? "read directly (invariant)" : "read through the timer thread");
+}
+
 /*
  * init: libusb backend init function
  *
@@ -976,39 +1069,45 @@ static int windows_init(struct libusb_context *ctx)
 		// Because QueryPerformanceCounter might report different values when
 		// running on different cores, we create a separate thread for the timer
 		// calls, which we glue to the first core always to prevent timing discrepancies.
+		// This is not needed if the counter is known to be consistent across cores.
+		init_hires_clock();
 		r = LIBUSB_ERROR_NO_MEM;
-		for (i = 0; i < 2; i++) {
-			timer_request[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
-			if (timer_request[i] == NULL) {
-				usbi_err(ctx, "could not create timer request event %d - aborting", i);
+		if (!hires_direct) {
+			for (i = 0; i < 2; i++) {
+				timer_request[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+				if (timer_request[i] == NULL) {
+					usbi_err(ctx, "could not create timer request event %d - aborting", i);
+					goto init_exit;
+				}
+			}
+			timer_response = CreateSemaphore(NULL, 0, MAX_TIMER_SEMAPHORES, NULL);
+			if (timer_response == NULL) {
+				usbi_err(ctx, "could not create timer response semaphore - aborting");
 				goto init_exit;
 			}
-		}
-		timer_response = CreateSemaphore(NULL, 0, MAX_TIMER_SEMAPHORES, NULL);
-		if (timer_response == NULL) {
-			usbi_err(ctx, "could not create timer response semaphore - aborting");
-			goto init_exit;
-		}
-		timer_mutex = CreateMutex(NULL, FALSE, NULL);
-		if (timer_mutex == NULL) {
-			usbi_err(ctx, "could not create timer mutex - aborting");
-			goto init_exit;
-		}
-		timer_thread = (HANDLE)_beginthreadex(NULL, 0, windows_clock_gettime_threaded, NULL, 0, NULL);
-		if (timer_thread == NULL) {
-			usbi_err(ctx, "Unable to create timer thread - aborting");
-			goto init_exit;
-		}
-		SetThreadAffinityMask(timer_thread, 0);
+			timer_mutex = CreateMutex(NULL, FALSE, NULL);
+			if (timer_mutex == NULL) {
+				usbi_err(ctx, "could not create timer mutex - aborting");
+				goto init_exit;
+			}
+			timer_thread = (HANDLE)_beginthreadex(NULL, 0, windows_clock_gettime_threaded, NULL, 0, NULL);
+			if (timer_thread == NULL) {
+				usbi_err(ctx, "Unable to create timer thread - aborting");
+				goto init_exit;
+			}
+			SetThreadAffinityMask(timer_thread, 0);
 
-		// Wait for timer thread to init before continuing.
-		if (WaitForSingleObject(timer_response, INFINITE) != WAIT_OBJECT_0) {
-			usbi_err(ctx, "Failed to wait for timer thread to become ready - aborting");
-			goto init_exit;
+			// Wait for timer thread to init before continuing.
+			if (WaitForSingleObject(timer_response, INFINITE) != WAIT_OBJECT_0) {
+				usbi_err(ctx, "Failed to wait for timer thread to become ready - aborting");
+				goto init_exit;
+			}
 		}
 
 		// Create a hash table to store session ids. Second parameter is better if prime
 		htab_create(ctx, HTAB_SIZE);
+
+		enum_cache_init(ctx);
 	}
 	// At this stage, either we went through full init successfully, or didn't need to
 	r = LIBUSB_SUCCESS;
@@ -1190,7 +1289,7 @@ static int cache_config_descriptors(struct libusb_device *dev, HANDLE hub_handle
  * Populate a libusb device structure
  */
 static int init_device(struct libusb_device* dev, struct libusb_device* parent_dev,
-					   uint8_t port_number, char* device_id, DWORD devinst)
+					   uint8_t port_number, char* device_id, DWORD devinst, struct enum_record *rec)
 {
 	HANDLE handle;
 	DWORD size;
@@ -1269,10 +1368,15 @@ static int init_device(struct libusb_device* dev, struct libusb_device* parent_d
 		dev->num_configurations = priv->dev_descriptor.bNumConfigurations;
 		priv->active_config = conn_info.CurrentConfigurationValue;
 		usbi_dbg("found %d configurations (active conf: %d)", dev->num_configurations, priv->active_config);
-		// If we can't read the config descriptors, just set the number of confs to zero
-		if (cache_config_descriptors(dev, handle, device_id) != LIBUSB_SUCCESS) {
-			dev->num_configurations = 0;
-			priv->dev_descriptor.bNumConfigurations = 0;
+		// Reuse the config descriptors of a previous device object for the same device
+		// if we have them. Else, if we can't read them, just set the number of confs to zero
+		if (enum_record_get_descriptors(rec, dev) != LIBUSB_SUCCESS) {
+			if (cache_config_descriptors(dev, handle, device_id) != LIBUSB_SUCCESS) {
+				dev->num_configurations = 0;
+				priv->dev_descriptor.bNumConfigurations = 0;
+			} else {
+				enum_record_set_descriptors(rec, dev);
+			}
 		}
 
 		// In their great wisdom, Microsoft decided to BREAK the USB speed report between Windows 7 and Windows 8
@@ -1461,43 +1565,222 @@ static int set_hid_interface(struct libusb_context* ctx, struct libusb_device* d
 }
 
 /*
- * get_device_list: libusb backend device enumeration function
+ * Enumeration cache
+ *
+ * Walking the SetupAPI device information sets is by far the most expensive part of
+ * get_device_list, yet its result only depends on the devices present on the system.
+ * The records produced by the walk are therefore kept process-wide and replayed by
+ * every context until the cfgmgr32 notifications report a device change. When these
+ * notifications are unavailable (pre Windows 8), the walk is redone on each call.
  */
-static int windows_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs)
+static void enum_cache_clear(void)
+{
+	unsigned int i, j;
+	struct enum_record *rec;
+
+	for (i = 0; i < enum_cache.nb_records; i++) {
+		rec = &enum_cache.record[i];
+		safe_free(rec->dev_id_path);
+		safe_free(rec->dev_interface_path);
+		if (rec->config_descriptor != NULL) {
+			for (j = 0; j < rec->num_configurations; j++)
+				safe_free(rec->config_descriptor[j]);
+			safe_free(rec->config_descriptor);
+		}
+	}
+	enum_cache.nb_records = 0;
+	enum_cache.valid = false;
+}
+
+static DWORD CALLBACK enum_cache_notification(LIBUSB_HCMNOTIFICATION notify, PVOID context,
+	LIBUSB_CM_NOTIFY_ACTION action, PVOID event_data, DWORD event_data_size)
+{
+	UNUSED(notify); UNUSED(context); UNUSED(action);
+	UNUSED(event_data); UNUSED(event_data_size);
+
+	InterlockedIncrement(&device_change_count);
+	return ERROR_SUCCESS;
+}
+
+static void enum_cache_init(struct libusb_context *ctx)
+{
+	LIBUSB_CM_NOTIFY_FILTER filter;
+	int i;
+
+	usbi_mutex_init(&enum_cache_lock, NULL);
+	enum_cache.nb_records = 0;
+	enum_cache.valid = false;
+	if ((CM_Register_Notification == NULL) || (CM_Unregister_Notification == NULL))
+		return;
+
+	// Interface arrivals/removals cover hotplug; device instance events cover driver changes
+	for (i = 0; i < 2; i++) {
+		memset(&filter, 0, sizeof(filter));
+		filter.cbSize = sizeof(filter);
+		if (i == 0) {
+			filter.Flags = CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES;
+			filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+		} else {
+			filter.Flags = CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES;
+			filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE;
+		}
+		if (CM_Register_Notification(&filter, NULL, enum_cache_notification,
+			&device_notification[i]) != CR_SUCCESS) {
+			usbi_dbg("could not register for device notifications - enumeration will not be cached");
+			device_notification[i] = NULL;
+			break;
+		}
+	}
+	if (i < 2) {
+		for (i = 0; i < 2; i++) {
+			if (device_notification[i] != NULL) {
+				CM_Unregister_Notification(device_notification[i]);
+				device_notification[i] = NULL;
+			}
+		}
+	}
+}
+
+static void enum_cache_exit(void)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (device_notification[i] != NULL) {
+			CM_Unregister_Notification(device_notification[i]);
+			device_notification[i] = NULL;
+		}
+	}
+	enum_cache_clear();
+	safe_free(enum_cache.record);
+	enum_cache.size = 0;
+	usbi_mutex_destroy(&enum_cache_lock);
+}
+
+static char *dup_path(const char *path)
+{
+	size_t size;
+	char *ret_path;
+
+	if (path == NULL)
+		return NULL;
+	size = safe_strlen(path) + 1;
+	ret_path = (char*) calloc(size, 1);
+	if (ret_path != NULL)
+		safe_strcpy(ret_path, size, path);
+	return ret_path;
+}
+
+/*
+ * Cache a copy of the config descriptors read by init_device, so that the next
+ * device object created for the same (unchanged) device does not need to reissue
+ * the hub requests. Failures are not reported, as they only mean a cache miss.
+ */
+static void enum_record_set_descriptors(struct enum_record *rec, struct libusb_device *dev)
+{
+	struct windows_device_priv *priv = _device_priv(dev);
+	PUSB_CONFIGURATION_DESCRIPTOR cd;
+	uint8_t i;
+
+	if ((rec == NULL) || (rec->config_descriptor != NULL) || (dev->num_configurations == 0)
+	  || (priv->config_descriptor == NULL))
+		return;
+	rec->config_descriptor = (unsigned char**) calloc(dev->num_configurations, sizeof(unsigned char*));
+	if (rec->config_descriptor == NULL)
+		return;
+	rec->num_configurations = dev->num_configurations;
+	for (i = 0; i < dev->num_configurations; i++) {
+		cd = (PUSB_CONFIGURATION_DESCRIPTOR)priv->config_descriptor[i];
+		if (cd == NULL)
+			break;
+		rec->config_descriptor[i] = (unsigned char*) malloc(cd->wTotalLength);
+		if (rec->config_descriptor[i] == NULL)
+			break;
+		memcpy(rec->config_descriptor[i], cd, cd->wTotalLength);
+	}
+	if (i < dev->num_configurations) {
+		for (i = 0; i < rec->num_configurations; i++)
+			safe_free(rec->config_descriptor[i]);
+		safe_free(rec->config_descriptor);
+		rec->num_configurations = 0;
+		return;
+	}
+	memcpy(&rec->dev_descriptor, &priv->dev_descriptor, sizeof(USB_DEVICE_DESCRIPTOR));
+}
+
+static int enum_record_get_descriptors(struct enum_record *rec, struct libusb_device *dev)
+{
+	struct windows_device_priv *priv = _device_priv(dev);
+	PUSB_CONFIGURATION_DESCRIPTOR cd;
+	uint8_t i;
+
+	if ((rec == NULL) || (rec->config_descriptor == NULL)
+	  || (rec->num_configurations != dev->num_configurations)
+	  || (memcmp(&rec->dev_descriptor, &priv->dev_descriptor, sizeof(USB_DEVICE_DESCRIPTOR)) != 0))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	priv->config_descriptor = (unsigned char**) calloc(dev->num_configurations, sizeof(unsigned char*));
+	if (priv->config_descriptor == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < dev->num_configurations; i++) {
+		cd = (PUSB_CONFIGURATION_DESCRIPTOR)rec->config_descriptor[i];
+		priv->config_descriptor[i] = (unsigned char*) malloc(cd->wTotalLength);
+		if (priv->config_descriptor[i] == NULL) {
+			while (i > 0)
+				safe_free(priv->config_descriptor[--i]);
+			safe_free(priv->config_descriptor);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memcpy(priv->config_descriptor[i], cd, cd->wTotalLength);
+	}
+	usbi_dbg("reused %d cached config descriptor(s)", dev->num_configurations);
+	return LIBUSB_SUCCESS;
+}
+
+static struct enum_record *enum_cache_add(void)
+{
+	struct enum_record *rec;
+
+	if (enum_cache.nb_records >= enum_cache.size) {
+		rec = (struct enum_record*) realloc(enum_cache.record,
+			(enum_cache.size + 64) * sizeof(struct enum_record));
+		if (rec == NULL)
+			return NULL;
+		enum_cache.record = rec;
+		enum_cache.size += 64;
+	}
+	rec = &enum_cache.record[enum_cache.nb_records++];
+	memset(rec, 0, sizeof(*rec));
+	return rec;
+}
+
+/*
+ * Walk the SetupAPI device information sets and record, for each pass, the devices
+ * and device interfaces that get_device_list needs to process.
+ * Must be called with enum_cache_lock held.
+ */
+static int enum_cache_scan(struct libusb_context *ctx)
 {
-	struct discovered_devs *discdevs;
 	HDEVINFO dev_info = { 0 };
 	const char* usb_class[] = {"USB", "NUSB3", "IUSB3"};
 	SP_DEVINFO_DATA dev_info_data = { 0 };
 	SP_DEVICE_INTERFACE_DETAIL_DATA_A *dev_interface_details = NULL;
 	GUID hid_guid;
-#define MAX_ENUM_GUIDS 64
 	const GUID* guid[MAX_ENUM_GUIDS];
-#define HCD_PASS 0
-#define HUB_PASS 1
-#define GEN_PASS 2
-#define DEV_PASS 3
-#define HID_PASS 4
 	int r = LIBUSB_SUCCESS;
 	int api, sub_api;
 	size_t class_index = 0;
-	unsigned int nb_guids, pass, i, j, ancestor;
+	unsigned int nb_guids, pass, i;
 	char path[MAX_PATH_LENGTH];
 	char strbuf[MAX_PATH_LENGTH];
-	struct libusb_device *dev, *parent_dev;
-	struct windows_device_priv *priv, *parent_priv;
 	char* dev_interface_path = NULL;
 	char* dev_id_path = NULL;
-	unsigned long session_id;
 	DWORD size, reg_type, port_nr, install_state;
 	HKEY key;
 	WCHAR guid_string_w[MAX_GUID_STRING_LENGTH];
 	GUID* if_guid;
 	LONG s;
-	// Keep a list of newly allocated devs to unref
-	libusb_device** unref_list;
-	unsigned int unref_size = 64;
-	unsigned int unref_cur = 0;
+	struct enum_record *rec;
 
 	// PASS 1 : (re)enumerate HCDs (allows for HCD hotplug)
 	// PASS 2 : (re)enumerate HUBS
@@ -1507,6 +1790,11 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 	// PASS 5+: (re)enumerate device interfaced GUIDs (including HID) and
 	//           set the device interfaces.
 
+	enum_cache_clear();
+	// Read the generation before the walk, so that a change occurring during the walk
+	// invalidates the records right away
+	enum_cache.generation = device_change_count;
+
 	// Init the GUID table
 	guid[HCD_PASS] = &GUID_DEVINTERFACE_USB_HOST_CONTROLLER;
 	guid[HUB_PASS] = &GUID_DEVINTERFACE_USB_HUB;
@@ -1516,11 +1804,6 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 	guid[HID_PASS] = &hid_guid;
 	nb_guids = HID_PASS+1;
 
-	unref_list = (libusb_device**) calloc(unref_size, sizeof(libusb_device*));
-	if (unref_list == NULL) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
 	for (pass = 0; ((pass < nb_guids) && (r == LIBUSB_SUCCESS)); pass++) {
 //#define ENUM_DEBUG
 #ifdef ENUM_DEBUG
@@ -1534,8 +1817,6 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 			safe_free(dev_interface_details);
 			safe_free(dev_interface_path);
 			safe_free(dev_id_path);
-			priv = parent_priv = NULL;
-			dev = parent_dev = NULL;
 
 			// Safe loop: end of loop conditions
 			if (r != LIBUSB_SUCCESS) {
@@ -1652,161 +1933,239 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 				break;
 			}
 
-			// Find parent device (for the passes that need it)
-			switch (pass) {
-			case HCD_PASS:
-			case DEV_PASS:
-			case HUB_PASS:
-				break;
-			default:
-				// Go through the ancestors until we see a face we recognize
-				parent_dev = NULL;
-				for (ancestor = 1; parent_dev == NULL; ancestor++) {
-					session_id = get_ancestor_session_id(dev_info_data.DevInst, ancestor);
-					if (session_id == 0) {
-						break;
-					}
-					parent_dev = usbi_get_device_by_session_id(ctx, session_id);
+			rec = enum_cache_add();
+			if (rec == NULL) {
+				LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
+			}
+			rec->pass = pass;
+			rec->index = i;
+			rec->devinst = dev_info_data.DevInst;
+			rec->port_nr = port_nr;
+			rec->api = api;
+			rec->sub_api = sub_api;
+			rec->dev_id_path = dev_id_path; dev_id_path = NULL;
+			rec->dev_interface_path = dev_interface_path; dev_interface_path = NULL;
+		}
+	}
+
+	// Free any additional GUIDs
+	for (pass = HID_PASS+1; pass < nb_guids; pass++) {
+		safe_free(guid[pass]);
+	}
+
+	if (r != LIBUSB_SUCCESS) {
+		enum_cache_clear();
+		return r;
+	}
+	// Only keep the records around if we are told about device changes
+	enum_cache.valid = (device_notification[0] != NULL);
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * get_device_list: libusb backend device enumeration function
+ */
+static int windows_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs)
+{
+	struct discovered_devs *discdevs;
+	int r = LIBUSB_SUCCESS;
+	unsigned int pass, i, j, ancestor;
+	struct libusb_device *dev, *parent_dev;
+	struct windows_device_priv *priv, *parent_priv;
+	struct enum_record *rec;
+	char* dev_interface_path = NULL;
+	unsigned long session_id;
+	// Keep a list of newly allocated devs to unref
+	libusb_device** unref_list;
+	unsigned int unref_size = 64;
+	unsigned int unref_cur = 0;
+
+	unref_list = (libusb_device**) calloc(unref_size, sizeof(libusb_device*));
+	if (unref_list == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_mutex_lock(&enum_cache_lock);
+	if (!enum_cache.valid || (enum_cache.generation != device_change_count)) {
+		r = enum_cache_scan(ctx);
+	} else {
+		usbi_dbg("reusing cached enumeration (%d records)", enum_cache.nb_records);
+	}
+
+	for (i = 0; i < enum_cache.nb_records; i++) {
+		// safe loop: free up any (unprotected) dynamic resource
+		// NB: this is always executed before breaking the loop
+		safe_free(dev_interface_path);
+		priv = parent_priv = NULL;
+		dev = parent_dev = NULL;
+
+		// Safe loop: end of loop conditions
+		if (r != LIBUSB_SUCCESS) {
+			break;
+		}
+		rec = &enum_cache.record[i];
+		pass = rec->pass;
+		if (rec->dev_interface_path != NULL) {
+			dev_interface_path = dup_path(rec->dev_interface_path);
+			if (dev_interface_path == NULL) {
+				LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
+			}
+		}
+
+		// Find parent device (for the passes that need it)
+		switch (pass) {
+		case HCD_PASS:
+		case DEV_PASS:
+		case HUB_PASS:
+			break;
+		default:
+			// Go through the ancestors until we see a face we recognize
+			parent_dev = NULL;
+			for (ancestor = 1; parent_dev == NULL; ancestor++) {
+				session_id = get_ancestor_session_id(rec->devinst, ancestor);
+				if (session_id == 0) {
+					break;
 				}
-				if (parent_dev == NULL) {
-					usbi_dbg("unlisted ancestor for '%s' (non USB HID, newly connected, etc.) - ignoring", dev_id_path);
+				parent_dev = usbi_get_device_by_session_id(ctx, session_id);
+			}
+			if (parent_dev == NULL) {
+				usbi_dbg("unlisted ancestor for '%s' (non USB HID, newly connected, etc.) - ignoring", rec->dev_id_path);
+				continue;
+			}
+			parent_priv = _device_priv(parent_dev);
+			// virtual USB devices are also listed during GEN - don't process these yet
+			if ( (pass == GEN_PASS) && (parent_priv->apib->id != USB_API_HUB) ) {
+				libusb_unref_device(parent_dev);
+				continue;
+			}
+			break;
+		}
+
+		// Create new or match existing device, using the (hashed) device_id as session id
+		if (pass <= DEV_PASS) {	// For subsequent passes, we'll lookup the parent
+			// These are the passes that create "new" devices
+			session_id = htab_hash(rec->dev_id_path);
+			dev = usbi_get_device_by_session_id(ctx, session_id);
+			if (dev == NULL) {
+				if (pass == DEV_PASS) {
+					// This can occur if the OS only reports a newly plugged device after we started enum
+					usbi_warn(ctx, "'%s' was only detected in late pass (newly connected device?)"
+						" - ignoring", rec->dev_id_path);
 					continue;
 				}
-				parent_priv = _device_priv(parent_dev);
-				// virtual USB devices are also listed during GEN - don't process these yet
-				if ( (pass == GEN_PASS) && (parent_priv->apib->id != USB_API_HUB) ) {
-					libusb_unref_device(parent_dev);
-					continue;
+				usbi_dbg("allocating new device for session [%X]", session_id);
+				if ((dev = usbi_alloc_device(ctx, session_id)) == NULL) {
+					LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
 				}
-				break;
+				windows_device_priv_init(dev);
+			} else {
+				usbi_dbg("found existing device for session [%X] (%d.%d)",
+					session_id, dev->bus_number, dev->device_address);
 			}
-
-			// Create new or match existing device, using the (hashed) device_id as session id
-			if (pass <= DEV_PASS) {	// For subsequent passes, we'll lookup the parent
-				// These are the passes that create "new" devices
-				session_id = htab_hash(dev_id_path);
-				dev = usbi_get_device_by_session_id(ctx, session_id);
-				if (dev == NULL) {
-					if (pass == DEV_PASS) {
-						// This can occur if the OS only reports a newly plugged device after we started enum
-						usbi_warn(ctx, "'%s' was only detected in late pass (newly connected device?)"
-							" - ignoring", dev_id_path);
-						continue;
-					}
-					usbi_dbg("allocating new device for session [%X]", session_id);
-					if ((dev = usbi_alloc_device(ctx, session_id)) == NULL) {
-						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
-					}
-					windows_device_priv_init(dev);
-				} else {
-					usbi_dbg("found existing device for session [%X] (%d.%d)",
-						session_id, dev->bus_number, dev->device_address);
+			// Keep track of devices that need unref
+			unref_list[unref_cur++] = dev;
+			if (unref_cur >= unref_size) {
+				unref_size += 64;
+				unref_list = usbi_reallocf(unref_list, unref_size*sizeof(libusb_device*));
+				if (unref_list == NULL) {
+					usbi_err(ctx, "could not realloc list for unref - aborting.");
+					LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
 				}
-				// Keep track of devices that need unref
-				unref_list[unref_cur++] = dev;
-				if (unref_cur >= unref_size) {
-					unref_size += 64;
-					unref_list = usbi_reallocf(unref_list, unref_size*sizeof(libusb_device*));
-					if (unref_list == NULL) {
-						usbi_err(ctx, "could not realloc list for unref - aborting.");
-						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
-					}
-				}
-				priv = _device_priv(dev);
 			}
+			priv = _device_priv(dev);
+		}
 
-			// Setup device
-			switch (pass) {
-			case HCD_PASS:
-				dev->bus_number = (uint8_t)(i + 1);	// bus 0 is reserved for disconnected
-				dev->device_address = 0;
-				dev->num_configurations = 0;
-				priv->apib = &usb_api_backend[USB_API_HUB];
-				priv->sub_api = SUB_API_NOTSET;
-				priv->depth = UINT8_MAX;	// Overflow to 0 for HCD Hubs
-				priv->path = dev_interface_path; dev_interface_path = NULL;
+		// Setup device
+		switch (pass) {
+		case HCD_PASS:
+			dev->bus_number = (uint8_t)(rec->index + 1);	// bus 0 is reserved for disconnected
+			dev->device_address = 0;
+			dev->num_configurations = 0;
+			priv->apib = &usb_api_backend[USB_API_HUB];
+			priv->sub_api = SUB_API_NOTSET;
+			priv->depth = UINT8_MAX;	// Overflow to 0 for HCD Hubs
+			safe_free(priv->path);
+			priv->path = dev_interface_path; dev_interface_path = NULL;
+			break;
+		case HUB_PASS:
+		case DEV_PASS:
+			// If the device has already been setup, don't do it again
+			if (priv->path != NULL)
 				break;
-			case HUB_PASS:
-			case DEV_PASS:
-				// If the device has already been setup, don't do it again
-				if (priv->path != NULL)
-					break;
-				// Take care of API initialization
-				priv->path = dev_interface_path; dev_interface_path = NULL;
-				priv->apib = &usb_api_backend[api];
-				priv->sub_api = sub_api;
-				switch(api) {
-				case USB_API_COMPOSITE:
-				case USB_API_HUB:
-					break;
-				case USB_API_HID:
-					priv->hid = calloc(1, sizeof(struct hid_device_priv));
-					if (priv->hid == NULL) {
-						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
-					}
-					priv->hid->nb_interfaces = 0;
-					break;
-				default:
-					// For other devices, the first interface is the same as the device
-					priv->usb_interface[0].path = (char*) calloc(safe_strlen(priv->path)+1, 1);
-					if (priv->usb_interface[0].path != NULL) {
-						safe_strcpy(priv->usb_interface[0].path, safe_strlen(priv->path)+1, priv->path);
-					} else {
-						usbi_warn(ctx, "could not duplicate interface path '%s'", priv->path);
-					}
-					// The following is needed if we want API calls to work for both simple
-					// and composite devices.
-					for(j=0; j<USB_MAXINTERFACES; j++) {
-						priv->usb_interface[j].apib = &usb_api_backend[api];
-					}
-					break;
+			// Take care of API initialization
+			priv->path = dev_interface_path; dev_interface_path = NULL;
+			priv->apib = &usb_api_backend[rec->api];
+			priv->sub_api = rec->sub_api;
+			switch(rec->api) {
+			case USB_API_COMPOSITE:
+			case USB_API_HUB:
+				break;
+			case USB_API_HID:
+				priv->hid = calloc(1, sizeof(struct hid_device_priv));
+				if (priv->hid == NULL) {
+					LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
 				}
+				priv->hid->nb_interfaces = 0;
 				break;
-			case GEN_PASS:
-				r = init_device(dev, parent_dev, (uint8_t)port_nr, dev_id_path, dev_info_data.DevInst);
-				if (r == LIBUSB_SUCCESS) {
-					// Append device to the list of discovered devices
-					discdevs = discovered_devs_append(*_discdevs, dev);
-					if (!discdevs) {
-						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
-					}
-					*_discdevs = discdevs;
-				} else if (r == LIBUSB_ERROR_NO_DEVICE) {
-					// This can occur if the device was disconnected but Windows hasn't
-					// refreshed its enumeration yet - in that case, we ignore the device
-					r = LIBUSB_SUCCESS;
+			default:
+				// For other devices, the first interface is the same as the device
+				priv->usb_interface[0].path = dup_path(priv->path);
+				if (priv->usb_interface[0].path == NULL) {
+					usbi_warn(ctx, "could not duplicate interface path '%s'", priv->path);
+				}
+				// The following is needed if we want API calls to work for both simple
+				// and composite devices.
+				for(j=0; j<USB_MAXINTERFACES; j++) {
+					priv->usb_interface[j].apib = &usb_api_backend[rec->api];
 				}
 				break;
-			default:	// HID_PASS and later
-				if (parent_priv->apib->id == USB_API_HID) {
-					usbi_dbg("setting HID interface for [%lX]:", parent_dev->session_data);
-					r = set_hid_interface(ctx, parent_dev, dev_interface_path);
-					if (r != LIBUSB_SUCCESS) LOOP_BREAK(r);
+			}
+			break;
+		case GEN_PASS:
+			r = init_device(dev, parent_dev, (uint8_t)rec->port_nr, rec->dev_id_path, rec->devinst, rec);
+			if (r == LIBUSB_SUCCESS) {
+				// Append device to the list of discovered devices
+				discdevs = discovered_devs_append(*_discdevs, dev);
+				if (!discdevs) {
+					LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
+				}
+				*_discdevs = discdevs;
+			} else if (r == LIBUSB_ERROR_NO_DEVICE) {
+				// This can occur if the device was disconnected but Windows hasn't
+				// refreshed its enumeration yet - in that case, we ignore the device
+				// and make sure the next call walks the device information sets again
+				enum_cache.valid = false;
+				r = LIBUSB_SUCCESS;
+			}
+			break;
+		default:	// HID_PASS and later
+			if (parent_priv->apib->id == USB_API_HID) {
+				usbi_dbg("setting HID interface for [%lX]:", parent_dev->session_data);
+				r = set_hid_interface(ctx, parent_dev, dev_interface_path);
+				if (r != LIBUSB_SUCCESS) LOOP_BREAK(r);
+				dev_interface_path = NULL;
+			} else if (parent_priv->apib->id == USB_API_COMPOSITE) {
+				usbi_dbg("setting composite interface for [%lX]:", parent_dev->session_data);
+				switch (set_composite_interface(ctx, parent_dev, dev_interface_path, rec->dev_id_path, rec->api, rec->sub_api)) {
+				case LIBUSB_SUCCESS:
 					dev_interface_path = NULL;
-				} else if (parent_priv->apib->id == USB_API_COMPOSITE) {
-					usbi_dbg("setting composite interface for [%lX]:", parent_dev->session_data);
-					switch (set_composite_interface(ctx, parent_dev, dev_interface_path, dev_id_path, api, sub_api)) {
-					case LIBUSB_SUCCESS:
-						dev_interface_path = NULL;
-						break;
-					case LIBUSB_ERROR_ACCESS:
-						// interface has already been set => make sure dev_interface_path is freed then
-						break;
-					default:
-						LOOP_BREAK(r);
-						break;
-					}
+					break;
+				case LIBUSB_ERROR_ACCESS:
+					// interface has already been set => make sure dev_interface_path is freed then
+					break;
+				default:
+					LOOP_BREAK(r);
+					break;
 				}
-				libusb_unref_device(parent_dev);
-				break;
 			}
+			libusb_unref_device(parent_dev);
+			break;
 		}
 	}
-
-	// Free any additional GUIDs
-	for (pass = HID_PASS+1; pass < nb_guids; pass++) {
-		safe_free(guid[pass]);
-	}
+	safe_free(dev_interface_path);
+	if (r != LIBUSB_SUCCESS)
+		enum_cache.valid = false;
+	usbi_mutex_unlock(&enum_cache_lock);
 
 	// Unref newly allocated devs
 	if (unref_list != NULL) {
@@ -1843,6 +2202,7 @@ static void windows_exit(void)
 
 	// Only works if exits and inits are balanced exactly
 	if (--concurrent_usage < 0) {	// Last exit
+		enum_cache_exit();
 		for (i=0; i<USB_API_MAX; i++) {
 			usb_api_backend[i].exit(SUB_API_NOTSET);
 		}
@@ -2037,6 +2397,29 @@ static int windows_reset_device(struct libusb_device_handle *dev_handle)
 	return priv->apib->reset_device(SUB_API_NOTSET, dev_handle);
 }
 
+static int windows_set_raw_io(struct libusb_device_handle *dev_handle, unsigned char endpoint, int enable)
+{
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_usb_api_backend const *apib = priv->apib;
+	int sub_api = priv->sub_api;
+	int iface;
+
+	iface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (iface < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	// The interfaces of a composite device each have their own driver
+	if (apib->id == USB_API_COMPOSITE) {
+		apib = priv->usb_interface[iface].apib;
+		sub_api = priv->usb_interface[iface].sub_api;
+	}
+	if (apib->id != USB_API_WINUSBX)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return winusbx_set_raw_io(sub_api, dev_handle, iface, endpoint, enable);
+}
+
 // The 3 functions below are unlikely to ever get supported on Windows
 static int windows_kernel_driver_active(struct libusb_device_handle *dev_handle, int iface)
 {
@@ -2253,6 +2636,7 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 	POLL_NFDS_TYPE i = 0;
 	bool found = false;
 	struct usbi_transfer *transfer;
+	struct winfd wfd;
 	DWORD io_size, io_result;
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
@@ -2267,16 +2651,26 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 		num_ready--;
 
 		// Because a Windows OVERLAPPED is used for poll emulation,
-		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		// a pollable fd is created and stored with each transfer, and
+		// the fd knows its transfer
+		found = false;
+		wfd = fd_to_winfd(fds[i].fd);
+		transfer = wfd.itransfer;
+		if (transfer != NULL) {
 			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
-				found = true;
-				break;
+			found = (transfer_priv->pollable_fd.fd == fds[i].fd);
+		}
+		if (!found) {
+			usbi_mutex_lock(&ctx->flying_transfers_lock);
+			list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+				transfer_priv = usbi_transfer_get_os_priv(transfer);
+				if (transfer_priv->pollable_fd.fd == fds[i].fd) {
+					found = true;
+					break;
+				}
 			}
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 		if (found) {
 			// Handle async requests that completed synchronously first
@@ -2305,28 +2699,29 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * Convert a QueryPerformanceCounter value to a timespec. The remainder is below
+ * hires_frequency, so scaling it to nanoseconds before dividing cannot overflow
+ * for any frequency up to 18 GHz, and keeps the full resolution of the counter.
+ */
+static void hires_counter_to_timespec(const LARGE_INTEGER *hires_counter, struct timespec *tp)
+{
+	uint64_t counter = (uint64_t)hires_counter->QuadPart;
+
+	tp->tv_sec = (long)(counter / hires_frequency);
+	tp->tv_nsec = (long)(((counter % hires_frequency) * UINT64_C(1000000000)) / hires_frequency);
+}
+
 /*
  * Monotonic and real time functions
  */
 unsigned __stdcall windows_clock_gettime_threaded(void* param)
 {
-	LARGE_INTEGER hires_counter, li_frequency;
+	LARGE_INTEGER hires_counter;
 	LONG nb_responses;
 	int timer_index;
 
-	// Init - find out if we have access to a monotonic (hires) timer
-	if (!QueryPerformanceFrequency(&li_frequency)) {
-		usbi_dbg("no hires timer available on this platform");
-		hires_frequency = 0;
-		hires_ticks_to_ps = UINT64_C(0);
-	} else {
-		hires_frequency = li_frequency.QuadPart;
-		// The hires frequency can go as high as 4 GHz, so we'll use a conversion
-		// to picoseconds to compute the tv_nsecs part in clock_gettime
-		hires_ticks_to_ps = UINT64_C(1000000000000) / hires_frequency;
-		usbi_dbg("hires timer available (Frequency: %"PRIu64" Hz)", hires_frequency);
-	}
-
+	// The hires timer was detected by init_hires_clock()
 	// Signal windows_init() that we're ready to service requests
 	if (ReleaseSemaphore(timer_response, 1, NULL) == 0) {
 		usbi_dbg("unable to release timer semaphore: %s", windows_error_str(0));
@@ -2354,8 +2749,7 @@ unsigned __stdcall windows_clock_gettime_threaded(void* param)
 			WaitForSingleObject(timer_mutex, INFINITE);
 			// Requests to this thread are for hires always
 			if ((QueryPerformanceCounter(&hires_counter) != 0) && (hires_frequency != 0)) {
-				timer_tp.tv_sec = (long)(hires_counter.QuadPart / hires_frequency);
-				timer_tp.tv_nsec = (long)(((hires_counter.QuadPart % hires_frequency)/1000) * hires_ticks_to_ps);
+				hires_counter_to_timespec(&hires_counter, &timer_tp);
 			} else {
 				// Fallback to real-time if we can't get monotonic value
 				// Note that real-time clock does not wait on the mutex or this thread.
@@ -2378,12 +2772,18 @@ unsigned __stdcall windows_clock_gettime_threaded(void* param)
 
 static int windows_clock_gettime(int clk_id, struct timespec *tp)
 {
+	LARGE_INTEGER hires_counter;
 	FILETIME filetime;
 	ULARGE_INTEGER rtime;
 	DWORD r;
 	switch(clk_id) {
 	case USBI_CLOCK_MONOTONIC:
-		if (hires_frequency != 0) {
+		if (hires_direct) {
+			if (QueryPerformanceCounter(&hires_counter) != 0) {
+				hires_counter_to_timespec(&hires_counter, tp);
+				return LIBUSB_SUCCESS;
+			}
+		} else if (hires_frequency != 0) {
 			while (1) {
 				InterlockedIncrement((LONG*)&request_count[0]);
 				SetEvent(timer_request[0]);
@@ -2404,6 +2804,7 @@ static int windows_clock_gettime(int clk_id, struct timespec *tp)
 			}
 		}
 		// Fall through and return real-time if monotonic was not detected @ timer init
+		// or if the direct read failed
 	case USBI_CLOCK_REALTIME:
 		// We follow http://msdn.microsoft.com/en-us/library/ms724928%28VS.85%29.aspx
 		// with a predef epoch_time to have an epoch that starts at 1970.01.01 00:00
@@ -2431,6 +2832,8 @@ const struct usbi_os_backend windows_backend = {
 
 	windows_get_device_list,
 	NULL,				/* hotplug_poll */
+	NULL,				/* sync_devices() */
+	NULL,				/* update_hotplug_subscription() */
 	windows_open,
 	windows_close,
 
@@ -2451,17 +2854,33 @@ const struct usbi_os_backend windows_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc() */
+	NULL,				/* dev_mem_free() */
+	NULL,				/* set_bulk_urb_size() */
+	NULL,				/* get_bulk_urb_size() */
+	windows_set_raw_io,
+	NULL,				/* set_dedicated_reaper() */
+
 	windows_kernel_driver_active,
 	windows_detach_kernel_driver,
 	windows_attach_kernel_driver,
 
 	windows_destroy_device,
+	NULL,				/* device_memory() */
 
 	windows_submit_transfer,
 	windows_cancel_transfer,
+	windows_abort_endpoint,
 	windows_clear_transfer_priv,
+	NULL,				/* prealloc_transfer() */
+	NULL,				/* destroy_transfer() */
+	NULL,				/* get_iso_packet_time() */
+	NULL,				/* sync_control_transfer() */
+	NULL,				/* sync_bulk_transfer() */
 
 	windows_handle_events,
+	NULL,				/* handle_event_fd() */
+	NULL,				/* busy_poll() */
 
 	windows_clock_gettime,
 #if defined(USBI_TIMERFD_AVAILABLE)
@@ -2803,6 +3222,10 @@ static int winusbx_configure_endpoints(int sub_api, struct libusb_device_handle
 	// see http://download.microsoft.com/download/D/1/D/D1DD7745-426B-4CC3-A269-ABBBE427C0EF/DVC-T705_DDC08.pptx
 	for (i=-1; i<priv->usb_interface[iface].nb_endpoints; i++) {
 		endpoint_address =(i==-1)?0:priv->usb_interface[iface].endpoint[i];
+		// RAW_IO is off on a newly configured pipe
+		if (endpoint_address & LIBUSB_ENDPOINT_IN) {
+			handle_priv->raw_io_max_size[endpoint_address & LIBUSB_ENDPOINT_ADDRESS_MASK] = 0;
+		}
 		if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint_address,
 			PIPE_TRANSFER_TIMEOUT, sizeof(ULONG), &timeout)) {
 			usbi_dbg("failed to set PIPE_TRANSFER_TIMEOUT for control endpoint %02X", endpoint_address);
@@ -2903,6 +3326,7 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 			}
 		}
 		handle_priv->interface_handle[iface].api_handle = winusb_handle;
+		handle_priv->interface_handle[iface].io_handle = file_handle;
 	} else {
 		// For all other interfaces, use GetAssociatedInterface()
 		winusb_handle = handle_priv->interface_handle[0].api_handle;
@@ -2912,6 +3336,7 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 			file_handle = handle_priv->interface_handle[0].dev_handle;
 			if (WinUSBX[sub_api].Initialize(file_handle, &winusb_handle)) {
 				handle_priv->interface_handle[0].api_handle = winusb_handle;
+				handle_priv->interface_handle[0].io_handle = file_handle;
 				usbi_warn(ctx, "auto-claimed interface 0 (required to claim %d with WinUSB)", iface);
 			} else {
 				usbi_warn(ctx, "failed to auto-claim interface 0 (required to claim %d with WinUSB): %s", iface, windows_error_str(0));
@@ -2933,6 +3358,8 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 				return LIBUSB_ERROR_ACCESS;
 			}
 		}
+		// associated interfaces do their I/O on the file of the first one
+		handle_priv->interface_handle[iface].io_handle = handle_priv->interface_handle[0].io_handle;
 	}
 	usbi_dbg("claimed interface %d", iface);
 	handle_priv->active_interface = iface;
@@ -2955,6 +3382,7 @@ static int winusbx_release_interface(int sub_api, struct libusb_device_handle *d
 
 	WinUSBX[sub_api].Free(winusb_handle);
 	handle_priv->interface_handle[iface].api_handle = INVALID_HANDLE_VALUE;
+	handle_priv->interface_handle[iface].io_handle = NULL;
 
 	return LIBUSB_SUCCESS;
 }
@@ -3040,11 +3468,12 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 	usbi_dbg("will use interface %d", current_interface);
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, RW_READ, NULL, NULL);
+	wfd = usbi_create_fd(winusb_handle, RW_READ, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
+	usbi_associate_fd(wfd.fd, handle_priv->interface_handle[current_interface].io_handle);
 
 	// Sending of set configuration control requests from WinUSB creates issues
 	if ( ((setup->request_type & (0x03 << 5)) == LIBUSB_REQUEST_TYPE_STANDARD)
@@ -3112,7 +3541,7 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
 	HANDLE winusb_handle;
 	bool ret;
-	int current_interface;
+	int current_interface, ep;
 	struct winfd wfd;
 
 	CHECK_WINUSBX_AVAILABLE(sub_api);
@@ -3127,13 +3556,26 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 
 	usbi_dbg("matched endpoint %02X with interface %d", transfer->endpoint, current_interface);
 
+	// RAW_IO reads are handed to the host controller as they are
+	if (IS_XFERIN(transfer)) {
+		ep = transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK;
+		if ( (handle_priv->raw_io_max_size[ep] != 0)
+		  && ( ((ULONG)transfer->length > handle_priv->raw_io_max_size[ep])
+		    || (transfer->length % handle_priv->raw_io_packet_size[ep] != 0) ) ) {
+			usbi_err(ctx, "RAW_IO transfers must be a multiple of %d bytes, up to %u bytes",
+				handle_priv->raw_io_packet_size[ep], (unsigned)handle_priv->raw_io_max_size[ep]);
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, IS_XFERIN(transfer) ? RW_READ : RW_WRITE, NULL, NULL);
+	wfd = usbi_create_fd(winusb_handle, IS_XFERIN(transfer) ? RW_READ : RW_WRITE, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
+	usbi_associate_fd(wfd.fd, handle_priv->interface_handle[current_interface].io_handle);
 
 	if (IS_XFERIN(transfer)) {
 		usbi_dbg("reading %d bytes", transfer->length);
@@ -3227,6 +3669,38 @@ static int winusbx_abort_transfers(int sub_api, struct usbi_transfer *itransfer)
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * Abort all the transfers on an endpoint at once, which only WinUSB (and
+ * libusbK) interfaces support
+ */
+static int windows_abort_endpoint(struct libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	HANDLE winusb_handle;
+	int current_interface, sub_api;
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (priv->usb_interface[current_interface].apib->id != USB_API_WINUSBX)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	sub_api = priv->usb_interface[current_interface].sub_api;
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+
+	usbi_dbg("aborting endpoint %02X on interface %d", endpoint, current_interface);
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+
+	if (!WinUSBX[sub_api].AbortPipe(winusb_handle, endpoint)) {
+		usbi_err(ctx, "AbortPipe failed: %s", windows_error_str(0));
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
 /*
  * from the "How to Use WinUSB to Communicate with a USB Device" Microsoft white paper
  * (http://www.microsoft.com/whdc/connect/usb/winusb_howto.mspx):
@@ -3291,10 +3765,55 @@ static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_ha
 
 static int winusbx_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size)
 {
+	// WinUSB reads straight into the transfer buffer, there is nothing to copy
 	itransfer->transferred += io_size;
 	return LIBUSB_TRANSFER_COMPLETED;
 }
 
+static int winusbx_set_raw_io(int sub_api, struct libusb_device_handle *dev_handle, int iface, unsigned char endpoint, int enable)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	HANDLE winusb_handle = handle_priv->interface_handle[iface].api_handle;
+	int ep = endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK;
+	UCHAR policy = (UCHAR)enable;
+	ULONG max_size = 0, length = sizeof(max_size);
+	int packet_size = 0;
+
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+
+	// libusb-win32 has no pipe policies (see winusbx_configure_endpoints)
+	if (sub_api == SUB_API_LIBUSB0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (enable) {
+		packet_size = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+		if (packet_size <= 0)
+			return (packet_size < 0) ? packet_size : LIBUSB_ERROR_OTHER;
+		// RAW_IO requests must not exceed what the pipe can take at once
+		if (!WinUSBX[sub_api].GetPipePolicy(winusb_handle, endpoint,
+			MAXIMUM_TRANSFER_SIZE, &length, &max_size) || (max_size == 0)) {
+			usbi_err(ctx, "could not get MAXIMUM_TRANSFER_SIZE for endpoint %02X: %s", endpoint, windows_error_str(0));
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+		max_size -= max_size % packet_size;
+	}
+
+	if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint,
+		RAW_IO, sizeof(UCHAR), &policy)) {
+		usbi_err(ctx, "failed to %s RAW_IO for endpoint %02X: %s", enable ? "enable" : "disable",
+			endpoint, windows_error_str(0));
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	usbi_dbg("RAW_IO %s for endpoint %02X (max transfer size %u)", enable ? "enabled" : "disabled",
+		endpoint, (unsigned)max_size);
+	handle_priv->raw_io_packet_size[ep] = packet_size;
+	handle_priv->raw_io_max_size[ep] = max_size;
+	return (int)max_size;
+}
+
 /*
  * Internal HID Support functions (from libusb-win32)
  * Note that functions that complete data transfer synchronously must return
@@ -4061,10 +4580,11 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	usbi_dbg("will use interface %d", current_interface);
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	wfd = usbi_create_fd(hid_handle, RW_READ, NULL, NULL);
+	wfd = usbi_create_fd(hid_handle, RW_READ, itransfer, NULL);
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
+	usbi_associate_fd(wfd.fd, hid_handle);
 
 	switch(LIBUSB_REQ_TYPE(setup->request_type)) {
 	case LIBUSB_REQUEST_TYPE_STANDARD:
@@ -4167,11 +4687,12 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	direction_in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
 
-	wfd = usbi_create_fd(hid_handle, direction_in?RW_READ:RW_WRITE, NULL, NULL);
+	wfd = usbi_create_fd(hid_handle, direction_in?RW_READ:RW_WRITE, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
+	usbi_associate_fd(wfd.fd, hid_handle);
 
 	// If report IDs are not in use, an extra prefix byte must be added
 	if ( ((direction_in) && (!priv->hid->uses_report_ids[0]))
@@ -277,12 +277,17 @@ static inline void windows_device_priv_release(libusb_device* dev) {
 struct interface_handle_t {
 	HANDLE dev_handle; // WinUSB needs an extra handle for the file
 	HANDLE api_handle; // used by the API to communicate with the device
+	HANDLE io_handle; // file the API handle does its I/O on (WinUSB), NULL if unknown
 };
 
 struct windows_device_handle_priv {
 	int active_interface;
 	struct interface_handle_t interface_handle[USB_MAXINTERFACES];
 	int autoclaim_count[USB_MAXINTERFACES]; // For auto-release
+	// Largest transfer and packet size of the IN endpoints in RAW_IO mode,
+	// indexed by endpoint number. 0 when RAW_IO is off
+	ULONG raw_io_max_size[16];
+	int raw_io_packet_size[16];
 };
 
 static inline struct windows_device_handle_priv *_device_handle_priv(
@@ -412,6 +417,42 @@ DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Child, (PDEVINST, DEVINST, ULONG));
 DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Sibling, (PDEVINST, DEVINST, ULONG));
 DLL_DECLARE(WINAPI, CONFIGRET, CM_Get_Device_IDA, (DEVINST, PCHAR, ULONG, ULONG));
 
+/* Cfgmgr32.dll device notifications (Windows 8 and later) */
+#if !defined(CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES)
+#define CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES	0x00000001
+#define CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES	0x00000002
+#define CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE		0
+#define CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE		2
+#endif
+#define CM_NOTIFY_MAX_DEVICE_ID_LEN					200
+
+typedef HANDLE LIBUSB_HCMNOTIFICATION, *PLIBUSB_HCMNOTIFICATION;
+typedef DWORD LIBUSB_CM_NOTIFY_ACTION;
+
+typedef struct _LIBUSB_CM_NOTIFY_FILTER {
+	DWORD cbSize;
+	DWORD Flags;
+	DWORD FilterType;
+	DWORD Reserved;
+	union {
+		struct {
+			GUID ClassGuid;
+		} DeviceInterface;
+		struct {
+			HANDLE hTarget;
+		} DeviceHandle;
+		struct {
+			WCHAR InstanceId[CM_NOTIFY_MAX_DEVICE_ID_LEN];
+		} DeviceInstance;
+	} u;
+} LIBUSB_CM_NOTIFY_FILTER, *PLIBUSB_CM_NOTIFY_FILTER;
+
+typedef DWORD (CALLBACK *LIBUSB_CM_NOTIFY_CALLBACK)(LIBUSB_HCMNOTIFICATION, PVOID, LIBUSB_CM_NOTIFY_ACTION, PVOID, DWORD);
+
+DLL_DECLARE(WINAPI, CONFIGRET, CM_Register_Notification, (PLIBUSB_CM_NOTIFY_FILTER, PVOID,
+	LIBUSB_CM_NOTIFY_CALLBACK, PLIBUSB_HCMNOTIFICATION));
+DLL_DECLARE(WINAPI, CONFIGRET, CM_Unregister_Notification, (LIBUSB_HCMNOTIFICATION));
+
 #define IOCTL_USB_GET_HUB_CAPABILITIES_EX \
   CTL_CODE( FILE_DEVICE_USB, USB_GET_HUB_CAPABILITIES_EX, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -35,19 +35,29 @@
 
 static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
+	struct usbi_event_waiter *waiter = transfer->user_data;
 	usbi_dbg("actual_length=%d", transfer->actual_length);
-	/* caller interprets result and frees transfer */
+	/* wake up only the thread waiting for this transfer, which interprets
+	 * the result and frees the transfer */
+	usbi_signal_event_waiter(HANDLE_CTX(transfer->dev_handle), waiter);
 }
 
 static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
-	int r, *completed = transfer->user_data;
+	struct usbi_event_waiter *waiter = transfer->user_data;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+	struct timeval tv = { 60, 0 };
+	int r;
 
-	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+	while (!waiter->completed) {
+		/* the context's event handlers never see the events of a handle
+		 * which belongs to an event domain */
+		if (transfer->dev_handle->event_domain)
+			r = libusb_handle_domain_events_timeout_completed(
+				transfer->dev_handle->event_domain, &tv,
+				&waiter->completed);
+		else
+			r = usbi_handle_events_for_waiter(ctx, &tv, waiter);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -59,6 +69,143 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+/* the largest control transfer buffer kept in a handle's cache. larger
+ * requests are rare and get a buffer of their own, so that one large
+ * request does not pin the memory for the life of the handle */
+#define MAX_SYNC_BUFFER_CACHE_SIZE	(LIBUSB_CONTROL_SETUP_SIZE + 4096)
+
+/* take the handle's cached transfer, allocating one if it is in use by
+ * another synchronous call. if buffer is given, also hand out a buffer of at
+ * least buffer_size bytes, reusing the cached one when it is large enough */
+static struct libusb_transfer *get_sync_transfer(
+	struct libusb_device_handle *dev_handle, unsigned char **buffer,
+	size_t *buffer_size)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *cached_buffer = NULL;
+	size_t cached_size = 0;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	transfer = dev_handle->sync_transfer;
+	dev_handle->sync_transfer = NULL;
+	if (buffer && *buffer_size <= MAX_SYNC_BUFFER_CACHE_SIZE) {
+		cached_buffer = dev_handle->sync_buffer;
+		cached_size = dev_handle->sync_buffer_size;
+		dev_handle->sync_buffer = NULL;
+		dev_handle->sync_buffer_size = 0;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!transfer) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			goto err;
+	}
+
+	if (buffer) {
+		if (cached_size < *buffer_size) {
+			free(cached_buffer);
+			cached_buffer = malloc(*buffer_size);
+			if (!cached_buffer)
+				goto err;
+			cached_size = *buffer_size;
+		}
+		*buffer = cached_buffer;
+		*buffer_size = cached_size;
+	}
+	return transfer;
+
+err:
+	free(cached_buffer);
+	libusb_free_transfer(transfer);
+	return NULL;
+}
+
+/* return a transfer and buffer obtained from get_sync_transfer() to the
+ * handle's cache, or free them if the cache has been refilled meanwhile or
+ * the buffer is too large to be cached */
+static void put_sync_transfer(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer, unsigned char *buffer,
+	size_t buffer_size)
+{
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!dev_handle->sync_transfer) {
+		dev_handle->sync_transfer = transfer;
+		transfer = NULL;
+	}
+	if (buffer && buffer_size <= MAX_SYNC_BUFFER_CACHE_SIZE
+			&& !dev_handle->sync_buffer) {
+		dev_handle->sync_buffer = buffer;
+		dev_handle->sync_buffer_size = buffer_size;
+		buffer = NULL;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	libusb_free_transfer(transfer);
+	free(buffer);
+}
+
+/* blocking in the backend means this thread does not handle events until the
+ * request completes. that is only acceptable if some other thread is handling
+ * them, or if there are no other transfers in flight that could need it. the
+ * context's event handler and transfers say nothing about the events of a
+ * handle in an event domain, so those never block in the backend */
+static int can_block_in_backend(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int r;
+
+	if (dev_handle->event_domain)
+		return 0;
+
+	if (libusb_event_handler_active(ctx))
+		return 1;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = list_empty(&ctx->flying_transfers);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+
+/* a dedicated reaper, see libusb_set_dedicated_reaper(), is the only thread
+ * which reaps the completions of its handle, so a synchronous transfer on
+ * that handle from one of the callbacks it runs would never complete */
+static int on_reaper_thread(struct libusb_device_handle *dev_handle)
+{
+	return dev_handle->dedicated_reaper
+		&& dev_handle->reaper_tid == usbi_get_tid();
+}
+
+/* interpret the outcome of a completed control transfer like
+ * libusb_control_transfer() does, copying the data of an IN request */
+static int control_transfer_result(struct libusb_transfer *transfer,
+	uint8_t bmRequestType, unsigned char *data)
+{
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		memcpy(data, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length);
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(transfer->dev_handle),
+			"unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
 /** \ingroup syncio
  * Perform a USB control transfer.
  *
@@ -85,73 +232,294 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
  * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
  * device
  * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from a callback run by the dedicated
+ * reaper of the handle, see libusb_set_dedicated_reaper()
  * \returns another LIBUSB_ERROR code on other failures
  */
 int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int completed = 0;
+	size_t buffer_size = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+	struct usbi_event_waiter waiter;
 	int r;
 
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+	if (on_reaper_thread(dev_handle))
+		return LIBUSB_ERROR_BUSY;
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
-		return LIBUSB_ERROR_NO_MEM;
+	/* the backend blocks in the kernel without a libusb_transfer or any
+	 * libusb lock, so there is nothing here for lock profiling to count.
+	 * usbi_count_sync_transfer() feeds the endpoint statistics and the
+	 * trace ring instead of the transfer lifecycle */
+	if (usbi_backend->sync_control_transfer
+			&& can_block_in_backend(dev_handle)) {
+		struct timespec start;
+
+		if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &start) < 0)
+			start.tv_sec = start.tv_nsec = 0;
+		r = usbi_backend->sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			usbi_count_sync_transfer(dev_handle, 0, wLength,
+				r > 0 ? r : 0, r, &start);
+			return r;
+		}
 	}
 
+	transfer = get_sync_transfer(dev_handle, &buffer, &buffer_size);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+
 	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
 		wLength);
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		sync_transfer_cb, &waiter, timeout);
+	usbi_init_event_waiter(&waiter);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_destroy_event_waiter(&waiter);
+		put_sync_transfer(dev_handle, transfer, buffer, buffer_size);
 		return r;
 	}
 
 	sync_transfer_wait_for_completion(transfer);
+	usbi_destroy_event_waiter(&waiter);
 
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-		memcpy(data, libusb_control_transfer_get_data(transfer),
-			transfer->actual_length);
+	r = control_transfer_result(transfer, bmRequestType, data);
+	put_sync_transfer(dev_handle, transfer, buffer, buffer_size);
+	return r;
+}
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
+/* a control transfer of a batch, and the request it performs */
+struct control_batch_slot {
+	struct control_batch *batch;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	size_t buffer_size;
+	int request;
+	int busy;
+
+	/* set by the callback, under the event waiters lock */
+	int done;
+	/* set once the waiting thread has seen done */
+	int reaped;
+};
+
+struct control_batch {
+	struct libusb_context *ctx;
+	struct usbi_event_waiter waiter;
+};
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer)
+{
+	struct control_batch_slot *slot = transfer->user_data;
+	struct control_batch *batch = slot->batch;
+
+	/* the slot is marked under the event waiters lock, so that the waiting
+	 * thread sees the completed transfer as soon as it sees the mark */
+	usbi_mutex_lock(&batch->ctx->event_waiters_lock);
+	slot->done = 1;
+	batch->waiter.completed = 1;
+	usbi_cond_signal(&batch->waiter.cond);
+	usbi_mutex_unlock(&batch->ctx->event_waiters_lock);
+}
+
+static int submit_control_batch_slot(struct control_batch_slot *slot,
+	struct libusb_device_handle *dev_handle,
+	struct libusb_control_request *request, unsigned int timeout)
+{
+	size_t buffer_size = LIBUSB_CONTROL_SETUP_SIZE + request->wLength;
+
+	if (slot->buffer_size < buffer_size) {
+		free(slot->buffer);
+		slot->buffer = malloc(buffer_size);
+		slot->buffer_size = slot->buffer ? buffer_size : 0;
+		if (!slot->buffer)
+			return LIBUSB_ERROR_NO_MEM;
 	}
 
-	libusb_free_transfer(transfer);
+	libusb_fill_control_setup(slot->buffer, request->bmRequestType,
+		request->bRequest, request->wValue, request->wIndex,
+		request->wLength);
+	if ((request->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK)
+			== LIBUSB_ENDPOINT_OUT)
+		memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, request->data,
+			request->wLength);
+
+	libusb_fill_control_transfer(slot->transfer, dev_handle, slot->buffer,
+		control_batch_cb, slot, timeout);
+	return libusb_submit_transfer(slot->transfer);
+}
+
+static void cancel_control_batch(struct control_batch_slot *slots,
+	int num_slots)
+{
+	int i;
+
+	for (i = 0; i < num_slots; i++) {
+		if (slots[i].busy)
+			libusb_cancel_transfer(slots[i].transfer);
+	}
+}
+
+/** \ingroup syncio
+ * Perform a sequence of USB control transfers, keeping up to max_in_flight
+ * of them submitted at a time instead of waiting for each one to complete
+ * before sending the next. This hides the round trip to the device, e.g.
+ * when downloading firmware or writing blocks of registers with vendor
+ * requests.
+ *
+ * The requests are submitted in array order on the default control pipe,
+ * where the host controller performs them one after the other. The
+ * function returns once all of them completed, or after the first request
+ * which failed. In that case, the requests submitted after it are
+ * cancelled, but up to max_in_flight - 1 of them may already have reached
+ * the device; the requests not yet submitted are left out.
+ *
+ * The result field of each request is set to its outcome.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param requests the requests to perform
+ * \param num_requests the number of requests
+ * \param max_in_flight the largest number of requests submitted at a time.
+ * 1 performs the requests like consecutive calls to libusb_control_transfer()
+ * \param timeout timeout (in millseconds) for each request, or 0 for an
+ * unlimited timeout
+ * \returns 0 if all requests succeeded
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_requests is negative or
+ * max_in_flight is not positive
+ * \returns LIBUSB_ERROR_BUSY if called from a callback run by the dedicated
+ * reaper of the handle, see libusb_set_dedicated_reaper()
+ * \returns the result of the first request which failed otherwise
+ */
+int API_EXPORTED libusb_control_transfer_batch(libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests,
+	int max_in_flight, unsigned int timeout)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct control_batch batch;
+	struct control_batch_slot *slots;
+	struct timeval tv = { 60, 0 };
+	int next = 0, num_busy = 0;
+	int error = 0, cancelled = 0;
+	int i, r;
+
+	if (num_requests < 0 || max_in_flight <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (on_reaper_thread(dev_handle))
+		return LIBUSB_ERROR_BUSY;
+	if (max_in_flight > num_requests)
+		max_in_flight = num_requests;
+	if (!max_in_flight)
+		return 0;
+
+	slots = calloc(max_in_flight, sizeof(*slots));
+	if (!slots)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < max_in_flight; i++) {
+		slots[i].batch = &batch;
+		slots[i].transfer = libusb_alloc_transfer(0);
+		if (!slots[i].transfer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+	}
+
+	batch.ctx = ctx;
+	usbi_init_event_waiter(&batch.waiter);
+	for (i = 0; i < num_requests; i++)
+		requests[i].result = LIBUSB_ERROR_INTERRUPTED;
+
+	while (1) {
+		/* keep the free slots busy with the next requests */
+		for (i = 0; !error && next < num_requests && i < max_in_flight; i++) {
+			if (slots[i].busy)
+				continue;
+			r = submit_control_batch_slot(&slots[i], dev_handle,
+				&requests[next], timeout);
+			if (r < 0) {
+				requests[next].result = r;
+				error = r;
+				break;
+			}
+			slots[i].request = next++;
+			slots[i].busy = 1;
+			num_busy++;
+		}
+
+		/* the batch is over once the submitted requests completed after
+		 * the last one was submitted, or after a failure */
+		if (!num_busy)
+			break;
+		if (error && !cancelled) {
+			cancel_control_batch(slots, max_in_flight);
+			cancelled = 1;
+		}
+
+		while (!batch.waiter.completed) {
+			if (dev_handle->event_domain)
+				r = libusb_handle_domain_events_timeout_completed(
+					dev_handle->event_domain, &tv,
+					&batch.waiter.completed);
+			else
+				r = usbi_handle_events_for_waiter(ctx, &tv,
+					&batch.waiter);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+				usbi_err(ctx, "libusb_handle_events failed: %s, cancelling batch",
+					libusb_error_name(r));
+				if (!error)
+					error = r;
+				if (!cancelled) {
+					cancel_control_batch(slots, max_in_flight);
+					cancelled = 1;
+				}
+			}
+		}
+
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		batch.waiter.completed = 0;
+		for (i = 0; i < max_in_flight; i++) {
+			slots[i].reaped = slots[i].done;
+			slots[i].done = 0;
+		}
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+		for (i = 0; i < max_in_flight; i++) {
+			struct libusb_control_request *request;
+
+			if (!slots[i].reaped)
+				continue;
+			slots[i].reaped = 0;
+			slots[i].busy = 0;
+			num_busy--;
+
+			request = &requests[slots[i].request];
+			if (error && slots[i].transfer->status
+					== LIBUSB_TRANSFER_CANCELLED)
+				continue;
+			request->result = control_transfer_result(slots[i].transfer,
+				request->bmRequestType, request->data);
+			if (request->result < 0 && !error)
+				error = request->result;
+		}
+	}
+
+	usbi_destroy_event_waiter(&batch.waiter);
+	r = error;
+
+out:
+	for (i = 0; i < max_in_flight; i++) {
+		libusb_free_transfer(slots[i].transfer);
+		free(slots[i].buffer);
+	}
+	free(slots);
 	return r;
 }
 
@@ -159,24 +527,48 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int completed = 0;
+	struct libusb_transfer *transfer;
+	struct usbi_event_waiter waiter;
 	int r;
 
+	if (on_reaper_thread(dev_handle))
+		return LIBUSB_ERROR_BUSY;
+
+	/* with a timeout, data transferred before it expired would be lost.
+	 * accounted for like the control fast path above */
+	if (usbi_backend->sync_bulk_transfer && timeout == 0
+			&& can_block_in_backend(dev_handle)) {
+		struct timespec start;
+
+		if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &start) < 0)
+			start.tv_sec = start.tv_nsec = 0;
+		r = usbi_backend->sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, transferred);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			usbi_count_sync_transfer(dev_handle, endpoint, length,
+				r == 0 ? *transferred : 0, r, &start);
+			return r;
+		}
+	}
+
+	transfer = get_sync_transfer(dev_handle, NULL, NULL);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
+		sync_transfer_cb, &waiter, timeout);
 	transfer->type = type;
 
+	usbi_init_event_waiter(&waiter);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_destroy_event_waiter(&waiter);
+		put_sync_transfer(dev_handle, transfer, NULL, 0);
 		return r;
 	}
 
 	sync_transfer_wait_for_completion(transfer);
+	usbi_destroy_event_waiter(&waiter);
 
 	*transferred = transfer->actual_length;
 	switch (transfer->status) {
@@ -205,7 +597,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, transfer, NULL, 0);
 	return r;
 }
 
@@ -247,6 +639,8 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
  * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
  * \ref packetoverflow
  * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from a callback run by the dedicated
+ * reaper of the handle, see libusb_set_dedicated_reaper()
  * \returns another LIBUSB_ERROR code on other failures
  */
 int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
@@ -296,6 +690,8 @@ int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
  * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
  * \ref packetoverflow
  * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from a callback run by the dedicated
+ * reaper of the handle, see libusb_set_dedicated_reaper()
  * \returns another LIBUSB_ERROR code on other error
  */
 int API_EXPORTED libusb_interrupt_transfer(
@@ -0,0 +1,147 @@
+/*
+ * libusb test for autotuned streaming rings, see libusb_set_ring_autotune()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend with a fixed delay per transfer, so that
+ * the throughput of a ring grows with both its transfer length and its
+ * queue depth. A ring on the bulk IN endpoint is autotuned while its data
+ * is consumed, and the test checks that the warm-up ends, that the chosen
+ * settings stay within the limits the ring was allocated with, that
+ * lengthening the transfers was found to pay off, and the measurements
+ * reported for the chosen settings.
+ */
+
+#include <sys/time.h>
+
+#include "nulltest.h"
+
+#define NUM_BUFFERS	8
+#define QUEUE_DEPTH	4
+#define BUF_SIZE	4096
+#define TUNE_UNIT	512
+
+/* the LIBUSB_NULL_DELAY_US the test runs with */
+#define DELAY_US	1000
+#define DELAY_US_STR	"1000"
+
+/* how long the warm-up may take, in seconds */
+#define TUNE_LIMIT	10
+
+/* how many completions the consumer got, and of how many bytes */
+static int num_read;
+static long bytes_read;
+
+static void consume(libusb_ring *ring)
+{
+	unsigned char *data;
+	int length;
+
+	while (libusb_ring_read(ring, &data, &length) == 1) {
+		CHECK(length > 0 && length <= BUF_SIZE);
+		CHECK_EQ(length % TUNE_UNIT, 0);
+		num_read++;
+		bytes_read += length;
+		libusb_ring_release(ring);
+	}
+}
+
+int main(void)
+{
+	struct libusb_ring_tuning tuning;
+	struct libusb_ring_stats stats;
+	struct timeval start, now;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_ring *ring;
+	int i;
+
+	nulltest_open(&ctx, &handle, "LIBUSB_NULL_DELAY_US", DELAY_US_STR, NULL);
+
+	CHECK_EQ(libusb_alloc_ring(handle, NULL_BULK_IN, NUM_BUFFERS,
+		QUEUE_DEPTH, BUF_SIZE, 0, NULL, NULL, &ring), 0);
+	CHECK_EQ(libusb_get_ring_tuning(ring, NULL),
+		LIBUSB_ERROR_INVALID_PARAM);
+
+	/* without autotuning, the ring runs with the settings it was
+	 * allocated with */
+	CHECK_EQ(libusb_get_ring_tuning(ring, &tuning), 0);
+	CHECK_EQ(tuning.queue_depth, QUEUE_DEPTH);
+	CHECK_EQ(tuning.transfer_length, BUF_SIZE);
+	CHECK_EQ(tuning.warming_up, 0);
+
+	/* the warm-up starts from one maximum size packet at the full depth */
+	CHECK_EQ(libusb_set_ring_autotune(ring, 1), 0);
+	CHECK_EQ(libusb_get_ring_tuning(ring, &tuning), 0);
+	CHECK_EQ(tuning.queue_depth, QUEUE_DEPTH);
+	CHECK_EQ(tuning.transfer_length, TUNE_UNIT);
+	CHECK_EQ(tuning.warming_up, 1);
+
+	CHECK_EQ(libusb_start_ring(ring), 0);
+	gettimeofday(&start, NULL);
+	do {
+		struct timeval tv = { 0, 10000 };
+
+		CHECK_EQ(libusb_handle_events_timeout_completed(ctx, &tv,
+			NULL), 0);
+		consume(ring);
+		CHECK_EQ(libusb_get_ring_tuning(ring, &tuning), 0);
+
+		gettimeofday(&now, NULL);
+		if (now.tv_sec - start.tv_sec > TUNE_LIMIT) {
+			fprintf(stderr, "still warming up after %d seconds\n",
+				TUNE_LIMIT);
+			return EXIT_FAILURE;
+		}
+	} while (tuning.warming_up);
+
+	CHECK(tuning.queue_depth >= 1 && tuning.queue_depth <= QUEUE_DEPTH);
+	CHECK(tuning.transfer_length > TUNE_UNIT
+		&& tuning.transfer_length <= BUF_SIZE);
+	CHECK_EQ(tuning.transfer_length % TUNE_UNIT, 0);
+	CHECK(tuning.throughput > 0);
+	CHECK(tuning.latency_us >= DELAY_US);
+
+	/* disabling autotuning keeps the chosen settings */
+	CHECK_EQ(libusb_set_ring_autotune(ring, 0), 0);
+	CHECK_EQ(libusb_get_ring_tuning(ring, &tuning), 0);
+	CHECK_EQ(tuning.warming_up, 0);
+	CHECK(tuning.transfer_length > TUNE_UNIT);
+
+	CHECK_EQ(libusb_stop_ring(ring), 0);
+	for (i = 0; i < 100; i++) {
+		struct timeval tv = { 0, 10000 };
+
+		CHECK_EQ(libusb_handle_events_timeout_completed(ctx, &tv,
+			NULL), 0);
+		consume(ring);
+		CHECK_EQ(libusb_get_ring_stats(ring, &stats), 0);
+		if (!stats.in_flight)
+			break;
+	}
+	CHECK_EQ(stats.in_flight, 0);
+	CHECK_EQ(stats.errors, 0);
+	CHECK_EQ(stats.transfers, num_read);
+	CHECK_EQ(stats.bytes, bytes_read);
+
+	libusb_free_ring(ring);
+	nulltest_close(ctx, handle);
+	printf("tuned to %d transfers of %d bytes, %llu bytes/s\n",
+		tuning.queue_depth, tuning.transfer_length,
+		(unsigned long long)tuning.throughput);
+	return 0;
+}
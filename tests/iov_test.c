@@ -0,0 +1,131 @@
+/*
+ * libusb test for scatter/gather transfers, see
+ * libusb_fill_bulk_transfer_iov()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend in loopback mode. Segments of odd lengths
+ * are gathered into one OUT transfer, and the data is read back with an IN
+ * transfer scattered over differently sized segments which have room for
+ * more than was sent. The test checks that the IN transfer completes short
+ * with exactly the data sent, in order across the segment boundaries, that
+ * the rest of the segments is left untouched, and that both transfers get
+ * their segment arrays back as their buffers.
+ */
+
+#include <string.h>
+
+#include "nulltest.h"
+
+#define NUM_OUT_IOV	4
+#define NUM_IN_IOV	3
+#define UNTOUCHED	0xee
+
+static const int out_lengths[NUM_OUT_IOV] = { 3, 500, 1, 600 };
+static const int in_lengths[NUM_IN_IOV] = { 512, 100, 1000 };
+
+static int done;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	(void)transfer;
+	done = 1;
+}
+
+static int total_length(const int *lengths, int n)
+{
+	int i, total = 0;
+
+	for (i = 0; i < n; i++)
+		total += lengths[i];
+	return total;
+}
+
+static void run_transfer(libusb_context *ctx, struct libusb_transfer *transfer)
+{
+	done = 0;
+	CHECK_EQ(libusb_submit_transfer(transfer), 0);
+	nulltest_wait(ctx, &done);
+	CHECK_EQ(transfer->status, LIBUSB_TRANSFER_COMPLETED);
+}
+
+int main(void)
+{
+	static unsigned char out_buf[2048], in_buf[2048];
+	struct libusb_iovec out_iov[NUM_OUT_IOV], in_iov[NUM_IN_IOV];
+	struct libusb_transfer *transfer;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	unsigned char *p;
+	int out_len = total_length(out_lengths, NUM_OUT_IOV);
+	int in_len = total_length(in_lengths, NUM_IN_IOV);
+	int i, j, n;
+
+	nulltest_open(&ctx, &handle, "LIBUSB_NULL_LOOPBACK", "1", NULL);
+
+	transfer = libusb_alloc_transfer(0);
+	CHECK(transfer != NULL);
+	CHECK_EQ(libusb_fill_bulk_transfer_iov(transfer, handle, NULL_BULK_OUT,
+		out_iov, 0, transfer_cb, NULL, 1000), LIBUSB_ERROR_INVALID_PARAM);
+
+	/* the segments lie apart from each other in the buffer, and each byte
+	 * holds its offset in the data sent */
+	for (i = 0, p = out_buf, n = 0; i < NUM_OUT_IOV; i++) {
+		out_iov[i].base = p;
+		out_iov[i].len = out_lengths[i];
+		for (j = 0; j < out_lengths[i]; j++)
+			p[j] = (unsigned char)(n + j);
+		n += out_lengths[i];
+		p += out_lengths[i] + 7;
+	}
+	CHECK_EQ(libusb_fill_bulk_transfer_iov(transfer, handle, NULL_BULK_OUT,
+		out_iov, NUM_OUT_IOV, transfer_cb, NULL, 1000), 0);
+	CHECK_EQ(transfer->length, out_len);
+	run_transfer(ctx, transfer);
+	CHECK_EQ(transfer->actual_length, out_len);
+	CHECK(transfer->buffer == (unsigned char *)out_iov);
+
+	memset(in_buf, UNTOUCHED, sizeof(in_buf));
+	for (i = 0, p = in_buf; i < NUM_IN_IOV; i++) {
+		in_iov[i].base = p;
+		in_iov[i].len = in_lengths[i];
+		p += in_lengths[i] + 5;
+	}
+	CHECK_EQ(libusb_fill_bulk_transfer_iov(transfer, handle, NULL_BULK_IN,
+		in_iov, NUM_IN_IOV, transfer_cb, NULL, 1000), 0);
+	CHECK_EQ(transfer->length, in_len);
+	run_transfer(ctx, transfer);
+	CHECK_EQ(transfer->actual_length, out_len);
+	CHECK(transfer->buffer == (unsigned char *)in_iov);
+
+	for (i = 0, n = 0; i < NUM_IN_IOV; i++) {
+		for (j = 0; j < in_lengths[i]; j++, n++) {
+			if (n < out_len)
+				CHECK_EQ(in_iov[i].base[j], (unsigned char)n);
+			else
+				CHECK_EQ(in_iov[i].base[j], UNTOUCHED);
+		}
+		/* nothing was written between the segments */
+		CHECK_EQ(in_iov[i].base[in_lengths[i]], UNTOUCHED);
+	}
+
+	libusb_free_transfer(transfer);
+	nulltest_close(ctx, handle);
+	printf("%d bytes gathered from %d and scattered over %d segments\n",
+		out_len, NUM_OUT_IOV, NUM_IN_IOV);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * libusb test helpers for the null backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "nulltest.h"
+
+/* the default device of the null backend */
+#define NULL_VID	0x1d6b
+#define NULL_PID	0x0104
+#define NULL_PRODUCT	"Null device"
+
+/* how long nulltest_wait() waits, in seconds */
+#define WAIT_LIMIT	5
+
+void nulltest_open(libusb_context **ctx, libusb_device_handle **handle,
+	...)
+{
+	struct libusb_device_descriptor desc;
+	unsigned char product[64];
+	const char *name;
+	va_list ap;
+	int r;
+
+	va_start(ap, handle);
+	while ((name = va_arg(ap, const char *)) != NULL)
+		setenv(name, va_arg(ap, const char *), 1);
+	va_end(ap);
+
+	r = libusb_init(ctx);
+	if (r < 0) {
+		printf("failed to init libusb: %s, skipping\n",
+			libusb_error_name(r));
+		exit(EXIT_SKIP);
+	}
+
+	/* another backend may well have a real device with these IDs */
+	*handle = libusb_open_device_with_vid_pid(*ctx, NULL_VID, NULL_PID);
+	if (*handle) {
+		r = libusb_get_device_descriptor(libusb_get_device(*handle),
+			&desc);
+		if (r == 0)
+			r = libusb_get_string_descriptor_ascii(*handle,
+				desc.iProduct, product, sizeof(product));
+		if (r < 0 || strcmp((char *)product, NULL_PRODUCT) != 0) {
+			libusb_close(*handle);
+			*handle = NULL;
+		}
+	}
+	if (!*handle) {
+		printf("no null backend device found, skipping\n");
+		libusb_exit(*ctx);
+		exit(EXIT_SKIP);
+	}
+
+	CHECK_EQ(libusb_claim_interface(*handle, 0), 0);
+}
+
+void nulltest_close(libusb_context *ctx, libusb_device_handle *handle)
+{
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+	libusb_exit(ctx);
+}
+
+void nulltest_wait(libusb_context *ctx, int *flag)
+{
+	struct timeval start, now;
+	int r;
+
+	gettimeofday(&start, NULL);
+	while (!*flag) {
+		struct timeval tv = { 0, 100000 };
+
+		r = libusb_handle_events_timeout_completed(ctx, &tv, flag);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			CHECK_EQ(r, 0);
+
+		gettimeofday(&now, NULL);
+		if (now.tv_sec - start.tv_sec > WAIT_LIMIT) {
+			fprintf(stderr, "gave up waiting after %d seconds\n",
+				WAIT_LIMIT);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
@@ -0,0 +1,71 @@
+/*
+ * libusb test helpers for the null backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_NULLTEST_H
+#define LIBUSB_NULLTEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libusb.h"
+
+/* automake's exit code for a skipped test */
+#define EXIT_SKIP	77
+
+/* the bulk and interrupt endpoints of the null backend's devices */
+#define NULL_BULK_OUT	0x01
+#define NULL_BULK_IN	0x81
+#define NULL_INTR_OUT	0x02
+#define NULL_INTR_IN	0x82
+
+/* fail the test with the location and text of a condition which does not
+ * hold */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+				__FILE__, __LINE__, #cond); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+/* fail the test unless a libusb call returned the expected value */
+#define CHECK_EQ(r, expected) \
+	do { \
+		long _r = (long)(r), _e = (long)(expected); \
+		if (_r != _e) { \
+			fprintf(stderr, "%s:%d: %s returned %ld (%s), " \
+				"expected %ld\n", __FILE__, __LINE__, #r, _r, \
+				_r < 0 ? libusb_error_name((int)_r) : "", _e); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+/* create a context and open the default device of the null backend with its
+ * interface claimed, after setting the LIBUSB_NULL_* variables given as a
+ * NULL terminated list of name, value pairs. exits with EXIT_SKIP when
+ * libusb was built with another backend */
+void nulltest_open(libusb_context **ctx, libusb_device_handle **handle,
+	...);
+void nulltest_close(libusb_context *ctx, libusb_device_handle *handle);
+
+/* handle events until *flag is set, failing the test if that takes longer
+ * than a few seconds */
+void nulltest_wait(libusb_context *ctx, int *flag);
+
+#endif
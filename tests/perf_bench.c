@@ -0,0 +1,537 @@
+/*
+ * libusb performance regression benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This runs a set of benchmarks against the given device, which may be a
+ * real device or one emulated by the null backend (./configure
+ * --enable-null-backend, whose default device is 1d6b:0104):
+ *
+ *  latency     submit to callback latency percentiles of single transfers
+ *  throughput  transfers and bytes per second by queue depth and size
+ *  sync        round trip of libusb_control_transfer() and
+ *              libusb_bulk_transfer()
+ *  devlist     libusb_get_device_list() time by device count. the count
+ *              can only be varied with the null backend, through
+ *              LIBUSB_NULL_DEVICES
+ *  init        libusb_init() plus libusb_exit()
+ *  config      libusb_get_active_config_descriptor() plus
+ *              libusb_free_config_descriptor()
+ *
+ * Transfers go to the first bulk or interrupt endpoint of the device, or
+ * to the given one. Each result is printed on its own line, as the name of
+ * the benchmark followed by space separated key=value pairs, times in
+ * microseconds, so that results can be compared by scripts:
+ *
+ *   latency endpoint=0x81 size=512 count=10000 p50=2.104 p90=2.513 ...
+ *
+ * Usage: perf_bench [-d vid:pid] [-e endpoint] [-n iterations] [benchmark...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+
+#define TIMEOUT		1000
+#define MAX_DEPTH	64
+#define MAX_SIZE	65536
+
+struct bench {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	uint16_t vid;
+	uint16_t pid;
+	unsigned char endpoint;
+	unsigned char type;
+	int iterations;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* print the percentiles of n samples, which get sorted */
+static void print_percentiles(double *samples, int n)
+{
+	qsort(samples, n, sizeof(*samples), compare_double);
+	printf(" p50=%.3f p90=%.3f p99=%.3f p999=%.3f max=%.3f",
+		samples[n / 2], samples[(int)(n * 0.9)],
+		samples[(int)(n * 0.99)], samples[(int)(n * 0.999)],
+		samples[n - 1]);
+}
+
+/* find the first bulk or interrupt endpoint of the first altsetting of any
+ * interface in the active configuration, or the given endpoint */
+static int find_endpoint(libusb_device *dev, int *iface, unsigned char *ep,
+	unsigned char *type)
+{
+	struct libusb_config_descriptor *config;
+	int i, j, r;
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (i = 0; i < config->bNumInterfaces && r; i++) {
+		const struct libusb_interface_descriptor *altsetting =
+			&config->interface[i].altsetting[0];
+		for (j = 0; j < altsetting->bNumEndpoints; j++) {
+			const struct libusb_endpoint_descriptor *epdesc =
+				&altsetting->endpoint[j];
+			unsigned char ep_type = epdesc->bmAttributes
+				& LIBUSB_TRANSFER_TYPE_MASK;
+			if (ep_type != LIBUSB_TRANSFER_TYPE_BULK
+					&& ep_type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+				continue;
+			if (*ep ? *ep != epdesc->bEndpointAddress
+					: !(epdesc->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+				continue;
+			*iface = altsetting->bInterfaceNumber;
+			*ep = epdesc->bEndpointAddress;
+			*type = ep_type;
+			r = 0;
+			break;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+struct stream {
+	int remaining;		/* transfers still to submit */
+	int in_flight;
+	int failed;
+	long long bytes;
+	double *latencies;	/* one per completed transfer, or NULL */
+	int num_latencies;
+};
+
+struct slot {
+	struct stream *stream;
+	double submitted;
+};
+
+static void LIBUSB_CALL stream_cb(struct libusb_transfer *transfer)
+{
+	struct slot *slot = transfer->user_data;
+	struct stream *stream = slot->stream;
+
+	stream->in_flight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		stream->failed++;
+		stream->remaining = 0;
+		return;
+	}
+
+	if (stream->latencies)
+		stream->latencies[stream->num_latencies++] =
+			now_us() - slot->submitted;
+	stream->bytes += transfer->actual_length;
+
+	if (stream->remaining > 0) {
+		stream->remaining--;
+		slot->submitted = now_us();
+		if (libusb_submit_transfer(transfer) < 0) {
+			stream->failed++;
+			stream->remaining = 0;
+			return;
+		}
+		stream->in_flight++;
+	}
+}
+
+/* run count transfers of the given size, keeping depth of them in flight.
+ * returns the elapsed time in microseconds, or a LIBUSB_ERROR code */
+static double run_stream(struct bench *b, int depth, int size, int count,
+	double *latencies)
+{
+	struct libusb_transfer *transfers[MAX_DEPTH];
+	struct slot slots[MAX_DEPTH];
+	struct stream stream;
+	unsigned char *buffer;
+	double start, elapsed;
+	int i, r = 0;
+
+	buffer = calloc(depth, size);
+	if (!buffer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.remaining = count;
+	stream.latencies = latencies;
+	for (i = 0; i < depth; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			depth = i;
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		slots[i].stream = &stream;
+		libusb_fill_bulk_transfer(transfers[i], b->handle, b->endpoint,
+			buffer + i * size, size, stream_cb, &slots[i], TIMEOUT);
+		transfers[i]->type = b->type;
+	}
+
+	start = now_us();
+	for (i = 0; i < depth && stream.remaining > 0; i++) {
+		stream.remaining--;
+		slots[i].submitted = now_us();
+		r = libusb_submit_transfer(transfers[i]);
+		if (r < 0) {
+			stream.remaining = 0;
+			break;
+		}
+		stream.in_flight++;
+	}
+	while (stream.in_flight > 0) {
+		int ret = libusb_handle_events(b->ctx);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			r = ret;
+			break;
+		}
+	}
+	elapsed = now_us() - start;
+	if (!r && stream.failed)
+		r = LIBUSB_ERROR_IO;
+
+out:
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(buffer);
+	return r < 0 ? r : elapsed;
+}
+
+static int bench_latency(struct bench *b)
+{
+	static const int sizes[] = { 64, 512, 16384 };
+	double *samples;
+	double r;
+	int i;
+
+	samples = malloc(b->iterations * sizeof(*samples));
+	if (!samples)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		r = run_stream(b, 1, sizes[i], b->iterations, samples);
+		if (r < 0) {
+			free(samples);
+			return (int)r;
+		}
+		printf("latency endpoint=0x%02x size=%d count=%d", b->endpoint,
+			sizes[i], b->iterations);
+		print_percentiles(samples, b->iterations);
+		printf("\n");
+	}
+
+	free(samples);
+	return 0;
+}
+
+static int bench_throughput(struct bench *b)
+{
+	static const int depths[] = { 1, 4, 16, 64 };
+	static const int sizes[] = { 64, 512, 4096, MAX_SIZE };
+	double elapsed;
+	int i, j;
+
+	for (i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); i++) {
+		for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++) {
+			elapsed = run_stream(b, depths[i], sizes[j],
+				b->iterations, NULL);
+			if (elapsed < 0)
+				return (int)elapsed;
+			printf("throughput endpoint=0x%02x depth=%d size=%d "
+				"count=%d elapsed=%.3f transfers_per_sec=%.1f "
+				"mb_per_sec=%.3f\n", b->endpoint, depths[i],
+				sizes[j], b->iterations, elapsed,
+				b->iterations * 1000000.0 / elapsed,
+				(double)b->iterations * sizes[j] / elapsed);
+		}
+	}
+	return 0;
+}
+
+static int bench_sync(struct bench *b)
+{
+	unsigned char buffer[512];
+	double *samples, start;
+	int i, r, transferred;
+
+	samples = malloc(b->iterations * sizeof(*samples));
+	if (!samples)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < b->iterations; i++) {
+		start = now_us();
+		r = libusb_control_transfer(b->handle, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, buffer, 2, TIMEOUT);
+		samples[i] = now_us() - start;
+		if (r < 0)
+			goto out;
+	}
+	printf("sync transfer=control count=%d", b->iterations);
+	print_percentiles(samples, b->iterations);
+	printf("\n");
+
+	for (i = 0; i < b->iterations; i++) {
+		start = now_us();
+		if (b->type == LIBUSB_TRANSFER_TYPE_BULK)
+			r = libusb_bulk_transfer(b->handle, b->endpoint, buffer,
+				sizeof(buffer), &transferred, TIMEOUT);
+		else
+			r = libusb_interrupt_transfer(b->handle, b->endpoint,
+				buffer, sizeof(buffer), &transferred, TIMEOUT);
+		samples[i] = now_us() - start;
+		if (r < 0)
+			goto out;
+	}
+	printf("sync transfer=%s endpoint=0x%02x size=%d count=%d",
+		b->type == LIBUSB_TRANSFER_TYPE_BULK ? "bulk" : "interrupt",
+		b->endpoint, (int)sizeof(buffer), b->iterations);
+	print_percentiles(samples, b->iterations);
+	printf("\n");
+	r = 0;
+
+out:
+	free(samples);
+	return r;
+}
+
+static int bench_devlist(struct bench *b)
+{
+	static const int counts[] = { 1, 8, 32 };
+	char list[32 * 10 + 1];
+	libusb_context *ctx;
+	libusb_device **devs;
+	double start, elapsed;
+	ssize_t cnt = 0;
+	int i, j, r;
+
+	for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+		/* only honoured by the null backend */
+		list[0] = '\0';
+		for (j = 0; j < counts[i]; j++)
+			snprintf(list + strlen(list), sizeof(list) - strlen(list),
+				"%s%04x:%04x", j ? "," : "", b->vid, b->pid);
+		setenv("LIBUSB_NULL_DEVICES", list, 1);
+
+		r = libusb_init(&ctx);
+		if (r < 0)
+			return r;
+
+		start = now_us();
+		for (j = 0; j < b->iterations; j++) {
+			cnt = libusb_get_device_list(ctx, &devs);
+			if (cnt < 0)
+				break;
+			libusb_free_device_list(devs, 1);
+		}
+		elapsed = now_us() - start;
+		libusb_exit(ctx);
+		if (cnt < 0)
+			return (int)cnt;
+
+		printf("devlist devices=%d count=%d avg=%.3f\n", (int)cnt,
+			b->iterations, elapsed / b->iterations);
+		if (i > 0 && cnt <= counts[i - 1])
+			break;
+	}
+	unsetenv("LIBUSB_NULL_DEVICES");
+	return 0;
+}
+
+static int bench_init(struct bench *b)
+{
+	libusb_context *ctx;
+	double *samples, start;
+	int i, r, count = b->iterations / 10 + 1;
+
+	samples = malloc(count * sizeof(*samples));
+	if (!samples)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < count; i++) {
+		start = now_us();
+		r = libusb_init(&ctx);
+		if (r < 0) {
+			free(samples);
+			return r;
+		}
+		libusb_exit(ctx);
+		samples[i] = now_us() - start;
+	}
+	printf("init count=%d", count);
+	print_percentiles(samples, count);
+	printf("\n");
+
+	free(samples);
+	return 0;
+}
+
+static int bench_config(struct bench *b)
+{
+	libusb_device *dev = libusb_get_device(b->handle);
+	struct libusb_config_descriptor *config;
+	double start, elapsed;
+	int i, r;
+
+	start = now_us();
+	for (i = 0; i < b->iterations; i++) {
+		r = libusb_get_active_config_descriptor(dev, &config);
+		if (r < 0)
+			return r;
+		libusb_free_config_descriptor(config);
+	}
+	elapsed = now_us() - start;
+
+	printf("config count=%d avg=%.3f\n", b->iterations,
+		elapsed / b->iterations);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct bench *b);
+	int needs_endpoint;
+} benchmarks[] = {
+	{ "latency", bench_latency, 1 },
+	{ "throughput", bench_throughput, 1 },
+	{ "sync", bench_sync, 1 },
+	{ "devlist", bench_devlist, 0 },
+	{ "init", bench_init, 0 },
+	{ "config", bench_config, 0 },
+};
+
+#define NUM_BENCHMARKS	((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+static int usage(const char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "usage: %s [-d vid:pid] [-e endpoint] [-n iterations] "
+		"[benchmark...]\nbenchmarks:", argv0);
+	for (i = 0; i < NUM_BENCHMARKS; i++)
+		fprintf(stderr, " %s", benchmarks[i].name);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	int selected[NUM_BENCHMARKS];
+	unsigned int vid = 0x1d6b, pid = 0x0104;
+	int any_selected = 0, iface = 0;
+	int i, j, r;
+
+	memset(&b, 0, sizeof(b));
+	memset(selected, 0, sizeof(selected));
+	b.iterations = 10000;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%x:%x", &vid, &pid) != 2)
+				return usage(argv[0]);
+		} else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+			b.endpoint = (unsigned char)strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			b.iterations = atoi(argv[++i]);
+		} else {
+			for (j = 0; j < NUM_BENCHMARKS; j++) {
+				if (!strcmp(argv[i], benchmarks[j].name))
+					break;
+			}
+			if (j == NUM_BENCHMARKS)
+				return usage(argv[0]);
+			selected[j] = any_selected = 1;
+		}
+	}
+	if (b.iterations <= 0)
+		b.iterations = 1;
+	b.vid = (uint16_t)vid;
+	b.pid = (uint16_t)pid;
+
+	r = libusb_init(&b.ctx);
+	if (r < 0) {
+		fprintf(stderr, "failed to init libusb: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	b.handle = libusb_open_device_with_vid_pid(b.ctx, b.vid, b.pid);
+	if (!b.handle) {
+		fprintf(stderr, "could not open device %04x:%04x\n", vid, pid);
+		r = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	r = find_endpoint(libusb_get_device(b.handle), &iface, &b.endpoint,
+		&b.type);
+	if (r == 0) {
+		libusb_set_auto_detach_kernel_driver(b.handle, 1);
+		r = libusb_claim_interface(b.handle, iface);
+		if (r < 0) {
+			fprintf(stderr, "failed to claim interface %d: %s\n",
+				iface, libusb_error_name(r));
+			goto out;
+		}
+	} else {
+		b.endpoint = 0;
+	}
+
+	for (i = 0; i < NUM_BENCHMARKS; i++) {
+		if (any_selected ? !selected[i] : 0)
+			continue;
+		if (benchmarks[i].needs_endpoint && !b.endpoint) {
+			fprintf(stderr, "skipping %s: no bulk or interrupt "
+				"endpoint\n", benchmarks[i].name);
+			continue;
+		}
+		r = benchmarks[i].run(&b);
+		if (r < 0) {
+			fprintf(stderr, "%s failed: %s\n", benchmarks[i].name,
+				libusb_error_name(r));
+			goto out_release;
+		}
+		fflush(stdout);
+	}
+
+out_release:
+	if (b.endpoint)
+		libusb_release_interface(b.handle, iface);
+out:
+	if (b.handle)
+		libusb_close(b.handle);
+	libusb_exit(b.ctx);
+	return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * libusb test for transfer priority classes, see libusb_set_handle_priority()
+ * and libusb_transfer_set_priority()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend, which completes the transfers of a handle
+ * in submission order, so the order of the callbacks is the order in which
+ * libusb_submit_transfers() submitted a batch. The transfers of a batch
+ * take the class of their handle unless they have one of their own, and the
+ * test checks the class each of them reports, and that the batch was
+ * submitted from the highest class down, in array order within each class.
+ */
+
+#include "nulltest.h"
+
+#define NUM_TRANSFERS	9
+#define BUF_SIZE	64
+
+/* the class of each transfer of the batch, UNSET for the class of the
+ * handle */
+#define UNSET		2
+static const int classes[NUM_TRANSFERS] = {
+	UNSET, LIBUSB_PRIORITY_HIGH, LIBUSB_PRIORITY_NORMAL,
+	UNSET, LIBUSB_PRIORITY_NORMAL, LIBUSB_PRIORITY_HIGH,
+	LIBUSB_PRIORITY_LOW, UNSET, LIBUSB_PRIORITY_HIGH,
+};
+
+static struct libusb_transfer *completed[NUM_TRANSFERS];
+static int num_completed;
+static int all_completed;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	CHECK(num_completed < NUM_TRANSFERS);
+	completed[num_completed] = transfer;
+	if (++num_completed == NUM_TRANSFERS)
+		all_completed = 1;
+}
+
+static void run_batch(libusb_context *ctx, struct libusb_transfer **transfers)
+{
+	int results[NUM_TRANSFERS];
+	int i;
+
+	num_completed = 0;
+	all_completed = 0;
+	CHECK_EQ(libusb_submit_transfers(transfers, NUM_TRANSFERS, results),
+		NUM_TRANSFERS);
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		CHECK_EQ(results[i], 0);
+	nulltest_wait(ctx, &all_completed);
+}
+
+int main(void)
+{
+	static unsigned char buffers[NUM_TRANSFERS][BUF_SIZE];
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int priority, prev, i, n;
+
+	CHECK(LIBUSB_PRIORITY_LOW < LIBUSB_PRIORITY_NORMAL);
+	CHECK(LIBUSB_PRIORITY_NORMAL < LIBUSB_PRIORITY_HIGH);
+
+	nulltest_open(&ctx, &handle, NULL);
+
+	CHECK_EQ(libusb_set_handle_priority(handle, LIBUSB_PRIORITY_HIGH + 1),
+		LIBUSB_ERROR_INVALID_PARAM);
+	CHECK_EQ(libusb_set_handle_priority(handle, LIBUSB_PRIORITY_LOW - 1),
+		LIBUSB_ERROR_INVALID_PARAM);
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		CHECK(transfers[i] != NULL);
+		CHECK_EQ(libusb_transfer_get_priority(transfers[i]),
+			LIBUSB_PRIORITY_NORMAL);
+		libusb_fill_bulk_transfer(transfers[i], handle, NULL_BULK_IN,
+			buffers[i], BUF_SIZE, transfer_cb, NULL, 1000);
+		if (classes[i] != UNSET)
+			CHECK_EQ(libusb_transfer_set_priority(transfers[i],
+				classes[i]), 0);
+	}
+	CHECK_EQ(libusb_transfer_set_priority(transfers[0],
+		LIBUSB_PRIORITY_HIGH + 1), LIBUSB_ERROR_INVALID_PARAM);
+	CHECK_EQ(libusb_transfer_get_priority(transfers[0]),
+		LIBUSB_PRIORITY_NORMAL);
+
+	/* the transfers without a class follow the handle */
+	CHECK_EQ(libusb_set_handle_priority(handle, LIBUSB_PRIORITY_LOW), 0);
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		CHECK_EQ(libusb_transfer_get_priority(transfers[i]),
+			classes[i] == UNSET ? LIBUSB_PRIORITY_LOW : classes[i]);
+
+	/* from the highest class down, and in array order within a class */
+	run_batch(ctx, transfers);
+	n = 0;
+	for (priority = LIBUSB_PRIORITY_HIGH; priority >= LIBUSB_PRIORITY_LOW;
+			priority--) {
+		for (i = 0; i < NUM_TRANSFERS; i++) {
+			if (libusb_transfer_get_priority(transfers[i]) != priority)
+				continue;
+			CHECK(completed[n] == transfers[i]);
+			CHECK_EQ(completed[n]->status, LIBUSB_TRANSFER_COMPLETED);
+			n++;
+		}
+	}
+	CHECK_EQ(n, NUM_TRANSFERS);
+
+	/* once all transfers are of one class, the batch keeps array order */
+	CHECK_EQ(libusb_set_handle_priority(handle, LIBUSB_PRIORITY_NORMAL), 0);
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		CHECK_EQ(libusb_transfer_set_priority(transfers[i],
+			LIBUSB_PRIORITY_NORMAL), 0);
+	run_batch(ctx, transfers);
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		CHECK(completed[i] == transfers[i]);
+
+	/* a handle class change applies to transfers without a class of
+	 * their own only */
+	prev = libusb_transfer_get_priority(transfers[0]);
+	CHECK_EQ(libusb_set_handle_priority(handle, LIBUSB_PRIORITY_HIGH), 0);
+	CHECK_EQ(libusb_transfer_get_priority(transfers[0]), prev);
+
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_free_transfer(transfers[i]);
+	nulltest_close(ctx, handle);
+	printf("%d transfers submitted by class\n", NUM_TRANSFERS);
+	return 0;
+}
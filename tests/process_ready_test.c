@@ -0,0 +1,141 @@
+/*
+ * libusb test for reactor style event handling, see libusb_get_event_fd()
+ * and libusb_process_ready()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend, which completes transfers as soon as they
+ * are submitted. The test waits for the event fd to become readable the way
+ * a reactor would, and checks that libusb_process_ready() refuses to wait
+ * while another thread holds the event handling lock, leaving the pending
+ * completions alone, and that it then reaps all of them in submission order
+ * in one call, after which the event fd is no longer readable.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+
+#include "nulltest.h"
+
+#define NUM_TRANSFERS	4
+#define BUF_SIZE	512
+
+static struct libusb_transfer *completed[NUM_TRANSFERS];
+static int num_completed;
+
+static pthread_mutex_t holder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t holder_cond = PTHREAD_COND_INITIALIZER;
+static int holding, release;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	CHECK(num_completed < NUM_TRANSFERS);
+	completed[num_completed++] = transfer;
+}
+
+/* holds the event handling lock until told to release it */
+static void *lock_holder(void *arg)
+{
+	libusb_context *ctx = arg;
+
+	libusb_lock_events(ctx);
+	pthread_mutex_lock(&holder_lock);
+	holding = 1;
+	pthread_cond_signal(&holder_cond);
+	while (!release)
+		pthread_cond_wait(&holder_cond, &holder_lock);
+	pthread_mutex_unlock(&holder_lock);
+	libusb_unlock_events(ctx);
+	return NULL;
+}
+
+static int event_fd_ready(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	r = poll(&pfd, 1, timeout_ms);
+	CHECK(r >= 0);
+	return r;
+}
+
+int main(void)
+{
+	static unsigned char buffers[NUM_TRANSFERS][BUF_SIZE];
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	pthread_t holder;
+	int fd, i;
+
+	nulltest_open(&ctx, &handle, NULL);
+
+	fd = libusb_get_event_fd(ctx);
+	if (fd == LIBUSB_ERROR_NOT_SUPPORTED) {
+		printf("no event fd on this platform, skipping\n");
+		nulltest_close(ctx, handle);
+		return EXIT_SKIP;
+	}
+	CHECK(fd >= 0);
+	CHECK_EQ(libusb_get_event_fd(ctx), fd);
+
+	/* nothing to do yet */
+	CHECK_EQ(libusb_process_ready(ctx), 0);
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		CHECK(transfers[i] != NULL);
+		libusb_fill_bulk_transfer(transfers[i], handle, NULL_BULK_IN,
+			buffers[i], BUF_SIZE, transfer_cb, NULL, 1000);
+		CHECK_EQ(libusb_submit_transfer(transfers[i]), 0);
+	}
+	CHECK_EQ(event_fd_ready(fd, 1000), 1);
+
+	CHECK_EQ(pthread_create(&holder, NULL, lock_holder, ctx), 0);
+	pthread_mutex_lock(&holder_lock);
+	while (!holding)
+		pthread_cond_wait(&holder_cond, &holder_lock);
+	pthread_mutex_unlock(&holder_lock);
+
+	CHECK_EQ(libusb_process_ready(ctx), LIBUSB_ERROR_BUSY);
+	CHECK_EQ(num_completed, 0);
+	CHECK_EQ(event_fd_ready(fd, 0), 1);
+
+	pthread_mutex_lock(&holder_lock);
+	release = 1;
+	pthread_cond_signal(&holder_cond);
+	pthread_mutex_unlock(&holder_lock);
+	CHECK_EQ(pthread_join(holder, NULL), 0);
+
+	CHECK_EQ(libusb_process_ready(ctx), 0);
+	CHECK_EQ(num_completed, NUM_TRANSFERS);
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		CHECK(completed[i] == transfers[i]);
+		CHECK_EQ(completed[i]->status, LIBUSB_TRANSFER_COMPLETED);
+		CHECK_EQ(completed[i]->actual_length, BUF_SIZE);
+	}
+	CHECK_EQ(event_fd_ready(fd, 0), 0);
+
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_free_transfer(transfers[i]);
+	nulltest_close(ctx, handle);
+	printf("%d transfers reaped in one call\n", NUM_TRANSFERS);
+	return 0;
+}
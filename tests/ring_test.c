@@ -0,0 +1,131 @@
+/*
+ * libusb test for streaming rings, see libusb_alloc_ring()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend in loopback mode. A known pattern is first
+ * written to the bulk OUT endpoint, one byte value per buffer, and a ring is
+ * then started on the bulk IN endpoint without reading from it. The ring
+ * must fill every buffer in order, count the completions that found no free
+ * buffer to resubmit as overruns, and hand the data out in order. Once
+ * stopped, it must retire its transfers and report no error.
+ */
+
+#include <string.h>
+
+#include "nulltest.h"
+
+#define NUM_BUFFERS	8
+#define QUEUE_DEPTH	4
+#define BUF_SIZE	512
+
+static int notified;
+static int all_filled;
+
+static void LIBUSB_CALL ring_cb(libusb_ring *ring, void *user_data)
+{
+	(void)ring;
+	(void)user_data;
+	if (++notified == NUM_BUFFERS)
+		all_filled = 1;
+}
+
+static void handle_pending(libusb_context *ctx)
+{
+	struct timeval tv = { 0, 0 };
+
+	CHECK_EQ(libusb_handle_events_timeout_completed(ctx, &tv, NULL), 0);
+}
+
+int main(void)
+{
+	unsigned char pattern[NUM_BUFFERS * BUF_SIZE];
+	struct libusb_ring_stats stats;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_ring *ring;
+	unsigned char *data;
+	int transferred, length;
+	int i, j;
+
+	nulltest_open(&ctx, &handle, "LIBUSB_NULL_LOOPBACK", "1", NULL);
+
+	CHECK_EQ(libusb_alloc_ring(handle, NULL_BULK_OUT, NUM_BUFFERS,
+		QUEUE_DEPTH, BUF_SIZE, 0, NULL, NULL, &ring),
+		LIBUSB_ERROR_INVALID_PARAM);
+	CHECK_EQ(libusb_alloc_ring(handle, NULL_BULK_IN, QUEUE_DEPTH,
+		NUM_BUFFERS, BUF_SIZE, 0, NULL, NULL, &ring),
+		LIBUSB_ERROR_INVALID_PARAM);
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		memset(pattern + i * BUF_SIZE, i, BUF_SIZE);
+	CHECK_EQ(libusb_bulk_transfer(handle, NULL_BULK_OUT, pattern,
+		sizeof(pattern), &transferred, 1000), 0);
+	CHECK_EQ(transferred, sizeof(pattern));
+
+	CHECK_EQ(libusb_alloc_ring(handle, NULL_BULK_IN, NUM_BUFFERS,
+		QUEUE_DEPTH, BUF_SIZE, 0, ring_cb, NULL, &ring), 0);
+	CHECK_EQ(libusb_start_ring(ring), 0);
+	CHECK_EQ(libusb_start_ring(ring), LIBUSB_ERROR_BUSY);
+	nulltest_wait(ctx, &all_filled);
+
+	/* the first QUEUE_DEPTH completions found a free buffer to resubmit,
+	 * the others did not */
+	CHECK_EQ(libusb_get_ring_stats(ring, &stats), 0);
+	CHECK_EQ(stats.transfers, NUM_BUFFERS);
+	CHECK_EQ(stats.bytes, sizeof(pattern));
+	CHECK_EQ(stats.overruns, NUM_BUFFERS - QUEUE_DEPTH);
+	CHECK_EQ(stats.errors, 0);
+	CHECK_EQ(stats.in_flight, 0);
+	CHECK_EQ(stats.filled, NUM_BUFFERS);
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		CHECK_EQ(libusb_ring_read(ring, &data, &length), 1);
+		CHECK_EQ(length, BUF_SIZE);
+		for (j = 0; j < BUF_SIZE; j++)
+			CHECK_EQ(data[j], i);
+		CHECK_EQ(libusb_ring_read(ring, &data, &length),
+			LIBUSB_ERROR_BUSY);
+		libusb_ring_release(ring);
+	}
+
+	/* the released buffers were resubmitted, and complete empty now that
+	 * the pattern has been consumed */
+	CHECK_EQ(libusb_get_ring_stats(ring, &stats), 0);
+	CHECK_EQ(stats.in_flight, QUEUE_DEPTH);
+	handle_pending(ctx);
+	CHECK_EQ(libusb_ring_read(ring, &data, &length), 0);
+	CHECK_EQ(libusb_get_ring_stats(ring, &stats), 0);
+	CHECK_EQ(stats.transfers, NUM_BUFFERS);
+
+	CHECK_EQ(libusb_stop_ring(ring), 0);
+	for (i = 0; i < 100; i++) {
+		handle_pending(ctx);
+		CHECK_EQ(libusb_get_ring_stats(ring, &stats), 0);
+		if (!stats.in_flight)
+			break;
+	}
+	CHECK_EQ(stats.in_flight, 0);
+	CHECK_EQ(libusb_ring_read(ring, &data, &length), 0);
+	CHECK_EQ(libusb_stop_ring(ring), LIBUSB_ERROR_NOT_FOUND);
+	CHECK_EQ(stats.errors, 0);
+
+	libusb_free_ring(ring);
+	nulltest_close(ctx, handle);
+	printf("ring filled %d buffers in order\n", NUM_BUFFERS);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * libusb test for the bulk stream scheduler, see
+ * libusb_alloc_stream_scheduler()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs against the null backend, whose bulk endpoints emulate streams and
+ * complete transfers in submission order. More transfers are submitted
+ * through a scheduler than its streams have room for, and the test checks
+ * that they are spread over the streams in turn, that the surplus is queued
+ * and dispatched to the stream which has room again, and the counters of
+ * each stream and of the whole scheduler.
+ */
+
+#include <string.h>
+
+#include "nulltest.h"
+
+#define NUM_STREAMS	4
+#define QUEUE_DEPTH	2
+#define NUM_TRANSFERS	(3 * NUM_STREAMS * QUEUE_DEPTH / 2)
+#define BUF_SIZE	512
+
+static struct libusb_transfer *completed[NUM_TRANSFERS];
+static uint32_t completed_stream[NUM_TRANSFERS];
+static int num_completed;
+static int all_completed;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	CHECK(num_completed < NUM_TRANSFERS);
+	completed[num_completed] = transfer;
+	completed_stream[num_completed] =
+		libusb_transfer_get_stream_id(transfer);
+	if (++num_completed == NUM_TRANSFERS)
+		all_completed = 1;
+}
+
+int main(void)
+{
+	static unsigned char buffers[NUM_TRANSFERS][BUF_SIZE];
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	struct libusb_stream_stats stats;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_stream_scheduler *sched;
+	uint32_t id;
+	int i;
+
+	nulltest_open(&ctx, &handle, NULL);
+
+	CHECK_EQ(libusb_alloc_stream_scheduler(handle, NULL_INTR_IN,
+		NUM_STREAMS, QUEUE_DEPTH, &sched), LIBUSB_ERROR_INVALID_PARAM);
+	CHECK_EQ(libusb_alloc_stream_scheduler(handle, NULL_BULK_IN, 0,
+		QUEUE_DEPTH, &sched), LIBUSB_ERROR_INVALID_PARAM);
+	CHECK_EQ(libusb_alloc_stream_scheduler(handle, NULL_BULK_IN,
+		NUM_STREAMS, QUEUE_DEPTH, &sched), NUM_STREAMS);
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		CHECK(transfers[i] != NULL);
+		libusb_fill_bulk_transfer(transfers[i], handle, NULL_BULK_IN,
+			buffers[i], BUF_SIZE, transfer_cb, NULL, 0);
+	}
+
+	/* a transfer for another endpoint is refused */
+	transfers[0]->endpoint = NULL_BULK_OUT;
+	CHECK_EQ(libusb_stream_submit(sched, transfers[0]),
+		LIBUSB_ERROR_INVALID_PARAM);
+	transfers[0]->endpoint = NULL_BULK_IN;
+
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		CHECK_EQ(libusb_stream_submit(sched, transfers[i]), 0);
+	CHECK_EQ(libusb_stream_submit(sched, transfers[0]),
+		LIBUSB_ERROR_BUSY);
+
+	CHECK_EQ(libusb_get_stream_stats(sched, 0, &stats), 0);
+	CHECK_EQ(stats.in_flight, NUM_STREAMS * QUEUE_DEPTH);
+	CHECK_EQ(stats.queued, NUM_TRANSFERS - NUM_STREAMS * QUEUE_DEPTH);
+	for (id = 1; id <= NUM_STREAMS; id++) {
+		CHECK_EQ(libusb_get_stream_stats(sched, id, &stats), 0);
+		CHECK_EQ(stats.in_flight, QUEUE_DEPTH);
+	}
+	CHECK_EQ(libusb_get_stream_stats(sched, NUM_STREAMS + 1, &stats),
+		LIBUSB_ERROR_NOT_FOUND);
+
+	nulltest_wait(ctx, &all_completed);
+
+	/* the streams were used in turn, and each queued transfer went to the
+	 * stream of the transfer whose completion made room for it */
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		CHECK(completed[i] == transfers[i]);
+		CHECK_EQ(completed[i]->status, LIBUSB_TRANSFER_COMPLETED);
+		CHECK_EQ(completed[i]->actual_length, BUF_SIZE);
+		CHECK(completed[i]->callback == transfer_cb);
+		CHECK_EQ(completed_stream[i], i % NUM_STREAMS + 1);
+	}
+
+	for (id = 1; id <= NUM_STREAMS; id++) {
+		CHECK_EQ(libusb_get_stream_stats(sched, id, &stats), 0);
+		CHECK_EQ(stats.transfers, NUM_TRANSFERS / NUM_STREAMS);
+		CHECK_EQ(stats.bytes, NUM_TRANSFERS / NUM_STREAMS * BUF_SIZE);
+		CHECK_EQ(stats.errors, 0);
+		CHECK_EQ(stats.in_flight, 0);
+		CHECK(stats.avg_latency_us <= stats.max_latency_us);
+	}
+	CHECK_EQ(libusb_get_stream_stats(sched, 0, &stats), 0);
+	CHECK_EQ(stats.transfers, NUM_TRANSFERS);
+	CHECK_EQ(stats.bytes, NUM_TRANSFERS * BUF_SIZE);
+	CHECK_EQ(stats.in_flight, 0);
+	CHECK_EQ(stats.queued, 0);
+
+	libusb_free_stream_scheduler(sched);
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		libusb_free_transfer(transfers[i]);
+	nulltest_close(ctx, handle);
+	printf("%d transfers spread over %d streams\n", NUM_TRANSFERS,
+		NUM_STREAMS);
+	return 0;
+}
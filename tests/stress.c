@@ -20,17 +20,37 @@
 #include <stdio.h>
 #include <string.h>
 #include <memory.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 
 #include "libusb.h"
 #include "libusb_testlib.h"
 
-/** Test that creates and destroys a single concurrent context
- * 10000 times. */
-static libusb_testlib_result test_init_and_exit(libusb_testlib_ctx * tctx)
+#define INIT_AND_EXIT_ITERATIONS 10000
+
+/* monotonic enough clock for timing many iterations, in microseconds */
+static double now_us(void)
+{
+#if defined(_WIN32)
+	return GetTickCount() * 1000.0;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+#endif
+}
+
+/* create and destroy a context INIT_AND_EXIT_ITERATIONS times and report
+ * how long a pair takes on average */
+static libusb_testlib_result init_and_exit_loop(libusb_testlib_ctx * tctx)
 {
 	libusb_context * ctx = NULL;
+	double start = now_us();
 	int i;
-	for (i = 0; i < 10000; ++i) {
+	for (i = 0; i < INIT_AND_EXIT_ITERATIONS; ++i) {
 		int r = libusb_init(&ctx);
 		if (r != LIBUSB_SUCCESS) {
 			libusb_testlib_logf(tctx,
@@ -42,9 +62,35 @@ static libusb_testlib_result test_init_and_exit(libusb_testlib_ctx * tctx)
 		ctx = NULL;
 	}
 
+	libusb_testlib_logf(tctx, "%.1f us per init/exit pair",
+		(now_us() - start) / INIT_AND_EXIT_ITERATIONS);
 	return TEST_STATUS_SUCCESS;
 }
 
+/** Test that creates and destroys a single concurrent context
+ * 10000 times. */
+static libusb_testlib_result test_init_and_exit(libusb_testlib_ctx * tctx)
+{
+	return init_and_exit_loop(tctx);
+}
+
+/** Test that creates and destroys a context 10000 times while another
+ * context stays open, which lets backends reuse what they have already
+ * found out about the system and its devices. */
+static libusb_testlib_result test_init_and_exit_shared(libusb_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_testlib_result result;
+	int r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	result = init_and_exit_loop(tctx);
+	libusb_exit(ctx);
+	return result;
+}
+
 /** Tests that devices can be listed 1000 times. */
 static libusb_testlib_result test_get_device_list(libusb_testlib_ctx * tctx)
 {
@@ -148,6 +194,7 @@ static libusb_testlib_result test_default_context_change(libusb_testlib_ctx * tc
 /* Fill in the list of tests. */
 static const libusb_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
+	{"init_and_exit_shared", &test_init_and_exit_shared},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
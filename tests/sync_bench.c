@@ -0,0 +1,165 @@
+/*
+ * libusb microbenchmark for the round-trip latency of synchronous
+ * control transfers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This issues GET_STATUS requests to the given device, first through
+ * libusb_control_transfer(), then by allocating, submitting and waiting for
+ * an asynchronous transfer for each request, which is what the synchronous
+ * API used to do. The average round-trip time of a request is reported for
+ * both, along with the fastest and slowest request.
+ *
+ * Usage: sync_bench vid:pid [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+
+#define TIMEOUT		1000
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0
+		+ (end->tv_usec - start->tv_usec);
+}
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+	*completed = 1;
+}
+
+static int sync_request(libusb_context *ctx, libusb_device_handle *handle)
+{
+	unsigned char status[2];
+	int r;
+
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, status, sizeof(status), TIMEOUT);
+	return r < 0 ? r : 0;
+}
+
+static int async_request(libusb_context *ctx, libusb_device_handle *handle)
+{
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	unsigned char *buffer;
+	int completed = 0;
+	int r;
+
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + 2);
+	if (!buffer) {
+		libusb_free_transfer(transfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buffer, transfer_cb,
+		&completed, TIMEOUT);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r = libusb_submit_transfer(transfer);
+	while (r == 0 && !completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r == LIBUSB_ERROR_INTERRUPTED)
+			r = 0;
+	}
+	if (r == 0 && transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		r = LIBUSB_ERROR_IO;
+
+	libusb_free_transfer(transfer);
+	return r;
+}
+
+static int run(const char *name, libusb_context *ctx,
+	libusb_device_handle *handle, int iterations,
+	int (*request)(libusb_context *, libusb_device_handle *))
+{
+	struct timeval start, end, first;
+	double us, min = 0, max = 0;
+	int i, r;
+
+	gettimeofday(&first, NULL);
+	for (i = 0; i < iterations; i++) {
+		gettimeofday(&start, NULL);
+		r = request(ctx, handle);
+		gettimeofday(&end, NULL);
+		if (r < 0) {
+			fprintf(stderr, "%s request %d failed: %s\n", name, i,
+				libusb_error_name(r));
+			return r;
+		}
+		us = elapsed_us(&start, &end);
+		if (i == 0 || us < min)
+			min = us;
+		if (us > max)
+			max = us;
+	}
+
+	printf("%-8s %12.3f %12.3f %12.3f\n", name,
+		elapsed_us(&first, &end) / iterations, min, max);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	unsigned int vid, pid;
+	int iterations = 10000;
+	int r;
+
+	if (argc < 2 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		fprintf(stderr, "usage: %s vid:pid [iterations]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (iterations <= 0)
+		iterations = 1;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "failed to init libusb: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+	if (!handle) {
+		fprintf(stderr, "could not open device %04x:%04x\n", vid, pid);
+		r = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	printf("%d GET_STATUS requests\n", iterations);
+	printf("%-8s %12s %12s %12s\n", "path", "avg (us)", "min (us)", "max (us)");
+	r = run("sync", ctx, handle, iterations, sync_request);
+	if (r == 0)
+		r = run("async", ctx, handle, iterations, async_request);
+
+out:
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return r < 0 ? 1 : 0;
+}
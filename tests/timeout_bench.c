@@ -0,0 +1,322 @@
+/*
+ * libusb microbenchmark for transfer submission and completion cost
+ * against the number of transfers in flight
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * For each queue depth, this submits that many transfers to an IN endpoint
+ * of the given device, each with a distinct finite timeout long enough that
+ * none of them expire during the run, then cancels them all and waits for
+ * the callbacks. The average cost of a submission and of a cancellation plus
+ * completion is reported per transfer. The device is expected to stay quiet
+ * on the chosen endpoint, so that transfers only complete by cancellation.
+ *
+ * Then a batch of transfers with short distinct timeouts is left to expire,
+ * and the run fails unless they all time out, in the order of their
+ * timeouts.
+ *
+ * Without a device, this runs against the default device of the null
+ * backend (./configure --enable-null-backend), with completions delayed
+ * past every timeout. The exit code is 77 (skipped, for make check) when
+ * libusb was built with another backend, or can't be initialized.
+ *
+ * Usage: timeout_bench [vid:pid [endpoint]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+
+#define MAX_DEPTH	2048
+#define BUF_SIZE	64
+
+/* number of transfers left to expire, and the spread of their timeouts */
+#define EXPIRY_DEPTH	256
+#define EXPIRY_BASE	20
+
+/* the default device of the null backend, and a completion delay longer than
+ * any timeout used here, in microseconds */
+#define NULL_VID	0x1d6b
+#define NULL_PID	0x0104
+#define NULL_DELAY_US	"600000000"
+
+/* automake's exit code for a skipped test */
+#define EXIT_SKIP	77
+
+static struct libusb_transfer *completed[MAX_DEPTH];
+static int num_completed = 0;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	if (num_completed < MAX_DEPTH)
+		completed[num_completed] = transfer;
+	num_completed++;
+}
+
+static int wait_completed(libusb_context *ctx, int depth)
+{
+	int r;
+
+	while (num_completed < depth) {
+		r = libusb_handle_events_completed(ctx, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "handle_events failed: %s\n",
+				libusb_error_name(r));
+			return r;
+		}
+	}
+	return 0;
+}
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0
+		+ (end->tv_usec - start->tv_usec);
+}
+
+/* find the first bulk or interrupt IN endpoint of the first altsetting of
+ * any interface in the active configuration */
+static int find_in_endpoint(libusb_device *dev, int *iface, unsigned char *ep,
+	unsigned char *type)
+{
+	struct libusb_config_descriptor *config;
+	int i, j, r;
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (i = 0; i < config->bNumInterfaces && r; i++) {
+		const struct libusb_interface_descriptor *altsetting =
+			&config->interface[i].altsetting[0];
+		for (j = 0; j < altsetting->bNumEndpoints; j++) {
+			const struct libusb_endpoint_descriptor *epdesc =
+				&altsetting->endpoint[j];
+			unsigned char ep_type = epdesc->bmAttributes
+				& LIBUSB_TRANSFER_TYPE_MASK;
+			if (!(epdesc->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+				continue;
+			if (ep_type != LIBUSB_TRANSFER_TYPE_BULK
+					&& ep_type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+				continue;
+			if (*ep && *ep != epdesc->bEndpointAddress)
+				continue;
+			*iface = altsetting->bInterfaceNumber;
+			*ep = epdesc->bEndpointAddress;
+			*type = ep_type;
+			r = 0;
+			break;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+static int run_depth(libusb_context *ctx, struct libusb_transfer **transfers,
+	int depth)
+{
+	struct timeval start, submitted, done;
+	int i, r;
+
+	num_completed = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < depth; i++) {
+		/* distinct, shuffled timeouts so that insertion order does not
+		 * match expiry order */
+		transfers[i]->timeout = 60000 + ((i * 7919) % MAX_DEPTH);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r < 0) {
+			fprintf(stderr, "submit %d failed: %s\n", i,
+				libusb_error_name(r));
+			depth = i;
+			break;
+		}
+	}
+	gettimeofday(&submitted, NULL);
+
+	for (i = 0; i < depth; i++)
+		libusb_cancel_transfer(transfers[i]);
+	r = wait_completed(ctx, depth);
+	if (r < 0)
+		return r;
+	gettimeofday(&done, NULL);
+
+	for (i = 0; i < depth; i++) {
+		if (completed[i]->status != LIBUSB_TRANSFER_CANCELLED) {
+			fprintf(stderr, "transfer with timeout %u completed with "
+				"status %d instead of being cancelled\n",
+				completed[i]->timeout, completed[i]->status);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	if (depth)
+		printf("%6d %14.3f %14.3f\n", depth,
+			elapsed_us(&start, &submitted) / depth,
+			elapsed_us(&submitted, &done) / depth);
+	return 0;
+}
+
+/* let transfers with distinct, shuffled timeouts expire, and check that they
+ * time out in the order of their timeouts */
+static int run_expiry(libusb_context *ctx, struct libusb_transfer **transfers)
+{
+	int depth, i, r;
+
+	num_completed = 0;
+	for (i = 0; i < EXPIRY_DEPTH; i++) {
+		transfers[i]->timeout = EXPIRY_BASE + ((i * 7919) % EXPIRY_DEPTH);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r < 0) {
+			fprintf(stderr, "submit %d failed: %s\n", i,
+				libusb_error_name(r));
+			depth = i;
+			for (i = 0; i < depth; i++)
+				libusb_cancel_transfer(transfers[i]);
+			wait_completed(ctx, depth);
+			return r;
+		}
+	}
+
+	r = wait_completed(ctx, EXPIRY_DEPTH);
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < EXPIRY_DEPTH; i++) {
+		if (completed[i]->status != LIBUSB_TRANSFER_TIMED_OUT) {
+			fprintf(stderr, "transfer with timeout %u completed with "
+				"status %d instead of timing out\n",
+				completed[i]->timeout, completed[i]->status);
+			return LIBUSB_ERROR_OTHER;
+		}
+		if (i && completed[i]->timeout < completed[i - 1]->timeout) {
+			fprintf(stderr, "transfer with timeout %u timed out after "
+				"the one with timeout %u\n", completed[i]->timeout,
+				completed[i - 1]->timeout);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+
+	printf("%d timeouts expired in order\n", EXPIRY_DEPTH);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int depths[] = { 1, 16, 64, 256, 512, 1024, 2048 };
+	struct libusb_transfer *transfers[MAX_DEPTH];
+	unsigned char *buffers = NULL;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	unsigned int vid = NULL_VID, pid = NULL_PID;
+	unsigned char ep = 0, type = 0;
+	int device_less = (argc < 2);
+	int iface = 0;
+	int i, r;
+
+	if (!device_less && sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		fprintf(stderr, "usage: %s [vid:pid [endpoint]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		ep = (unsigned char)strtoul(argv[2], NULL, 0);
+
+	/* only honoured by the null backend: keep the transfers in flight
+	 * until they are cancelled or time out */
+	if (device_less)
+		setenv("LIBUSB_NULL_DELAY_US", NULL_DELAY_US, 1);
+
+	memset(transfers, 0, sizeof(transfers));
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "failed to init libusb: %s\n", libusb_error_name(r));
+		return device_less ? EXIT_SKIP : 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+	if (!handle && device_less) {
+		printf("no device given and no null backend device found, skipping\n");
+		libusb_exit(ctx);
+		return EXIT_SKIP;
+	}
+	if (!handle) {
+		fprintf(stderr, "could not open device %04x:%04x\n", vid, pid);
+		r = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	r = find_in_endpoint(libusb_get_device(handle), &iface, &ep, &type);
+	if (r < 0) {
+		fprintf(stderr, "no usable IN endpoint found\n");
+		goto out;
+	}
+
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	r = libusb_claim_interface(handle, iface);
+	if (r < 0) {
+		fprintf(stderr, "failed to claim interface %d: %s\n", iface,
+			libusb_error_name(r));
+		goto out;
+	}
+
+	buffers = malloc(MAX_DEPTH * BUF_SIZE);
+	if (!buffers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out_release;
+	}
+
+	for (i = 0; i < MAX_DEPTH; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out_release;
+		}
+		if (type == LIBUSB_TRANSFER_TYPE_BULK)
+			libusb_fill_bulk_transfer(transfers[i], handle, ep,
+				buffers + i * BUF_SIZE, BUF_SIZE, transfer_cb, NULL, 0);
+		else
+			libusb_fill_interrupt_transfer(transfers[i], handle, ep,
+				buffers + i * BUF_SIZE, BUF_SIZE, transfer_cb, NULL, 0);
+	}
+
+	printf("endpoint 0x%02x, interface %d\n", ep, iface);
+	printf("%6s %14s %14s\n", "depth", "submit (us)", "complete (us)");
+	for (i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); i++) {
+		r = run_depth(ctx, transfers, depths[i]);
+		if (r < 0)
+			break;
+	}
+	if (r == 0)
+		r = run_expiry(ctx, transfers);
+
+out_release:
+	for (i = 0; i < MAX_DEPTH; i++)
+		libusb_free_transfer(transfers[i]);
+	free(buffers);
+	libusb_release_interface(handle, iface);
+out:
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return r < 0 ? 1 : 0;
+}